@@ -0,0 +1,28 @@
+# Tell sakura the working directory of the shell with OSC 7, so new tabs
+# open there. Source it from ~/.bashrc or ~/.zshrc:
+#
+#     . /usr/share/sakura/sakura.sh
+
+__sakura_osc7() {
+	local LC_ALL=C dir="$PWD" uri="" c i
+	[ -n "$ZSH_VERSION" ] && setopt localoptions nomultibyte
+	# Percent-encode everything but unreserved characters and slashes
+	for (( i = 0; i < ${#dir}; i++ )); do
+		c="${dir:$i:1}"
+		case "$c" in
+			[-/._~A-Za-z0-9]) uri+="$c" ;;
+			*) printf -v c '%%%02X' "'$c"; uri+="$c" ;;
+		esac
+	done
+	printf '\033]7;file://%s%s\033\\' "${HOSTNAME:-$HOST}" "$uri"
+}
+
+if [ -n "$ZSH_VERSION" ]; then
+	autoload -Uz add-zsh-hook
+	add-zsh-hook precmd __sakura_osc7
+elif [ -n "$BASH_VERSION" ]; then
+	case ";$PROMPT_COMMAND;" in
+		*";__sakura_osc7;"*) ;;
+		*) PROMPT_COMMAND="__sakura_osc7${PROMPT_COMMAND:+;$PROMPT_COMMAND}" ;;
+	esac
+fi
@@ -20,25 +20,44 @@
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE			/* posix_openpt, environ and MSG_CMSG_CLOEXEC for the spawn helper */
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <math.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
 #include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <limits.h>
 #include <locale.h>
 #include <libintl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <gtk/gtk.h>
 #include <pango/pango.h>
 #include <vte/vte.h>
 #include <gdk/gdkx.h>
+#include <gio/gunixsocketaddress.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #define _(String) gettext(String)
 #define N_(String) (String)
@@ -194,6 +213,19 @@ const GdkRGBA xterm_palette[PALETTE_SIZE] = {
 };
 
 
+/* Palettes by config name. Unknown names get the last one */
+static const struct {
+	const char *name;
+	const GdkRGBA *colors;
+} palettes[] = {
+	{ "linux", linux_palette },
+	{ "xterm", xterm_palette },
+	{ "tango", tango_palette },
+	{ "solarized_dark", solarized_dark_palette },
+	{ "solarized_light", solarized_light_palette },
+};
+#define NUM_PALETTES (sizeof(palettes)/sizeof(palettes[0]))
+
 #define CLOSE_BUTTON_CSS "* {\n"\
 				"-GtkButton-default-border : 0;\n"\
 				"-GtkButton-default-outside-border : 0;\n"\
@@ -210,23 +242,49 @@ const GdkRGBA xterm_palette[PALETTE_SIZE] = {
 
 #define NUM_COLORSETS 6
 
-static struct {
+/* Per-window state. Everything else lives in the sakura struct and is shared
+ * by all the windows of the process (see server mode) */
+struct window {
 	GtkWidget *main_window;
 	GtkWidget *notebook;
 	GtkWidget *menu;
+	char *current_match;
+	const struct link *current_link; /* Matcher of current_match */
+	guint width;
+	guint height;
+	glong columns;
+	glong rows;
+	gint label_count;
+	bool fullscreen;
+	bool keep_fc;				/* Global flag to indicate that we don't want changes in the files and columns values */
+	bool resized;
+	bool focused;                    /* For fading feature */
+	bool first_focus;                /* Did this window already register its first WM-focus? */
+	bool title_set_byuser;
+	bool hold;                       /* Hold window after execute command (-h) */
+	GtkWidget *item_copy_link;       /* We include here only the items which need to be hidden */
+	GtkWidget *item_clear_background; /* We include here only the items which need to be hidden */
+	GtkWidget *item_open_link;
+	GtkWidget *open_link_separator;
+	char *title;                     /* Window title given in the command line (-t) */
+	char *cwd;                       /* Working directory of the invoking process */
+	char **envv;                     /* Environment of the invoking process, passed to the childs */
+	char *argv[3];
+	struct search *search;           /* Open search dialog, see sakura_search_dialog */
+	guint label_tick;                /* Frame callback updating the changed titles, see sakura_labels_tick */
+	struct terminal *title_term;     /* Last tab whose title changed before that */
+	gint64 bell_time;                /* Monotonic time of the last urgency hint */
+};
+
+static struct {
+	GList *windows;				/* List of open windows (struct window) */
 	PangoFontDescription *font;
 	GdkRGBA forecolors[NUM_COLORSETS];
 	GdkRGBA backcolors[NUM_COLORSETS];
 	GdkRGBA curscolors[NUM_COLORSETS];
 	const GdkRGBA *palette;
 	bool has_rgba;				/* RGBA capabilities */
-	char *current_match;
-	guint width;
-	guint height;
-	glong columns;
-	glong rows;
 	gint scroll_lines;
-	gint label_count;
 	VteTerminalCursorShape cursor_type;
 	bool first_tab;
 	bool show_scrollbar;
@@ -239,21 +297,31 @@ static struct {
 	bool visible_bell;
 	bool blinking_cursor;
 	bool allow_bold;
-	bool fullscreen;
-	bool keep_fc;				/* Global flag to indicate that we don't want changes in the files and columns values */
-	bool config_modified;		/* Configuration has been modified */
-	bool externally_modified;	/* Configuration file has been modified by another proccess */
-	bool resized;
-	GtkWidget *item_copy_link;       /* We include here only the items which need to be hidden */
-	GtkWidget *item_clear_background; /* We include here only the items which need to be hidden */
+	bool config_modified;		/* Configuration has unsaved changes */
+	bool font_override;		/* The font is the one from -f, not saved */
 
 	bool disable_numbered_tabswitch; /* For disabling direct tabswitching key */
-	bool focused;                    /* For fading feature */
-	bool first_focus;                /* Did this window already register its first WM-focus? */
 	bool use_fading;
+	bool server_mode;                /* Accept new windows from other sakura invocations */
+	bool spawn_hidden_tabs;          /* Start the placeholder tabs after the window is drawn */
+	bool process_labels;             /* Busy tabs are labeled with their foreground process */
+	bool cgroups;                    /* Each tab in its own cgroup, see sakura_cgroup_create */
+	gint cgroup_cpu_weight;          /* Of the current tab, the others get less */
+	gint cgroup_io_weight;
+	gint cgroup_memory_high;         /* MB, 0 for no limit */
+	gchar *cgroup_root;              /* Where the tab groups are created, NULL until then */
+	bool cgroup_failed;
+	char *log_dir;                   /* Session logs of the new tabs go there, NULL for none */
+	char *log_format;                /* "raw", "text" or "both" */
+	gint log_rotate_size;            /* MB per log file, 0 for no limit */
+	gint log_rotate_minutes;         /* 0 for no limit */
+	bool log_compress;               /* With zstd */
+	gint shell_pool;                 /* Warm shells kept by the spawn helper */
+	gint scrollback_budget;          /* MB of scrollback shared by all the tabs, 0 for no limit */
+	gint throttle_lines;             /* Lines per second background tabs may print, 0 for no limit */
+	gdouble scrollback_scale;        /* Shrinks the budget under memory pressure */
+	bool search_indexing;            /* Scrollback is being indexed, since the first search */
 
-	GtkWidget *item_open_link;
-	GtkWidget *open_link_separator;
 	GKeyFile *cfg;
 	GtkCssProvider *provider;
 	char *configfile;
@@ -272,6 +340,7 @@ static struct {
 	gint font_size_accelerator;
 	gint set_tab_name_accelerator;
 	gint set_colorset_accelerator;
+	gint search_accelerator;
 	gint add_tab_key;
 	gint del_tab_key;
 	gint prev_tab_key;
@@ -280,16 +349,52 @@ static struct {
 	gint paste_key;
 	gint scrollbar_key;
 	gint set_tab_name_key;
+	gint search_key;
 	gint fullscreen_key;
 	gint increase_font_size_key;
 	gint decrease_font_size_key;
 	gint set_colorset_keys[NUM_COLORSETS];
-	GRegex *http_regexp;
-	char *argv[3];
-	bool title_set_byuser;
+	char *keybindings;			/* User defined bindings, "action:accelerator;..." */
+	GHashTable *bindings;		/* (modifiers, keyval) -> struct binding */
+	GHashTable *terms;			/* Tab registry: id -> struct terminal */
+	GHashTable *terms_by_vte;	/* VteTerminal -> struct terminal */
+	GHashTable *terms_by_pid;	/* Child pid -> struct terminal */
+	guint next_term_id;
+	char *link_matchers;		/* Built-in link matchers in use, see link_builtins */
+	char *link_patterns;		/* User defined ones, "name=regex" and "name.open=command" lines */
+	char *trigger_patterns;		/* "actions=text" and "actions=/regex/" lines, see sakura_triggers_compile */
+	struct triggers *triggers;	/* Compiled from them, NULL without any */
+	GPtrArray *links;			/* struct link, registered in this order in every vte */
+	GSocketService *server;
+	char *socket_path;
+	GSocketService *control;	/* Remote control, see sakura_control_command */
+	char *control_path;
 } sakura;
 
+/* Foreground process of a tab, see sakura_proc_sample */
+struct proc_info {
+	pid_t pgid;          /* Foreground process group, 0 if not sampled yet */
+	gchar *name;
+	gchar *cwd;          /* Of the shell, new tabs start there */
+	gint cpu;            /* % of a CPU since the previous sample */
+	gint64 rss;
+	guint64 ticks;       /* utime+stime at the last sample */
+	guint64 usage;       /* Or usage_usec of the cgroup of the tab */
+	gint64 sampled;      /* Monotonic time of the last sample */
+	int pidfd;           /* Tells when the group leader exits, -1 without pidfd support */
+	guint pidfd_watch;
+};
+
+/* A link matcher, see sakura_links_compile */
+struct link {
+	gchar *name;
+	GRegex *regex;
+	gchar *command;			/* %s is the match. NULL opens URLs in the browser, or nothing */
+};
+
 struct terminal {
+	guint id;            /* Stable while the tab lives, unlike its page number */
+	struct window *win;
 	GtkWidget *hbox;
 	GtkWidget *vte;     /* Reference to VTE terminal */
 	GPid pid;          /* pid of the forked proccess */
@@ -299,13 +404,70 @@ struct terminal {
 	bool label_set_byuser;
 	GtkBorder *border;   /* inner-property data */
 	int colorset;
+	guint pending;       /* APPLY_ flags deferred until the tab is shown */
+	gchar *spawn_cwd;    /* Placeholder tabs have no vte yet, they start here when shown */
+	gint scroll_limit;   /* Scrollback lines given by the budget, see sakura_scrollback_rebalance */
+	gint64 last_active;  /* Monotonic time of the last output or switch to the tab */
+	GPtrArray *search_blocks; /* Index of the scrollback text, struct search_block */
+	glong search_row;    /* First row not indexed yet */
+	guint search_idle;
+	bool search_behind;  /* The index is catching up, searches are rerun when done */
+	bool links_off;      /* No link matching, it's in the alternate screen */
+	struct proc_info proc;
+	gchar *cwd;          /* Sent by the shell with OSC 7, NULL until then */
+	bool had_history;    /* Has had scrollback, see sakura_links_screen_changed */
+	bool title_changed;  /* Its label is updated on the next frame */
+	bool throttled;      /* Flooding in the background, see sakura_flow_tick */
+	gchar *cgroup;       /* Directory of its cgroup, NULL without one */
+	bool cgroup_foreground; /* Has the weights of the current tab */
+	guint trigger_timeout;
+	bool trigger_running; /* Its rows are being matched, see sakura_triggers_scan */
+	bool trigger_more;   /* Output since, scan again when done */
+	glong trigger_row;   /* Last row matched, maybe partially */
+	guint64 trigger_fired; /* Triggers that already fired for it */
+	guint trigger_actions; /* TRIGGER_MARK and TRIGGER_HIGHLIGHT shown by its label */
+	gint64 trigger_notified;
+	gint flow_paused;    /* Intervals left with its output stopped */
+	int flow_fd;         /* Slave side of its pty while throttled, -1 otherwise */
+	glong flow_row;      /* Cursor row at the previous tick */
+	struct session_log *log; /* Relay of its output, NULL when not logged */
 };
 
 
 #define ICON_FILE "terminal-tango.svg"
-#define SCROLL_LINES 4096
 #define DEFAULT_SCROLL_LINES 4096
+#define SCROLLBACK_MIN_LINES 200	/* No tab goes below this, whatever the budget */
+#define SCROLLBACK_CELL_SIZE 8		/* Rough bytes per cell in vte's scrollback ring */
+#define SCROLLBACK_ROW_SIZE 32		/* And per row */
+#define SCROLLBACK_INTERVAL 2		/* Seconds between rebalances */
+#define SCROLLBACK_PRESSURE 10.0	/* PSI "some" avg10 above which the budget shrinks */
+#define SEARCH_BLOCK_ROWS 128		/* Rows per index block, each with its own bloom filter */
+#define SEARCH_BLOOM_BITS 8192
+#define SEARCH_INDEX_CHUNK 2048		/* Rows indexed per idle run */
+#define SEARCH_MAX_RESULTS 1000		/* Per tab, the most recent ones */
+#define SEARCH_DELAY 150			/* ms after the last keystroke before searching */
+#define TAB_WIDGETS_SIZE 8192		/* Rough size of the widgets of a tab, with their GObject data */
+#define VTE_WIDGET_SIZE 65536		/* And of a vte besides its rows: pty buffers, fonts, matchers */
+#define PROC_INTERVAL 1				/* Seconds between samples of the foreground processes */
+#define FLOW_INTERVAL 250			/* ms between output rate samples */
+#define FLOW_PAUSE 3				/* Intervals a throttled tab is stopped before it's sampled again */
+#define DEFAULT_THROTTLE_LINES 5000
+#define CGROUP_MOUNT "/sys/fs/cgroup"
+#define CGROUP_BACKGROUND_SHARE 4	/* Background tabs get this much less CPU and IO weight */
+#define DEFAULT_CGROUP_WEIGHT 100
+#define TRIGGER_MAX 64				/* Bits of the masks */
+#define TRIGGER_CHUNK 500			/* Rows matched at a time */
+#define TRIGGER_INTERVAL 100		/* ms from the output to the matching */
+#define TRIGGER_NOTIFY_INTERVAL (5*G_USEC_PER_SEC)	/* Between notifications of a tab */
+#define LOG_BUFFER (1024*1024)		/* Output handed to the log writer at a time */
+#define LOG_FLUSH 1000				/* ms, or at least this often */
+#define LOG_READ 65536
+#define LOG_ZSTD_OUT 65536
+#define LOG_ZSTD_LEVEL 3
+#define DEFAULT_LOG_ROTATE_SIZE 64
+#define BELL_INTERVAL 1000000		/* us, bells closer than this don't set the urgency hint again */
 #define HTTP_REGEXP "(ftp|http)s?://[-a-zA-Z0-9.?$%&/=_~#.,:;+]*[-a-zA-Z0-9.?$%&/=_~#+]"
+#define DEFAULT_LINK_MATCHERS "url"
 #define DEFAULT_CONFIGFILE "sakura.conf"
 #define DEFAULT_COLUMNS 80
 #define DEFAULT_ROWS 24
@@ -327,6 +489,7 @@ struct terminal {
 #define DEFAULT_FONT_SIZE_ACCELERATOR (GDK_CONTROL_MASK)
 #define DEFAULT_SET_TAB_NAME_ACCELERATOR (GDK_CONTROL_MASK|GDK_SHIFT_MASK)
 #define DEFAULT_SELECT_COLORSET_ACCELERATOR (GDK_CONTROL_MASK|GDK_SHIFT_MASK)
+#define DEFAULT_SEARCH_ACCELERATOR (GDK_CONTROL_MASK|GDK_SHIFT_MASK)
 #define DEFAULT_ADD_TAB_KEY  GDK_KEY_T
 #define DEFAULT_DEL_TAB_KEY  GDK_KEY_W
 #define DEFAULT_PREV_TAB_KEY  GDK_KEY_Left
@@ -335,42 +498,306 @@ struct terminal {
 #define DEFAULT_PASTE_KEY  GDK_KEY_V
 #define DEFAULT_SCROLLBAR_KEY  GDK_KEY_S
 #define DEFAULT_SET_TAB_NAME_KEY  GDK_KEY_N
+#define DEFAULT_SEARCH_KEY  GDK_KEY_F
 #define DEFAULT_FULLSCREEN_KEY  GDK_KEY_F11
 #define DEFAULT_INCREASE_FONT_SIZE_KEY GDK_KEY_plus
 #define DEFAULT_DECREASE_FONT_SIZE_KEY GDK_KEY_minus
 
-/* make this an array instead of #defines to get a compile time
- * error instead of a runtime if NUM_COLORSETS changes */
-static int cs_keys[NUM_COLORSETS] =
-		{GDK_KEY_F1, GDK_KEY_F2, GDK_KEY_F3, GDK_KEY_F4, GDK_KEY_F5, GDK_KEY_F6};
-
 #define ERROR_BUFFER_LENGTH 256
+#define SERVER_MAX_MESSAGE (1024*1024)
+#define CONTROL_MAX_LINE (1024*1024)
+#define DEFAULT_SHELL_POOL 1
+#define SHELL_POOL_MAX 16
+#define HELPER_TIMEOUT 1000		/* ms a spawn reply is waited for before forking ourselves */
+#define TRACE_MAX_EVENTS 128
+#define SNAPSHOT_MAGIC 0x6b617273	/* "sark" */
+#define SNAPSHOT_VERSION 12
+#define SNAPSHOT_STRINGS_SIZE 4096
 const char cfg_group[] = "sakura";
 
+/* Startup phases, collected until the first frame is drawn (--startup-trace) */
+static struct {
+	gint64 start;
+	gint n_events;
+	bool done;
+	struct {
+		const char *name;
+		gint64 ts, dur;
+	} events[TRACE_MAX_EVENTS];
+} trace;
+
+/* Resolved settings, cached in binary form next to the config file so the
+ * keyfile doesn't have to be parsed at every startup. Bump SNAPSHOT_VERSION
+ * when changing the list of fields */
+#define SNAPSHOT_INTS(X) \
+	X(scroll_lines) X(last_colorset) X(shell_pool) X(scrollback_budget) X(throttle_lines) \
+	X(cgroup_cpu_weight) X(cgroup_io_weight) X(cgroup_memory_high) \
+	X(log_rotate_size) X(log_rotate_minutes) \
+	X(add_tab_accelerator) X(del_tab_accelerator) X(switch_tab_accelerator) \
+	X(move_tab_accelerator) X(copy_accelerator) X(scrollbar_accelerator) \
+	X(open_url_accelerator) X(font_size_accelerator) X(set_tab_name_accelerator) \
+	X(set_colorset_accelerator) X(search_accelerator) \
+	X(add_tab_key) X(del_tab_key) X(prev_tab_key) X(next_tab_key) X(copy_key) \
+	X(paste_key) X(scrollbar_key) X(set_tab_name_key) X(search_key) X(fullscreen_key) \
+	X(increase_font_size_key) X(decrease_font_size_key)
+#define SNAPSHOT_BOOLS(X) \
+	X(first_tab) X(show_scrollbar) X(show_resize_grip) X(show_closebutton) \
+	X(tabs_on_bottom) X(less_questions) X(urgent_bell) X(audible_bell) \
+	X(visible_bell) X(blinking_cursor) X(allow_bold) \
+	X(disable_numbered_tabswitch) X(use_fading) X(server_mode) X(spawn_hidden_tabs) \
+	X(process_labels) X(cgroups) X(log_compress)
+#define SNAPSHOT_STRINGS(X) \
+	X(background) X(word_chars) X(icon) X(tab_default_title) X(keybindings) \
+	X(link_matchers) X(link_patterns) X(trigger_patterns) X(log_dir) X(log_format)
+
+struct snapshot {
+	guint32 magic;
+	guint32 version;
+	guint32 size;			/* sizeof(struct snapshot), catches ABI changes */
+	guint32 hash;			/* Of the config file contents */
+	gint64 mtime;			/* Of the config file */
+	gint64 file_size;
+	GdkRGBA forecolors[NUM_COLORSETS];
+	GdkRGBA backcolors[NUM_COLORSETS];
+	GdkRGBA curscolors[NUM_COLORSETS];
+	gint set_colorset_keys[NUM_COLORSETS];
+	gint cursor_type;
+	gint palette;			/* Index in palettes[] */
+	gint font;				/* Strings are offsets in strings[], -1 for NULL */
+#define X(field) gint field;
+	SNAPSHOT_INTS(X)
+	SNAPSHOT_STRINGS(X)
+#undef X
+#define X(field) guint8 field;
+	SNAPSHOT_BOOLS(X)
+#undef X
+	char strings[SNAPSHOT_STRINGS_SIZE];
+};
+
 static GQuark term_data_id = 0;
-#define  sakura_get_page_term( sakura, page_idx )  \
+#define  sakura_get_page_term( win, page_idx )  \
     (struct terminal*)g_object_get_qdata(  \
-            G_OBJECT( gtk_notebook_get_nth_page( (GtkNotebook*)sakura.notebook, page_idx ) ), term_data_id);
+            G_OBJECT( gtk_notebook_get_nth_page( (GtkNotebook*)(win)->notebook, page_idx ) ), term_data_id);
 
-#define  sakura_set_page_term( sakura, page_idx, term )  \
+#define  sakura_set_page_term( win, page_idx, term )  \
     g_object_set_qdata_full( \
-            G_OBJECT( gtk_notebook_get_nth_page( (GtkNotebook*)sakura.notebook, page_idx) ), \
-            term_data_id, term, (GDestroyNotify)g_free);
+            G_OBJECT( gtk_notebook_get_nth_page( (GtkNotebook*)(win)->notebook, page_idx) ), \
+            term_data_id, term, (GDestroyNotify)sakura_term_free);
+
+/* Config file schema. Every setting is described here once: its key, how
+ * it's stored, its default and the field of the sakura struct it's bound to.
+ * Strings defaults go in def, numbers, keyvals and booleans in idef */
+enum config_type {
+	CONFIG_BOOLEAN,		/* bool, true/false */
+	CONFIG_YESNO,		/* bool, Yes/No */
+	CONFIG_INTEGER,		/* gint */
+	CONFIG_KEY,			/* gint keyval, stored by name */
+	CONFIG_STRING,		/* char *, NULL isn't stored */
+	CONFIG_OPTSTRING,	/* char *, NULL is stored as "none" */
+	CONFIG_COLOR,		/* GdkRGBA */
+	CONFIG_FONT,		/* PangoFontDescription * */
+	CONFIG_PALETTE		/* const GdkRGBA *, stored by palette name */
+};
+
+/* What has to be updated in the open windows when a key changes on disk */
+enum config_apply {
+	APPLY_NONE = 0,
+	APPLY_FONT = 1<<0,
+	APPLY_COLORS = 1<<1,
+	APPLY_TERM = 1<<2,			/* Per terminal options */
+	APPLY_BACKGROUND = 1<<3,
+	APPLY_TABS = 1<<4,
+	APPLY_SCROLLBAR = 1<<5,
+	APPLY_GRIP = 1<<6,
+	APPLY_MENU = 1<<7,			/* Shown in the popup menu */
+	APPLY_BINDINGS = 1<<8,
+	APPLY_LABEL = 1<<9,			/* The terminal title or foreground process changed */
+	APPLY_POOL = 1<<10,			/* Size of the warm shell pool */
+	APPLY_LINKS = 1<<11,			/* Link matchers */
+	APPLY_CGROUP = 1<<12,		/* Limits of the tab cgroups */
+	APPLY_TRIGGERS = 1<<13		/* Output triggers */
+};
+
+/* Updates a hidden tab can wait for. It keeps reading its pty, but how it
+ * looks only matters once it's shown */
+#define APPLY_DEFERRABLE (APPLY_FONT|APPLY_COLORS|APPLY_LABEL)
+
+struct config_key {
+	const char *key;
+	enum config_type type;
+	const char *def;
+	gint idef;
+	void *field;
+	guint apply;
+};
+
+union config_value {
+	bool b;
+	gint i;
+	char *s;
+	GdkRGBA c;
+	PangoFontDescription *f;
+	const GdkRGBA *p;
+};
+
+#define COLORSET_CONFIG(n, key) \
+	{ "colorset" #n "_fore", CONFIG_COLOR, "rgb(192,192,192)", 0, &sakura.forecolors[n-1], APPLY_COLORS }, \
+	{ "colorset" #n "_back", CONFIG_COLOR, "rgba(0,0,0,1)", 0, &sakura.backcolors[n-1], APPLY_COLORS }, \
+	{ "colorset" #n "_curs", CONFIG_COLOR, "rgb(255,255,255)", 0, &sakura.curscolors[n-1], APPLY_COLORS }, \
+	{ "colorset" #n "_key", CONFIG_KEY, NULL, key, &sakura.set_colorset_keys[n-1], APPLY_BINDINGS }
+
+static const struct config_key config_schema[] = {
+	COLORSET_CONFIG(1, GDK_KEY_F1),
+	COLORSET_CONFIG(2, GDK_KEY_F2),
+	COLORSET_CONFIG(3, GDK_KEY_F3),
+	COLORSET_CONFIG(4, GDK_KEY_F4),
+	COLORSET_CONFIG(5, GDK_KEY_F5),
+	COLORSET_CONFIG(6, GDK_KEY_F6),
+	{ "last_colorset", CONFIG_INTEGER, NULL, 1, &sakura.last_colorset, APPLY_NONE },
+	{ "background", CONFIG_OPTSTRING, NULL, 0, &sakura.background, APPLY_BACKGROUND|APPLY_MENU },
+	{ "scroll_lines", CONFIG_INTEGER, NULL, DEFAULT_SCROLL_LINES, &sakura.scroll_lines, APPLY_TERM },
+	{ "scrollback_budget", CONFIG_INTEGER, NULL, 0, &sakura.scrollback_budget, APPLY_TERM },
+	{ "throttle_lines", CONFIG_INTEGER, NULL, DEFAULT_THROTTLE_LINES, &sakura.throttle_lines, APPLY_NONE },
+	{ "font", CONFIG_FONT, DEFAULT_FONT, 0, &sakura.font, APPLY_FONT },
+	{ "show_always_first_tab", CONFIG_YESNO, NULL, false, &sakura.first_tab, APPLY_TABS|APPLY_MENU },
+	{ "scrollbar", CONFIG_BOOLEAN, NULL, false, &sakura.show_scrollbar, APPLY_SCROLLBAR|APPLY_MENU },
+	{ "resize_grip", CONFIG_BOOLEAN, NULL, false, &sakura.show_resize_grip, APPLY_GRIP|APPLY_MENU },
+	{ "closebutton", CONFIG_BOOLEAN, NULL, true, &sakura.show_closebutton, APPLY_MENU },
+	{ "tabs_on_bottom", CONFIG_BOOLEAN, NULL, false, &sakura.tabs_on_bottom, APPLY_TABS|APPLY_MENU },
+	{ "less_questions", CONFIG_BOOLEAN, NULL, false, &sakura.less_questions, APPLY_MENU },
+	{ "disable_numbered_tabswitch", CONFIG_BOOLEAN, NULL, false, &sakura.disable_numbered_tabswitch, APPLY_BINDINGS|APPLY_MENU },
+	{ "use_fading", CONFIG_BOOLEAN, NULL, false, &sakura.use_fading, APPLY_COLORS|APPLY_MENU },
+	{ "urgent_bell", CONFIG_YESNO, NULL, true, &sakura.urgent_bell, APPLY_MENU },
+	{ "audible_bell", CONFIG_YESNO, NULL, true, &sakura.audible_bell, APPLY_TERM|APPLY_MENU },
+	{ "visible_bell", CONFIG_YESNO, NULL, false, &sakura.visible_bell, APPLY_TERM|APPLY_MENU },
+	{ "blinking_cursor", CONFIG_YESNO, NULL, false, &sakura.blinking_cursor, APPLY_TERM|APPLY_MENU },
+	{ "allow_bold", CONFIG_YESNO, NULL, true, &sakura.allow_bold, APPLY_TERM|APPLY_MENU },
+	{ "cursor_type", CONFIG_INTEGER, NULL, VTE_CURSOR_SHAPE_BLOCK, &sakura.cursor_type, APPLY_TERM|APPLY_MENU },
+	{ "word_chars", CONFIG_STRING, DEFAULT_WORD_CHARS, 0, &sakura.word_chars, APPLY_TERM },
+	{ "palette", CONFIG_PALETTE, DEFAULT_PALETTE, 0, &sakura.palette, APPLY_COLORS|APPLY_MENU },
+	{ "add_tab_accelerator", CONFIG_INTEGER, NULL, DEFAULT_ADD_TAB_ACCELERATOR, &sakura.add_tab_accelerator, APPLY_BINDINGS },
+	{ "del_tab_accelerator", CONFIG_INTEGER, NULL, DEFAULT_DEL_TAB_ACCELERATOR, &sakura.del_tab_accelerator, APPLY_BINDINGS },
+	{ "switch_tab_accelerator", CONFIG_INTEGER, NULL, DEFAULT_SWITCH_TAB_ACCELERATOR, &sakura.switch_tab_accelerator, APPLY_BINDINGS },
+	{ "move_tab_accelerator", CONFIG_INTEGER, NULL, DEFAULT_MOVE_TAB_ACCELERATOR, &sakura.move_tab_accelerator, APPLY_BINDINGS },
+	{ "copy_accelerator", CONFIG_INTEGER, NULL, DEFAULT_COPY_ACCELERATOR, &sakura.copy_accelerator, APPLY_BINDINGS },
+	{ "scrollbar_accelerator", CONFIG_INTEGER, NULL, DEFAULT_SCROLLBAR_ACCELERATOR, &sakura.scrollbar_accelerator, APPLY_BINDINGS },
+	{ "open_url_accelerator", CONFIG_INTEGER, NULL, DEFAULT_OPEN_URL_ACCELERATOR, &sakura.open_url_accelerator, APPLY_BINDINGS },
+	{ "font_size_accelerator", CONFIG_INTEGER, NULL, DEFAULT_FONT_SIZE_ACCELERATOR, &sakura.font_size_accelerator, APPLY_BINDINGS },
+	{ "set_tab_name_accelerator", CONFIG_INTEGER, NULL, DEFAULT_SET_TAB_NAME_ACCELERATOR, &sakura.set_tab_name_accelerator, APPLY_BINDINGS },
+	{ "add_tab_key", CONFIG_KEY, NULL, DEFAULT_ADD_TAB_KEY, &sakura.add_tab_key, APPLY_BINDINGS },
+	{ "del_tab_key", CONFIG_KEY, NULL, DEFAULT_DEL_TAB_KEY, &sakura.del_tab_key, APPLY_BINDINGS },
+	{ "prev_tab_key", CONFIG_KEY, NULL, DEFAULT_PREV_TAB_KEY, &sakura.prev_tab_key, APPLY_BINDINGS },
+	{ "next_tab_key", CONFIG_KEY, NULL, DEFAULT_NEXT_TAB_KEY, &sakura.next_tab_key, APPLY_BINDINGS },
+	{ "copy_key", CONFIG_KEY, NULL, DEFAULT_COPY_KEY, &sakura.copy_key, APPLY_BINDINGS },
+	{ "paste_key", CONFIG_KEY, NULL, DEFAULT_PASTE_KEY, &sakura.paste_key, APPLY_BINDINGS },
+	{ "scrollbar_key", CONFIG_KEY, NULL, DEFAULT_SCROLLBAR_KEY, &sakura.scrollbar_key, APPLY_BINDINGS },
+	{ "set_tab_name_key", CONFIG_KEY, NULL, DEFAULT_SET_TAB_NAME_KEY, &sakura.set_tab_name_key, APPLY_BINDINGS },
+	{ "search_key", CONFIG_KEY, NULL, DEFAULT_SEARCH_KEY, &sakura.search_key, APPLY_BINDINGS },
+	{ "increase_font_size_key", CONFIG_KEY, NULL, DEFAULT_INCREASE_FONT_SIZE_KEY, &sakura.increase_font_size_key, APPLY_BINDINGS },
+	{ "decrease_font_size_key", CONFIG_KEY, NULL, DEFAULT_DECREASE_FONT_SIZE_KEY, &sakura.decrease_font_size_key, APPLY_BINDINGS },
+	{ "fullscreen_key", CONFIG_KEY, NULL, DEFAULT_FULLSCREEN_KEY, &sakura.fullscreen_key, APPLY_BINDINGS },
+	{ "set_colorset_accelerator", CONFIG_INTEGER, NULL, DEFAULT_SELECT_COLORSET_ACCELERATOR, &sakura.set_colorset_accelerator, APPLY_BINDINGS },
+	{ "search_accelerator", CONFIG_INTEGER, NULL, DEFAULT_SEARCH_ACCELERATOR, &sakura.search_accelerator, APPLY_BINDINGS },
+	{ "icon_file", CONFIG_STRING, ICON_FILE, 0, &sakura.icon, APPLY_NONE },
+	{ "tab_default_title", CONFIG_STRING, NULL, 0, &sakura.tab_default_title, APPLY_NONE },
+	{ "keybindings", CONFIG_STRING, NULL, 0, &sakura.keybindings, APPLY_BINDINGS },
+	{ "link_matchers", CONFIG_STRING, DEFAULT_LINK_MATCHERS, 0, &sakura.link_matchers, APPLY_LINKS },
+	{ "link_patterns", CONFIG_STRING, NULL, 0, &sakura.link_patterns, APPLY_LINKS },
+	{ "triggers", CONFIG_STRING, NULL, 0, &sakura.trigger_patterns, APPLY_TRIGGERS },
+	{ "server_mode", CONFIG_BOOLEAN, NULL, false, &sakura.server_mode, APPLY_NONE },
+	{ "spawn_hidden_tabs", CONFIG_BOOLEAN, NULL, false, &sakura.spawn_hidden_tabs, APPLY_NONE },
+	{ "process_labels", CONFIG_BOOLEAN, NULL, true, &sakura.process_labels, APPLY_LABEL },
+	{ "cgroups", CONFIG_BOOLEAN, NULL, false, &sakura.cgroups, APPLY_NONE },
+	{ "cgroup_cpu_weight", CONFIG_INTEGER, NULL, DEFAULT_CGROUP_WEIGHT, &sakura.cgroup_cpu_weight, APPLY_CGROUP },
+	{ "cgroup_io_weight", CONFIG_INTEGER, NULL, DEFAULT_CGROUP_WEIGHT, &sakura.cgroup_io_weight, APPLY_CGROUP },
+	{ "cgroup_memory_high", CONFIG_INTEGER, NULL, 0, &sakura.cgroup_memory_high, APPLY_CGROUP },
+	{ "log_dir", CONFIG_STRING, NULL, 0, &sakura.log_dir, APPLY_NONE },
+	{ "log_format", CONFIG_STRING, "raw", 0, &sakura.log_format, APPLY_NONE },
+	{ "log_rotate_size", CONFIG_INTEGER, NULL, DEFAULT_LOG_ROTATE_SIZE, &sakura.log_rotate_size, APPLY_NONE },
+	{ "log_rotate_minutes", CONFIG_INTEGER, NULL, 0, &sakura.log_rotate_minutes, APPLY_NONE },
+	{ "log_compress", CONFIG_BOOLEAN, NULL, false, &sakura.log_compress, APPLY_NONE },
+	{ "shell_pool", CONFIG_INTEGER, NULL, DEFAULT_SHELL_POOL, &sakura.shell_pool, APPLY_POOL },
+};
+#define NUM_CONFIG_KEYS (sizeof(config_schema)/sizeof(config_schema[0]))
 
-#define  sakura_set_config_integer(key, value) do {\
-	g_key_file_set_integer(sakura.cfg, cfg_group, key, value);\
-	sakura.config_modified=TRUE;\
-	} while(0);
+/* Config changes are saved by a worker thread, after CONFIG_SAVE_DELAY ms
+ * without further changes. Changes made to the file by others are loaded
+ * the same way, after CONFIG_RELOAD_DELAY ms without file events */
+#define CONFIG_SAVE_DELAY 500
+#define CONFIG_RELOAD_DELAY 200
 
-#define  sakura_set_config_string(key, value) do {\
-	g_key_file_set_value(sakura.cfg, cfg_group, key, value);\
-	sakura.config_modified=TRUE;\
-	} while(0);
+struct config_job {
+	gchar *configfile;
+	gchar *values[NUM_CONFIG_KEYS];	/* New values, NULL for unchanged keys */
+};
+
+static struct {
+	gchar *saved[NUM_CONFIG_KEYS];	/* Values as they are in the config file */
+	guint timeout;					/* Pending save */
+	struct config_job *running;		/* Save being done by the worker */
+	GMutex lock;					/* Serializes config file writes */
+	GCond cond;						/* Signaled with the lock held when the worker is done */
+	bool done;						/* The running save is over */
+	bool ok;						/* And it succeeded */
+	guint reload_timeout;			/* Pending reload */
+	bool reloading;					/* Config file being read by the worker */
+} config_writer;
+
+#ifdef SAKURA_BENCH
+/* Benchmarks, only built into sakura-bench. They drive a real window, run
+ * them under Xvfb (see the bench targets in CMakeLists.txt) */
+#define BENCH_SAMPLES 1000
+#define BENCH_KEY_TIMEOUT 1000		/* ms to wait for a key to reach the screen */
+#define BENCH_SETTLE 500			/* ms to let new tabs start before measuring */
+#define BENCH_LINK_COLUMNS 400
+#define BENCH_LINK_ROWS 120
+#define BENCH_SIZE 32				/* MB of output per throughput workload */
+#define BENCH_TICK 10				/* ms between main loop liveness checks */
+#define BENCH_STALL 50				/* ms without getting to run that count as a stall */
+#define BENCH_TABS 50				/* Tabs of the tabs_50 throughput workload */
+
+/* Where a typed key is timestamped, in the order it gets there */
+enum bench_stage {
+	BENCH_KEY_PRESS,	/* sakura_key_press */
+	BENCH_PTY_WRITE,	/* vte "commit", the key is written to the pty */
+	BENCH_ECHO,			/* vte "contents-changed", the child echoed it */
+	BENCH_DRAW,			/* vte "draw" */
+	BENCH_FRAME,		/* Frame clock "after-paint", the frame is committed */
+	BENCH_STAGES
+};
 
-#define  sakura_set_config_boolean(key, value) do {\
-	g_key_file_set_boolean(sakura.cfg, cfg_group, key, value);\
-	sakura.config_modified=TRUE;\
-	} while(0);
+static struct {
+	struct window *win;
+	struct terminal *term;		/* Tab the keys are typed in */
+	gchar *dir;					/* Scripts run in the tabs, and their data */
+	GSList *files;				/* Created in dir */
+	const gchar *echo_child, *flood_child;
+	GdkDevice *keyboard;
+	GString *json;
+	guint scenario;
+	gint samples, sample;
+	gint64 start;				/* When the measured key was injected */
+	gint64 *times[BENCH_STAGES];	/* Per sample, -1 if the key didn't get there */
+	bool pending;				/* A key is being measured */
+	guint timeout;
+	gint flood_page;
+	guint workload;				/* Throughput */
+	gint64 bytes;
+	guint frames;
+	guint stalls;
+	gint64 max_stall;
+	gint64 last_tick;
+	gint64 peak_rss;
+	guint ticker;
+	gint running;				/* Tabs of the workload still reading */
+} bench;
+
+static void     sakura_bench_mark(enum bench_stage);
+static void     sakura_bench_latency_start(struct window *);
+static void     sakura_bench_throughput_start(struct window *);
+static void     sakura_bench_links_start(struct window *);
+static void     sakura_bench_set_child(const char *);
+#endif
 
 
 /* Callbacks */
@@ -381,19 +808,53 @@ static void     sakura_decrease_font (GtkWidget *, void *);
 static void     sakura_child_exited (GtkWidget *, void *);
 static void     sakura_eof (GtkWidget *, void *);
 static void     sakura_title_changed (GtkWidget *, void *);
+static gboolean sakura_labels_tick (GtkWidget *, GdkFrameClock *, gpointer);
+static void     sakura_cwd_changed (GtkWidget *, void *);
 static gboolean sakura_delete_event (GtkWidget *, void *);
 static void     sakura_destroy_window (GtkWidget *, void *);
 
 static gboolean sakura_resized_window( GtkWidget *, GdkEventConfigure *, void *);
 static gboolean sakura_focus_change( GtkWidget *, GdkEvent *, void *);
 static void     sakura_closebutton_clicked (GtkWidget *, void *);
-static void     sakura_conf_changed (GtkWidget *, void *);
+static void     sakura_conf_changed (GFileMonitor *, GFile *, GFile *, GFileMonitorEvent, void *);
 static void     sakura_window_show_event (GtkWidget *, gpointer);
 static gboolean sakura_notebook_focus_in (GtkWidget *, void *);
-static gboolean sakura_notebook_scroll (GtkWidget *, GdkEventScroll *);
+static gboolean sakura_notebook_scroll (GtkWidget *, GdkEventScroll *, void *);
+static void     sakura_switch_page (GtkNotebook *, GtkWidget *, guint, void *);
 /* Menuitem callbacks */
 static void     sakura_font_dialog (GtkWidget *, void *);
 static void     sakura_set_name_dialog (GtkWidget *, void *);
+static void     sakura_search_dialog (GtkWidget *, void *);
+static void     sakura_search_close(struct window *);
+static void     sakura_stats_dialog(GtkWidget *, void *);
+static gchar   *sakura_stats_json();
+static gboolean sakura_stats_signal(gpointer);
+static void     sakura_links_compile();
+static void     sakura_update_tab_label(struct terminal *);
+static bool     sakura_proc_busy(struct terminal *);
+static gboolean sakura_flow_tick(gpointer);
+static void     sakura_cgroup_limits(struct terminal *, bool, bool);
+static void     sakura_triggers_compile();
+static void     sakura_triggers_schedule(struct terminal *);
+static void     sakura_trigger_label(struct terminal *, guint);
+static void     sakura_cgroup_switch(struct window *, gint);
+static gchar   *sakura_cgroup_create(struct terminal *);
+static void     sakura_cgroup_join(const char *);
+static void     sakura_cgroup_attach(struct terminal *);
+static void     sakura_cgroup_detach(struct terminal *);
+static int      sakura_log_start(struct terminal *, int, GPid, GError **);
+static void     sakura_log_detach(struct terminal *);
+static void     sakura_log_done();
+static int      sakura_term_pty(struct terminal *);
+static bool     sakura_cgroup_stat(struct terminal *, gint64);
+static void     sakura_flow_release(struct terminal *);
+static bool     sakura_proc_running(struct terminal *);
+static gboolean sakura_proc_monitor(gpointer);
+static void     sakura_proc_forget(struct terminal *);
+static bool     sakura_link_opens(const struct link *);
+static void     sakura_link_open(struct window *, const struct link *, const char *);
+static void     sakura_links_register(struct terminal *);
+static void     sakura_links_screen_changed(GtkAdjustment *, void *);
 static void     sakura_color_dialog (GtkWidget *, void *);
 static void     sakura_set_title_dialog (GtkWidget *, void *);
 static void     sakura_select_background_dialog (GtkWidget *, void *);
@@ -414,7 +875,6 @@ static void     sakura_show_scrollbar(GtkWidget *, void *);
 
 static void     sakura_show_resize_grip(GtkWidget *, void *);
 static void     sakura_closebutton_clicked(GtkWidget *, void *);
-static void     sakura_conf_changed(GtkWidget *, void *);
 static void     sakura_window_show_event(GtkWidget *, gpointer);
 
 static void     sakura_disable_numbered_tabswitch (GtkWidget *, void *);
@@ -422,25 +882,67 @@ static void     sakura_use_fading (GtkWidget *, void *);
 static void     sakura_setname_entry_changed(GtkWidget *, void *);
 
 /* Misc */
-static void     sakura_error(const char *, ...);
+static void     sakura_error(struct window *, const char *, ...);
 
 /* Functions */
 static void     sakura_init();
-static void     sakura_init_popup();
-static void     sakura_destroy();
-static void     sakura_add_tab();
-static void     sakura_del_tab();
-static void     sakura_move_tab(gint);
-static gint     sakura_find_tab(VteTerminal *);
+static struct window *sakura_window_new(char **, const char *);
+static void     sakura_init_popup(struct window *);
+static void     sakura_destroy(struct window *);
+static void     sakura_add_tab(struct window *);
+static struct terminal *sakura_add_tab_full(struct window *, const char *, char **, char **, bool, GError **);
+static void     sakura_add_tabs(struct window *, gint);
+static void     sakura_tab_materialize(struct terminal *);
+static gboolean sakura_materialize_idle(gpointer);
+static gint     sakura_scrollback_lines(struct terminal *);
+static gboolean sakura_scrollback_rebalance(gpointer);
+static void     sakura_contents_changed(GtkWidget *, void *);
+static void     sakura_search_index_schedule(struct terminal *);
+static void     sakura_search_block_unref(gpointer);
+static void     sakura_del_tab(struct window *, gint);
+static void     sakura_move_tab(struct window *, gint);
+static void     sakura_term_register(struct terminal *);
+static void     sakura_term_free(struct terminal *);
+static struct terminal *sakura_term_by_id(guint);
+static struct terminal *sakura_term_by_vte(VteTerminal *);
+static struct terminal *sakura_term_by_pid(GPid);
 static void     sakura_set_font();
-static void     sakura_set_tab_label_text(const gchar *, gint page);
-static void     sakura_set_size(void);
-static void     sakura_set_bgimage();
-static void     sakura_set_config_key(const gchar *, guint);
-static guint    sakura_get_config_key(const gchar *);
+static void     sakura_set_tab_label_text(struct terminal *, const gchar *);
+static void     sakura_set_size(struct window *);
+static void     sakura_set_size_all(void);
+static void     sakura_set_bgimage(struct window *, char *);
 static void     sakura_config_done();
-static void     sakura_set_colorset (int);
+static void     sakura_config_load();
+static void     sakura_config_read();
+static void     sakura_config_mark_saved();
+static void     sakura_config_changed();
+static void     sakura_config_save_async();
+static gboolean sakura_config_reload_timeout(gpointer);
+static void     sakura_set_term_options(struct terminal *);
+static guint    sakura_term_defer(struct window *, struct terminal *, guint);
+static void     sakura_set_term_colors(struct window *, struct terminal *);
+static void     sakura_bindings_compile();
+static struct config_job *sakura_config_job_new();
+static void     sakura_config_job_free(struct config_job *);
+static void     sakura_config_job_saved(struct config_job *);
+static bool     sakura_config_write(struct config_job *, GError **);
+static bool     sakura_snapshot_load();
+static void     sakura_snapshot_save();
+static guint    sakura_palette_index(const char *);
+static void     sakura_set_colorset (struct window *, int);
 static void     sakura_set_colors (void);
+static bool     sakura_server_forward(char **);
+static void     sakura_server_start(void);
+static void     sakura_server_stop(void);
+static void     sakura_helper_start(void);
+static void     sakura_helper_pool(struct window *);
+static bool     sakura_spawn(struct terminal *, const char *, char **, char **, GSpawnFlags, GError **);
+static void     sakura_control_start(void);
+static void     sakura_control_stop(void);
+static int      sakura_control_client(const char *);
+static gint64   sakura_trace_now(void);
+static void     sakura_trace_add(const char *, gint64);
+static gboolean sakura_trace_first_frame(GtkWidget *, void *, gpointer);
 
 /* Globals for command line parameters */
 static const char *option_font;
@@ -459,6 +961,19 @@ static char *option_config_file;
 static gboolean option_fullscreen;
 static gboolean option_maximize;
 static gboolean option_help;
+static gboolean option_standalone;
+static char *option_startup_trace;
+static gboolean option_control;
+static gboolean option_stats;
+#ifdef SAKURA_BENCH
+static char *option_bench_latency;
+static gint option_bench_samples=BENCH_SAMPLES;
+static char *option_bench_throughput;
+static gint option_bench_size=BENCH_SIZE;
+static char *option_bench_links;
+static gboolean option_bench_triggers;
+static char *option_bench_log;
+#endif
 
 static GOptionEntry entries[] = {
 	{ "help", 'h', 0, G_OPTION_ARG_NONE, &option_help, N_("Show help options"), NULL },
@@ -479,184 +994,259 @@ static GOptionEntry entries[] = {
 	{ "fullscreen", 's', 0, G_OPTION_ARG_NONE, &option_fullscreen, N_("Fullscreen mode"), NULL },
 	{ "geometry", 0, 0, G_OPTION_ARG_STRING, &option_geometry, N_("X geometry specification"), NULL },
 	{ "config-file", 0, 0, G_OPTION_ARG_FILENAME, &option_config_file, N_("Use alternate configuration file"), NULL },
+	{ "standalone", 0, 0, G_OPTION_ARG_NONE, &option_standalone, N_("Don't open the window in an already running sakura"), NULL },
+	{ "startup-trace", 0, 0, G_OPTION_ARG_FILENAME, &option_startup_trace, N_("Write a Chrome trace of the startup phases to FILE"), N_("FILE") },
+	{ "control", 0, 0, G_OPTION_ARG_NONE, &option_control, N_("Send the commands read from stdin to the running sakura and print its replies"), NULL },
+	{ "stats", 0, 0, G_OPTION_ARG_NONE, &option_stats, N_("Print the memory statistics of the running sakura as JSON"), NULL },
+#ifdef SAKURA_BENCH
+	{ "bench-latency", 0, 0, G_OPTION_ARG_FILENAME, &option_bench_latency, "Measure keystroke latency and write a JSON report to FILE", "FILE" },
+	{ "bench-samples", 0, 0, G_OPTION_ARG_INT, &option_bench_samples, "Keys typed per benchmark scenario", "N" },
+	{ "bench-throughput", 0, 0, G_OPTION_ARG_FILENAME, &option_bench_throughput, "Measure output throughput and write a JSON report to FILE", "FILE" },
+	{ "bench-size", 0, 0, G_OPTION_ARG_INT, &option_bench_size, "MB of output per throughput workload", "MB" },
+	{ "bench-links", 0, 0, G_OPTION_ARG_FILENAME, &option_bench_links, "Measure the link matching cost per hover and write a JSON report to FILE", "FILE" },
+	{ "bench-triggers", 0, 0, G_OPTION_ARG_NONE, &option_bench_triggers, "Match 30 output triggers during the throughput benchmark", NULL },
+	{ "bench-log", 0, 0, G_OPTION_ARG_FILENAME, &option_bench_log, "Log the raw and text output of the throughput benchmark to DIR", "DIR" },
+#endif
 	{ NULL }
 };
 
 
-static
-gboolean sakura_key_press (GtkWidget *widget, GdkEventKey *event, gpointer user_data)
+/* Actions that can be bound to keys. They return false when they don't
+ * apply, so the key goes to the terminal */
+static bool
+sakura_action_new_tab(struct window *win, gint arg)
 {
-	if (event->type!=GDK_KEY_PRESS) return FALSE;
+	sakura_add_tab(win);
+	return true;
+}
 
-	unsigned int topage = 0;
+static bool
+sakura_action_close_tab(struct window *win, gint arg)
+{
+	sakura_close_tab(NULL, win);
+	return true;
+}
 
-	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	guint keyval = event->keyval;
+static bool
+sakura_action_switch_tab(struct window *win, gint arg)
+{
+	/* Tabs are numbered from 1 */
+	if (arg > gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)) ||
+	    arg-1 == gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook)))
+		return false;
 
-	/* Check if Caps lock is enabled. If it is, change keyval to make keybindings work with
-	   both lowercase and uppercase letters */
-	/*if (gdk_keymap_get_caps_lock_state(gdk_keymap_get_default())) {*/
-	/* make pressed key uppercase by default */
-	keyval = gdk_keyval_to_upper(keyval);
-	/*}*/
+	gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook), arg-1);
+	return true;
+}
 
-	/* add_tab_accelerator + T or del_tab_accelerator + W pressed */
-	if ( (event->state & sakura.add_tab_accelerator)==sakura.add_tab_accelerator &&
-			keyval==sakura.add_tab_key) {
-		sakura_add_tab();
-		return TRUE;
-	} else if ( (event->state & sakura.del_tab_accelerator)==sakura.del_tab_accelerator &&
-			keyval==sakura.del_tab_key ) {
-		/* Delete current tab */
-		sakura_close_tab(NULL, NULL);
-		return TRUE;
+static bool
+sakura_action_prev_tab(struct window *win, gint arg)
+{
+	if (gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook))==0) {
+		gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook), -1);
+	} else {
+		gtk_notebook_prev_page(GTK_NOTEBOOK(win->notebook));
 	}
+	return true;
+}
 
-	/* switch_tab_accelerator + number pressed / switch_tab_accelerator + (left/right) cursor pressed */
-	/*
-		if ( (event->state & sakura.switch_tab_accelerator) == sakura.switch_tab_accelerator ) {
-		BUGFIX (https://bugs.launchpad.net/sakura/+bug/1438082):
-			in cases when user configured accelerators like this one:
-				switch_tab_accelerator=4  for ctrl+next[prev]_tab_key
-				move_tab_accelerator=5  for ctrl+shift+next[prev]_tab_key
-			move never works, because switch will be processed firstly
-	*/
-	if(
-		(event->state & sakura.switch_tab_accelerator) == sakura.switch_tab_accelerator
-		&&
-		(
-			sakura.switch_tab_accelerator > sakura.move_tab_accelerator
-			||
-			(event->state & sakura.move_tab_accelerator) != sakura.move_tab_accelerator
-		)
-	) {
-		if ((keyval>=GDK_KEY_1) && (keyval<=GDK_KEY_9) && (keyval<=GDK_KEY_1-1+npages)
-				&& (keyval!=GDK_KEY_1+gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook)))) {
-			switch(keyval) {
-				case GDK_KEY_1: topage=0; break;
-				case GDK_KEY_2: topage=1; break;
-				case GDK_KEY_3: topage=2; break;
-				case GDK_KEY_4: topage=3; break;
-				case GDK_KEY_5: topage=4; break;
-				case GDK_KEY_6: topage=5; break;
-				case GDK_KEY_7: topage=6; break;
-				case GDK_KEY_8: topage=7; break;
-				case GDK_KEY_9: topage=8; break;
-			}
-			if (topage <= npages)
-				gtk_notebook_set_current_page(GTK_NOTEBOOK(sakura.notebook), topage);
-			return TRUE;
-		} else if (keyval==sakura.prev_tab_key) {
-			if (gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook))==0) {
-				gtk_notebook_set_current_page(GTK_NOTEBOOK(sakura.notebook), npages-1);
-			} else {
-				gtk_notebook_prev_page(GTK_NOTEBOOK(sakura.notebook));
-			}
-			return TRUE;
-		} else if (keyval==sakura.next_tab_key) {
-			if (gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook))==(npages-1)) {
-				gtk_notebook_set_current_page(GTK_NOTEBOOK(sakura.notebook), 0);
-			} else {
-				gtk_notebook_next_page(GTK_NOTEBOOK(sakura.notebook));
-			}
-			return TRUE;
-		}
-	}
+static bool
+sakura_action_next_tab(struct window *win, gint arg)
+{
+	gint npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
 
-	/* move_tab_accelerator + (left/right) cursor pressed */
-	/* if ( (event->state & sakura.move_tab_accelerator)==sakura.move_tab_accelerator ) { */
-	if(
-		((event->state & sakura.move_tab_accelerator) == sakura.move_tab_accelerator)
-		&&
-		(
-			sakura.move_tab_accelerator > sakura.switch_tab_accelerator
-			||
-			(event->state & sakura.switch_tab_accelerator) != sakura.switch_tab_accelerator
-		)
-	) {
-		if (keyval==sakura.prev_tab_key) {
-			sakura_move_tab(BACKWARDS);
-			return TRUE;
-		} else if (keyval==sakura.next_tab_key) {
-			sakura_move_tab(FORWARD);
-			return TRUE;
-		}
+	if (gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook))==(npages-1)) {
+		gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook), 0);
+	} else {
+		gtk_notebook_next_page(GTK_NOTEBOOK(win->notebook));
 	}
+	return true;
+}
 
-	/* copy_accelerator-[C/V] pressed */
-	//SAY("copy acc: %d", sakura.copy_accelerator);
-	//SAY("ev+copy: %d", (event->state & sakura.copy_accelerator));
-	if ( (event->state & sakura.copy_accelerator)==sakura.copy_accelerator ) {
-		//SAY("%d %d", keyval, sakura.copy_key);
-		if (keyval==sakura.copy_key) {
-			sakura_copy(NULL, NULL);
-			return TRUE;
-		} else if (keyval==sakura.paste_key) {
-			sakura_paste(NULL, NULL);
-			return TRUE;
-		}
-	}
+static bool
+sakura_action_move_tab_back(struct window *win, gint arg)
+{
+	sakura_move_tab(win, BACKWARDS);
+	return true;
+}
 
-	/* scrollbar_accelerator-[S] pressed */
-	if ( (event->state & sakura.scrollbar_accelerator)==sakura.scrollbar_accelerator ) {
-		if (keyval==sakura.scrollbar_key) {
-			sakura_show_scrollbar(NULL, NULL);
-			return TRUE;
-		}
-	}
+static bool
+sakura_action_move_tab_forward(struct window *win, gint arg)
+{
+	sakura_move_tab(win, FORWARD);
+	return true;
+}
 
-	/* set_tab_name_accelerator-[N] pressed */
-	if ( (event->state & sakura.set_tab_name_accelerator)==sakura.set_tab_name_accelerator ) {
-		if (keyval==sakura.set_tab_name_key) {
-			sakura_set_name_dialog(NULL, NULL);
-			return TRUE;
-		}
-	}
+static bool
+sakura_action_copy(struct window *win, gint arg)
+{
+	sakura_copy(NULL, win);
+	return true;
+}
 
-	/* font_size_accelerator-[+] or [-] pressed */
-	if ( (event->state & sakura.font_size_accelerator)==sakura.font_size_accelerator ) {
-		if (keyval==sakura.increase_font_size_key) {
-			sakura_increase_font(NULL, NULL);
-			return TRUE;
-		} else if (keyval==sakura.decrease_font_size_key) {
-			sakura_decrease_font(NULL, NULL);
-			return TRUE;
-		}
-	}
+static bool
+sakura_action_paste(struct window *win, gint arg)
+{
+	sakura_paste(NULL, win);
+	return true;
+}
 
-	/* F11 (fullscreen) pressed */
-	if (keyval==sakura.fullscreen_key){
-		sakura_fullscreen(NULL, NULL);
-		return TRUE;
-	}
+static bool
+sakura_action_toggle_scrollbar(struct window *win, gint arg)
+{
+	sakura_show_scrollbar(NULL, win);
+	return true;
+}
 
-	/* Change in colorset */
-	if ( (event->state & sakura.set_colorset_accelerator)==sakura.set_colorset_accelerator ) {
-		int i;
-		for(i=0; i<NUM_COLORSETS; i++) {
-			if (keyval==sakura.set_colorset_keys[i]){
-				sakura_set_colorset(i);
-				return TRUE;
-			}
-		}
+static bool
+sakura_action_set_tab_name(struct window *win, gint arg)
+{
+	sakura_set_name_dialog(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_search(struct window *win, gint arg)
+{
+	sakura_search_dialog(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_set_window_title(struct window *win, gint arg)
+{
+	sakura_set_title_dialog(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_increase_font_size(struct window *win, gint arg)
+{
+	sakura_increase_font(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_decrease_font_size(struct window *win, gint arg)
+{
+	sakura_decrease_font(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_select_font(struct window *win, gint arg)
+{
+	sakura_font_dialog(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_select_colors(struct window *win, gint arg)
+{
+	sakura_color_dialog(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_fullscreen(struct window *win, gint arg)
+{
+	sakura_fullscreen(NULL, win);
+	return true;
+}
+
+static bool
+sakura_action_set_colorset(struct window *win, gint arg)
+{
+	if (arg > NUM_COLORSETS)
+		return false;
+
+	sakura_set_colorset(win, arg-1);
+	return true;
+}
+
+struct action {
+	const char *name;
+	bool (*run)(struct window *, gint);
+	bool numbered;			/* Takes a number, as in switch_tab_12 */
+};
+
+static const struct action actions[] = {
+	{ "new_tab", sakura_action_new_tab, false },
+	{ "close_tab", sakura_action_close_tab, false },
+	{ "switch_tab", sakura_action_switch_tab, true },
+	{ "prev_tab", sakura_action_prev_tab, false },
+	{ "next_tab", sakura_action_next_tab, false },
+	{ "move_tab_back", sakura_action_move_tab_back, false },
+	{ "move_tab_forward", sakura_action_move_tab_forward, false },
+	{ "copy", sakura_action_copy, false },
+	{ "paste", sakura_action_paste, false },
+	{ "toggle_scrollbar", sakura_action_toggle_scrollbar, false },
+	{ "set_tab_name", sakura_action_set_tab_name, false },
+	{ "search", sakura_action_search, false },
+	{ "set_window_title", sakura_action_set_window_title, false },
+	{ "increase_font_size", sakura_action_increase_font_size, false },
+	{ "decrease_font_size", sakura_action_decrease_font_size, false },
+	{ "select_font", sakura_action_select_font, false },
+	{ "select_colors", sakura_action_select_colors, false },
+	{ "fullscreen", sakura_action_fullscreen, false },
+	{ "set_colorset", sakura_action_set_colorset, true },
+};
+#define NUM_ACTIONS (sizeof(actions)/sizeof(actions[0]))
+
+/* A key binding. They're compiled from the config into sakura.bindings */
+struct binding {
+	gint64 key;				/* BINDING_KEY(modifiers, keyval) */
+	const struct action *action;
+	gint arg;
+	bool user;				/* From the keybindings setting */
+};
+#define BINDING_KEY(mods, keyval) (((gint64)(mods) << 32) | (keyval))
+
+
+static
+gboolean sakura_key_press (GtkWidget *widget, GdkEventKey *event, gpointer user_data)
+{
+	struct window *win = (struct window *)user_data;
+	struct binding *binding;
+	guint mods;
+	gint64 key;
+
+	if (event->type!=GDK_KEY_PRESS) return FALSE;
+
+#ifdef SAKURA_BENCH
+	sakura_bench_mark(BENCH_KEY_PRESS);
+#endif
+
+	/* Bindings use uppercase keyvals, so they work with both lowercase and
+	 * uppercase letters (and caps lock) */
+	mods = event->state & gtk_accelerator_get_default_mod_mask();
+	key = BINDING_KEY(mods, gdk_keyval_to_upper(event->keyval));
+	binding = g_hash_table_lookup(sakura.bindings, &key);
+
+	/* Shift may be needed just to type the key, as in Ctrl + '+' */
+	if (!binding && (mods & GDK_SHIFT_MASK)) {
+		key = BINDING_KEY(mods & ~GDK_SHIFT_MASK, gdk_keyval_to_upper(event->keyval));
+		binding = g_hash_table_lookup(sakura.bindings, &key);
 	}
-	return FALSE;
+
+	if (!binding)
+		return FALSE;
+
+	return binding->action->run(win, binding->arg) ? TRUE : FALSE;
 }
 
 
 static gboolean
 sakura_button_press(GtkWidget *widget, GdkEventButton *button_event, gpointer user_data)
 {
-	struct terminal *term;
+	struct terminal *term = (struct terminal *)user_data;
+	struct window *win = term->win;
 	glong column, row;
-	gint page, tag;
+	gint tag;
 
 	if (button_event->type != GDK_BUTTON_PRESS)
 		return FALSE;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
-
 	/* Find out if cursor it's over a matched expression...*/
 
 	/* Get the column and row relative to pointer position */
@@ -664,14 +1254,17 @@ sakura_button_press(GtkWidget *widget, GdkEventButton *button_event, gpointer us
 			VTE_TERMINAL(term->vte)));
 	row = ((glong) (button_event->y) / vte_terminal_get_char_height(
 			VTE_TERMINAL(term->vte)));
-	sakura.current_match = vte_terminal_match_check(VTE_TERMINAL(term->vte), column, row, &tag);
+	g_free(win->current_match);
+	win->current_match = vte_terminal_match_check(VTE_TERMINAL(term->vte), column, row, &tag);
+	win->current_link = win->current_match && tag >= 0 && tag < (gint)sakura.links->len ?
+	                    g_ptr_array_index(sakura.links, tag) : NULL;
 
 	/* Left button: open the URL if any */
 	if (button_event->button == 1 &&
 	    ((button_event->state & sakura.open_url_accelerator) == sakura.open_url_accelerator)
-	    && sakura.current_match) {
+	    && win->current_link && sakura_link_opens(win->current_link)) {
 
-		sakura_open_url(NULL, NULL);
+		sakura_open_url(NULL, win);
 
 		return TRUE;
 	}
@@ -679,18 +1272,18 @@ sakura_button_press(GtkWidget *widget, GdkEventButton *button_event, gpointer us
 	/* Right button: show the popup menu */
 	if (button_event->button == 3) {
 		GtkMenu *menu;
-		menu = GTK_MENU (widget);
+		menu = GTK_MENU (win->menu);
 
-		if (sakura.current_match) {
-			/* Show the extra options in the menu */
-			gtk_widget_show(sakura.item_open_link);
-			gtk_widget_show(sakura.item_copy_link);
-			gtk_widget_show(sakura.open_link_separator);
+		if (win->current_match) {
+			/* Show the extra options in the menu. Some matches can only be copied */
+			gtk_widget_set_visible(win->item_open_link, win->current_link && sakura_link_opens(win->current_link));
+			gtk_widget_show(win->item_copy_link);
+			gtk_widget_show(win->open_link_separator);
 		} else {
 			/* Hide all the options */
-			gtk_widget_hide(sakura.item_open_link);
-			gtk_widget_hide(sakura.item_copy_link);
-			gtk_widget_hide(sakura.open_link_separator);
+			gtk_widget_hide(win->item_open_link);
+			gtk_widget_hide(win->item_copy_link);
+			gtk_widget_hide(win->open_link_separator);
 		}
 
 		gtk_menu_popup (menu, NULL, NULL, NULL, NULL, button_event->button, button_event->time);
@@ -708,11 +1301,12 @@ sakura_button_press(GtkWidget *widget, GdkEventButton *button_event, gpointer us
 static gboolean
 sakura_notebook_focus_in(GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	struct terminal *term;
 	int index;
 
-	index = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, index);
+	index = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, index);
 
 	/* if found term - stop event propagation */
 	if(term != NULL) {
@@ -730,19 +1324,20 @@ sakura_notebook_focus_in(GtkWidget *widget, void *data)
 	bugfix (https://bugs.launchpad.net/sakura/+bug/1077967)
 */
 static gboolean
-sakura_notebook_scroll(GtkWidget *widget, GdkEventScroll *event)
+sakura_notebook_scroll(GtkWidget *widget, GdkEventScroll *event, void *data)
 {
+	struct window *win = (struct window *)data;
 	gint page, npages;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
 
 	switch(event->direction) {
 		case GDK_SCROLL_UP:
-			gtk_notebook_set_current_page(GTK_NOTEBOOK(sakura.notebook), page >= 0 ? --page : npages);
+			gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook), page >= 0 ? --page : npages);
 			break;
 		case GDK_SCROLL_DOWN:
-			gtk_notebook_set_current_page(GTK_NOTEBOOK(sakura.notebook), ++page < npages ? page : 0);
+			gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook), ++page < npages ? page : 0);
 			break;
 	}
 
@@ -750,13 +1345,51 @@ sakura_notebook_scroll(GtkWidget *widget, GdkEventScroll *event)
 }
 
 
+/* Hidden tabs catch up with the updates they deferred, in a single pass.
+ * Placeholders are materialized */
+static void
+sakura_switch_page (GtkNotebook *notebook, GtkWidget *widget, guint page, void *data)
+{
+	struct window *win = (struct window *)data;
+	struct terminal *term;
+
+	term = sakura_get_page_term(win, page);
+	/* Not set yet when the first tab is appended */
+	if (!term)
+		return;
+
+	sakura_tab_materialize(term);
+	term->last_active = g_get_monotonic_time();
+	sakura_flow_release(term);
+	sakura_cgroup_switch(win, page);
+	if (term->trigger_actions)
+		sakura_trigger_label(term, 0);
+	/* The shown tab goes first in the budget, don't wait for the timer */
+	if (sakura.scrollback_budget > 0)
+		sakura_scrollback_rebalance(NULL);
+	if (!term->pending)
+		return;
+
+	if (term->pending & APPLY_FONT)
+		vte_terminal_set_font(VTE_TERMINAL(term->vte), sakura.font);
+	if (term->pending & APPLY_COLORS)
+		sakura_set_term_colors(win, term);
+	if (term->pending & APPLY_LABEL)
+		sakura_update_tab_label(term);
+
+	term->pending = 0;
+}
+
+
 static void
 sakura_page_removed (GtkWidget *widget, void *data)
 {
-	if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook))==1) {
+	struct window *win = (struct window *)data;
+
+	if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook))==1) {
 		/* If the first tab is disabled, window size changes and we need
 		 * to recalculate its size */
-		sakura_set_size();
+		sakura_set_size(win);
 	}
 }
 
@@ -764,12 +1397,20 @@ sakura_page_removed (GtkWidget *widget, void *data)
 static void
 sakura_beep (GtkWidget *widget, void *data)
 {
+	struct window *win = ((struct terminal *)data)->win;
+	gint64 now = g_get_monotonic_time();
+
+	/* Bell storms would flood the window manager */
+	if (now - win->bell_time < BELL_INTERVAL)
+		return;
+	win->bell_time = now;
+
 	// Remove the urgency hint. This is necessary to signal the window manager
 	// that a new urgent event happened when the urgent hint is set next time.
-	gtk_window_set_urgency_hint(GTK_WINDOW(sakura.main_window), FALSE);
+	gtk_window_set_urgency_hint(GTK_WINDOW(win->main_window), FALSE);
 
 	if (sakura.urgent_bell) {
-		gtk_window_set_urgency_hint(GTK_WINDOW(sakura.main_window), TRUE);
+		gtk_window_set_urgency_hint(GTK_WINDOW(win->main_window), TRUE);
 	}
 }
 
@@ -783,9 +1424,10 @@ sakura_increase_font (GtkWidget *widget, void *data)
 	new_size=pango_font_description_get_size(sakura.font)+PANGO_SCALE;
 
 	pango_font_description_set_size(sakura.font, new_size);
+	sakura.font_override=false;
 	sakura_set_font();
-	sakura_set_size();
-	sakura_set_config_string("font", pango_font_description_to_string(sakura.font));
+	sakura_set_size_all();
+	sakura_config_changed();
 }
 
 
@@ -800,9 +1442,10 @@ sakura_decrease_font (GtkWidget *widget, void *data)
 	/* Set a minimal size */
 	if (new_size >= FONT_MINIMAL_SIZE ) {
 		pango_font_description_set_size(sakura.font, new_size);
+		sakura.font_override=false;
 		sakura_set_font();
-		sakura_set_size();
-		sakura_set_config_string("font", pango_font_description_to_string(sakura.font));
+		sakura_set_size_all();
+		sakura_config_changed();
 	}
 }
 
@@ -810,20 +1453,11 @@ sakura_decrease_font (GtkWidget *widget, void *data)
 static void
 sakura_child_exited (GtkWidget *widget, void *data)
 {
-	gint status, page, npages;
-	struct terminal *term;
-
-	page = gtk_notebook_page_num(GTK_NOTEBOOK(sakura.notebook),
-				gtk_widget_get_parent(widget));
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
-
-	/* Only write configuration to disk if it's the last tab */
-	if (npages==1) {
-		sakura_config_done();
-	}
+	struct terminal *term = (struct terminal *)data;
+	struct window *win = term->win;
+	gint npages;
 
-	if (option_hold==TRUE) {
+	if (win->hold) {
 		SAY("hold option has been activated");
 		return;
 	}
@@ -831,37 +1465,33 @@ sakura_child_exited (GtkWidget *widget, void *data)
 	/* Child should be automatically reaped because we don't use G_SPAWN_DO_NOT_REAP_CHILD flag */
 	g_spawn_close_pid(term->pid);
 
-	sakura_del_tab(page);
+	sakura_del_tab(win, gtk_notebook_page_num(GTK_NOTEBOOK(win->notebook), term->hbox));
 
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
 	if (npages==0)
-		sakura_destroy();
+		sakura_destroy(win);
 }
 
 
 static void
 sakura_eof (GtkWidget *widget, void *data)
 {
+	struct window *win = ((struct terminal *)data)->win;
 	gint npages;
 	struct terminal *term;
 
 	SAY("Got EOF signal");
 
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-
-	/* Only write configuration to disk if it's the last tab */
-	if (npages==1) {
-		sakura_config_done();
-	}
+	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
 
 	/* Workaround for libvte strange behaviour. There is not child-exited signal for
 	   the last terminal, so we need to kill it here.  Check with libvte authors about
 	   child-exited/eof signals */
-	if (gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook))==0) {
+	if (gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook))==0) {
 
-		term = sakura_get_page_term(sakura, 0);
+		term = sakura_get_page_term(win, 0);
 
-		if (option_hold==TRUE) {
+		if (win->hold) {
 			SAY("hold option has been activated");
 			return;
 		}
@@ -869,11 +1499,11 @@ sakura_eof (GtkWidget *widget, void *data)
 		/* Child should be automatically reaped because we don't use G_SPAWN_DO_NOT_REAP_CHILD flag */
 		g_spawn_close_pid(term->pid);
 
-		sakura_del_tab(0);
+		sakura_del_tab(win, 0);
 
-		npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+		npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
 		if (npages==0)
-			sakura_destroy();
+			sakura_destroy(win);
 	}
 }
 
@@ -881,120 +1511,158 @@ sakura_eof (GtkWidget *widget, void *data)
 static void
 sakura_title_changed (GtkWidget *widget, void *data)
 {
-	struct terminal *term;
-	const char *title;
-	gint n_pages;
-	gint modified_page;
-	VteTerminal *vte_term=(VteTerminal *)widget;
+	struct terminal *term = (struct terminal *)data;
+	struct window *win = term->win;
+
+	/* Hidden tabs update their label when they are shown */
+	if (!sakura_term_defer(win, term, APPLY_LABEL))
+		return;
+
+	/* Progress bars change the title many times per frame, only the last
+	 * one is shown. Unmapped windows have no frames */
+	term->title_changed = true;
+	win->title_term = term;
+	if (!gtk_widget_get_mapped(win->main_window))
+		sakura_labels_tick(win->main_window, NULL, win);
+	else if (!win->label_tick)
+		win->label_tick = gtk_widget_add_tick_callback(win->main_window, sakura_labels_tick, win, NULL);
+}
+
 
-	modified_page = sakura_find_tab(vte_term);
-	n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, modified_page);
+/* Update the labels of the tabs whose title changed, and the window title */
+static gboolean
+sakura_labels_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer data)
+{
+	struct window *win = (struct window *)data;
+	struct terminal *term, *title_term = NULL;
+	const char *title;
+	gint page, n_pages;
 
-	title = vte_terminal_get_window_title(VTE_TERMINAL(term->vte));
+	win->label_tick = 0;
+	n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+	for (page=0; page<n_pages; page++) {
+		term = sakura_get_page_term(win, page);
+		if (term == win->title_term)
+			title_term = term;
+		if (term->title_changed) {
+			term->title_changed = false;
+			/* User set values overrides any other one, but title should be changed */
+			sakura_update_tab_label(term);
+		}
+	}
 
-	/* User set values overrides any other one, but title should be changed */
-	if (!term->label_set_byuser)
-		sakura_set_tab_label_text(title, modified_page);
+	/* Unless it was closed since */
+	win->title_term = NULL;
+	if (!title_term || !title_term->vte)
+		return G_SOURCE_REMOVE;
+	title = vte_terminal_get_window_title(VTE_TERMINAL(title_term->vte));
 
 	// do not override title if set by user
-	if (sakura.title_set_byuser)
-		return;
+	if (win->title_set_byuser)
+		return G_SOURCE_REMOVE;
 
-	if (option_title == NULL) {
-		if (n_pages==1) {
-			/* Beware: It doesn't work in Unity because there is a Compiz bug: #257391 */
-			gtk_window_set_title(GTK_WINDOW(sakura.main_window), title);
-		} else
-			gtk_window_set_title(GTK_WINDOW(sakura.main_window), "sakura");
+	if (win->title == NULL) {
+		/* Beware: It doesn't work in Unity because there is a Compiz bug: #257391 */
+		if (n_pages!=1)
+			title = "sakura";
 	} else {
-		gtk_window_set_title(GTK_WINDOW(sakura.main_window), option_title);
+		title = win->title;
 	}
+	/* Each change is a round trip to the window manager */
+	if (g_strcmp0(title, gtk_window_get_title(GTK_WINDOW(win->main_window))))
+		gtk_window_set_title(GTK_WINDOW(win->main_window), title);
 
+	return G_SOURCE_REMOVE;
 }
 
 
-/* Save configuration */
+/* OSC 7: the shell tells its directory as a file://host/path URI. Those of
+ * other hosts (ssh sessions) can't be opened here and are ignored */
 static void
-sakura_config_done()
+sakura_cwd_changed (GtkWidget *widget, void *data)
 {
-	GError *gerror = NULL;
-	gsize len = 0;
-
-	gchar *cfgdata = g_key_file_to_data(sakura.cfg, &len, &gerror);
-	if (!cfgdata) {
-		fprintf(stderr, "%s\n", gerror->message);
-		exit(EXIT_FAILURE);
-	}
+	struct terminal *term = (struct terminal *)data;
+	const char *uri;
+	gchar *path, *host = NULL;
 
-	/* Write to file IF there's been changes */
-	if (sakura.config_modified) {
+	uri = vte_terminal_get_current_directory_uri(VTE_TERMINAL(term->vte));
+	if (!uri || !(path = g_filename_from_uri(uri, &host, NULL)))
+		return;
 
-		bool overwrite=true;
+	if (!host || !host[0] || !g_ascii_strcasecmp(host, "localhost") || !g_ascii_strcasecmp(host, g_get_host_name())) {
+		g_free(term->cwd);
+		term->cwd = path;
+	} else {
+		g_free(path);
+	}
+	g_free(host);
+}
 
-		if (sakura.externally_modified) {
-			GtkWidget *dialog;
-			gint response;
 
-			dialog=gtk_message_dialog_new(GTK_WINDOW(sakura.main_window), GTK_DIALOG_MODAL,
-					GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
-					_("Configuration has been modified by another proccess. Overwrite?"));
+/* Save configuration */
+/* Save any pending changes before exiting. This is the only synchronous save */
+static void
+sakura_config_done()
+{
+	struct config_job *job;
+	GError *gerror=NULL;
 
-			response=gtk_dialog_run(GTK_DIALOG(dialog));
-			gtk_widget_destroy(dialog);
+	if (config_writer.timeout) {
+		g_source_remove(config_writer.timeout);
+		config_writer.timeout=0;
+	}
 
-			if (response==GTK_RESPONSE_YES) {
-				overwrite=true;
-			} else
-				overwrite=false;
-		}
+	/* Wait for the worker, its completion callback won't run anymore. What
+	 * it failed to save is saved below */
+	if (config_writer.running) {
+		g_mutex_lock(&config_writer.lock);
+		while (!config_writer.done)
+			g_cond_wait(&config_writer.cond, &config_writer.lock);
+		g_mutex_unlock(&config_writer.lock);
+		if (config_writer.ok)
+			sakura_config_job_saved(config_writer.running);
+		else
+			sakura.config_modified=true;
+		config_writer.running=NULL;
+		if (config_writer.ok && !sakura.config_modified)
+			sakura_snapshot_save();
+	}
 
-		if (overwrite) {
-			GIOChannel *cfgfile = g_io_channel_new_file(sakura.configfile, "w", &gerror);
-			if (!cfgfile) {
-				fprintf(stderr, "%s\n", gerror->message);
-				g_error_free(gerror);
-				exit(EXIT_FAILURE);
-			}
+	job = sakura_config_job_new();
+	if (!job)
+		return;
 
-			/* FIXME: if the number of chars written is not "len", something happened.
-			 * Check for errors appropriately...*/
-			GIOStatus status = g_io_channel_write_chars(cfgfile, cfgdata, len, NULL, &gerror);
-			if (status != G_IO_STATUS_NORMAL) {
-				// FIXME: we should deal with temporary failures (G_IO_STATUS_AGAIN)
-				fprintf(stderr, "%s\n", gerror->message);
-				g_error_free(gerror);
-				exit(EXIT_FAILURE);
-			}
-			g_io_channel_shutdown(cfgfile, TRUE, &gerror);
-			g_io_channel_unref(cfgfile);
-		}
+	if (sakura_config_write(job, &gerror)) {
+		sakura_snapshot_save();
+	} else {
+		fprintf(stderr, "%s\n", gerror->message);
+		g_error_free(gerror);
 	}
+	sakura_config_job_free(job);
 }
 
 
 static gboolean
 sakura_delete_event (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	struct terminal *term;
 	GtkWidget *dialog;
 	gint response;
 	gint npages;
 	gint i;
-	pid_t pgid;
 
 	if (!sakura.less_questions) {
-		npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+		npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
 
-		/* Check for each tab if there are running processes. Use tcgetpgrp to compare to the shell PGID */
+		/* Check for each tab if there are running processes */
 		for (i=0; i < npages; i++) {
 
-			term = sakura_get_page_term(sakura, i);
-			pgid = tcgetpgrp(vte_terminal_get_pty(VTE_TERMINAL(term->vte)));
+			term = sakura_get_page_term(win, i);
 
 			/* If running processes are found, we ask one time and exit */
-			if ( (pgid != -1) && (pgid != term->pid)) {
-				dialog=gtk_message_dialog_new(GTK_WINDOW(sakura.main_window), GTK_DIALOG_MODAL,
+			if (sakura_proc_running(term)) {
+				dialog=gtk_message_dialog_new(GTK_WINDOW(win->main_window), GTK_DIALOG_MODAL,
 											  GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
 											  _("There are running processes.\n\nDo you really want to close Sakura?"));
 
@@ -1002,7 +1670,6 @@ sakura_delete_event (GtkWidget *widget, void *data)
 				gtk_widget_destroy(dialog);
 
 				if (response==GTK_RESPONSE_YES) {
-					sakura_config_done();
 					return FALSE;
 				} else {
 					return TRUE;
@@ -1012,7 +1679,6 @@ sakura_delete_event (GtkWidget *widget, void *data)
 		}
 	}
 
-	sakura_config_done();
 	return FALSE;
 }
 
@@ -1020,7 +1686,7 @@ sakura_delete_event (GtkWidget *widget, void *data)
 static void
 sakura_destroy_window (GtkWidget *widget, void *data)
 {
-	sakura_destroy();
+	sakura_destroy((struct window *)data);
 }
 
 
@@ -1028,17 +1694,18 @@ static void
 sakura_window_show_event(GtkWidget *widget, gpointer data)
 {
 	// set size when the window is first shown
-	sakura_set_size();
+	sakura_set_size((struct window *)data);
 }
 
 
 static void
 sakura_font_dialog (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	GtkWidget *font_dialog;
 	gint response;
 
-	font_dialog=gtk_font_chooser_dialog_new(_("Select font"), GTK_WINDOW(sakura.main_window));
+	font_dialog=gtk_font_chooser_dialog_new(_("Select font"), GTK_WINDOW(win->main_window));
 	gtk_font_chooser_set_font_desc(GTK_FONT_CHOOSER(font_dialog), sakura.font);
 
 	response=gtk_dialog_run(GTK_DIALOG(font_dialog));
@@ -1046,9 +1713,10 @@ sakura_font_dialog (GtkWidget *widget, void *data)
 	if (response==GTK_RESPONSE_OK) {
 		pango_font_description_free(sakura.font);
 		sakura.font=gtk_font_chooser_get_font_desc(GTK_FONT_CHOOSER(font_dialog));
+		sakura.font_override=false;
 		sakura_set_font();
-		sakura_set_size();
-		sakura_set_config_string("font", pango_font_description_to_string(sakura.font));
+		sakura_set_size_all();
+		sakura_config_changed();
 	}
 
 	gtk_widget_destroy(font_dialog);
@@ -1058,6 +1726,7 @@ sakura_font_dialog (GtkWidget *widget, void *data)
 static void
 sakura_set_name_dialog (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	GtkWidget *input_dialog;
 	GtkWidget *entry, *label;
 	GtkWidget *name_hbox; /* We need this for correct spacing */
@@ -1066,10 +1735,10 @@ sakura_set_name_dialog (GtkWidget *widget, void *data)
 	struct terminal *term;
 	const gchar *text;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	input_dialog=gtk_dialog_new_with_buttons(_("Set tab name"), GTK_WINDOW(sakura.main_window), GTK_DIALOG_MODAL,
+	input_dialog=gtk_dialog_new_with_buttons(_("Set tab name"), GTK_WINDOW(win->main_window), GTK_DIALOG_MODAL,
 	                                         _("_Cancel"), GTK_RESPONSE_REJECT,
 	                                         _("_Apply"), GTK_RESPONSE_ACCEPT, NULL);
 
@@ -1088,7 +1757,7 @@ sakura_set_name_dialog (GtkWidget *widget, void *data)
 	label=gtk_label_new(_("New text"));
 	/* Set tab label as entry default text (when first tab is not displayed, get_tab_label_text
 	   returns a null value, so check accordingly */
-	text = gtk_notebook_get_tab_label_text(GTK_NOTEBOOK(sakura.notebook), term->hbox);
+	text = gtk_notebook_get_tab_label_text(GTK_NOTEBOOK(win->notebook), term->hbox);
 	if (text) {
 		gtk_entry_set_text(GTK_ENTRY(entry), text);
 	}
@@ -1104,14 +1773,14 @@ sakura_set_name_dialog (GtkWidget *widget, void *data)
 
 	response=gtk_dialog_run(GTK_DIALOG(input_dialog));
 	if (response==GTK_RESPONSE_ACCEPT) {
-		sakura_set_tab_label_text(gtk_entry_get_text(GTK_ENTRY(entry)), page);
+		sakura_set_tab_label_text(term, gtk_entry_get_text(GTK_ENTRY(entry)));
 		term->label_set_byuser=true;
 	}
 	gtk_widget_destroy(input_dialog);
 }
 
 static void
-sakura_set_colorset (int cs)
+sakura_set_colorset (struct window *win, int cs)
 {
 	gint page;
 	struct terminal *term;
@@ -1119,45 +1788,71 @@ sakura_set_colorset (int cs)
 	if (cs<0 || cs>= NUM_COLORSETS)
 		return;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 	term->colorset=cs;
 
 	sakura_set_colors();
 }
 
+/* Apply colors to a single terminal. Fading is a per window thing now that
+ * several windows share the same colorsets, so it's computed here instead of
+ * modifying sakura.forecolors */
 static void
-sakura_set_colors ()
+sakura_set_term_colors (struct window *win, struct terminal *term)
 {
-	int i;
-	int n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	struct terminal *term;
+	GdkRGBA fore = sakura.forecolors[term->colorset];
 	GdkRGBA white={255, 255, 255, 1};
 
-	/* Re-apply in each notebook tab its terminals colors */
-	for (i = (n_pages - 1); i >= 0; i--) {
-		term = sakura_get_page_term(sakura, i);
-		if (sakura.has_rgba) {
-			/* FIXME: Is this still needed with RGBA colors?? */
-			/* This is needed for set_opacity to have effect. The opacity does
-			   take effect when switching tabs, so this setting to white is
-			   actually needed only in the shown tab.*/
-			vte_terminal_set_color_background_rgba(VTE_TERMINAL (term->vte), &white);
-			vte_terminal_set_opacity(VTE_TERMINAL (term->vte), (int)((sakura.backcolors[term->colorset].alpha)*65535));
-		}
-		vte_terminal_set_colors_rgba(VTE_TERMINAL(term->vte),
-		                        &sakura.forecolors[term->colorset],
-		                        &sakura.backcolors[term->colorset],
-		                        sakura.palette, PALETTE_SIZE);
-		vte_terminal_set_color_cursor_rgba(VTE_TERMINAL(term->vte), &sakura.curscolors[term->colorset]);
+	if (sakura.has_rgba) {
+		/* FIXME: Is this still needed with RGBA colors?? */
+		/* This is needed for set_opacity to have effect. The opacity does
+		   take effect when switching tabs, so this setting to white is
+		   actually needed only in the shown tab.*/
+		vte_terminal_set_color_background_rgba(VTE_TERMINAL (term->vte), &white);
+		vte_terminal_set_opacity(VTE_TERMINAL (term->vte), (int)((sakura.backcolors[term->colorset].alpha)*65535));
+	}
+
+	if (sakura.use_fading && win->first_focus && !win->focused) {
+		fore.red = fore.red/100.0 * FADE_PERCENT;
+		fore.green = fore.green/100.0 * FADE_PERCENT;
+		fore.blue = fore.blue/100.0 * FADE_PERCENT;
 	}
 
+	vte_terminal_set_colors_rgba(VTE_TERMINAL(term->vte), &fore,
+	                        &sakura.backcolors[term->colorset],
+	                        sakura.palette, PALETTE_SIZE);
+	vte_terminal_set_color_cursor_rgba(VTE_TERMINAL(term->vte), &sakura.curscolors[term->colorset]);
 }
 
-/* Callback from the color change dialog. Updates the contents of that
- * dialog, passed as 'data' from user input. */
 static void
-sakura_color_dialog_changed( GtkWidget *widget, void *data)
+sakura_set_window_colors (struct window *win)
+{
+	int i;
+	int n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+	struct terminal *term;
+
+	/* Re-apply in each notebook tab its terminals colors */
+	for (i = (n_pages - 1); i >= 0; i--) {
+		term = sakura_get_page_term(win, i);
+		if (sakura_term_defer(win, term, APPLY_COLORS))
+			sakura_set_term_colors(win, term);
+	}
+}
+
+static void
+sakura_set_colors ()
+{
+	GList *l;
+
+	for (l = sakura.windows; l; l = l->next)
+		sakura_set_window_colors((struct window *)l->data);
+}
+
+/* Callback from the color change dialog. Updates the contents of that
+ * dialog, passed as 'data' from user input. */
+static void
+sakura_color_dialog_changed( GtkWidget *widget, void *data)
 {
 	int selected=-1;
 	GtkDialog *dialog = (GtkDialog*)data;
@@ -1196,6 +1891,7 @@ sakura_color_dialog_changed( GtkWidget *widget, void *data)
 static void
 sakura_color_dialog (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	GtkWidget *color_dialog;
 	GtkWidget *label1, *label2, *label3, *set_label, *opacity_label;
 	GtkWidget *buttonfore, *buttonback, *buttoncurs, *set_combo, *opacity_spin;
@@ -1211,10 +1907,10 @@ sakura_color_dialog (GtkWidget *widget, void *data)
 	GdkRGBA temp_back[NUM_COLORSETS];
 	GdkRGBA temp_curs[NUM_COLORSETS];
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	color_dialog=gtk_dialog_new_with_buttons(_("Select color"), GTK_WINDOW(sakura.main_window),
+	color_dialog=gtk_dialog_new_with_buttons(_("Select color"), GTK_WINDOW(win->main_window),
 	                                                            GTK_DIALOG_MODAL,
 	                                                            _("_Cancel"), GTK_RESPONSE_REJECT,
 	                                                            _("_Select"), GTK_RESPONSE_ACCEPT, NULL);
@@ -1308,29 +2004,11 @@ sakura_color_dialog (GtkWidget *widget, void *data)
 
 
 	if (response==GTK_RESPONSE_ACCEPT) {
-		/* Save all colorsets to both the global struct and configuration.*/
+		/* Save all colorsets to the global struct. They're written on exit */
 		for( i=0; i<NUM_COLORSETS; i++) {
-			char name[20];
-			gchar *cfgtmp;
-
 			sakura.forecolors[i]=temp_fore[i];
 			sakura.backcolors[i]=temp_back[i];
 			sakura.curscolors[i]=temp_curs[i];
-
-			sprintf(name, "colorset%d_fore", i+1);
-			cfgtmp=gdk_rgba_to_string(&sakura.forecolors[i]);
-			sakura_set_config_string(name, cfgtmp);
-			g_free(cfgtmp);
-
-			sprintf(name, "colorset%d_back", i+1);
-			cfgtmp=gdk_rgba_to_string(&sakura.backcolors[i]);
-			sakura_set_config_string(name, cfgtmp);
-			g_free(cfgtmp);
-
-			sprintf(name, "colorset%d_curs", i+1);
-			cfgtmp=gdk_rgba_to_string(&sakura.curscolors[i]);
-			sakura_set_config_string(name, cfgtmp);
-			g_free(cfgtmp);
 		}
 
 		/* Apply the new colorsets to all tabs
@@ -1338,48 +2016,24 @@ sakura_color_dialog (GtkWidget *widget, void *data)
 		 * This is probably what the new user expects, and the experienced user
 		 * hopefully will not mind. */
 		term->colorset = gtk_combo_box_get_active(GTK_COMBO_BOX(set_combo));
-		sakura_set_config_integer("last_colorset", term->colorset+1);
+		sakura.last_colorset = term->colorset+1;
+		sakura_config_changed();
 		sakura_set_colors();
 	}
 
 	gtk_widget_destroy(color_dialog);
 }
 
-static void
-sakura_fade_out()
-{
-	int i;
-	for( i=0; i<NUM_COLORSETS; i++) {
-		GdkRGBA x = sakura.forecolors[i];
-		x.red = x.red/100.0 * FADE_PERCENT;
-		x.green = x.green/100.0 * FADE_PERCENT;
-		x.blue = x.blue/100.0 * FADE_PERCENT;
-		sakura.forecolors[i]=x;
-	}
-}
-
-static void
-sakura_fade_in()
-{
-	int i;
-	for( i=0; i<NUM_COLORSETS; i++) {
-		GdkRGBA x = sakura.forecolors[i];
-		x.red = x.red/FADE_PERCENT * 100.0;
-		x.green = x.green/FADE_PERCENT * 100.0;
-		x.blue = x.blue/FADE_PERCENT * 100.0;
-		sakura.forecolors[i]=x;
-	}
-}
-
 static void
 sakura_set_title_dialog (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	GtkWidget *title_dialog;
 	GtkWidget *entry, *label;
 	GtkWidget *title_hbox;
 	gint response;
 
-	title_dialog=gtk_dialog_new_with_buttons(_("Set window title"), GTK_WINDOW(sakura.main_window), GTK_DIALOG_MODAL,
+	title_dialog=gtk_dialog_new_with_buttons(_("Set window title"), GTK_WINDOW(win->main_window), GTK_DIALOG_MODAL,
 	                                         _("_Cancel"), GTK_RESPONSE_REJECT,
 	                                         _("_Apply"), GTK_RESPONSE_ACCEPT, NULL);
 
@@ -1396,7 +2050,7 @@ sakura_set_title_dialog (GtkWidget *widget, void *data)
 	label=gtk_label_new(_("New window title"));
 	title_hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
 	/* Set window label as entry default text */
-	gtk_entry_set_text(GTK_ENTRY(entry), gtk_window_get_title(GTK_WINDOW(sakura.main_window)));
+	gtk_entry_set_text(GTK_ENTRY(entry), gtk_window_get_title(GTK_WINDOW(win->main_window)));
 	gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
 	gtk_box_pack_start(GTK_BOX(title_hbox), label, TRUE, TRUE, 12);
 	gtk_box_pack_start(GTK_BOX(title_hbox), entry, TRUE, TRUE, 12);
@@ -1410,8 +2064,8 @@ sakura_set_title_dialog (GtkWidget *widget, void *data)
 	response=gtk_dialog_run(GTK_DIALOG(title_dialog));
 	if (response==GTK_RESPONSE_ACCEPT) {
 		/* Bug #257391 shadow reachs here too... */
-		gtk_window_set_title(GTK_WINDOW(sakura.main_window), gtk_entry_get_text(GTK_ENTRY(entry)));
-		sakura.title_set_byuser=TRUE;
+		gtk_window_set_title(GTK_WINDOW(win->main_window), gtk_entry_get_text(GTK_ENTRY(entry)));
+		win->title_set_byuser=TRUE;
 	}
 	gtk_widget_destroy(title_dialog);
 }
@@ -1420,11 +2074,12 @@ sakura_set_title_dialog (GtkWidget *widget, void *data)
 static void
 sakura_select_background_dialog (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	GtkWidget *dialog;
 	gint response;
 	gchar *filename;
 
-	dialog = gtk_file_chooser_dialog_new (_("Select a background file"), GTK_WINDOW(sakura.main_window),
+	dialog = gtk_file_chooser_dialog_new (_("Select a background file"), GTK_WINDOW(win->main_window),
 	                                                                     GTK_FILE_CHOOSER_ACTION_OPEN,
 	                                                                     _("_Cancel"), GTK_RESPONSE_CANCEL,
 	                                                                     _("_Open"), GTK_RESPONSE_ACCEPT,
@@ -1434,9 +2089,10 @@ sakura_select_background_dialog (GtkWidget *widget, void *data)
 	response=gtk_dialog_run(GTK_DIALOG(dialog));
 	if (response == GTK_RESPONSE_ACCEPT) {
 		filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
+		g_free(sakura.background);
 		sakura.background=g_strdup(filename);
-		sakura_set_bgimage(sakura.background);
-		gtk_widget_show(sakura.item_clear_background);
+		sakura_set_bgimage(win, sakura.background);
+		gtk_widget_show(win->item_clear_background);
 		g_free(filename);
 	}
 
@@ -1447,12 +2103,13 @@ sakura_select_background_dialog (GtkWidget *widget, void *data)
 static void
 sakura_copy_url (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	GtkClipboard* clip;
 
 	clip = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
-	gtk_clipboard_set_text(clip, sakura.current_match, -1 );
+	gtk_clipboard_set_text(clip, win->current_match, -1 );
 	clip = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
-	gtk_clipboard_set_text(clip, sakura.current_match, -1 );
+	gtk_clipboard_set_text(clip, win->current_match, -1 );
 
 }
 
@@ -1460,24 +2117,30 @@ sakura_copy_url (GtkWidget *widget, void *data)
 static void
 sakura_open_url (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	GError *error=NULL;
 	gchar *cmd;
 	gchar *browser=NULL;
 
+	if (win->current_link && win->current_link->command) {
+		sakura_link_open(win, win->current_link, win->current_match);
+		return;
+	}
+
 	browser=(gchar *)g_getenv("BROWSER");
 
 	if (browser) {
-		cmd=g_strdup_printf("%s %s", browser, sakura.current_match);
+		cmd=g_strdup_printf("%s %s", browser, win->current_match);
 	} else {
 		if ( (browser = g_find_program_in_path("xdg-open")) ) {
-			cmd=g_strdup_printf("%s %s", browser, sakura.current_match);
+			cmd=g_strdup_printf("%s %s", browser, win->current_match);
 			g_free(browser);
 		} else
-			cmd=g_strdup_printf("firefox %s", sakura.current_match);
+			cmd=g_strdup_printf("firefox %s", win->current_match);
 	}
 
 	if (!g_spawn_command_line_async(cmd, &error)) {
-		sakura_error("Couldn't exec \"%s\": %s", cmd, error->message);
+		sakura_error(win, "Couldn't exec \"%s\": %s", cmd, error->message);
 	}
 
 	g_free(cmd);
@@ -1487,120 +2150,115 @@ sakura_open_url (GtkWidget *widget, void *data)
 static void
 sakura_clear (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	gint page;
 	struct terminal *term;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	gtk_widget_hide(sakura.item_clear_background);
+	gtk_widget_hide(win->item_clear_background);
 
 	vte_terminal_set_background_image(VTE_TERMINAL(term->vte), NULL);
 
-	sakura_set_config_string("background", "none");
-
 	g_free(sakura.background);
 	sakura.background=NULL;
+	sakura_config_changed();
 }
 
 
 static void
 sakura_show_first_tab (GtkWidget *widget, void *data)
 {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		gtk_notebook_set_show_tabs(GTK_NOTEBOOK(sakura.notebook), TRUE);
-		sakura_set_config_string("show_always_first_tab", "Yes");
-		sakura.first_tab = true;
-	} else {
-		/* Only hide tabs if the notebook has one page */
-		if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook)) == 1) {
-			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(sakura.notebook), FALSE);
+	struct window *win;
+	GList *l;
+
+	sakura.first_tab = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	sakura_config_changed();
+
+	for (l = sakura.windows; l; l = l->next) {
+		win = (struct window *)l->data;
+		if (sakura.first_tab) {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), TRUE);
+		} else if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)) == 1) {
+			/* Only hide tabs if the notebook has one page */
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), FALSE);
 		}
-		sakura_set_config_string("show_always_first_tab", "No");
-		sakura.first_tab = false;
 	}
-	sakura_set_size();
+	sakura_set_size_all();
 }
 
 static void
 sakura_tabs_on_bottom (GtkWidget *widget, void *data)
 {
+	gboolean bottom = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	GList *l;
 
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(sakura.notebook), GTK_POS_BOTTOM);
-		sakura_set_config_boolean("tabs_on_bottom", TRUE);
-	} else {
-		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(sakura.notebook), GTK_POS_TOP);
-		sakura_set_config_boolean("tabs_on_bottom", FALSE);
+	for (l = sakura.windows; l; l = l->next) {
+		struct window *win = (struct window *)l->data;
+		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(win->notebook), bottom ? GTK_POS_BOTTOM : GTK_POS_TOP);
 	}
+	sakura.tabs_on_bottom = bottom;
+	sakura_config_changed();
 }
 
 static void
 sakura_less_questions (GtkWidget *widget, void *data)
 {
 
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		sakura.less_questions=TRUE;
-		sakura_set_config_boolean("less_questions", TRUE);
-	} else {
-		sakura.less_questions=FALSE;
-		sakura_set_config_boolean("less_questions", FALSE);
-	}
+	sakura.less_questions = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	sakura_config_changed();
 }
 
 static void
 sakura_show_close_button (GtkWidget *widget, void *data)
 {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		sakura_set_config_boolean("closebutton", TRUE);
-	} else {
-		sakura_set_config_boolean("closebutton", FALSE);
-	}
+	sakura.show_closebutton = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	sakura_config_changed();
 }
 
 static void
 sakura_show_resize_grip (GtkWidget *widget, void *data)
 {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		sakura_set_config_boolean("resize_grip", TRUE);
-		gtk_window_set_has_resize_grip(GTK_WINDOW(sakura.main_window), TRUE);
-	} else {
-		sakura_set_config_boolean("resize_grip", FALSE);
-		gtk_window_set_has_resize_grip(GTK_WINDOW(sakura.main_window), FALSE);
+	gboolean grip = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	GList *l;
+
+	sakura.show_resize_grip = grip;
+	sakura_config_changed();
+	for (l = sakura.windows; l; l = l->next) {
+		struct window *win = (struct window *)l->data;
+		gtk_window_set_has_resize_grip(GTK_WINDOW(win->main_window), grip);
 	}
 }
 
 static void
 sakura_show_scrollbar (GtkWidget *widget, void *data)
 {
-	gint page;
+	struct window *win;
 	struct terminal *term;
 	gint n_pages;
+	GList *l;
 	int i;
 
-	sakura.keep_fc=1;
+	sakura.show_scrollbar = !sakura.show_scrollbar;
+	sakura_config_changed();
 
-	n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
-
-	if (!g_key_file_get_boolean(sakura.cfg, cfg_group, "scrollbar", NULL)) {
-		sakura.show_scrollbar=true;
-		sakura_set_config_boolean("scrollbar", TRUE);
-	} else {
-		sakura.show_scrollbar=false;
-		sakura_set_config_boolean("scrollbar", FALSE);
-	}
-
-	/* Toggle/Untoggle the scrollbar for all tabs */
-	for (i = (n_pages - 1); i >= 0; i--) {
-		term = sakura_get_page_term(sakura, i);
-		if (!sakura.show_scrollbar)
-			gtk_widget_hide(term->scrollbar);
-		else
-			gtk_widget_show(term->scrollbar);
+	/* Toggle/Untoggle the scrollbar for all tabs of all windows */
+	for (l = sakura.windows; l; l = l->next) {
+		win = (struct window *)l->data;
+		win->keep_fc=1;
+		n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+		for (i = (n_pages - 1); i >= 0; i--) {
+			term = sakura_get_page_term(win, i);
+			if (!term->vte)
+				continue;
+			if (!sakura.show_scrollbar)
+				gtk_widget_hide(term->scrollbar);
+			else
+				gtk_widget_show(term->scrollbar);
+		}
+		sakura_set_size(win);
 	}
-	sakura_set_size();
 }
 
 
@@ -1608,98 +2266,83 @@ static void
 sakura_urgent_bell (GtkWidget *widget, void *data)
 {
 	sakura.urgent_bell = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
-	if (sakura.urgent_bell) {
-		sakura_set_config_string("urgent_bell", "Yes");
-	} else {
-		sakura_set_config_string("urgent_bell", "No");
-	}
+	sakura_config_changed();
 }
 
 
 static void
 sakura_audible_bell (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	gint page;
 	struct terminal *term;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		vte_terminal_set_audible_bell (VTE_TERMINAL(term->vte), TRUE);
-		sakura_set_config_string("audible_bell", "Yes");
-	} else {
-		vte_terminal_set_audible_bell (VTE_TERMINAL(term->vte), FALSE);
-		sakura_set_config_string("audible_bell", "No");
-	}
+	sakura.audible_bell = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	vte_terminal_set_audible_bell (VTE_TERMINAL(term->vte), sakura.audible_bell ? TRUE : FALSE);
+	sakura_config_changed();
 }
 
 
 static void
 sakura_visible_bell (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	gint page;
 	struct terminal *term;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		vte_terminal_set_visible_bell (VTE_TERMINAL(term->vte), TRUE);
-		sakura_set_config_string("visible_bell", "Yes");
-	} else {
-		vte_terminal_set_visible_bell (VTE_TERMINAL(term->vte), FALSE);
-		sakura_set_config_string("visible_bell", "No");
-	}
+	sakura.visible_bell = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	vte_terminal_set_visible_bell (VTE_TERMINAL(term->vte), sakura.visible_bell ? TRUE : FALSE);
+	sakura_config_changed();
 }
 
 
 static void
 sakura_blinking_cursor (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	gint page;
 	struct terminal *term;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		vte_terminal_set_cursor_blink_mode (VTE_TERMINAL(term->vte), VTE_CURSOR_BLINK_ON);
-		sakura_set_config_string("blinking_cursor", "Yes");
-	} else {
-		vte_terminal_set_cursor_blink_mode (VTE_TERMINAL(term->vte), VTE_CURSOR_BLINK_OFF);
-		sakura_set_config_string("blinking_cursor", "No");
-	}
+	sakura.blinking_cursor = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	vte_terminal_set_cursor_blink_mode (VTE_TERMINAL(term->vte), sakura.blinking_cursor ? VTE_CURSOR_BLINK_ON : VTE_CURSOR_BLINK_OFF);
+	sakura_config_changed();
 }
 
 
 static void
 sakura_allow_bold (GtkWidget *widget, void *data)
 {
+	struct window *win = (struct window *)data;
 	gint page;
 	struct terminal *term;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		vte_terminal_set_allow_bold (VTE_TERMINAL(term->vte), TRUE);
-		sakura_set_config_string("allow_bold", "Yes");
-	} else {
-		vte_terminal_set_allow_bold (VTE_TERMINAL(term->vte), FALSE);
-		sakura_set_config_string("allow_bold", "No");
-	}
+	sakura.allow_bold = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+	vte_terminal_set_allow_bold (VTE_TERMINAL(term->vte), sakura.allow_bold ? TRUE : FALSE);
+	sakura_config_changed();
 }
 
 
 static void
 sakura_set_cursor(GtkWidget *widget, void *data)
 {
+	struct window *win;
 	struct terminal *term;
 	int n_pages, i;
+	GList *l;
 
 	char *cursor_string = (char *)data;
-	n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
 
 	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
 
@@ -1711,12 +2354,17 @@ sakura_set_cursor(GtkWidget *widget, void *data)
 			sakura.cursor_type=VTE_CURSOR_SHAPE_IBEAM;
 		}
 
-		for (i = (n_pages - 1); i >= 0; i--) {
-			term = sakura_get_page_term(sakura, i);
-			vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte), sakura.cursor_type);
+		for (l = sakura.windows; l; l = l->next) {
+			win = (struct window *)l->data;
+			n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+			for (i = (n_pages - 1); i >= 0; i--) {
+				term = sakura_get_page_term(win, i);
+				if (term->vte)
+					vte_terminal_set_cursor_shape(VTE_TERMINAL(term->vte), sakura.cursor_type);
+			}
 		}
 
-		sakura_set_config_integer("cursor_type", sakura.cursor_type);
+		sakura_config_changed();
 	}
 }
 
@@ -1724,1596 +2372,7676 @@ sakura_set_cursor(GtkWidget *widget, void *data)
 static void
 sakura_set_palette(GtkWidget *widget, void *data)
 {
-	struct terminal *term;
-	int n_pages, i;
-
 	char *palette=(char *)data;
 
-	n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-
 	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		if (strcmp(palette, "linux")==0) {
-			sakura.palette=linux_palette;
-		} else if (strcmp(palette, "xterm")==0) {
-			sakura.palette=xterm_palette;
-		} else if (strcmp(palette, "tango")==0) {
-			sakura.palette=tango_palette;
-		} else if (strcmp(palette, "solarized_dark")==0) {
-			sakura.palette=solarized_dark_palette;
-		} else {
-			sakura.palette=solarized_light_palette;
-		}
-
-		for (i = (n_pages - 1); i >= 0; i--) {
-			term = sakura_get_page_term(sakura, i);
-			vte_terminal_set_colors_rgba(VTE_TERMINAL(term->vte),
-			                        &sakura.forecolors[term->colorset],
-			                        &sakura.backcolors[term->colorset],
-			                        sakura.palette, PALETTE_SIZE);
-			vte_terminal_set_color_cursor_rgba(VTE_TERMINAL(term->vte), &sakura.curscolors[term->colorset]);
-		}
-
-		sakura_set_config_string("palette", palette);
+		sakura.palette = palettes[sakura_palette_index(palette)].colors;
+		sakura_set_colors();
+		sakura_config_changed();
 	}
 }
 
 
-/* Retrieve the cwd of the specified term page.
- * Original function was from terminal-screen.c of gnome-terminal, copyright (C) 2001 Havoc Pennington
- * Adapted by Hong Jen Yee, non-linux shit removed by David Gómez */
-static char*
-sakura_get_term_cwd(struct terminal* term)
+/* Foreground process monitor. A single timer samples every tab: its
+ * foreground process group, and the name, CPU and RSS of the group leader
+ * when it's not the shell, and the cwd of the shell. Labels, close
+ * confirmations and new tabs use the samples, which are taken again only
+ * when the terminal had output since. The leader is also watched with a
+ * pidfd where there's one, so its exit is seen at once */
+static void
+sakura_proc_forget(struct terminal *term)
 {
-	char *cwd = NULL;
-
-	if (term->pid >= 0) {
-		char *file, *buf;
-		struct stat sb;
-		int len;
-
-		file = g_strdup_printf ("/proc/%d/cwd", term->pid);
+	if (term->proc.pidfd_watch)
+		g_source_remove(term->proc.pidfd_watch);
+	term->proc.pidfd_watch = 0;
+	if (term->proc.pidfd >= 0)
+		close(term->proc.pidfd);
+	term->proc.pidfd = -1;
+	g_free(term->proc.name);
+	term->proc.name = NULL;
+	term->proc.cpu = 0;
+	term->proc.rss = 0;
+	term->proc.ticks = 0;
+	term->proc.usage = 0;
+}
 
-		if (g_stat(file, &sb) == -1) {
-			g_free(file);
-			return cwd;
-		}
 
-		buf = malloc(sb.st_size + 1);
+static void sakura_proc_sample(struct terminal *);
 
-		if(buf == NULL) {
-			g_free(file);
-			return cwd;
-		}
+static gboolean
+sakura_proc_exited(gint fd, GIOCondition condition, gpointer data)
+{
+	struct terminal *term = data;
 
-		len = readlink(file, buf, sb.st_size + 1);
+	term->proc.pidfd_watch = 0;
+	sakura_proc_sample(term);
+	return G_SOURCE_REMOVE;
+}
 
-		if (len > 0 && buf[0] == '/') {
-			buf[len] = '\0';
-			cwd = g_strdup(buf);
-		}
 
-		g_free(buf);
-		g_free(file);
+static void
+sakura_proc_watch(struct terminal *term)
+{
+#ifdef SYS_pidfd_open
+	term->proc.pidfd = syscall(SYS_pidfd_open, term->proc.pgid, 0);
+	if (term->proc.pidfd >= 0) {
+		fcntl(term->proc.pidfd, F_SETFD, FD_CLOEXEC);
+		term->proc.pidfd_watch = g_unix_fd_add(term->proc.pidfd, G_IO_IN, sakura_proc_exited, term);
 	}
-
-	return cwd;
+#endif
 }
 
 
-static gboolean
-sakura_resized_window (GtkWidget *widget, GdkEventConfigure *event, void *data)
+/* Name, CPU time and RSS of the group leader, from /proc/PID/stat */
+static void
+sakura_proc_stat(struct terminal *term, gint64 now)
 {
-	if (event->width!=sakura.width || event->height!=sakura.height) {
-		SAY("Configure event received. Current w %d h %d ConfigureEvent w %d h %d",
-		sakura.width, sakura.height, event->width, event->height);
-		sakura.resized=TRUE;
-	}
+	gchar path[64], *stat, *comm, *end;
+	gchar **fields;
+	guint64 ticks;
+	gint64 rss;
 
-	return FALSE;
-}
+	g_snprintf(path, sizeof(path), "/proc/%d/stat", term->proc.pgid);
+	if (!g_file_get_contents(path, &stat, NULL, NULL))
+		return;
 
-static gboolean sakura_focus_change(GtkWidget *widget, GdkEvent *event, void *data)
-{
-	if (sakura.use_fading && event->type == GDK_FOCUS_CHANGE) {
-		sakura.focused = !sakura.focused;
-		if (sakura.focused) {
-			if (!sakura.first_focus){
-				sakura.first_focus = true;
-			} else {
-				sakura_fade_in();
-			}
-		} else {
-			sakura_fade_out();
+	/* The name can have spaces and parentheses */
+	comm = strchr(stat, '(');
+	end = strrchr(stat, ')');
+	if (comm && end && end > comm) {
+		fields = g_strsplit(end + 2, " ", 0);
+		if (g_strv_length(fields) > 21) {
+			ticks = g_ascii_strtoull(fields[11], NULL, 10) + g_ascii_strtoull(fields[12], NULL, 10);
+			rss = g_ascii_strtoll(fields[21], NULL, 10);
+			if (term->proc.ticks && now > term->proc.sampled)
+				term->proc.cpu = (gint)((ticks - term->proc.ticks) * 100 * G_USEC_PER_SEC /
+				                        ((now - term->proc.sampled) * sysconf(_SC_CLK_TCK)));
+			term->proc.ticks = ticks;
+			term->proc.rss = rss * sysconf(_SC_PAGESIZE);
+			if (!term->proc.name)
+				term->proc.name = g_strndup(comm + 1, end - comm - 1);
 		}
-		sakura_set_colors();
-
+		g_strfreev(fields);
 	}
- 	return FALSE;
+	g_free(stat);
 }
 
+
 static void
-sakura_setname_entry_changed (GtkWidget *widget, void *data)
+sakura_proc_sample(struct terminal *term)
 {
-	GtkDialog *title_dialog=(GtkDialog *)data;
+	gchar path[64], cwd[PATH_MAX];
+	gint64 now = g_get_monotonic_time();
+	pid_t pgid;
+	ssize_t len;
+	bool busy = sakura_proc_busy(term);
+	gint cpu = term->proc.cpu;
 
-	if (strcmp(gtk_entry_get_text(GTK_ENTRY(widget)), "")==0) {
-		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, FALSE);
-	} else {
-		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, TRUE);
+	if (!term->vte || term->pid <= 0)
+		return;
+
+	pgid = tcgetpgrp(sakura_term_pty(term));
+	if (pgid != term->proc.pgid) {
+		sakura_proc_forget(term);
+		term->proc.pgid = pgid;
+		if (pgid > 0 && pgid != term->pid)
+			sakura_proc_watch(term);
+		/* Back to the shell after a reset, the screen is all there is */
+		if (term->links_off && !sakura_proc_busy(term))
+			sakura_links_screen_changed(vte_terminal_get_adjustment(VTE_TERMINAL(term->vte)), term);
+	}
+	/* The usage of a tab with a cgroup is that of the whole group */
+	if (pgid > 0 && pgid != term->pid && (!term->cgroup || !term->proc.name || !sakura_cgroup_stat(term, now)))
+		sakura_proc_stat(term, now);
+
+	/* Not needed once the shell tells it with OSC 7 */
+	g_snprintf(path, sizeof(path), "/proc/%d/cwd", term->pid);
+	len = term->cwd ? 0 : readlink(path, cwd, sizeof(cwd)-1);
+	if (len > 0 && cwd[0] == '/') {
+		cwd[len] = '\0';
+		if (g_strcmp0(cwd, term->proc.cwd)) {
+			g_free(term->proc.cwd);
+			term->proc.cwd = g_strdup(cwd);
+		}
 	}
+	term->proc.sampled = now;
+
+	if ((busy != sakura_proc_busy(term) || cpu != term->proc.cpu) &&
+	    sakura_term_defer(term->win, term, APPLY_LABEL))
+		sakura_update_tab_label(term);
 }
 
 
-/* Parameters are never used */
+/* Sample again only if the terminal had output since the last time */
 static void
-sakura_copy (GtkWidget *widget, void *data)
+sakura_proc_refresh(struct terminal *term)
 {
-	gint page;
-	struct terminal *term;
-
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
-
-	vte_terminal_copy_clipboard(VTE_TERMINAL(term->vte));
+	if (term->proc.sampled < term->last_active)
+		sakura_proc_sample(term);
 }
 
 
-/* Parameters are never used */
-static void
-sakura_paste (GtkWidget *widget, void *data)
+static gboolean
+sakura_proc_monitor(gpointer data)
 {
-	gint page;
+	GHashTableIter iter;
 	struct terminal *term;
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	/* Idle tabs only when they had output, the usage of busy ones changes
+	   without it */
+	g_hash_table_iter_init(&iter, sakura.terms);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&term)) {
+		if (sakura_proc_busy(term))
+			sakura_proc_sample(term);
+		else
+			sakura_proc_refresh(term);
+	}
 
-	vte_terminal_paste_clipboard(VTE_TERMINAL(term->vte));
+	return G_SOURCE_CONTINUE;
 }
 
 
-static void
-sakura_new_tab (GtkWidget *widget, void *data)
+/* Is something besides the shell running in the tab? */
+static bool
+sakura_proc_busy(struct terminal *term)
 {
-	sakura_add_tab();
+	return term->proc.pgid > 0 && term->proc.pgid != term->pid;
 }
 
 
-static void
-sakura_close_tab (GtkWidget *widget, void *data)
+static bool
+sakura_proc_running(struct terminal *term)
 {
-	pid_t pgid;
-	GtkWidget *dialog;
-	gint response;
-	struct terminal *term;
-	gint page, npages;
+	sakura_proc_refresh(term);
+	return sakura_proc_busy(term);
+}
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
 
-	/* Only write configuration to disk if it's the last tab */
-	if (npages==1) {
-		sakura_config_done();
-	}
+/* The label of a tab: its title, or what's running in it */
+static void
+sakura_update_tab_label(struct terminal *term)
+{
+	gchar *label = NULL;
 
-	/* Check if there are running processes for this tab. Use tcgetpgrp to compare to the shell PGID */
-	pgid = tcgetpgrp(vte_terminal_get_pty(VTE_TERMINAL(term->vte)));
+	if (term->label_set_byuser)
+		return;
 
-	if ( (pgid != -1) && (pgid != term->pid) && (!sakura.less_questions) ) {
-			dialog=gtk_message_dialog_new(GTK_WINDOW(sakura.main_window), GTK_DIALOG_MODAL,
-										  GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
-										  _("There is a running process in this terminal.\n\nDo you really want to close it?"));
+	if (sakura.process_labels && sakura_proc_busy(term) && term->proc.name)
+		label = g_strdup_printf(_("%s (%d%% CPU)"), term->proc.name, term->proc.cpu);
+	sakura_set_tab_label_text(term, label ? label : vte_terminal_get_window_title(VTE_TERMINAL(term->vte)));
+	g_free(label);
+}
 
-			response=gtk_dialog_run(GTK_DIALOG(dialog));
-			gtk_widget_destroy(dialog);
 
-			if (response==GTK_RESPONSE_YES) {
-				sakura_del_tab(page);
-			}
-	} else
-		sakura_del_tab(page);
+/* Flow control. vte reads the pty of every tab as fast as it can, so a
+ * background tab flooding output takes the main loop from the one being
+ * typed in. Background tabs printing more than throttle_lines lines per
+ * second get their output stopped as with ^S, which blocks the writes of
+ * their programs, and resumed for a FLOW_INTERVAL every FLOW_PAUSE to
+ * measure them again. The current tab of each window is never stopped */
+static void
+sakura_flow_pause(struct terminal *term, bool pause)
+{
+	int master;
+	char *slave;
 
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	if (npages==0)
-		sakura_destroy();
+	if (term->flow_fd < 0) {
+		if (!pause || !term->vte)
+			return;
+		master = sakura_term_pty(term);
+		if (master < 0 || !(slave = ptsname(master)))
+			return;
+		/* Output can only be stopped from the slave side */
+		term->flow_fd = open(slave, O_RDWR|O_NOCTTY|O_CLOEXEC);
+		if (term->flow_fd < 0)
+			return;
+	}
+	tcflow(term->flow_fd, pause ? TCOOFF : TCOON);
 }
 
 
+/* Stop throttling a tab, shown with an insensitive label */
 static void
-sakura_fullscreen (GtkWidget *widget, void *data)
+sakura_flow_release(struct terminal *term)
 {
-	if (sakura.fullscreen!=TRUE) {
-		sakura.fullscreen=TRUE;
-		gtk_window_fullscreen(GTK_WINDOW(sakura.main_window));
-	} else {
-		gtk_window_unfullscreen(GTK_WINDOW(sakura.main_window));
-		sakura.fullscreen=FALSE;
+	if (!term->throttled)
+		return;
+
+	term->throttled = false;
+	term->flow_paused = 0;
+	if (term->flow_fd >= 0) {
+		sakura_flow_pause(term, false);
+		close(term->flow_fd);
+		term->flow_fd = -1;
 	}
+	gtk_widget_set_sensitive(term->label, TRUE);
 }
 
 
-/* Callback for the tabs close buttons */
-static void
-sakura_closebutton_clicked(GtkWidget *widget, void *data)
+static gboolean
+sakura_flow_tick(gpointer data)
 {
-	gint page;
-	GtkWidget *hbox=(GtkWidget *)data;
+	GHashTableIter iter;
 	struct terminal *term;
-	pid_t pgid;
-	GtkWidget *dialog;
-	gint npages, response;
+	glong column, row, lines;
+	bool background;
+
+	g_hash_table_iter_init(&iter, sakura.terms);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&term)) {
+		if (!term->vte || term->pid <= 0)
+			continue;
+
+		/* Absolute row of the cursor, it grows with the lines printed */
+		vte_terminal_get_cursor_position(VTE_TERMINAL(term->vte), &column, &row);
+		lines = MAX(row - term->flow_row, 0);
+		term->flow_row = row;
+
+		background = gtk_notebook_get_current_page(GTK_NOTEBOOK(term->win->notebook)) !=
+		             gtk_notebook_page_num(GTK_NOTEBOOK(term->win->notebook), term->hbox);
+		if (sakura.throttle_lines <= 0 || !background) {
+			sakura_flow_release(term);
+			continue;
+		}
 
-	page = gtk_notebook_page_num(GTK_NOTEBOOK(sakura.notebook), hbox);
-	term = sakura_get_page_term(sakura, page);
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+		/* Resumed for one interval after FLOW_PAUSE of them */
+		if (term->flow_paused > 0) {
+			if (--term->flow_paused == 0)
+				sakura_flow_pause(term, false);
+			continue;
+		}
 
-	/* Only write configuration to disk if it's the last tab */
-	if (npages==1) {
-		sakura_config_done();
+		if (lines * 1000 / FLOW_INTERVAL > sakura.throttle_lines) {
+			term->throttled = true;
+			term->flow_paused = FLOW_PAUSE;
+			sakura_flow_pause(term, true);
+			gtk_widget_set_sensitive(term->label, FALSE);
+		} else {
+			sakura_flow_release(term);
+		}
 	}
 
-	/* Check if there are running processes for this tab. Use tcgetpgrp to compare to the shell PGID */
-	pgid = tcgetpgrp(vte_terminal_get_pty(VTE_TERMINAL(term->vte)));
-
-	if ( (pgid != -1) && (pgid != term->pid) && (!sakura.less_questions) ) {
-			dialog=gtk_message_dialog_new(GTK_WINDOW(sakura.main_window), GTK_DIALOG_MODAL,
-										  GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
-										  _("There is a running process in this terminal.\n\nDo you really want to close it?"));
+	return G_SOURCE_CONTINUE;
+}
 
-			response=gtk_dialog_run(GTK_DIALOG(dialog));
-			gtk_widget_destroy(dialog);
 
-			if (response==GTK_RESPONSE_YES) {
-				sakura_del_tab(page);
+/* cgroups. With cgroups=true each tab runs in its own cgroup v2 group, a
+ * sibling of a "sakura" one where sakura itself is moved, all of them under
+ * the group sakura was started in, which must be delegated to the user (a
+ * systemd scope or service). The weights of background tabs are
+ * cgroup_cpu_weight and cgroup_io_weight divided by CGROUP_BACKGROUND_SHARE,
+ * and the process monitor reads the usage of the tabs from their group */
+static bool
+sakura_cgroup_write(const char *dir, const char *file, const char *format, ...)
+{
+	gchar *path, *value;
+	va_list args;
+	ssize_t len;
+	int fd;
 
-				if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook))==0)
-					sakura_destroy();
-			}
-	} else {  /* No processes, hell with tab */
+	va_start(args, format);
+	value = g_strdup_vprintf(format, args);
+	va_end(args);
 
-		sakura_del_tab(page);
+	/* cgroupfs files take one write, g_file_set_contents would rename */
+	path = g_build_filename(dir, file, NULL);
+	fd = open(path, O_WRONLY|O_CLOEXEC);
+	len = fd < 0 ? -1 : write(fd, value, strlen(value));
+	if (fd >= 0)
+		close(fd);
+	g_free(path);
+	g_free(value);
 
-		if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook))==0)
-			sakura_destroy();
-	}
+	return len >= 0;
 }
 
-/* Callback called when sakura configuration file is modified by an external process */
-static void
-sakura_conf_changed (GtkWidget *widget, void *data)
+
+/* Is pid sakura or one of its children, like the spawn helper and its shells? */
+static bool
+sakura_cgroup_ours(pid_t pid)
 {
-	sakura.externally_modified=true;
+	gchar path[64], *stat, *end;
+	gint depth;
+
+	for (depth = 0; pid > 1 && depth < 8; depth++) {
+		if (pid == getpid())
+			return true;
+		g_snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+		if (!g_file_get_contents(path, &stat, NULL, NULL))
+			return false;
+		/* The parent pid goes after the name and the state */
+		end = strrchr(stat, ')');
+		pid = end ? (pid_t)strtol(end + 3, NULL, 10) : 0;
+		g_free(stat);
+	}
+	return false;
 }
 
-static void
-sakura_disable_numbered_tabswitch(GtkWidget *widget, void *data)
+
+/* The group the tab groups are created in, set up the first time */
+static const gchar*
+sakura_cgroup_root()
 {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		sakura.disable_numbered_tabswitch = true;
-		sakura_set_config_boolean("disable_numbered_tabswitch", TRUE);
-	} else {
-		sakura.disable_numbered_tabswitch = false;
-		sakura_set_config_boolean("disable_numbered_tabswitch", FALSE);
+	gchar *contents, **lines, *dir = NULL, *leaf, *path;
+	const gchar *controllers[] = { "+cpu", "+memory", "+io" };
+	gint i, enabled = 0;
+	pid_t pid;
+
+	if (sakura.cgroup_root || sakura.cgroup_failed)
+		return sakura.cgroup_root;
+	sakura.cgroup_failed = true;
+
+	if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+		return NULL;
+	lines = g_strsplit(contents, "\n", 0);
+	for (i = 0; lines[i]; i++)
+		if (g_str_has_prefix(lines[i], "0::"))
+			dir = g_build_filename(CGROUP_MOUNT, lines[i] + 3, NULL);
+	g_strfreev(lines);
+	g_free(contents);
+	if (!dir) {
+		fprintf(stderr, "cgroup v2 is not mounted, tabs are not grouped\n");
+		return NULL;
+	}
+	/* Started again in the group of an earlier sakura */
+	if (g_str_has_suffix(dir, "/sakura"))
+		dir[strlen(dir) - strlen("/sakura")] = '\0';
+
+	/* Groups with processes can't enable controllers for their children, so
+	 * ours move to a leaf. Others, like the shell sakura was started from,
+	 * stay and the tabs only get their usage accounted */
+	leaf = g_build_filename(dir, "sakura", NULL);
+	if (g_mkdir(leaf, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Can't create %s: %s\n", leaf, g_strerror(errno));
+		g_free(leaf); g_free(dir);
+		return NULL;
+	}
+	path = g_build_filename(dir, "cgroup.procs", NULL);
+	if (g_file_get_contents(path, &contents, NULL, NULL)) {
+		lines = g_strsplit(contents, "\n", 0);
+		for (i = 0; lines[i]; i++) {
+			pid = (pid_t)strtol(lines[i], NULL, 10);
+			if (pid > 0 && sakura_cgroup_ours(pid))
+				sakura_cgroup_write(leaf, "cgroup.procs", "%d", pid);
+		}
+		g_strfreev(lines);
+		g_free(contents);
 	}
+	g_free(path);
+	g_free(leaf);
+
+	for (i = 0; i < G_N_ELEMENTS(controllers); i++)
+		enabled += sakura_cgroup_write(dir, "cgroup.subtree_control", "%s", controllers[i]);
+	if (enabled < G_N_ELEMENTS(controllers))
+		fprintf(stderr, "Not all cgroup controllers are delegated to %s, tab limits may not apply\n", dir);
+
+	sakura.cgroup_failed = false;
+	sakura.cgroup_root = dir;
+	return dir;
 }
 
+
+/* Weights of a tab, lower in the background, and its memory limit */
 static void
-sakura_use_fading(GtkWidget *widget, void *data)
+sakura_cgroup_limits(struct terminal *term, bool foreground, bool all)
 {
-	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
-		sakura.use_fading = true;
-		sakura_set_config_boolean("use_fading", TRUE);
-	} else {
-		sakura.use_fading = false;
-		sakura_set_config_boolean("use_fading", FALSE);
-		sakura_fade_in();
-		sakura_set_colors();
-	}
-}
+	gint share = foreground ? 1 : CGROUP_BACKGROUND_SHARE;
 
+	if (!term->cgroup || (!all && term->cgroup_foreground == foreground))
+		return;
+	term->cgroup_foreground = foreground;
 
-/******* Functions ********/
+	sakura_cgroup_write(term->cgroup, "cpu.weight", "%d", CLAMP(sakura.cgroup_cpu_weight / share, 1, 10000));
+	sakura_cgroup_write(term->cgroup, "io.weight", "default %d", CLAMP(sakura.cgroup_io_weight / share, 1, 10000));
+	if (!all)
+		return;
+	if (sakura.cgroup_memory_high > 0)
+		sakura_cgroup_write(term->cgroup, "memory.high", "%" G_GINT64_FORMAT, (gint64)sakura.cgroup_memory_high * 1024 * 1024);
+	else
+		sakura_cgroup_write(term->cgroup, "memory.high", "max");
+}
 
 
+/* Switching tabs swaps their weights */
 static void
-sakura_init()
+sakura_cgroup_switch(struct window *win, gint current)
 {
-	GError *gerror=NULL;
-	char* configdir = NULL;
-	int i;
+	struct terminal *term;
+	gint page;
 
-	term_data_id = g_quark_from_static_string("sakura_term");
+	for (page = 0; page < gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)); page++) {
+		term = sakura_get_page_term(win, page);
+		sakura_cgroup_limits(term, page == current, false);
+	}
+}
 
-	/* Config file initialization*/
-	sakura.cfg = g_key_file_new();
-	sakura.config_modified=false;
 
-	configdir = g_build_filename( g_get_user_config_dir(), "sakura", NULL );
-	if( ! g_file_test( g_get_user_config_dir(), G_FILE_TEST_EXISTS) )
-		g_mkdir( g_get_user_config_dir(), 0755 );
-	if( ! g_file_test( configdir, G_FILE_TEST_EXISTS) )
-		g_mkdir( configdir, 0755 );
-	if (option_config_file) {
-		sakura.configfile=g_build_filename(configdir, option_config_file, NULL);
-	} else {
-		/* Use more standard-conforming path for config files, if available. */
-		sakura.configfile=g_build_filename(configdir, DEFAULT_CONFIGFILE, NULL);
-	}
-	g_free(configdir);
+/* Create the group of a new tab before its child is started, which joins
+ * it before exec so whatever it forks is in it too. Named after sakura and a
+ * counter: other sakuras could share the root, and tabs have no id yet.
+ * Returns the cgroup.procs file the child writes itself to, or NULL */
+static gchar *
+sakura_cgroup_create(struct terminal *term)
+{
+	static guint count;
+	const gchar *root;
+	gint page;
 
-	/* Open config file */
-	if (!g_key_file_load_from_file(sakura.cfg, sakura.configfile, 0, &gerror)) {
-		/* If there's no file, ignore the error. A new one is created */
-		if (gerror->code==G_KEY_FILE_ERROR_UNKNOWN_ENCODING || gerror->code==G_KEY_FILE_ERROR_INVALID_VALUE) {
-			g_error_free(gerror);
-			fprintf(stderr, "Not valid config file format\n");
-			exit(EXIT_FAILURE);
-		}
+	if (!sakura.cgroups || term->cgroup || !(root = sakura_cgroup_root()))
+		return NULL;
+
+	term->cgroup = g_strdup_printf("%s/tab-%d-%u", root, getpid(), ++count);
+	if (g_mkdir(term->cgroup, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Can't create cgroup %s: %s\n", term->cgroup, g_strerror(errno));
+		g_free(term->cgroup);
+		term->cgroup = NULL;
+		return NULL;
 	}
 
-	/* Add GFile monitor to control file external changes */
-	GFile *cfgfile = g_file_new_for_path(sakura.configfile);
-	GFileMonitor *mon_cfgfile = g_file_monitor_file (cfgfile, 0, NULL, NULL);
-	g_signal_connect(G_OBJECT(mon_cfgfile), "changed", G_CALLBACK(sakura_conf_changed), NULL);
+	page = gtk_notebook_page_num(GTK_NOTEBOOK(term->win->notebook), term->hbox);
+	sakura_cgroup_limits(term, page == gtk_notebook_get_current_page(GTK_NOTEBOOK(term->win->notebook)), true);
+	return g_build_filename(term->cgroup, "cgroup.procs", NULL);
+}
 
-	gchar *cfgtmp = NULL;
 
-	/* We can safely ignore errors from g_key_file_get_value(), since if the
-	 * call to g_key_file_has_key() was successful, the key IS there. From the
-	 * glib docs I don't know if we can ignore errors from g_key_file_has_key,
-	 * too. I think we can: the only possible error is that the config file
-	 * doesn't exist, but we have just read it!
-	 */
+/* In a child between fork and exec, only async-signal-safe calls */
+static void
+sakura_cgroup_join(const char *procs)
+{
+	int fd;
 
-	for( i=0; i<NUM_COLORSETS; i++) {
-		char temp_name[20];
+	if (!procs || !*procs)
+		return;
+	fd = open(procs, O_WRONLY|O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (write(fd, "0", 1) < 0) {}
+	close(fd);
+}
 
-		sprintf(temp_name, "colorset%d_fore", i+1);
-		if (!g_key_file_has_key(sakura.cfg, cfg_group, temp_name, NULL)) {
-			sakura_set_config_string(temp_name, "rgb(192,192,192)");
-		}
-		cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, temp_name, NULL);
-		gdk_rgba_parse(&sakura.forecolors[i], cfgtmp);
-		g_free(cfgtmp);
 
-		sprintf(temp_name, "colorset%d_back", i+1);
-		if (!g_key_file_has_key(sakura.cfg, cfg_group, temp_name, NULL)) {
-			sakura_set_config_string(temp_name, "rgba(0,0,0,1)");
-		}
-		cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, temp_name, NULL);
-		gdk_rgba_parse(&sakura.backcolors[i], cfgtmp);
-		g_free(cfgtmp);
+/* Warm shells were started before their tab, they're moved to its group */
+static void
+sakura_cgroup_attach(struct terminal *term)
+{
+	if (!term->cgroup || sakura_cgroup_write(term->cgroup, "cgroup.procs", "%d", term->pid))
+		return;
 
-		sprintf(temp_name, "colorset%d_curs", i+1);
-		if (!g_key_file_has_key(sakura.cfg, cfg_group, temp_name, NULL)) {
-			sakura_set_config_string(temp_name, "rgb(255,255,255)");
-		}
-		cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, temp_name, NULL);
-		gdk_rgba_parse(&sakura.curscolors[i], cfgtmp);
-		g_free(cfgtmp);
+	fprintf(stderr, "Can't use cgroup %s: %s\n", term->cgroup, g_strerror(errno));
+	g_rmdir(term->cgroup);
+	g_free(term->cgroup);
+	term->cgroup = NULL;
+}
 
-		sprintf(temp_name, "colorset%d_key", i+1);
-		if (!g_key_file_has_key(sakura.cfg, cfg_group, temp_name, NULL)) {
-			sakura_set_config_key(temp_name, cs_keys[i]);
-		}
-		sakura.set_colorset_keys[i]= sakura_get_config_key(temp_name);
-	}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "last_colorset", NULL)) {
-		sakura_set_config_integer("last_colorset", 1);
-	}
-	sakura.last_colorset = g_key_file_get_integer(sakura.cfg, cfg_group, "last_colorset", NULL);
+/* Its processes may outlive the tab, then the group stays */
+static void
+sakura_cgroup_detach(struct terminal *term)
+{
+	if (!term->cgroup)
+		return;
+	g_rmdir(term->cgroup);
+	g_free(term->cgroup);
+	term->cgroup = NULL;
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "background", NULL)) {
-		sakura_set_config_string("background", "none");
-	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "background", NULL);
-	if (strcmp(cfgtmp, "none")==0) {
-		sakura.background=NULL;
-	} else {
-		sakura.background=g_strdup(cfgtmp);
-	}
-	g_free(cfgtmp);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "scroll_lines", NULL)) {
-		g_key_file_set_integer(sakura.cfg, cfg_group, "scroll_lines", DEFAULT_SCROLL_LINES);
-	}
-	sakura.scroll_lines = g_key_file_get_integer(sakura.cfg, cfg_group, "scroll_lines", NULL);
+/* CPU and memory used by the whole tab, read from its group */
+static bool
+sakura_cgroup_stat(struct terminal *term, gint64 now)
+{
+	gchar *path, *contents, *usage;
+	guint64 usec;
+	bool ok;
+
+	path = g_build_filename(term->cgroup, "cpu.stat", NULL);
+	ok = g_file_get_contents(path, &contents, NULL, NULL);
+	g_free(path);
+	if (!ok)
+		return false;
+	usage = strstr(contents, "usage_usec ");
+	usec = usage ? g_ascii_strtoull(usage + strlen("usage_usec "), NULL, 10) : 0;
+	g_free(contents);
+
+	if (term->proc.usage && now > term->proc.sampled)
+		term->proc.cpu = (gint)((usec - term->proc.usage) * 100 / (now - term->proc.sampled));
+	term->proc.usage = usec;
+
+	path = g_build_filename(term->cgroup, "memory.current", NULL);
+	if (g_file_get_contents(path, &contents, NULL, NULL)) {
+		term->proc.rss = g_ascii_strtoll(contents, NULL, 10);
+		g_free(contents);
+	}
+	g_free(path);
+
+	return true;
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "font", NULL)) {
-		sakura_set_config_string("font", DEFAULT_FONT);
-	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "font", NULL);
-	sakura.font = pango_font_description_from_string(cfgtmp);
-	free(cfgtmp);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "show_always_first_tab", NULL)) {
-		sakura_set_config_string("show_always_first_tab", "No");
-	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "show_always_first_tab", NULL);
-	sakura.first_tab = (strcmp(cfgtmp, "Yes")==0) ? true : false;
-	free(cfgtmp);
+/* Working directory of a tab, from OSC 7 or else from the shell's /proc entry */
+static char*
+sakura_get_term_cwd(struct terminal* term)
+{
+	if (term->cwd)
+		return g_strdup(term->cwd);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "scrollbar", NULL)) {
-		sakura_set_config_boolean("scrollbar", FALSE);
-	}
-	sakura.show_scrollbar = g_key_file_get_boolean(sakura.cfg, cfg_group, "scrollbar", NULL);
+	sakura_proc_refresh(term);
+	return g_strdup(term->proc.cwd);
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "resize_grip", NULL)) {
-		sakura_set_config_boolean("resize_grip", FALSE);
-	}
-	sakura.show_resize_grip = g_key_file_get_boolean(sakura.cfg, cfg_group, "resize_grip", NULL);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "closebutton", NULL)) {
-		sakura_set_config_boolean("closebutton", TRUE);
+static gboolean
+sakura_resized_window (GtkWidget *widget, GdkEventConfigure *event, void *data)
+{
+	struct window *win = (struct window *)data;
+	if (event->width!=win->width || event->height!=win->height) {
+		SAY("Configure event received. Current w %d h %d ConfigureEvent w %d h %d",
+		win->width, win->height, event->width, event->height);
+		win->resized=TRUE;
 	}
-	sakura.show_closebutton = g_key_file_get_boolean(sakura.cfg, cfg_group, "closebutton", NULL);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "tabs_on_bottom", NULL)) {
-		sakura_set_config_boolean("tabs_on_bottom", FALSE);
-	}
-	sakura.tabs_on_bottom = g_key_file_get_boolean(sakura.cfg, cfg_group, "tabs_on_bottom", NULL);
+	return FALSE;
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "less_questions", NULL)) {
-		sakura_set_config_boolean("less_questions", FALSE);
-	}
-	sakura.less_questions = g_key_file_get_boolean(sakura.cfg, cfg_group, "less_questions", NULL);
+static gboolean sakura_focus_change(GtkWidget *widget, GdkEvent *event, void *data)
+{
+	struct window *win = (struct window *)data;
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "disable_numbered_tabswitch", NULL)) {
-		sakura_set_config_boolean("disable_numbered_tabswitch", FALSE);
+	if (event->type == GDK_FOCUS_CHANGE) {
+		win->focused = event->focus_change.in;
+		if (win->focused)
+			win->first_focus = true;
+		if (sakura.use_fading)
+			sakura_set_window_colors(win);
 	}
-	sakura.disable_numbered_tabswitch = g_key_file_get_boolean(sakura.cfg, cfg_group, "disable_numbered_tabswitch", NULL);
+ 	return FALSE;
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "use_fading", NULL)) {
-		sakura_set_config_boolean("use_fading", FALSE);
-	}
-	sakura.use_fading = g_key_file_get_boolean(sakura.cfg, cfg_group, "use_fading", NULL);
+static void
+sakura_setname_entry_changed (GtkWidget *widget, void *data)
+{
+	GtkDialog *title_dialog=(GtkDialog *)data;
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "urgent_bell", NULL)) {
-		sakura_set_config_string("urgent_bell", "Yes");
+	if (strcmp(gtk_entry_get_text(GTK_ENTRY(widget)), "")==0) {
+		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, FALSE);
+	} else {
+		gtk_dialog_set_response_sensitive(GTK_DIALOG(title_dialog), GTK_RESPONSE_ACCEPT, TRUE);
 	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "urgent_bell", NULL);
-	sakura.urgent_bell= (strcmp(cfgtmp, "Yes")==0) ? 1 : 0;
-	g_free(cfgtmp);
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "audible_bell", NULL)) {
-		sakura_set_config_string("audible_bell", "Yes");
-	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "audible_bell", NULL);
-	sakura.audible_bell= (strcmp(cfgtmp, "Yes")==0) ? 1 : 0;
-	g_free(cfgtmp);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "visible_bell", NULL)) {
-		sakura_set_config_string("visible_bell", "No");
-	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "visible_bell", NULL);
-	sakura.visible_bell= (strcmp(cfgtmp, "Yes")==0) ? 1 : 0;
-	g_free(cfgtmp);
+/* Parameters are never used */
+static void
+sakura_copy (GtkWidget *widget, void *data)
+{
+	struct window *win = (struct window *)data;
+	gint page;
+	struct terminal *term;
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "blinking_cursor", NULL)) {
-		sakura_set_config_string("blinking_cursor", "No");
-	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "blinking_cursor", NULL);
-	sakura.blinking_cursor= (strcmp(cfgtmp, "Yes")==0) ? 1 : 0;
-	g_free(cfgtmp);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "allow_bold", NULL)) {
-		sakura_set_config_string("allow_bold", "Yes");
-	}
-	cfgtmp = g_key_file_get_value(sakura.cfg, cfg_group, "allow_bold", NULL);
-	sakura.allow_bold= (strcmp(cfgtmp, "Yes")==0) ? 1 : 0;
-	g_free(cfgtmp);
+	vte_terminal_copy_clipboard(VTE_TERMINAL(term->vte));
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "cursor_type", NULL)) {
-		sakura_set_config_string("cursor_type", "VTE_CURSOR_SHAPE_BLOCK");
-	}
-	sakura.cursor_type = g_key_file_get_integer(sakura.cfg, cfg_group, "cursor_type", NULL);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "word_chars", NULL)) {
-		sakura_set_config_string("word_chars", DEFAULT_WORD_CHARS);
-	}
-	sakura.word_chars = g_key_file_get_value(sakura.cfg, cfg_group, "word_chars", NULL);
+/* Parameters are never used */
+static void
+sakura_paste (GtkWidget *widget, void *data)
+{
+	struct window *win = (struct window *)data;
+	gint page;
+	struct terminal *term;
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "palette", NULL)) {
-		sakura_set_config_string("palette", DEFAULT_PALETTE);
-	}
-	cfgtmp = g_key_file_get_string(sakura.cfg, cfg_group, "palette", NULL);
-	if (strcmp(cfgtmp, "linux")==0) {
-		sakura.palette=linux_palette;
-	} else if (strcmp(cfgtmp, "xterm")==0) {
-		sakura.palette=xterm_palette;
-	} else if (strcmp(cfgtmp, "tango")==0) {
-		sakura.palette=tango_palette;
-	} else if (strcmp(cfgtmp, "solarized_dark")==0) {
-		sakura.palette=solarized_dark_palette;
-	} else {
-		sakura.palette=solarized_light_palette;
-	}
-	g_free(cfgtmp);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "add_tab_accelerator", NULL)) {
-		sakura_set_config_integer("add_tab_accelerator", DEFAULT_ADD_TAB_ACCELERATOR);
-	}
-	sakura.add_tab_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "add_tab_accelerator", NULL);
+	vte_terminal_paste_clipboard(VTE_TERMINAL(term->vte));
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "del_tab_accelerator", NULL)) {
-		sakura_set_config_integer("del_tab_accelerator", DEFAULT_DEL_TAB_ACCELERATOR);
-	}
-	sakura.del_tab_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "del_tab_accelerator", NULL);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "switch_tab_accelerator", NULL)) {
-		sakura_set_config_integer("switch_tab_accelerator", DEFAULT_SWITCH_TAB_ACCELERATOR);
-	}
-	sakura.switch_tab_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "switch_tab_accelerator", NULL);
+static void
+sakura_new_tab (GtkWidget *widget, void *data)
+{
+	struct window *win = (struct window *)data;
+	sakura_add_tab(win);
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "move_tab_accelerator", NULL)) {
-		sakura_set_config_integer("move_tab_accelerator", DEFAULT_MOVE_TAB_ACCELERATOR);
-	}
-	sakura.move_tab_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "move_tab_accelerator", NULL);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "copy_accelerator", NULL)) {
-		sakura_set_config_integer("copy_accelerator", DEFAULT_COPY_ACCELERATOR);
-	}
-	sakura.copy_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "copy_accelerator", NULL);
+static void
+sakura_close_tab (GtkWidget *widget, void *data)
+{
+	struct window *win = (struct window *)data;
+	GtkWidget *dialog;
+	gint response;
+	struct terminal *term;
+	gint page, npages;
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "scrollbar_accelerator", NULL)) {
-		sakura_set_config_integer("scrollbar_accelerator", DEFAULT_SCROLLBAR_ACCELERATOR);
-	}
-	sakura.scrollbar_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "scrollbar_accelerator", NULL);
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "open_url_accelerator", NULL)) {
-		sakura_set_config_integer("open_url_accelerator", DEFAULT_OPEN_URL_ACCELERATOR);
-	}
-	sakura.open_url_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "open_url_accelerator", NULL);
+	/* Check if there are running processes for this tab */
+	if (sakura_proc_running(term) && !sakura.less_questions) {
+			dialog=gtk_message_dialog_new(GTK_WINDOW(win->main_window), GTK_DIALOG_MODAL,
+										  GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
+										  _("There is a running process in this terminal.\n\nDo you really want to close it?"));
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "font_size_accelerator", NULL)) {
-		sakura_set_config_integer("font_size_accelerator", DEFAULT_FONT_SIZE_ACCELERATOR);
-	}
-	sakura.font_size_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "font_size_accelerator", NULL);
+			response=gtk_dialog_run(GTK_DIALOG(dialog));
+			gtk_widget_destroy(dialog);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "set_tab_name_accelerator", NULL)) {
-		sakura_set_config_integer("set_tab_name_accelerator", DEFAULT_SET_TAB_NAME_ACCELERATOR);
-	}
-	sakura.set_tab_name_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "set_tab_name_accelerator", NULL);
+			if (response==GTK_RESPONSE_YES) {
+				sakura_del_tab(win, page);
+			}
+	} else
+		sakura_del_tab(win, page);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "add_tab_key", NULL)) {
-		sakura_set_config_key("add_tab_key", DEFAULT_ADD_TAB_KEY);
-	}
-	sakura.add_tab_key = sakura_get_config_key("add_tab_key");
+	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+	if (npages==0)
+		sakura_destroy(win);
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "del_tab_key", NULL)) {
-		sakura_set_config_key("del_tab_key", DEFAULT_DEL_TAB_KEY);
-	}
-	sakura.del_tab_key = sakura_get_config_key("del_tab_key");
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "prev_tab_key", NULL)) {
-		sakura_set_config_key("prev_tab_key", DEFAULT_PREV_TAB_KEY);
+static void
+sakura_fullscreen (GtkWidget *widget, void *data)
+{
+	struct window *win = (struct window *)data;
+	if (win->fullscreen!=TRUE) {
+		win->fullscreen=TRUE;
+		gtk_window_fullscreen(GTK_WINDOW(win->main_window));
+	} else {
+		gtk_window_unfullscreen(GTK_WINDOW(win->main_window));
+		win->fullscreen=FALSE;
 	}
-	sakura.prev_tab_key = sakura_get_config_key("prev_tab_key");
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "next_tab_key", NULL)) {
-		sakura_set_config_key("next_tab_key", DEFAULT_NEXT_TAB_KEY);
-	}
-	sakura.next_tab_key = sakura_get_config_key("next_tab_key");
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "copy_key", NULL)) {
-		sakura_set_config_key( "copy_key", DEFAULT_COPY_KEY);
-	}
-	sakura.copy_key = sakura_get_config_key("copy_key");
+/* Callback for the tabs close buttons */
+static void
+sakura_closebutton_clicked(GtkWidget *widget, void *data)
+{
+	gint page;
+	struct terminal *term = (struct terminal *)data;
+	struct window *win = term->win;
+	GtkWidget *dialog;
+	gint response;
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "paste_key", NULL)) {
-		sakura_set_config_key("paste_key", DEFAULT_PASTE_KEY);
-	}
-	sakura.paste_key = sakura_get_config_key("paste_key");
+	page = gtk_notebook_page_num(GTK_NOTEBOOK(win->notebook), term->hbox);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "scrollbar_key", NULL)) {
-		sakura_set_config_key("scrollbar_key", DEFAULT_SCROLLBAR_KEY);
-	}
-	sakura.scrollbar_key = sakura_get_config_key("scrollbar_key");
+	/* Check if there are running processes for this tab */
+	if (sakura_proc_running(term) && !sakura.less_questions) {
+			dialog=gtk_message_dialog_new(GTK_WINDOW(win->main_window), GTK_DIALOG_MODAL,
+										  GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO,
+										  _("There is a running process in this terminal.\n\nDo you really want to close it?"));
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "set_tab_name_key", NULL)) {
-		sakura_set_config_key("set_tab_name_key", DEFAULT_SET_TAB_NAME_KEY);
-	}
+			response=gtk_dialog_run(GTK_DIALOG(dialog));
+			gtk_widget_destroy(dialog);
 
-	sakura.set_tab_name_key = sakura_get_config_key("set_tab_name_key");
+			if (response==GTK_RESPONSE_YES) {
+				sakura_del_tab(win, page);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "increase_font_size_key", NULL)) {
-		sakura_set_config_key("increase_font_size_key", DEFAULT_INCREASE_FONT_SIZE_KEY);
-	}
-	sakura.increase_font_size_key = sakura_get_config_key("increase_font_size_key");
+				if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook))==0)
+					sakura_destroy(win);
+			}
+	} else {  /* No processes, hell with tab */
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "decrease_font_size_key", NULL)) {
-		sakura_set_config_key("decrease_font_size_key", DEFAULT_DECREASE_FONT_SIZE_KEY);
-	}
-	sakura.decrease_font_size_key = sakura_get_config_key("decrease_font_size_key");
+		sakura_del_tab(win, page);
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "fullscreen_key", NULL)) {
-		sakura_set_config_key("fullscreen_key", DEFAULT_FULLSCREEN_KEY);
+		if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook))==0)
+			sakura_destroy(win);
 	}
-	sakura.fullscreen_key = sakura_get_config_key("fullscreen_key");
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "set_colorset_accelerator", NULL)) {
-		sakura_set_config_integer("set_colorset_accelerator", DEFAULT_SELECT_COLORSET_ACCELERATOR);
-	}
-	sakura.set_colorset_accelerator = g_key_file_get_integer(sakura.cfg, cfg_group, "set_colorset_accelerator", NULL);
+/* Callback called when sakura configuration file is modified by an external process */
+static void
+sakura_conf_changed (GFileMonitor *monitor, GFile *file, GFile *other, GFileMonitorEvent event, void *data)
+{
+	/* Editors saving through a rename send several events. Reload after the last one */
+	if (config_writer.reload_timeout)
+		g_source_remove(config_writer.reload_timeout);
+	config_writer.reload_timeout = g_timeout_add(CONFIG_RELOAD_DELAY, sakura_config_reload_timeout, NULL);
+}
 
+static void
+sakura_disable_numbered_tabswitch(GtkWidget *widget, void *data)
+{
+	sakura_config_changed();
+	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
+		sakura.disable_numbered_tabswitch = true;
+	} else {
+		sakura.disable_numbered_tabswitch = false;
+	}
+	sakura_bindings_compile();
+}
 
-	if (!g_key_file_has_key(sakura.cfg, cfg_group, "icon_file", NULL)) {
-		sakura_set_config_string("icon_file", ICON_FILE);
+static void
+sakura_use_fading(GtkWidget *widget, void *data)
+{
+	sakura_config_changed();
+	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget))) {
+		sakura.use_fading = true;
+	} else {
+		sakura.use_fading = false;
+		sakura_set_colors();
 	}
-	sakura.icon = g_key_file_get_string(sakura.cfg, cfg_group, "icon_file", NULL);
+}
 
-	/* set default title pattern from config or NULL */
-	sakura.tab_default_title = g_key_file_get_string(sakura.cfg, cfg_group, "tab_default_title", NULL);
 
-	sakura.provider = gtk_css_provider_new();
+/******* Functions ********/
 
-	sakura.main_window=gtk_window_new(GTK_WINDOW_TOPLEVEL);
-	gtk_window_set_title(GTK_WINDOW(sakura.main_window), "sakura");
-	gtk_window_set_has_resize_grip(GTK_WINDOW(sakura.main_window), sakura.show_resize_grip);
 
-	/* Add datadir path to icon name */
-	char *icon = g_key_file_get_value(sakura.cfg, cfg_group, "icon_file", NULL);
-	char *icon_path = g_strdup_printf(DATADIR "/pixmaps/%s", icon);
-	gtk_window_set_icon_from_file(GTK_WINDOW(sakura.main_window), icon_path, &gerror);
-	g_free(icon); g_free(icon_path); icon=NULL; icon_path=NULL;
+static guint
+sakura_palette_index(const char *name)
+{
+	guint i;
 
-	/* Default terminal size*/
-	sakura.columns = DEFAULT_COLUMNS;
-	sakura.rows = DEFAULT_ROWS;
+	for (i=0; i<NUM_PALETTES-1; i++) {
+		if (g_strcmp0(name, palettes[i].name)==0)
+			break;
+	}
+	return i;
+}
 
-	sakura.notebook=gtk_notebook_new();
 
-	/* Adding mask, for handle scroll events */
-	gtk_widget_add_events(sakura.notebook, GDK_SCROLL_MASK);
+/* FNV-1a, good enough to notice config file changes */
+static guint32
+sakura_hash(const gchar *data, gsize len)
+{
+	guint32 hash = 2166136261u;
+	gsize i;
 
-	/* Figure out if we have rgba capabilities. FIXME: Is this really needed? */
-	GdkScreen *screen = gtk_widget_get_screen (GTK_WIDGET (sakura.main_window));
-	GdkVisual *visual = gdk_screen_get_rgba_visual (screen);
-	if (visual != NULL && gdk_screen_is_composited (screen)) {
-		gtk_widget_set_visual (GTK_WIDGET (sakura.main_window), visual);
-		sakura.has_rgba = true;
-	} else {
-		/* Probably not needed, as is likely the default initializer */
-		sakura.has_rgba = false;
+	for (i=0; i<len; i++) {
+		hash ^= (guchar)data[i];
+		hash *= 16777619u;
 	}
+	return hash;
+}
 
-	/* Command line options initialization */
 
-	/* Set argv for forked childs. Real argv vector starts at argv[1] because we're
-	   using G_SPAWN_FILE_AND_ARGV_ZERO to be able to launch login shells */
-	sakura.argv[0]=g_strdup(g_getenv("SHELL"));
-	if (option_login) {
-		sakura.argv[1]=g_strdup_printf("-%s", g_getenv("SHELL"));
-	} else {
-		sakura.argv[1]=g_strdup(g_getenv("SHELL"));
-	}
-	sakura.argv[2]=NULL;
+/* Stat and hash the config file. Returns false if it cannot be read. A
+ * missing file is a valid state too: everything is at its default */
+static bool
+sakura_config_stamp(gint64 *mtime, gint64 *size, guint32 *hash)
+{
+	struct stat st;
+	gchar *contents;
+	gsize len;
 
-	if (option_title) {
-		gtk_window_set_title(GTK_WINDOW(sakura.main_window), option_title);
+	if (g_stat(sakura.configfile, &st) != 0) {
+		if (errno != ENOENT)
+			return false;
+		*mtime = 0; *size = -1; *hash = 0;
+		return true;
 	}
 
-	if (option_columns) {
-		sakura.columns = option_columns;
-	}
+	*mtime = (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st.st_mtim.tv_nsec;
+	*size = st.st_size;
 
-	if (option_rows) {
-		sakura.rows = option_rows;
-	}
+	if (!g_file_get_contents(sakura.configfile, &contents, &len, NULL))
+		return false;
+	*hash = sakura_hash(contents, len);
+	g_free(contents);
 
-	if (option_font) {
-		sakura.font=pango_font_description_from_string(option_font);
-	}
+	return true;
+}
 
-	/* These options are exclusive */
-	if (option_fullscreen) {
-		sakura_fullscreen(NULL, NULL);
-	} else if (option_maximize) {
-		gtk_window_maximize(GTK_WINDOW(sakura.main_window));
-	}
 
-	sakura.label_count=1;
-	sakura.fullscreen=FALSE;
-	sakura.title_set_byuser=FALSE;
-	sakura.resized=FALSE;
-	sakura.keep_fc=false;
-	sakura.externally_modified=false;
+static bool
+sakura_snapshot_load()
+{
+	struct snapshot *snap;
+	struct stat st;
+	gint64 mtime, size;
+	guint32 hash;
+	gchar *path;
+	bool valid;
+	int fd;
+	gint64 t = sakura_trace_now();
+
+	path = g_strconcat(sakura.configfile, ".snapshot", NULL);
+	fd = g_open(path, O_RDONLY, 0);
+	g_free(path);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) != 0 || st.st_size != sizeof(struct snapshot)) {
+		close(fd);
+		return false;
+	}
+
+	snap = mmap(NULL, sizeof(struct snapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (snap == MAP_FAILED)
+		return false;
+
+	valid = snap->magic == SNAPSHOT_MAGIC && snap->version == SNAPSHOT_VERSION &&
+	        snap->size == sizeof(struct snapshot);
+
+	/* The config file has to be exactly the one the snapshot was made from */
+	if (valid) {
+		valid = sakura_config_stamp(&mtime, &size, &hash) &&
+		        snap->mtime == mtime && snap->file_size == size && snap->hash == hash;
+	}
+
+	/* And its contents have to make sense */
+	valid = valid && snap->strings[SNAPSHOT_STRINGS_SIZE-1] == '\0' &&
+	        snap->palette >= 0 && snap->palette < (gint)NUM_PALETTES &&
+	        snap->last_colorset >= 1 && snap->last_colorset <= NUM_COLORSETS &&
+	        snap->font >= 0 && snap->font < SNAPSHOT_STRINGS_SIZE;
+#define X(field) valid = valid && snap->field >= -1 && snap->field < SNAPSHOT_STRINGS_SIZE;
+	SNAPSHOT_STRINGS(X)
+#undef X
+
+	if (valid) {
+		memcpy(sakura.forecolors, snap->forecolors, sizeof(sakura.forecolors));
+		memcpy(sakura.backcolors, snap->backcolors, sizeof(sakura.backcolors));
+		memcpy(sakura.curscolors, snap->curscolors, sizeof(sakura.curscolors));
+		memcpy(sakura.set_colorset_keys, snap->set_colorset_keys, sizeof(sakura.set_colorset_keys));
+		sakura.cursor_type = snap->cursor_type;
+		sakura.palette = palettes[snap->palette].colors;
+		sakura.font = pango_font_description_from_string(snap->strings + snap->font);
+#define X(field) sakura.field = snap->field;
+		SNAPSHOT_INTS(X)
+		SNAPSHOT_BOOLS(X)
+#undef X
+#define X(field) sakura.field = snap->field < 0 ? NULL : g_strdup(snap->strings + snap->field);
+		SNAPSHOT_STRINGS(X)
+#undef X
+		sakura_trace_add("config_snapshot", t);
+	}
+
+	munmap(snap, sizeof(struct snapshot));
+
+	return valid;
+}
 
-	gerror=NULL;
-	sakura.http_regexp=g_regex_new(HTTP_REGEXP, G_REGEX_CASELESS, G_REGEX_MATCH_NOTEMPTY, &gerror);
 
-	gtk_container_add(GTK_CONTAINER(sakura.main_window), sakura.notebook);
+/* Add a string to the snapshot string table. Returns its offset, -1 for NULL
+ * and -2 if there's no room left */
+static gint
+sakura_snapshot_add_string(struct snapshot *snap, gsize *used, const char *str)
+{
+	gsize len;
+	gint offset;
 
-	/* Init notebook */
-	gtk_notebook_set_scrollable(GTK_NOTEBOOK(sakura.notebook), TRUE);
-	/* Adding mask to see wheter sakura window is focused or not */
-	gtk_widget_add_events(sakura.main_window, GDK_FOCUS_CHANGE_MASK);
-	sakura.focused = false;
-	sakura.first_focus = false;
+	if (!str)
+		return -1;
 
-	sakura_init_popup();
+	len = strlen(str) + 1;
+	if (*used + len >= SNAPSHOT_STRINGS_SIZE)
+		return -2;
 
-	g_signal_connect(G_OBJECT(sakura.main_window), "delete_event", G_CALLBACK(sakura_delete_event), NULL);
-	g_signal_connect(G_OBJECT(sakura.main_window), "destroy", G_CALLBACK(sakura_destroy_window), NULL);
-	g_signal_connect(G_OBJECT(sakura.main_window), "key-press-event", G_CALLBACK(sakura_key_press), NULL);
-	g_signal_connect(G_OBJECT(sakura.main_window), "configure-event", G_CALLBACK(sakura_resized_window), NULL);
-	g_signal_connect(G_OBJECT(sakura.main_window), "event", G_CALLBACK(sakura_focus_change), NULL);
-	g_signal_connect(G_OBJECT(sakura.main_window), "show", G_CALLBACK(sakura_window_show_event), NULL);
+	offset = *used;
+	memcpy(snap->strings + offset, str, len);
+	*used += len;
 
-	/* bugfix (https://bugs.launchpad.net/sakura/+bug/1510186) - return focus to current vte */
-//	g_signal_connect(G_OBJECT(sakura.notebook), "focus-in-event", G_CALLBACK(sakura_notebook_focus_in), NULL);
-	/* bugfix (https://bugs.launchpad.net/sakura/+bug/1077967) - emulate GTK2 mouse scroll behavior */
-	g_signal_connect(sakura.notebook, "scroll-event", G_CALLBACK(sakura_notebook_scroll), NULL);
+	return offset;
 }
 
 
 static void
-sakura_init_popup()
+sakura_snapshot_save()
 {
-	GtkWidget *item_new_tab, *item_set_name, *item_close_tab, *item_copy,
-	          *item_paste, *item_select_font, *item_select_colors,
-	          *item_select_background, *item_set_title, *item_fullscreen,
-	          *item_toggle_scrollbar, *item_options,
-	          *item_show_first_tab, *item_urgent_bell, *item_audible_bell, *item_visible_bell,
-	          *item_blinking_cursor, *item_allow_bold, *item_other_options,
-	          *item_cursor, *item_cursor_block, *item_cursor_underline, *item_cursor_ibeam,
-	          *item_palette, *item_palette_tango, *item_palette_linux, *item_palette_xterm,
-	          *item_palette_solarized_dark, *item_palette_solarized_light,
-	          *item_show_close_button, *item_tabs_on_bottom, *item_less_questions,
-			  *item_toggle_resize_grip,
-	          *item_disable_numbered_tabswitch, *item_use_fading;
-	GtkWidget *options_menu, *other_options_menu, *cursor_menu, *palette_menu;
+	struct snapshot *snap;
+	gchar *path, *font;
+	gsize used = 0;
+	bool fits = true;
+	guint i;
 
-	sakura.item_open_link=gtk_menu_item_new_with_label(_("Open link"));
-	sakura.item_copy_link=gtk_menu_item_new_with_label(_("Copy link"));
-	item_new_tab=gtk_menu_item_new_with_label(_("New tab"));
-	item_set_name=gtk_menu_item_new_with_label(_("Set tab name..."));
-	item_close_tab=gtk_menu_item_new_with_label(_("Close tab"));
-	item_fullscreen=gtk_menu_item_new_with_label(("Full screen"));
-	item_copy=gtk_menu_item_new_with_label(_("Copy"));
-	item_paste=gtk_menu_item_new_with_label(_("Paste"));
-	item_select_font=gtk_menu_item_new_with_label(_("Select font..."));
-	item_select_colors=gtk_menu_item_new_with_label(_("Select colors..."));
-	item_select_background=gtk_menu_item_new_with_label(_("Select background..."));
-	sakura.item_clear_background=gtk_menu_item_new_with_label(_("Clear background"));
-	item_set_title=gtk_menu_item_new_with_label(_("Set window title..."));
+	snap = g_new0(struct snapshot, 1);
 
-	item_options=gtk_menu_item_new_with_label(_("Options"));
+	if (!sakura_config_stamp(&snap->mtime, &snap->file_size, &snap->hash)) {
+		g_free(snap);
+		return;
+	}
 
-	item_other_options=gtk_menu_item_new_with_label(_("More"));
-	item_show_first_tab=gtk_check_menu_item_new_with_label(_("Always show tab bar"));
-	item_tabs_on_bottom=gtk_check_menu_item_new_with_label(_("Tabs at bottom"));
-	item_show_close_button=gtk_check_menu_item_new_with_label(_("Show close button on tabs"));
-	item_toggle_scrollbar=gtk_check_menu_item_new_with_label(_("Show scrollbar"));
-	item_toggle_resize_grip=gtk_check_menu_item_new_with_label(_("Show resize grip"));
-	item_less_questions=gtk_check_menu_item_new_with_label(_("Don't show exit dialog"));
-	item_urgent_bell=gtk_check_menu_item_new_with_label(_("Set urgent bell"));
-	item_audible_bell=gtk_check_menu_item_new_with_label(_("Set audible bell"));
-	item_visible_bell=gtk_check_menu_item_new_with_label(_("Set visible bell"));
-	item_blinking_cursor=gtk_check_menu_item_new_with_label(_("Set blinking cursor"));
-	item_allow_bold=gtk_check_menu_item_new_with_label(_("Enable bold font"));
-	item_disable_numbered_tabswitch=gtk_check_menu_item_new_with_label(_("Disable numbered tabswitch"));
-	item_use_fading=gtk_check_menu_item_new_with_label(_("Use focus fading"));
-	item_cursor=gtk_menu_item_new_with_label(_("Set cursor type"));
-	item_cursor_block=gtk_radio_menu_item_new_with_label(NULL, _("Block"));
-	item_cursor_underline=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_cursor_block), _("Underline"));
-	item_cursor_ibeam=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_cursor_block), _("IBeam"));
-	item_palette=gtk_menu_item_new_with_label(_("Set palette"));
-	item_palette_tango=gtk_radio_menu_item_new_with_label(NULL, "Tango");
-	item_palette_linux=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Linux");
-	item_palette_xterm=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Xterm");
-	item_palette_solarized_dark=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Solarized dark");
-	item_palette_solarized_light=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Solarized light");
+	snap->magic = SNAPSHOT_MAGIC;
+	snap->version = SNAPSHOT_VERSION;
+	snap->size = sizeof(struct snapshot);
 
-	/* Show defaults in menu items */
-	gchar *cfgtmp = NULL;
+	memcpy(snap->forecolors, sakura.forecolors, sizeof(sakura.forecolors));
+	memcpy(snap->backcolors, sakura.backcolors, sizeof(sakura.backcolors));
+	memcpy(snap->curscolors, sakura.curscolors, sizeof(sakura.curscolors));
+	memcpy(snap->set_colorset_keys, sakura.set_colorset_keys, sizeof(sakura.set_colorset_keys));
+	snap->cursor_type = sakura.cursor_type;
+	for (snap->palette=0; snap->palette < (gint)NUM_PALETTES-1; snap->palette++) {
+		if (palettes[snap->palette].colors == sakura.palette)
+			break;
+	}
 
-	if (sakura.first_tab) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_first_tab), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_first_tab), FALSE);
+	/* Like the config file, without the font from -f */
+	for (i=0; i<NUM_CONFIG_KEYS && config_schema[i].field != &sakura.font; i++);
+	if (sakura.font_override && i < NUM_CONFIG_KEYS && config_writer.saved[i])
+		font = g_strdup(config_writer.saved[i]);
+	else
+		font = pango_font_description_to_string(sakura.font);
+	snap->font = sakura_snapshot_add_string(snap, &used, font);
+	fits = snap->font >= 0;
+	g_free(font);
+#define X(field) snap->field = sakura.field;
+	SNAPSHOT_INTS(X)
+	SNAPSHOT_BOOLS(X)
+#undef X
+#define X(field) snap->field = sakura_snapshot_add_string(snap, &used, sakura.field); fits = fits && snap->field != -2;
+	SNAPSHOT_STRINGS(X)
+#undef X
+
+	/* Values out of range are not worth a snapshot, we just parse the keyfile */
+	if (fits && sakura.last_colorset >= 1 && sakura.last_colorset <= NUM_COLORSETS) {
+		path = g_strconcat(sakura.configfile, ".snapshot", NULL);
+		g_file_set_contents(path, (gchar *)snap, sizeof(struct snapshot), NULL);
+		g_free(path);
+	}
+
+	g_free(snap);
+}
+
+
+/* Load the config file, only done when it's really needed: the settings
+ * usually come from the snapshot */
+static void
+sakura_config_load()
+{
+	GError *gerror=NULL;
+
+	if (sakura.cfg)
+		return;
+
+	sakura.cfg = g_key_file_new();
+	if (!g_key_file_load_from_file(sakura.cfg, sakura.configfile, 0, &gerror)) {
+		/* If there's no file, ignore the error. A new one is created */
+		if (gerror->code==G_KEY_FILE_ERROR_UNKNOWN_ENCODING || gerror->code==G_KEY_FILE_ERROR_INVALID_VALUE) {
+			g_error_free(gerror);
+			fprintf(stderr, "Not valid config file format\n");
+			exit(EXIT_FAILURE);
+		}
+		g_error_free(gerror);
 	}
+}
 
-	if (sakura.show_closebutton) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_close_button), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_close_button), FALSE);
+
+/* Store a config value in dest, which has the C type of k. Returns false if
+ * the value is not valid for the key */
+static bool
+sakura_config_parse(const struct config_key *k, const gchar *value, union config_value *dest)
+{
+	gchar *end;
+	guint keyval;
+
+	switch (k->type) {
+		case CONFIG_BOOLEAN:
+			if (strcmp(value, "true")==0 || strcmp(value, "1")==0) {
+				dest->b = true;
+			} else if (strcmp(value, "false")==0 || strcmp(value, "0")==0) {
+				dest->b = false;
+			} else
+				return false;
+			break;
+		case CONFIG_YESNO:
+			dest->b = (strcmp(value, "Yes")==0) ? true : false;
+			break;
+		case CONFIG_INTEGER:
+			dest->i = strtol(value, &end, 10);
+			if (end==value || *end!='\0')
+				return false;
+			break;
+		case CONFIG_KEY:
+			keyval = gdk_keyval_from_name(value);
+			/* For backwards compatibility with integer values */
+			/* If gdk_keyval_from_name fail, it seems to be integer value*/
+			if ((keyval==GDK_KEY_VoidSymbol)||(keyval==0)) {
+				keyval = strtol(value, &end, 10);
+				if (end==value || *end!='\0')
+					return false;
+			}
+			/* always use uppercase value as keyval. (https://bugs.launchpad.net/sakura/+bug/1399487), and possibly (https://bugs.launchpad.net/sakura/+bug/1521723)*/
+			dest->i = gdk_keyval_to_upper(keyval);
+			break;
+		case CONFIG_STRING:
+			g_free(dest->s);
+			dest->s = g_strdup(value);
+			break;
+		case CONFIG_OPTSTRING:
+			g_free(dest->s);
+			dest->s = (strcmp(value, "none")==0) ? NULL : g_strdup(value);
+			break;
+		case CONFIG_COLOR:
+			return gdk_rgba_parse(&dest->c, value);
+		case CONFIG_FONT:
+			if (dest->f)
+				pango_font_description_free(dest->f);
+			dest->f = pango_font_description_from_string(value);
+			break;
+		case CONFIG_PALETTE:
+			dest->p = palettes[sakura_palette_index(value)].colors;
+			break;
 	}
 
-	if (sakura.tabs_on_bottom) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_tabs_on_bottom), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_tabs_on_bottom), FALSE);
+	return true;
+}
+
+
+static void
+sakura_config_default(const struct config_key *k, union config_value *dest)
+{
+	switch (k->type) {
+		case CONFIG_BOOLEAN:
+		case CONFIG_YESNO:
+			dest->b = k->idef;
+			break;
+		case CONFIG_INTEGER:
+		case CONFIG_KEY:
+			dest->i = k->idef;
+			break;
+		case CONFIG_STRING:
+		case CONFIG_OPTSTRING:
+			g_free(dest->s);
+			dest->s = g_strdup(k->def);
+			break;
+		default:
+			sakura_config_parse(k, k->def, dest);
 	}
+}
 
-	if (sakura.less_questions) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_less_questions), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_less_questions), FALSE);
+
+/* The string stored in the config file for a value. NULL means nothing is stored */
+static gchar *
+sakura_config_format(const struct config_key *k, const union config_value *src)
+{
+	guint i;
+
+	switch (k->type) {
+		case CONFIG_BOOLEAN:
+			return g_strdup(src->b ? "true" : "false");
+		case CONFIG_YESNO:
+			return g_strdup(src->b ? "Yes" : "No");
+		case CONFIG_INTEGER:
+			return g_strdup_printf("%d", src->i);
+		case CONFIG_KEY:
+			if (gdk_keyval_name(src->i))
+				return g_strdup(gdk_keyval_name(src->i));
+			return g_strdup_printf("%d", src->i);
+		case CONFIG_STRING:
+			return g_strdup(src->s);
+		case CONFIG_OPTSTRING:
+			return g_strdup(src->s ? src->s : "none");
+		case CONFIG_COLOR:
+			return gdk_rgba_to_string(&src->c);
+		case CONFIG_FONT:
+			return pango_font_description_to_string(src->f);
+		case CONFIG_PALETTE:
+			for (i=0; i<NUM_PALETTES; i++) {
+				if (palettes[i].colors == src->p)
+					return g_strdup(palettes[i].name);
+			}
 	}
 
-	if (sakura.show_scrollbar) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_scrollbar), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_scrollbar), FALSE);
+	return NULL;
+}
+
+
+static void
+sakura_config_value_free(const struct config_key *k, union config_value *v)
+{
+	if (k->type==CONFIG_STRING || k->type==CONFIG_OPTSTRING) {
+		g_free(v->s);
+	} else if (k->type==CONFIG_FONT && v->f) {
+		pango_font_description_free(v->f);
 	}
+}
 
-	if (sakura.show_resize_grip) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_resize_grip), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_resize_grip), FALSE);
+
+/* Get the value of a key from cfg into dest, or its default if it's missing or invalid */
+static void
+sakura_config_get(GKeyFile *cfg, const struct config_key *k, union config_value *dest)
+{
+	gchar *value;
+
+	value = g_key_file_get_value(cfg, cfg_group, k->key, NULL);
+	if (value && (k->type==CONFIG_STRING || k->type==CONFIG_OPTSTRING)) {
+		/* Strings may have escape sequences */
+		g_free(value);
+		value = g_key_file_get_string(cfg, cfg_group, k->key, NULL);
+	}
+	if (!value || !sakura_config_parse(k, value, dest)) {
+		sakura_config_default(k, dest);
 	}
+	g_free(value);
+}
 
-	if (sakura.use_fading) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_use_fading), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_use_fading), FALSE);
+
+/* Resolve all the settings from the config file in a single pass. Missing or
+ * invalid keys get their default, but nothing is written back for them */
+static void
+sakura_config_read()
+{
+	const struct config_key *k;
+	gint64 t;
+
+	t = sakura_trace_now();
+	sakura_config_load();
+	sakura_trace_add("config_load", t);
+	t = sakura_trace_now();
+
+	for (k=config_schema; k<config_schema+NUM_CONFIG_KEYS; k++) {
+		sakura_config_get(sakura.cfg, k, k->field);
 	}
 
-	if (sakura.urgent_bell) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_urgent_bell), TRUE);
+	if (sakura.last_colorset < 1 || sakura.last_colorset > NUM_COLORSETS)
+		sakura.last_colorset = 1;
+
+	sakura_trace_add("config_keys", t);
+}
+
+
+/* Remember the current values as the ones in the config file */
+static void
+sakura_config_mark_saved()
+{
+	guint i;
+
+	for (i=0; i<NUM_CONFIG_KEYS; i++) {
+		g_free(config_writer.saved[i]);
+		config_writer.saved[i] = sakura_config_format(&config_schema[i], config_schema[i].field);
 	}
+}
 
-	if (sakura.audible_bell) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_audible_bell), TRUE);
+
+/* Collect the values changed since the last save. NULL if there are none */
+static struct config_job *
+sakura_config_job_new()
+{
+	struct config_job *job;
+	gchar *value;
+	bool changed=false;
+	guint i;
+
+	if (!sakura.config_modified)
+		return NULL;
+
+	job = g_new0(struct config_job, 1);
+	for (i=0; i<NUM_CONFIG_KEYS; i++) {
+		/* The file keeps its font until it's changed from here */
+		if (sakura.font_override && config_schema[i].field == &sakura.font)
+			continue;
+		value = sakura_config_format(&config_schema[i], config_schema[i].field);
+		if (value && g_strcmp0(value, config_writer.saved[i])!=0) {
+			job->values[i] = value;
+			changed=true;
+		} else {
+			g_free(value);
+		}
 	}
 
-	if (sakura.visible_bell) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_visible_bell), TRUE);
+	if (!changed) {
+		g_free(job);
+		return NULL;
 	}
 
-	if (sakura.blinking_cursor) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_blinking_cursor), TRUE);
+	job->configfile = g_strdup(sakura.configfile);
+	sakura.config_modified=false;
+	return job;
+}
+
+
+static void
+sakura_config_job_free(struct config_job *job)
+{
+	guint i;
+
+	for (i=0; i<NUM_CONFIG_KEYS; i++)
+		g_free(job->values[i]);
+	g_free(job->configfile);
+	g_free(job);
+}
+
+
+static void
+sakura_config_job_saved(struct config_job *job)
+{
+	guint i;
+
+	for (i=0; i<NUM_CONFIG_KEYS; i++) {
+		if (job->values[i]) {
+			g_free(config_writer.saved[i]);
+			config_writer.saved[i] = g_strdup(job->values[i]);
+		}
 	}
+}
 
-	if (sakura.allow_bold) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_allow_bold), TRUE);
+
+/* Write the job's values into the config file. The file is read again and
+ * only our changes are applied, so changes made to other keys by someone
+ * else are kept. It's replaced atomically, no half-written config is ever
+ * left behind. Runs in the worker thread, so it can't touch sakura */
+static bool
+sakura_config_write(struct config_job *job, GError **gerror)
+{
+	GKeyFile *cfg;
+	GError *lerror=NULL;
+	struct stat st;
+	gchar *data=NULL, *tmpfile=NULL;
+	gsize len, done;
+	ssize_t n;
+	int fd=-1, err=0;
+	bool ok=false, created=false;
+	guint i;
+
+	g_mutex_lock(&config_writer.lock);
+
+	cfg = g_key_file_new();
+	if (!g_key_file_load_from_file(cfg, job->configfile, G_KEY_FILE_KEEP_COMMENTS, &lerror)) {
+		/* Don't overwrite a config file we can't understand */
+		if (!g_error_matches(lerror, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_propagate_error(gerror, lerror);
+			goto out;
+		}
+		g_clear_error(&lerror);
 	}
 
-	switch (sakura.cursor_type){
-		case VTE_CURSOR_SHAPE_BLOCK:
-			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_block), TRUE);
+	for (i=0; i<NUM_CONFIG_KEYS; i++) {
+		if (!job->values[i])
+			continue;
+		if (config_schema[i].type==CONFIG_STRING || config_schema[i].type==CONFIG_OPTSTRING) {
+			g_key_file_set_string(cfg, cfg_group, config_schema[i].key, job->values[i]);
+		} else {
+			g_key_file_set_value(cfg, cfg_group, config_schema[i].key, job->values[i]);
+		}
+	}
+	data = g_key_file_to_data(cfg, &len, NULL);
+
+	tmpfile = g_strconcat(job->configfile, ".XXXXXX", NULL);
+	fd = g_mkstemp_full(tmpfile, O_WRONLY, 0644);
+	if (fd == -1) {
+		err = errno;
+		goto out;
+	}
+	created = true;
+	/* Keep the permissions of the file we're replacing */
+	if (g_stat(job->configfile, &st) == 0)
+		fchmod(fd, st.st_mode & 0777);
+
+	for (done=0; done<len; done+=n) {
+		n = write(fd, data+done, len-done);
+		if (n == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			err = errno;
+			goto out;
+		}
+	}
+	if (fsync(fd) == -1) {
+		err = errno;
+		goto out;
+	}
+	if (close(fd) == -1) {
+		err = errno;
+		fd = -1;
+		goto out;
+	}
+	fd = -1;
+
+	if (g_rename(tmpfile, job->configfile) == -1) {
+		err = errno;
+		goto out;
+	}
+	ok = true;
+
+out:
+	if (err)
+		g_set_error(gerror, G_FILE_ERROR, g_file_error_from_errno(err),
+		            _("Cannot save configuration to %s: %s"), job->configfile, g_strerror(err));
+	if (fd != -1)
+		close(fd);
+	if (!ok && created)
+		g_unlink(tmpfile);
+	g_free(tmpfile);
+	g_free(data);
+	g_key_file_free(cfg);
+
+	g_mutex_unlock(&config_writer.lock);
+	return ok;
+}
+
+
+static void
+sakura_config_save_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+	GError *gerror=NULL;
+	bool ok;
+
+	ok = sakura_config_write((struct config_job *)data, &gerror);
+
+	g_mutex_lock(&config_writer.lock);
+	config_writer.done=true;
+	config_writer.ok=ok;
+	g_cond_signal(&config_writer.cond);
+	g_mutex_unlock(&config_writer.lock);
+
+	if (ok) {
+		g_task_return_boolean(task, TRUE);
+	} else {
+		g_task_return_error(task, gerror);
+	}
+}
+
+
+static void
+sakura_config_saved(GObject *source, GAsyncResult *result, gpointer data)
+{
+	struct config_job *job = g_task_get_task_data(G_TASK(result));
+	GError *gerror=NULL;
+	GtkWidget *dialog;
+
+	config_writer.running=NULL;
+
+	if (g_task_propagate_boolean(G_TASK(result), &gerror)) {
+		sakura_config_job_saved(job);
+		/* Changes made meanwhile aren't in the file yet, their save snapshots */
+		if (!sakura.config_modified)
+			sakura_snapshot_save();
+		return;
+	}
+
+	/* The changes are kept, they're saved again with the next change or at exit */
+	sakura.config_modified=true;
+	fprintf(stderr, "%s\n", gerror->message);
+	if (sakura.windows) {
+		struct window *win = (struct window *)sakura.windows->data;
+		dialog = gtk_message_dialog_new(GTK_WINDOW(win->main_window), GTK_DIALOG_DESTROY_WITH_PARENT,
+		                                GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "%s", gerror->message);
+		gtk_window_set_title(GTK_WINDOW(dialog), _("Error message"));
+		g_signal_connect(dialog, "response", G_CALLBACK(gtk_widget_destroy), NULL);
+		gtk_widget_show(dialog);
+	}
+	g_error_free(gerror);
+}
+
+
+static void
+sakura_config_save_async()
+{
+	struct config_job *job;
+	GTask *task;
+
+	job = sakura_config_job_new();
+	if (!job)
+		return;
+
+	config_writer.running = job;
+	config_writer.done = false;
+	task = g_task_new(NULL, NULL, sakura_config_saved, NULL);
+	g_task_set_task_data(task, job, (GDestroyNotify)sakura_config_job_free);
+	g_task_run_in_thread(task, sakura_config_save_thread);
+	g_object_unref(task);
+}
+
+
+static gboolean
+sakura_config_save_timeout(gpointer data)
+{
+	/* One save at a time. Try again later */
+	if (config_writer.running)
+		return G_SOURCE_CONTINUE;
+
+	config_writer.timeout=0;
+	sakura_config_save_async();
+	return G_SOURCE_REMOVE;
+}
+
+
+/* A setting has been changed. Save it when changes stop coming */
+static void
+sakura_config_changed()
+{
+	sakura.config_modified=true;
+
+	if (config_writer.timeout)
+		g_source_remove(config_writer.timeout);
+	config_writer.timeout = g_timeout_add(CONFIG_SAVE_DELAY, sakura_config_save_timeout, NULL);
+}
+
+
+/* Move a value into the field of its key, freeing the old one */
+static void
+sakura_config_store(const struct config_key *k, union config_value *v)
+{
+	switch (k->type) {
+		case CONFIG_BOOLEAN:
+		case CONFIG_YESNO:
+			*(bool *)k->field = v->b;
 			break;
-		case VTE_CURSOR_SHAPE_UNDERLINE:
-			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_underline), TRUE);
+		case CONFIG_INTEGER:
+		case CONFIG_KEY:
+			*(gint *)k->field = v->i;
+			break;
+		case CONFIG_STRING:
+		case CONFIG_OPTSTRING:
+			g_free(*(char **)k->field);
+			*(char **)k->field = v->s;
+			break;
+		case CONFIG_COLOR:
+			*(GdkRGBA *)k->field = v->c;
+			break;
+		case CONFIG_FONT:
+			pango_font_description_free(*(PangoFontDescription **)k->field);
+			*(PangoFontDescription **)k->field = v->f;
+			break;
+		case CONFIG_PALETTE:
+			*(const GdkRGBA **)k->field = v->p;
 			break;
-		case VTE_CURSOR_SHAPE_IBEAM:
-			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_ibeam), TRUE);
 	}
+}
 
-	cfgtmp = g_key_file_get_string(sakura.cfg, cfg_group, "palette", NULL);
-	if (strcmp(cfgtmp, "linux")==0) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_linux), TRUE);
-	} else if (strcmp(cfgtmp, "tango")==0) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_tango), TRUE);
-	} else if (strcmp(cfgtmp, "xterm")==0) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_xterm), TRUE);
-	} else if (strcmp(cfgtmp, "solarized_dark")==0) {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_solarized_dark), TRUE);
-	} else {
-		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_solarized_light), TRUE);
+
+static gchar *
+sakura_action_name(const struct action *action, gint arg)
+{
+	if (action->numbered)
+		return g_strdup_printf("%s_%d", action->name, arg);
+	return g_strdup(action->name);
+}
+
+
+static const struct action *
+sakura_action_named(const char *name)
+{
+	guint i;
+
+	for (i=0; i<NUM_ACTIONS; i++) {
+		if (strcmp(actions[i].name, name)==0)
+			return &actions[i];
+	}
+	return NULL;
+}
+
+
+/* Add a binding to the table, unless the keys are already taken. Returns false on conflicts */
+static bool
+sakura_bindings_add(guint mods, guint keyval, const struct action *action, gint arg, bool user)
+{
+	struct binding *binding, *old;
+	gint64 key;
+	gchar *accel, *name, *old_name;
+
+	mods &= gtk_accelerator_get_default_mod_mask();
+	keyval = gdk_keyval_to_upper(keyval);
+	key = BINDING_KEY(mods, keyval);
+
+	old = g_hash_table_lookup(sakura.bindings, &key);
+	if (old) {
+		/* User bindings replace the default ones silently */
+		if (old->user && !user)
+			return true;
+		accel = gtk_accelerator_name(keyval, mods);
+		name = sakura_action_name(action, arg);
+		old_name = sakura_action_name(old->action, old->arg);
+		fprintf(stderr, "Key binding %s for %s conflicts with %s, ignored\n", accel, name, old_name);
+		g_free(accel); g_free(name); g_free(old_name);
+		return false;
+	}
+
+	binding = g_new(struct binding, 1);
+	binding->key = key;
+	binding->action = action;
+	binding->arg = arg;
+	binding->user = user;
+	g_hash_table_insert(sakura.bindings, &binding->key, binding);
+	return true;
+}
+
+
+static const struct action *
+sakura_action_find(const char *name, gint *arg)
+{
+	const char *number;
+	gchar *end;
+	guint i;
+	size_t len;
+
+	for (i=0; i<NUM_ACTIONS; i++) {
+		len = strlen(actions[i].name);
+		if (strncmp(name, actions[i].name, len)!=0)
+			continue;
+
+		number = name+len;
+		if (!actions[i].numbered && *number=='\0') {
+			*arg = 0;
+			return &actions[i];
+		}
+		if (actions[i].numbered && *number=='_') {
+			*arg = strtol(number+1, &end, 10);
+			if (end!=number+1 && *end=='\0' && *arg > 0)
+				return &actions[i];
+		}
 	}
-	g_free(cfgtmp);
 
-	sakura.open_link_separator=gtk_separator_menu_item_new();
+	return NULL;
+}
+
+
+/* Build the (modifiers, keyval) -> action table from the settings, so a
+ * keypress is a single lookup. Bindings from the keybindings setting go
+ * first, the ones from the *_accelerator and *_key settings fill the rest */
+static void
+sakura_bindings_compile()
+{
+	const struct action *action;
+	gchar **entries, **entry, **parts;
+	guint keyval;
+	GdkModifierType mods;
+	gint arg, i;
+
+	if (sakura.bindings)
+		g_hash_table_destroy(sakura.bindings);
+	sakura.bindings = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+
+	if (sakura.keybindings) {
+		entries = g_strsplit(sakura.keybindings, ";", 0);
+		for (entry=entries; *entry; entry++) {
+			g_strstrip(*entry);
+			if (**entry=='\0')
+				continue;
+			parts = g_strsplit(*entry, ":", 2);
+			action = parts[1] ? sakura_action_find(g_strstrip(parts[0]), &arg) : NULL;
+			if (!action) {
+				fprintf(stderr, "Unknown action in key binding \"%s\"\n", *entry);
+			} else {
+				gtk_accelerator_parse(g_strstrip(parts[1]), &keyval, &mods);
+				if (keyval==0) {
+					fprintf(stderr, "Invalid accelerator in key binding \"%s\"\n", *entry);
+				} else {
+					sakura_bindings_add(mods, keyval, action, arg, true);
+				}
+			}
+			g_strfreev(parts);
+		}
+		g_strfreev(entries);
+	}
+
+	sakura_bindings_add(sakura.add_tab_accelerator, sakura.add_tab_key, sakura_action_named("new_tab"), 0, false);
+	sakura_bindings_add(sakura.del_tab_accelerator, sakura.del_tab_key, sakura_action_named("close_tab"), 0, false);
+	if (!sakura.disable_numbered_tabswitch) {
+		for (i=1; i<=9; i++)
+			sakura_bindings_add(sakura.switch_tab_accelerator, GDK_KEY_0+i, sakura_action_named("switch_tab"), i, false);
+	}
+	sakura_bindings_add(sakura.switch_tab_accelerator, sakura.prev_tab_key, sakura_action_named("prev_tab"), 0, false);
+	sakura_bindings_add(sakura.switch_tab_accelerator, sakura.next_tab_key, sakura_action_named("next_tab"), 0, false);
+	sakura_bindings_add(sakura.move_tab_accelerator, sakura.prev_tab_key, sakura_action_named("move_tab_back"), 0, false);
+	sakura_bindings_add(sakura.move_tab_accelerator, sakura.next_tab_key, sakura_action_named("move_tab_forward"), 0, false);
+	sakura_bindings_add(sakura.copy_accelerator, sakura.copy_key, sakura_action_named("copy"), 0, false);
+	sakura_bindings_add(sakura.copy_accelerator, sakura.paste_key, sakura_action_named("paste"), 0, false);
+	sakura_bindings_add(sakura.scrollbar_accelerator, sakura.scrollbar_key, sakura_action_named("toggle_scrollbar"), 0, false);
+	sakura_bindings_add(sakura.set_tab_name_accelerator, sakura.set_tab_name_key, sakura_action_named("set_tab_name"), 0, false);
+	sakura_bindings_add(sakura.search_accelerator, sakura.search_key, sakura_action_named("search"), 0, false);
+	sakura_bindings_add(sakura.font_size_accelerator, sakura.increase_font_size_key, sakura_action_named("increase_font_size"), 0, false);
+	sakura_bindings_add(sakura.font_size_accelerator, sakura.decrease_font_size_key, sakura_action_named("decrease_font_size"), 0, false);
+	sakura_bindings_add(0, sakura.fullscreen_key, sakura_action_named("fullscreen"), 0, false);
+	for (i=0; i<NUM_COLORSETS; i++)
+		sakura_bindings_add(sakura.set_colorset_accelerator, sakura.set_colorset_keys[i], sakura_action_named("set_colorset"), i+1, false);
+}
+
+
+/* Apply the changed settings to all the open windows and terminals, in a single pass */
+static void
+sakura_config_apply(guint apply)
+{
+	struct window *win;
+	struct terminal *term;
+	GdkPixbuf *pixbuf=NULL;
+	GError *gerror=NULL;
+	gint n_pages;
+	GList *l;
+	int i;
+
+	if ((apply & APPLY_BACKGROUND) && sakura.background) {
+		pixbuf = gdk_pixbuf_new_from_file(sakura.background, &gerror);
+		if (!pixbuf) {
+			fprintf(stderr, "%s\n", gerror->message);
+			g_error_free(gerror);
+		}
+	}
+
+	for (l = sakura.windows; l; l = l->next) {
+		win = (struct window *)l->data;
+		n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+
+		if (apply & APPLY_TABS) {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), sakura.first_tab || n_pages > 1);
+			gtk_notebook_set_tab_pos(GTK_NOTEBOOK(win->notebook), sakura.tabs_on_bottom ? GTK_POS_BOTTOM : GTK_POS_TOP);
+		}
+		if (apply & APPLY_GRIP) {
+			gtk_window_set_has_resize_grip(GTK_WINDOW(win->main_window), sakura.show_resize_grip);
+		}
+		/* Menu items show the settings they were created with. Start again */
+		if (apply & APPLY_MENU) {
+			gtk_widget_destroy(win->menu);
+			sakura_init_popup(win);
+		}
+
+		win->keep_fc=1;
+		for (i = (n_pages - 1); i >= 0; i--) {
+			term = sakura_get_page_term(win, i);
+			/* Placeholders get the new settings when they are materialized */
+			if (!term->vte)
+				continue;
+			if (sakura_term_defer(win, term, apply & APPLY_FONT))
+				vte_terminal_set_font(VTE_TERMINAL(term->vte), sakura.font);
+			if (apply & APPLY_TERM)
+				sakura_set_term_options(term);
+			if (apply & APPLY_SCROLLBAR) {
+				if (sakura.show_scrollbar)
+					gtk_widget_show(term->scrollbar);
+				else
+					gtk_widget_hide(term->scrollbar);
+			}
+			if (apply & APPLY_BACKGROUND)
+				vte_terminal_set_background_image(VTE_TERMINAL(term->vte), pixbuf);
+			if (sakura_term_defer(win, term, apply & APPLY_LABEL))
+				sakura_update_tab_label(term);
+			if (apply & APPLY_CGROUP)
+				sakura_cgroup_limits(term, i == gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook)), true);
+		}
+		if (apply & APPLY_COLORS)
+			sakura_set_window_colors(win);
+
+		if (apply & (APPLY_FONT|APPLY_TABS|APPLY_SCROLLBAR))
+			sakura_set_size(win);
+		win->keep_fc=0;
+	}
+
+	if (apply & APPLY_BINDINGS)
+		sakura_bindings_compile();
+
+	if (apply & APPLY_POOL)
+		sakura_helper_pool(NULL);
+
+	if (apply & APPLY_LINKS)
+		sakura_links_compile();
+
+	if (apply & APPLY_TRIGGERS)
+		sakura_triggers_compile();
+
+	if (pixbuf)
+		g_object_unref(pixbuf);
+}
+
+
+/* Compare the config file as it is now with what we know it had, and take
+ * the keys that changed. Keys we have unsaved changes for are left alone,
+ * the next save writes them */
+static void
+sakura_config_merge(GKeyFile *cfg)
+{
+	const struct config_key *k;
+	union config_value value;
+	gchar *disk, *current;
+	guint i, apply=0;
+
+	for (i=0; i<NUM_CONFIG_KEYS; i++) {
+		k = &config_schema[i];
+
+		memset(&value, 0, sizeof(value));
+		sakura_config_get(cfg, k, &value);
+		disk = sakura_config_format(k, &value);
+
+		if (!disk || g_strcmp0(disk, config_writer.saved[i])==0) {
+			sakura_config_value_free(k, &value);
+			g_free(disk);
+			continue;
+		}
+
+		current = sakura_config_format(k, k->field);
+		if (g_strcmp0(current, config_writer.saved[i])==0) {
+			SAY("%s changed to %s", k->key, disk);
+			sakura_config_store(k, &value);
+			apply |= k->apply;
+		} else {
+			sakura_config_value_free(k, &value);
+		}
+		g_free(current);
+
+		g_free(config_writer.saved[i]);
+		config_writer.saved[i] = disk;
+	}
+
+	if (sakura.last_colorset < 1 || sakura.last_colorset > NUM_COLORSETS)
+		sakura.last_colorset = 1;
+
+	if (apply)
+		sakura_config_apply(apply);
+}
+
+
+static void
+sakura_config_reload_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+	GKeyFile *cfg;
+	GError *gerror=NULL;
+
+	cfg = g_key_file_new();
+	if (!g_key_file_load_from_file(cfg, (const gchar *)data, 0, &gerror) &&
+	    !g_error_matches(gerror, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+		g_key_file_free(cfg);
+		g_task_return_error(task, gerror);
+		return;
+	}
+	g_clear_error(&gerror);
+	g_task_return_pointer(task, cfg, (GDestroyNotify)g_key_file_free);
+}
+
+
+static void
+sakura_config_reloaded(GObject *source, GAsyncResult *result, gpointer data)
+{
+	GKeyFile *cfg;
+	GError *gerror=NULL;
+
+	config_writer.reloading=false;
+
+	cfg = g_task_propagate_pointer(G_TASK(result), &gerror);
+	if (!cfg) {
+		/* Probably caught in the middle of an edit. Keep the current settings */
+		SAY("Cannot reload configuration: %s", gerror->message);
+		g_error_free(gerror);
+		return;
+	}
+
+	sakura_config_merge(cfg);
+	g_key_file_free(cfg);
+}
+
+
+static gboolean
+sakura_config_reload_timeout(gpointer data)
+{
+	GTask *task;
+
+	if (config_writer.reloading)
+		return G_SOURCE_CONTINUE;
+
+	config_writer.reload_timeout=0;
+	config_writer.reloading=true;
+	task = g_task_new(NULL, NULL, sakura_config_reloaded, NULL);
+	g_task_set_task_data(task, g_strdup(sakura.configfile), g_free);
+	g_task_run_in_thread(task, sakura_config_reload_thread);
+	g_object_unref(task);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void
+sakura_init()
+{
+	char* configdir = NULL;
+	gint64 t_init = sakura_trace_now();
+
+	term_data_id = g_quark_from_static_string("sakura_term");
+	sakura.terms = g_hash_table_new(g_direct_hash, g_direct_equal);
+	sakura.terms_by_vte = g_hash_table_new(g_direct_hash, g_direct_equal);
+	sakura.terms_by_pid = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	/* Config file initialization*/
+	sakura.cfg = NULL;
+	sakura.config_modified=false;
+
+	configdir = g_build_filename( g_get_user_config_dir(), "sakura", NULL );
+	if( ! g_file_test( g_get_user_config_dir(), G_FILE_TEST_EXISTS) )
+		g_mkdir( g_get_user_config_dir(), 0755 );
+	if( ! g_file_test( configdir, G_FILE_TEST_EXISTS) )
+		g_mkdir( configdir, 0755 );
+	if (option_config_file) {
+		sakura.configfile=g_build_filename(configdir, option_config_file, NULL);
+	} else {
+		/* Use more standard-conforming path for config files, if available. */
+		sakura.configfile=g_build_filename(configdir, DEFAULT_CONFIGFILE, NULL);
+	}
+	g_free(configdir);
+
+	/* Add GFile monitor to control file external changes */
+	GFile *cfgfile = g_file_new_for_path(sakura.configfile);
+	GFileMonitor *mon_cfgfile = g_file_monitor_file (cfgfile, 0, NULL, NULL);
+	g_signal_connect(G_OBJECT(mon_cfgfile), "changed", G_CALLBACK(sakura_conf_changed), NULL);
+
+	if (!sakura_snapshot_load()) {
+		sakura_config_read();
+		sakura_snapshot_save();
+	}
+	sakura_config_mark_saved();
+	sakura_bindings_compile();
+
+	sakura.scrollback_scale = 1.0;
+	g_timeout_add_seconds(SCROLLBACK_INTERVAL, sakura_scrollback_rebalance, NULL);
+	g_unix_signal_add(SIGUSR1, sakura_stats_signal, NULL);
+	g_timeout_add_seconds(PROC_INTERVAL, sakura_proc_monitor, NULL);
+	g_timeout_add(FLOW_INTERVAL, sakura_flow_tick, NULL);
+
+	sakura.provider = gtk_css_provider_new();
+
+	/* Figure out if we have rgba capabilities. FIXME: Is this really needed? */
+	GdkScreen *screen = gdk_screen_get_default();
+	if (gdk_screen_get_rgba_visual(screen) != NULL && gdk_screen_is_composited (screen)) {
+		sakura.has_rgba = true;
+	} else {
+		/* Probably not needed, as is likely the default initializer */
+		sakura.has_rgba = false;
+	}
+
+	sakura.windows=NULL;
+
+	sakura_links_compile();
+	sakura_triggers_compile();
+
+	sakura_trace_add("sakura_init", t_init);
+}
+
+
+/* Create a new toplevel window using the current command line options. envv and
+ * cwd are the environment and working directory of the process that asked for
+ * it, which is not us when running as a server */
+static struct window *
+sakura_window_new(char **envv, const char *cwd)
+{
+	struct window *win;
+	GError *gerror=NULL;
+	const gchar *shell;
+	gint64 t_new = sakura_trace_now(), t;
+
+	win = g_new0(struct window, 1);
+
+	win->main_window=gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_title(GTK_WINDOW(win->main_window), "sakura");
+	gtk_window_set_has_resize_grip(GTK_WINDOW(win->main_window), sakura.show_resize_grip);
+
+	/* Add datadir path to icon name */
+	char *icon_path = g_strdup_printf(DATADIR "/pixmaps/%s", sakura.icon);
+	t = sakura_trace_now();
+	if (!gtk_window_set_icon_from_file(GTK_WINDOW(win->main_window), icon_path, &gerror))
+		g_clear_error(&gerror);
+	sakura_trace_add("icon_load", t);
+	g_free(icon_path); icon_path=NULL;
+
+	/* Default terminal size*/
+	win->columns = DEFAULT_COLUMNS;
+	win->rows = DEFAULT_ROWS;
+
+	win->notebook=gtk_notebook_new();
+
+	/* Adding mask, for handle scroll events */
+	gtk_widget_add_events(win->notebook, GDK_SCROLL_MASK);
+
+	if (sakura.has_rgba) {
+		GdkScreen *screen = gtk_widget_get_screen (GTK_WIDGET (win->main_window));
+		gtk_widget_set_visual (GTK_WIDGET (win->main_window), gdk_screen_get_rgba_visual (screen));
+	}
+
+	/* Command line options initialization */
+
+	/* The environment for the children, also carrying TERM and the SHELL to use */
+	win->envv = g_strdupv(envv);
+	win->envv = g_environ_setenv(win->envv, "TERM", "xterm-256color", TRUE);
+	win->cwd = g_strdup(cwd);
+
+	shell = g_environ_getenv(win->envv, "SHELL");
+	if (!shell) shell = "/bin/sh";
+
+	/* Set argv for forked childs. Real argv vector starts at argv[1] because we're
+	   using G_SPAWN_FILE_AND_ARGV_ZERO to be able to launch login shells */
+	win->argv[0]=g_strdup(shell);
+	if (option_login) {
+		win->argv[1]=g_strdup_printf("-%s", shell);
+	} else {
+		win->argv[1]=g_strdup(shell);
+	}
+	win->argv[2]=NULL;
+
+	if (option_title) {
+		win->title = g_strdup(option_title);
+		gtk_window_set_title(GTK_WINDOW(win->main_window), option_title);
+	}
+
+	if (option_columns) {
+		win->columns = option_columns;
+	}
+
+	if (option_rows) {
+		win->rows = option_rows;
+	}
+
+	/* The font is shared, so a font given for a new window changes all of them */
+	if (option_font) {
+		pango_font_description_free(sakura.font);
+		sakura.font=pango_font_description_from_string(option_font);
+		sakura.font_override=true;
+		sakura_set_font();
+	}
+
+	/* Startup notification id of the launcher, when we're serving another process */
+	const gchar *startup_id = g_environ_getenv(win->envv, "DESKTOP_STARTUP_ID");
+	if (startup_id) {
+		gtk_window_set_startup_id(GTK_WINDOW(win->main_window), startup_id);
+		win->envv = g_environ_unsetenv(win->envv, "DESKTOP_STARTUP_ID");
+	}
+
+	win->hold = option_hold;
+
+	/* These options are exclusive */
+	if (option_fullscreen) {
+		sakura_fullscreen(NULL, win);
+	} else if (option_maximize) {
+		gtk_window_maximize(GTK_WINDOW(win->main_window));
+	}
+
+	win->label_count=1;
+	win->title_set_byuser=FALSE;
+	win->resized=FALSE;
+	win->keep_fc=false;
+
+	gtk_container_add(GTK_CONTAINER(win->main_window), win->notebook);
+
+	/* Init notebook */
+	gtk_notebook_set_scrollable(GTK_NOTEBOOK(win->notebook), TRUE);
+	/* Adding mask to see wheter sakura window is focused or not */
+	gtk_widget_add_events(win->main_window, GDK_FOCUS_CHANGE_MASK);
+	win->focused = false;
+	win->first_focus = false;
+
+	t = sakura_trace_now();
+	sakura_init_popup(win);
+	sakura_trace_add("init_popup", t);
+
+	g_signal_connect(G_OBJECT(win->main_window), "delete_event", G_CALLBACK(sakura_delete_event), win);
+	g_signal_connect(G_OBJECT(win->main_window), "destroy", G_CALLBACK(sakura_destroy_window), win);
+	g_signal_connect(G_OBJECT(win->main_window), "key-press-event", G_CALLBACK(sakura_key_press), win);
+	g_signal_connect(G_OBJECT(win->main_window), "configure-event", G_CALLBACK(sakura_resized_window), win);
+	g_signal_connect(G_OBJECT(win->main_window), "event", G_CALLBACK(sakura_focus_change), win);
+	g_signal_connect(G_OBJECT(win->main_window), "show", G_CALLBACK(sakura_window_show_event), win);
+
+	/* bugfix (https://bugs.launchpad.net/sakura/+bug/1510186) - return focus to current vte */
+//	g_signal_connect(G_OBJECT(win->notebook), "focus-in-event", G_CALLBACK(sakura_notebook_focus_in), win);
+	/* bugfix (https://bugs.launchpad.net/sakura/+bug/1077967) - emulate GTK2 mouse scroll behavior */
+	g_signal_connect(win->notebook, "scroll-event", G_CALLBACK(sakura_notebook_scroll), win);
+	g_signal_connect(G_OBJECT(win->notebook), "switch-page", G_CALLBACK(sakura_switch_page), win);
+
+	if (!trace.done) {
+		g_signal_connect_after(G_OBJECT(win->main_window), "draw", G_CALLBACK(sakura_trace_first_frame), NULL);
+	}
+
+	sakura.windows = g_list_append(sakura.windows, win);
+	sakura_trace_add("window_new", t_new);
+
+	return win;
+}
+
+
+static void
+sakura_init_popup(struct window *win)
+{
+	GtkWidget *item_new_tab, *item_set_name, *item_search, *item_stats, *item_close_tab, *item_copy,
+	          *item_paste, *item_select_font, *item_select_colors,
+	          *item_select_background, *item_set_title, *item_fullscreen,
+	          *item_toggle_scrollbar, *item_options,
+	          *item_show_first_tab, *item_urgent_bell, *item_audible_bell, *item_visible_bell,
+	          *item_blinking_cursor, *item_allow_bold, *item_other_options,
+	          *item_cursor, *item_cursor_block, *item_cursor_underline, *item_cursor_ibeam,
+	          *item_palette, *item_palette_tango, *item_palette_linux, *item_palette_xterm,
+	          *item_palette_solarized_dark, *item_palette_solarized_light,
+	          *item_show_close_button, *item_tabs_on_bottom, *item_less_questions,
+			  *item_toggle_resize_grip,
+	          *item_disable_numbered_tabswitch, *item_use_fading;
+	GtkWidget *options_menu, *other_options_menu, *cursor_menu, *palette_menu;
+
+	win->item_open_link=gtk_menu_item_new_with_label(_("Open link"));
+	win->item_copy_link=gtk_menu_item_new_with_label(_("Copy link"));
+	item_new_tab=gtk_menu_item_new_with_label(_("New tab"));
+	item_set_name=gtk_menu_item_new_with_label(_("Set tab name..."));
+	item_search=gtk_menu_item_new_with_label(_("Search..."));
+	item_close_tab=gtk_menu_item_new_with_label(_("Close tab"));
+	item_fullscreen=gtk_menu_item_new_with_label(("Full screen"));
+	item_copy=gtk_menu_item_new_with_label(_("Copy"));
+	item_paste=gtk_menu_item_new_with_label(_("Paste"));
+	item_select_font=gtk_menu_item_new_with_label(_("Select font..."));
+	item_select_colors=gtk_menu_item_new_with_label(_("Select colors..."));
+	item_select_background=gtk_menu_item_new_with_label(_("Select background..."));
+	win->item_clear_background=gtk_menu_item_new_with_label(_("Clear background"));
+	item_set_title=gtk_menu_item_new_with_label(_("Set window title..."));
+	item_stats=gtk_menu_item_new_with_label(_("Statistics..."));
+
+	item_options=gtk_menu_item_new_with_label(_("Options"));
+
+	item_other_options=gtk_menu_item_new_with_label(_("More"));
+	item_show_first_tab=gtk_check_menu_item_new_with_label(_("Always show tab bar"));
+	item_tabs_on_bottom=gtk_check_menu_item_new_with_label(_("Tabs at bottom"));
+	item_show_close_button=gtk_check_menu_item_new_with_label(_("Show close button on tabs"));
+	item_toggle_scrollbar=gtk_check_menu_item_new_with_label(_("Show scrollbar"));
+	item_toggle_resize_grip=gtk_check_menu_item_new_with_label(_("Show resize grip"));
+	item_less_questions=gtk_check_menu_item_new_with_label(_("Don't show exit dialog"));
+	item_urgent_bell=gtk_check_menu_item_new_with_label(_("Set urgent bell"));
+	item_audible_bell=gtk_check_menu_item_new_with_label(_("Set audible bell"));
+	item_visible_bell=gtk_check_menu_item_new_with_label(_("Set visible bell"));
+	item_blinking_cursor=gtk_check_menu_item_new_with_label(_("Set blinking cursor"));
+	item_allow_bold=gtk_check_menu_item_new_with_label(_("Enable bold font"));
+	item_disable_numbered_tabswitch=gtk_check_menu_item_new_with_label(_("Disable numbered tabswitch"));
+	item_use_fading=gtk_check_menu_item_new_with_label(_("Use focus fading"));
+	item_cursor=gtk_menu_item_new_with_label(_("Set cursor type"));
+	item_cursor_block=gtk_radio_menu_item_new_with_label(NULL, _("Block"));
+	item_cursor_underline=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_cursor_block), _("Underline"));
+	item_cursor_ibeam=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_cursor_block), _("IBeam"));
+	item_palette=gtk_menu_item_new_with_label(_("Set palette"));
+	item_palette_tango=gtk_radio_menu_item_new_with_label(NULL, "Tango");
+	item_palette_linux=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Linux");
+	item_palette_xterm=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Xterm");
+	item_palette_solarized_dark=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Solarized dark");
+	item_palette_solarized_light=gtk_radio_menu_item_new_with_label_from_widget(GTK_RADIO_MENU_ITEM(item_palette_tango), "Solarized light");
+
+	/* Show defaults in menu items */
+	if (sakura.first_tab) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_first_tab), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_first_tab), FALSE);
+	}
+
+	if (sakura.show_closebutton) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_close_button), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_show_close_button), FALSE);
+	}
+
+	if (sakura.tabs_on_bottom) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_tabs_on_bottom), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_tabs_on_bottom), FALSE);
+	}
+
+	if (sakura.less_questions) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_less_questions), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_less_questions), FALSE);
+	}
+
+	if (sakura.show_scrollbar) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_scrollbar), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_scrollbar), FALSE);
+	}
+
+	if (sakura.show_resize_grip) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_resize_grip), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_toggle_resize_grip), FALSE);
+	}
+
+	if (sakura.use_fading) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_use_fading), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_use_fading), FALSE);
+	}
+
+	if (sakura.urgent_bell) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_urgent_bell), TRUE);
+	}
+
+	if (sakura.audible_bell) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_audible_bell), TRUE);
+	}
+
+	if (sakura.visible_bell) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_visible_bell), TRUE);
+	}
+
+	if (sakura.blinking_cursor) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_blinking_cursor), TRUE);
+	}
+
+	if (sakura.allow_bold) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_allow_bold), TRUE);
+	}
+
+	switch (sakura.cursor_type){
+		case VTE_CURSOR_SHAPE_BLOCK:
+			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_block), TRUE);
+			break;
+		case VTE_CURSOR_SHAPE_UNDERLINE:
+			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_underline), TRUE);
+			break;
+		case VTE_CURSOR_SHAPE_IBEAM:
+			gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_cursor_ibeam), TRUE);
+	}
+
+	if (sakura.palette==linux_palette) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_linux), TRUE);
+	} else if (sakura.palette==tango_palette) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_tango), TRUE);
+	} else if (sakura.palette==xterm_palette) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_xterm), TRUE);
+	} else if (sakura.palette==solarized_dark_palette) {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_solarized_dark), TRUE);
+	} else {
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item_palette_solarized_light), TRUE);
+	}
+
+	win->open_link_separator=gtk_separator_menu_item_new();
+
+	win->menu=gtk_menu_new();
+	//sakura.labels_menu=gtk_menu_new();
+
+	/* Add items to popup menu */
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), gtk_separator_menu_item_new());
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), win->item_open_link);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), win->item_copy_link);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), win->open_link_separator);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_new_tab);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_set_name);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_search);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_close_tab);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), gtk_separator_menu_item_new());
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_set_title);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_stats);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), gtk_separator_menu_item_new());
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_copy);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_paste);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), win->item_clear_background);
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), gtk_separator_menu_item_new());
+	gtk_menu_shell_append(GTK_MENU_SHELL(win->menu), item_options);
+
+	options_menu=gtk_menu_new();
+	other_options_menu=gtk_menu_new();
+	cursor_menu=gtk_menu_new();
+	palette_menu=gtk_menu_new();
+
+	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_fullscreen);
+	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_colors);
+	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_font);
+	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_background);
+	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), gtk_separator_menu_item_new());
+	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_other_options);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_show_first_tab);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_tabs_on_bottom);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_show_close_button);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), gtk_separator_menu_item_new());
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_toggle_scrollbar);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_toggle_resize_grip);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_less_questions);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_urgent_bell);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_audible_bell);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_visible_bell);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_disable_numbered_tabswitch);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_use_fading);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_blinking_cursor);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_allow_bold);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_cursor);
+	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_block);
+	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_underline);
+	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_ibeam);
+	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_palette);
+	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_tango);
+	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_linux);
+	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_xterm);
+	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_solarized_dark);
+	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_solarized_light);
+
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_options), options_menu);
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_other_options), other_options_menu);
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_cursor), cursor_menu);
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_palette), palette_menu);
+
+	/* ... and finally assign callbacks to menuitems */
+	g_signal_connect(G_OBJECT(item_new_tab), "activate", G_CALLBACK(sakura_new_tab), win);
+	g_signal_connect(G_OBJECT(item_set_name), "activate", G_CALLBACK(sakura_set_name_dialog), win);
+	g_signal_connect(G_OBJECT(item_search), "activate", G_CALLBACK(sakura_search_dialog), win);
+	g_signal_connect(G_OBJECT(item_close_tab), "activate", G_CALLBACK(sakura_close_tab), win);
+	g_signal_connect(G_OBJECT(item_select_font), "activate", G_CALLBACK(sakura_font_dialog), win);
+	g_signal_connect(G_OBJECT(item_select_background), "activate", G_CALLBACK(sakura_select_background_dialog), win);
+	g_signal_connect(G_OBJECT(item_copy), "activate", G_CALLBACK(sakura_copy), win);
+	g_signal_connect(G_OBJECT(item_paste), "activate", G_CALLBACK(sakura_paste), win);
+	g_signal_connect(G_OBJECT(item_select_colors), "activate", G_CALLBACK(sakura_color_dialog), win);
+
+	g_signal_connect(G_OBJECT(item_show_first_tab), "activate", G_CALLBACK(sakura_show_first_tab), win);
+	g_signal_connect(G_OBJECT(item_tabs_on_bottom), "activate", G_CALLBACK(sakura_tabs_on_bottom), win);
+	g_signal_connect(G_OBJECT(item_less_questions), "activate", G_CALLBACK(sakura_less_questions), win);
+	g_signal_connect(G_OBJECT(item_show_close_button), "activate", G_CALLBACK(sakura_show_close_button), win);
+	g_signal_connect(G_OBJECT(item_toggle_scrollbar), "activate", G_CALLBACK(sakura_show_scrollbar), win);
+	g_signal_connect(G_OBJECT(item_toggle_resize_grip), "activate", G_CALLBACK(sakura_show_resize_grip), win);
+	g_signal_connect(G_OBJECT(item_urgent_bell), "activate", G_CALLBACK(sakura_urgent_bell), win);
+	g_signal_connect(G_OBJECT(item_audible_bell), "activate", G_CALLBACK(sakura_audible_bell), win);
+	g_signal_connect(G_OBJECT(item_visible_bell), "activate", G_CALLBACK(sakura_visible_bell), win);
+	g_signal_connect(G_OBJECT(item_blinking_cursor), "activate", G_CALLBACK(sakura_blinking_cursor), win);
+	g_signal_connect(G_OBJECT(item_allow_bold), "activate", G_CALLBACK(sakura_allow_bold), win);
+	g_signal_connect(G_OBJECT(item_disable_numbered_tabswitch),
+			"activate", G_CALLBACK(sakura_disable_numbered_tabswitch), win);
+	g_signal_connect(G_OBJECT(item_use_fading), "activate", G_CALLBACK(sakura_use_fading), win);
+	g_signal_connect(G_OBJECT(item_set_title), "activate", G_CALLBACK(sakura_set_title_dialog), win);
+	g_signal_connect(G_OBJECT(item_stats), "activate", G_CALLBACK(sakura_stats_dialog), win);
+	g_signal_connect(G_OBJECT(item_cursor_block), "activate", G_CALLBACK(sakura_set_cursor), "block");
+	g_signal_connect(G_OBJECT(item_cursor_underline), "activate", G_CALLBACK(sakura_set_cursor), "underline");
+	g_signal_connect(G_OBJECT(item_cursor_ibeam), "activate", G_CALLBACK(sakura_set_cursor), "ibeam");
+	g_signal_connect(G_OBJECT(item_palette_tango), "activate", G_CALLBACK(sakura_set_palette), "tango");
+	g_signal_connect(G_OBJECT(item_palette_linux), "activate", G_CALLBACK(sakura_set_palette), "linux");
+	g_signal_connect(G_OBJECT(item_palette_xterm), "activate", G_CALLBACK(sakura_set_palette), "xterm");
+	g_signal_connect(G_OBJECT(item_palette_solarized_dark), "activate", G_CALLBACK(sakura_set_palette), "solarized_dark");
+	g_signal_connect(G_OBJECT(item_palette_solarized_light), "activate", G_CALLBACK(sakura_set_palette), "solarized_light");
+
+	g_signal_connect(G_OBJECT(win->item_open_link), "activate", G_CALLBACK(sakura_open_url), win);
+	g_signal_connect(G_OBJECT(win->item_copy_link), "activate", G_CALLBACK(sakura_copy_url), win);
+	g_signal_connect(G_OBJECT(win->item_clear_background), "activate", G_CALLBACK(sakura_clear), win);
+	g_signal_connect(G_OBJECT(item_fullscreen), "activate", G_CALLBACK(sakura_fullscreen), win);
+
+
+	gtk_widget_show_all(win->menu);
+
+	/* We don't want to see this if there's no background image */
+	if (!sakura.background) {
+		gtk_widget_hide(win->item_clear_background);
+	}
+}
+
+
+static void
+sakura_destroy(struct window *win)
+{
+	/* We're called both explicitly and from the window "destroy" signal */
+	if (!g_list_find(sakura.windows, win))
+		return;
+
+	SAY("Destroying window");
+	sakura.windows = g_list_remove(sakura.windows, win);
+
+	/* Delete all existing tabs */
+	while (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)) >= 1) {
+		sakura_del_tab(win, -1);
+	}
+
+	sakura_search_close(win);
+	g_signal_handlers_disconnect_matched(G_OBJECT(win->main_window), G_SIGNAL_MATCH_DATA, 0, 0, NULL, NULL, win);
+	gtk_widget_destroy(win->main_window);
+	gtk_widget_destroy(win->menu);
+
+	g_free(win->argv[0]);
+	g_free(win->argv[1]);
+	g_free(win->title);
+	g_free(win->cwd);
+	g_strfreev(win->envv);
+	g_free(win);
+
+	/* Other windows are still being served */
+	if (sakura.windows)
+		return;
+
+	SAY("Destroying sakura");
+
+	sakura_server_stop();
+	sakura_control_stop();
+	sakura_config_done();
+	sakura_log_done();
+
+	if (sakura.cfg)
+		g_key_file_free(sakura.cfg);
+
+	pango_font_description_free(sakura.font);
+	g_hash_table_destroy(sakura.bindings);
+
+	if (sakura.background)
+		free(sakura.background);
+
+	free(sakura.configfile);
+
+	gtk_main_quit();
+
+}
+
+
+static void
+sakura_set_size(struct window *win)
+{
+	struct terminal *term;
+	gint pad_x, pad_y;
+	gint char_width, char_height;
+	guint npages;
+	gint min_width, natural_width;
+	gint page;
+	gint64 t = sakura_trace_now();
+
+
+	/* Measured on the tab being shown, other ones can still be placeholders */
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
+	sakura_tab_materialize(term);
+	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+
+	/* Mayhaps an user resize happened. Check if row and columns have changed */
+	if (win->resized) {
+		win->columns=vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+		win->rows=vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+		SAY("New columns %ld and rows %ld", win->columns, win->rows);
+		win->resized=FALSE;
+	}
+
+	gtk_widget_style_get(term->vte, "inner-border", &term->border, NULL);
+	pad_x = term->border->left + term->border->right;
+	pad_y = term->border->top + term->border->bottom;
+	SAY("padding x %d y %d", pad_x, pad_y);
+	char_width = vte_terminal_get_char_width(VTE_TERMINAL(term->vte));
+	char_height = vte_terminal_get_char_height(VTE_TERMINAL(term->vte));
+
+	win->width = pad_x + (char_width * win->columns);
+	win->height = pad_y + (char_height * win->rows);
+
+	if (npages>=2 || sakura.first_tab) {
+		//gint min_height, natural_height;
+		//gtk_widget_get_preferred_height(win->notebook, &min_height, &natural_height);
+		//SAY("NOTEBOOK min height %d natural height %d", min_height, natural_height);
+		/* Deprecated. TODO: Remove
+		guint16 hb, vb;
+		hb=gtk_notebook_get_tab_hborder(GTK_NOTEBOOK(win->notebook));
+		vb=gtk_notebook_get_tab_vborder(GTK_NOTEBOOK(win->notebook));
+		SAY("notebook borders h %d v %d", hb, vb);*/
+
+		/* TODO: Yeah i know, this is utterly shit. Remove this ugly hack and set geometry hints*/
+		if (!sakura.show_scrollbar)
+			//win->height += min_height - 10;
+			win->height += 10;
+		else
+			//win->height += min_height - 47;
+			win->height += 47;
+
+		win->width += 8;
+		win->width += /* (hb*2)+*/ (pad_x*2);
+	}
+
+	gtk_widget_get_preferred_width(term->scrollbar, &min_width, &natural_width);
+	SAY("SCROLLBAR min width %d natural width %d", min_width, natural_width);
+	if(sakura.show_scrollbar) {
+		win->width += min_width;
+	}
+
+	/* GTK does not ignore resize for maximized windows on some systems,
+	so we do need check if it's maximized or not */
+	GdkWindow *gdk_window = gtk_widget_get_window(GTK_WIDGET(win->main_window));
+	if(gdk_window != NULL) {
+		if(gdk_window_get_state(gdk_window) & GDK_WINDOW_STATE_MAXIMIZED) {
+			SAY("window is maximized, will not resize");
+			sakura_trace_add("set_size", t);
+			return;
+		}
+	}
+
+	gtk_window_resize(GTK_WINDOW(win->main_window), win->width, win->height);
+	SAY("RESIZED TO %d %d", win->width, win->height);
+	sakura_trace_add("set_size", t);
+}
+
+
+static void
+sakura_set_size_all(void)
+{
+	GList *l;
+
+	for (l = sakura.windows; l; l = l->next)
+		sakura_set_size((struct window *)l->data);
+}
+
+
+static void
+sakura_set_font()
+{
+	struct window *win;
+	gint n_pages;
+	struct terminal *term;
+	GList *l;
+	int i;
+
+	/* Set the font for all tabs of all windows */
+	for (l = sakura.windows; l; l = l->next) {
+		win = (struct window *)l->data;
+		n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+		for (i = (n_pages - 1); i >= 0; i--) {
+			term = sakura_get_page_term(win, i);
+			if (sakura_term_defer(win, term, APPLY_FONT))
+				vte_terminal_set_font(VTE_TERMINAL(term->vte), sakura.font);
+		}
+	}
+}
+
+
+static void
+sakura_move_tab(struct window *win, gint direction)
+{
+	gint page, n_pages;
+	GtkWidget *child;
+
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+	child=gtk_notebook_get_nth_page(GTK_NOTEBOOK(win->notebook), page);
+
+	if (direction==FORWARD) {
+		if (page!=n_pages-1)
+			gtk_notebook_reorder_child(GTK_NOTEBOOK(win->notebook), child, page+1);
+	} else {
+		if (page!=0)
+			gtk_notebook_reorder_child(GTK_NOTEBOOK(win->notebook), child, page-1);
+	}
+}
+
+
+/* Tab registry. Terminals are found by id, vte widget or child pid without
+ * walking the notebooks; page numbers are only for showing them */
+static void
+sakura_term_register(struct terminal *term)
+{
+	/* Placeholders are registered again when they get their vte and child */
+	if (!term->id) {
+		term->id = ++sakura.next_term_id;
+		g_hash_table_insert(sakura.terms, GUINT_TO_POINTER(term->id), term);
+	}
+	if (term->vte)
+		g_hash_table_insert(sakura.terms_by_vte, term->vte, term);
+	if (term->pid > 0)
+		g_hash_table_insert(sakura.terms_by_pid, GINT_TO_POINTER(term->pid), term);
+}
+
+
+/* Called when its page is destroyed */
+static void
+sakura_term_free(struct terminal *term)
+{
+	g_hash_table_remove(sakura.terms, GUINT_TO_POINTER(term->id));
+	if (term->vte)
+		g_hash_table_remove(sakura.terms_by_vte, term->vte);
+	if (term->pid > 0 && g_hash_table_lookup(sakura.terms_by_pid, GINT_TO_POINTER(term->pid)) == term)
+		g_hash_table_remove(sakura.terms_by_pid, GINT_TO_POINTER(term->pid));
+	sakura_proc_forget(term);
+	if (term->flow_fd >= 0)
+		close(term->flow_fd);
+	sakura_cgroup_detach(term);
+	sakura_log_detach(term);
+	if (term->trigger_timeout)
+		g_source_remove(term->trigger_timeout);
+	g_free(term->proc.cwd);
+	g_free(term->cwd);
+	if (term->search_idle)
+		g_source_remove(term->search_idle);
+	if (term->search_blocks)
+		g_ptr_array_free(term->search_blocks, TRUE);
+	g_free(term->label_text);
+	g_free(term->spawn_cwd);
+	g_free(term);
+}
+
+
+static struct terminal *
+sakura_term_by_id(guint id)
+{
+	return g_hash_table_lookup(sakura.terms, GUINT_TO_POINTER(id));
+}
+
+
+static struct terminal *
+sakura_term_by_vte(VteTerminal *vte)
+{
+	return g_hash_table_lookup(sakura.terms_by_vte, vte);
+}
+
+
+static struct terminal *
+sakura_term_by_pid(GPid pid)
+{
+	return g_hash_table_lookup(sakura.terms_by_pid, GINT_TO_POINTER(pid));
+}
+
+
+/* Returns the updates in apply the terminal has to do now. If its tab is
+ * hidden, the deferrable ones are left for sakura_switch_page */
+static guint
+sakura_term_defer(struct window *win, struct terminal *term, guint apply)
+{
+	/* The notebook only has its current page child visible */
+	if (gtk_widget_get_child_visible(term->hbox))
+		return apply;
+
+	term->pending |= apply & APPLY_DEFERRABLE;
+	return apply & ~APPLY_DEFERRABLE;
+}
+
+
+static void
+sakura_set_tab_label_text(struct terminal *term, const gchar *title)
+{
+	GString *chopped_title;
+	glong len;
+
+	if ( (title!=NULL) && (g_strcmp0(title, "") !=0) ) {
+		/* Chop to max size, in characters. TODO: Should it be configurable by the user? */
+		len = g_utf8_strlen(title, -1);
+		chopped_title = g_string_new_len(title, g_utf8_offset_to_pointer(title, MIN(len, TAB_MAX_SIZE)) - title);
+		/* Honor the minimum tab label size */
+		while (len++ < TAB_MIN_SIZE)
+			g_string_append_c(chopped_title, ' ');
+		/* Don't relayout the tabs for nothing */
+		if (g_strcmp0(chopped_title->str, gtk_label_get_text(GTK_LABEL(term->label))))
+			gtk_label_set_text(GTK_LABEL(term->label), chopped_title->str);
+		g_string_free(chopped_title, TRUE);
+	} else { /* Use the default values */
+		gtk_label_set_text(GTK_LABEL(term->label), term->label_text);
+	}
+}
+
+
+static void
+sakura_add_tab(struct window *win)
+{
+	sakura_add_tab_full(win, NULL, NULL, NULL, false, NULL);
+}
+
+
+/* The tabs asked for in the command line. Only the first one is shown, so the
+ * rest are placeholders until they are */
+static void
+sakura_add_tabs(struct window *win, gint ntabs)
+{
+	gint i;
+
+	for (i=0; i<ntabs; i++)
+		sakura_add_tab_full(win, NULL, NULL, NULL, true, NULL);
+
+	/* Low priority idles run after the window has been drawn */
+	if (ntabs > 1 && sakura.spawn_hidden_tabs)
+		g_idle_add_full(G_PRIORITY_LOW, sakura_materialize_idle, NULL, NULL);
+}
+
+
+/* Create the vte of a tab and its scrollbar */
+static void
+sakura_term_create_vte(struct terminal *term)
+{
+	term->vte=vte_terminal_new();
+
+	/* Init vte */
+	sakura_links_register(term);
+	vte_terminal_set_mouse_autohide(VTE_TERMINAL(term->vte), TRUE);
+
+	term->scrollbar=gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, vte_terminal_get_adjustment(VTE_TERMINAL(term->vte)));
+
+	gtk_box_pack_start(GTK_BOX(term->hbox), term->vte, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(term->hbox), term->scrollbar, FALSE, FALSE, 0);
+
+	/* vte signals */
+	g_signal_connect(G_OBJECT(term->vte), "beep", G_CALLBACK(sakura_beep), term);
+	g_signal_connect(G_OBJECT(term->vte), "increase-font-size", G_CALLBACK(sakura_increase_font), term);
+	g_signal_connect(G_OBJECT(term->vte), "decrease-font-size", G_CALLBACK(sakura_decrease_font), term);
+	g_signal_connect(G_OBJECT(term->vte), "child-exited", G_CALLBACK(sakura_child_exited), term);
+	g_signal_connect(G_OBJECT(term->vte), "eof", G_CALLBACK(sakura_eof), term);
+	g_signal_connect(G_OBJECT(term->vte), "window-title-changed", G_CALLBACK(sakura_title_changed), term);
+	g_signal_connect(G_OBJECT(term->vte), "current-directory-uri-changed", G_CALLBACK(sakura_cwd_changed), term);
+	g_signal_connect(G_OBJECT(term->vte), "button-press-event", G_CALLBACK(sakura_button_press), term);
+	g_signal_connect(G_OBJECT(term->vte), "contents-changed", G_CALLBACK(sakura_contents_changed), term);
+	g_signal_connect(G_OBJECT(vte_terminal_get_adjustment(VTE_TERMINAL(term->vte))), "changed",
+	                 G_CALLBACK(sakura_links_screen_changed), term);
+}
+
+
+/* Configuration for a newly created vte */
+static void
+sakura_term_configure(struct terminal *term)
+{
+	GdkRGBA white={255, 255, 255, 1};
+	GdkPixbuf *pixbuf;
+
+	vte_terminal_set_color_background_rgba(VTE_TERMINAL (term->vte), &white);
+	vte_terminal_set_backspace_binding(VTE_TERMINAL(term->vte), VTE_ERASE_ASCII_DELETE);
+	sakura_set_term_colors(term->win, term);
+
+	if (sakura.background) {
+		pixbuf = gdk_pixbuf_new_from_file(sakura.background, NULL);
+		if (pixbuf) {
+			vte_terminal_set_background_image(VTE_TERMINAL(term->vte), pixbuf);
+			g_object_unref(pixbuf);
+		}
+	}
+
+	sakura_set_term_options(term);
+}
+
+
+/* Give a placeholder tab its vte and start its shell */
+static void
+sakura_tab_materialize(struct terminal *term)
+{
+	struct window *win = term->win;
+	gint64 t = sakura_trace_now();
+
+	if (term->vte)
+		return;
+
+	win->keep_fc=true;
+
+	sakura_term_create_vte(term);
+	vte_terminal_set_font(VTE_TERMINAL(term->vte), sakura.font);
+	gtk_widget_show_all(term->hbox);
+	if (!sakura.show_scrollbar) {
+		gtk_widget_hide(term->scrollbar);
+	}
+
+	sakura_spawn(term, term->spawn_cwd, win->argv, win->envv, G_SPAWN_SEARCH_PATH|G_SPAWN_FILE_AND_ARGV_ZERO, NULL);
+	g_free(term->spawn_cwd);
+	term->spawn_cwd=NULL;
+
+	sakura_term_register(term);
+	sakura_term_configure(term);
+	/* Font and colors are up to date now */
+	term->pending &= ~(APPLY_FONT|APPLY_COLORS);
+
+	win->keep_fc=false;
+	sakura_trace_add("materialize_tab", t);
+}
+
+
+/* spawn_hidden_tabs: materialize the placeholders, one per idle */
+static gboolean
+sakura_materialize_idle(gpointer data)
+{
+	GHashTableIter iter;
+	gpointer term;
+
+	g_hash_table_iter_init(&iter, sakura.terms);
+	while (g_hash_table_iter_next(&iter, NULL, &term)) {
+		if (!((struct terminal *)term)->vte) {
+			sakura_tab_materialize(term);
+			return G_SOURCE_CONTINUE;
+		}
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Add a tab running argv in cwd with envv. NULL means the defaults: the shell,
+ * the directory of the current tab and the environment of the window. A lazy
+ * tab that isn't the first one is only a placeholder until it's shown */
+static struct terminal *
+sakura_add_tab_full(struct window *win, const char *spawn_cwd, char **argv, char **envv, bool lazy, GError **error)
+{
+	struct terminal *term;
+	GtkWidget *tab_hbox;
+	GtkWidget *close_button;
+	int index;
+	int npages;
+	gchar *cwd = spawn_cwd ? g_strdup(spawn_cwd) : NULL;
+	/* The shell goes with its own argv[0], given commands are looked up in PATH */
+	char **spawn_argv = argv ? argv : win->argv;
+	GSpawnFlags spawn_flags = argv ? G_SPAWN_SEARCH_PATH : G_SPAWN_SEARCH_PATH|G_SPAWN_FILE_AND_ARGV_ZERO;
+	gchar *label_text = _("Terminal %d");
+	gint64 t_tab = sakura_trace_now(), t;
+
+
+	term = g_new0( struct terminal, 1 );
+	term->last_active = g_get_monotonic_time();
+	term->proc.pidfd = -1;
+	term->flow_fd = -1;
+	term->hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+
+	/* Create label for tabs */
+	term->label_set_byuser=false;
+
+	term->colorset=sakura.last_colorset-1;
+
+	/* appling tab title pattern from config (https://answers.launchpad.net/sakura/+question/267951) */
+	if(sakura.tab_default_title != NULL) {
+		label_text = sakura.tab_default_title;
+		term->label_set_byuser = true;
+	}
+
+	term->label_text=g_strdup_printf(label_text, win->label_count++);
+	term->label=gtk_label_new(term->label_text);
+
+	tab_hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
+	gtk_box_pack_start(GTK_BOX(tab_hbox), term->label, FALSE, FALSE, 0);
+
+	/* If the tab close button is enabled, create and add it to the tab */
+	if (sakura.show_closebutton) {
+		close_button=gtk_button_new();
+		/* adding scroll-event to button, to propagate it to notebook (fix for scroll event until pointer above the button) */
+		gtk_widget_add_events(close_button, GDK_SCROLL_MASK);
+
+		gtk_widget_set_name(close_button, "closebutton");
+		gtk_button_set_relief(GTK_BUTTON(close_button), GTK_RELIEF_NONE);
+
+		GtkWidget *image=gtk_image_new_from_icon_name("window-close", GTK_ICON_SIZE_MENU);
+		gtk_container_add (GTK_CONTAINER (close_button), image);
+		gtk_box_pack_start(GTK_BOX(tab_hbox), close_button, FALSE, FALSE, 0);
+	}
+
+	if (sakura.tabs_on_bottom) {
+		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(win->notebook), GTK_POS_BOTTOM);
+	}
+
+	gtk_widget_show_all(tab_hbox);
+
+	/* Select the directory to use for the new tab */
+	index = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	if(index >= 0) {
+		struct terminal *prev_term;
+		prev_term = sakura_get_page_term(win, index );
+		if (!cwd)
+			cwd = sakura_get_term_cwd( prev_term );
+
+		term->colorset = prev_term->colorset;
+	}
+	if (!cwd)
+		cwd = g_strdup(win->cwd);
+
+	/* Keep values when adding tabs */
+	win->keep_fc=true;
+
+	if ((index=gtk_notebook_append_page(GTK_NOTEBOOK(win->notebook), term->hbox, tab_hbox))==-1) {
+		sakura_error(win, "Cannot create a new tab");
+		exit(1);
+	}
+
+	gtk_notebook_set_tab_reorderable(GTK_NOTEBOOK(win->notebook), term->hbox, TRUE);
+	// TODO: Set group id to support detached tabs
+	// gtk_notebook_set_tab_detachable(GTK_NOTEBOOK(win->notebook), term->hbox, TRUE);
+
+	term->win = win;
+	sakura_set_page_term(win, index, term );
+
+	/* Notebook signals */
+	g_signal_connect(G_OBJECT(win->notebook), "page-removed", G_CALLBACK(sakura_page_removed), win);
+	if (sakura.show_closebutton) {
+		g_signal_connect(G_OBJECT(close_button), "clicked", G_CALLBACK(sakura_closebutton_clicked), term);
+	}
+
+	npages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+
+	/* Placeholder: the vte is created and the shell started by sakura_tab_materialize */
+	if (lazy && npages > 1) {
+		term->spawn_cwd = cwd;
+		gtk_widget_show_all(term->hbox);
+		if (npages==2) {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), TRUE);
+			sakura_set_size(win);
+		}
+		sakura_term_register(term);
+		win->keep_fc=false;
+		sakura_trace_add("add_placeholder_tab", t_tab);
+		return term;
+	}
+
+	sakura_term_create_vte(term);
+
+	/* Every tab of the window gets the environment of the process that asked for it */
+	char **command_env = envv ? envv : win->envv;
+	/* First tab */
+	if (npages == 1) {
+		if (sakura.first_tab) {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), TRUE);
+		} else {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), FALSE);
+		}
+
+		gtk_notebook_set_show_border(GTK_NOTEBOOK(win->notebook), FALSE);
+		vte_terminal_set_font(VTE_TERMINAL(term->vte), sakura.font);
+		/* Set size before showing the widgets but after setting the font */
+		sakura_set_size(win);
+
+		gtk_widget_show_all(win->notebook);
+		if (!sakura.show_scrollbar) {
+			gtk_widget_hide(term->scrollbar);
+		}
+
+		if (option_geometry) {
+			if (!gtk_window_parse_geometry(GTK_WINDOW(win->main_window), option_geometry)) {
+				fprintf(stderr, "Invalid geometry.\n");
+				gtk_widget_show(win->main_window);
+			} else {
+				gtk_widget_show(win->main_window);
+				win->columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+				win->rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+			}
+		} else {
+            gtk_widget_show(win->main_window);
+		}
+
+		/* Set WINDOWID env variable */
+		GdkWindow *gwin = gtk_widget_get_window (win->main_window);
+		if (gwin != NULL) {
+			guint winid = gdk_x11_window_get_xid (gwin);
+			gchar *winidstr = g_strdup_printf ("0x%x", winid);
+			win->envv = g_environ_setenv(win->envv, "WINDOWID", winidstr, FALSE);
+			command_env = win->envv;
+			g_free (winidstr);
+		}
+
+		int command_argc=0; char **command_argv;
+		if (option_execute||option_xterm_execute) {
+			GError *gerror = NULL;
+			gchar *path;
+
+			if(option_execute) {
+				/* -x option */
+				if (!g_shell_parse_argv(option_execute, &command_argc, &command_argv, &gerror)) {
+					switch (gerror->code) {
+						case G_SHELL_ERROR_EMPTY_STRING:
+							sakura_error(win, "Empty exec string");
+							exit(1);
+							break;
+						case G_SHELL_ERROR_BAD_QUOTING:
+							sakura_error(win, "Cannot parse command line arguments: mangled quoting");
+							exit(1);
+							break;
+						case G_SHELL_ERROR_FAILED:
+							sakura_error(win, "Error in exec option command line arguments");
+							exit(1);
+					}
+					g_error_free(gerror);
+				}
+			} else {
+				/* -e option - last in the command line, takes all extra arguments */
+				if (option_xterm_args) {
+					gchar *command_joined;
+					command_joined = g_strjoinv(" ", option_xterm_args);
+					if (!g_shell_parse_argv(command_joined, &command_argc, &command_argv, &gerror)) {
+						switch (gerror->code) {
+							case G_SHELL_ERROR_EMPTY_STRING:
+								sakura_error(win, "Empty exec string");
+								exit(1);
+								break;
+							case G_SHELL_ERROR_BAD_QUOTING:
+								sakura_error(win, "Cannot parse command line arguments: mangled quoting");
+								exit(1);
+							case G_SHELL_ERROR_FAILED:
+								sakura_error(win, "Error in exec option command line arguments");
+								exit(1);
+						}
+					}
+					g_error_free(gerror);
+					g_free(command_joined);
+				}
+			}
+
+			/* Check if the command is valid */
+			if (command_argc > 0) {
+				path=g_find_program_in_path(command_argv[0]);
+				if (path) {
+					t = sakura_trace_now();
+					if (!sakura_spawn(term, NULL, command_argv, command_env, G_SPAWN_SEARCH_PATH, &gerror)) {
+						SAY("error: %s", gerror->message);
+					}
+					sakura_trace_add("fork_command", t);
+				} else {
+					sakura_error(win, "%s command not found", command_argv[0]);
+					command_argc=0;
+					//exit(1);
+				}
+				free(path);
+				g_strfreev(command_argv); g_strfreev(option_xterm_args);
+				option_xterm_args=NULL;
+			}
+		} // else { /* No execute option */
+
+		/* Only fork if there is no execute option or if it has failed */
+		if ( (!option_execute && !option_xterm_args) || (command_argc==0)) {
+			if (win->hold) {
+				sakura_error(win, "Hold option given without any command");
+				win->hold=FALSE;
+			}
+			t = sakura_trace_now();
+			sakura_spawn(term, cwd, spawn_argv, command_env, spawn_flags, error);
+			sakura_trace_add("fork_command", t);
+		}
+	/* Not the first tab */
+	} else {
+		vte_terminal_set_font(VTE_TERMINAL(term->vte), sakura.font);
+		gtk_widget_show_all(term->hbox);
+		if (!sakura.show_scrollbar) {
+			gtk_widget_hide(term->scrollbar);
+		}
+
+		if (npages==2) {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), TRUE);
+			sakura_set_size(win);
+		}
+		/* Call set_current page after showing the widget: gtk ignores this
+		 * function in the window is not visible *sigh*. Gtk documentation
+		 * says this is for "historical" reasons. Me arse */
+		gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook), index);
+		t = sakura_trace_now();
+		sakura_spawn(term, cwd, spawn_argv, command_env, spawn_flags, error);
+		sakura_trace_add("fork_command", t);
+	}
+
+	free(cwd);
+
+	/* Registered once its child pid is known */
+	sakura_term_register(term);
+
+	/* Configuration for the newly created terminal */
+	sakura_term_configure(term);
+
+	/* FIXME: Possible race here. Find some way to force to process all configure
+	 * events before setting keep_fc again to false */
+	win->keep_fc=false;
+
+	sakura_trace_add("add_tab", t_tab);
+
+	return term;
+}
+
+
+/* Terminal options from the config, for new terminals and config reloads */
+static void
+sakura_set_term_options(struct terminal *term)
+{
+	/* Without a budget the timer leaves the tabs alone, forget what it gave */
+	if (sakura.scrollback_budget <= 0 && term->scroll_limit) {
+		term->scroll_limit = 0;
+		gtk_widget_set_tooltip_text(term->label, NULL);
+	}
+	vte_terminal_set_scrollback_lines(VTE_TERMINAL(term->vte), sakura_scrollback_lines(term));
+
+	if (sakura.word_chars) {
+		vte_terminal_set_word_chars( VTE_TERMINAL (term->vte), sakura.word_chars );
+	}
+
+	/* Get rid of these nasty bells */
+	vte_terminal_set_audible_bell (VTE_TERMINAL(term->vte), sakura.audible_bell ? TRUE : FALSE);
+	vte_terminal_set_visible_bell (VTE_TERMINAL(term->vte), sakura.visible_bell ? TRUE : FALSE);
+
+	/* Disable stupid blinking cursor */
+	vte_terminal_set_cursor_blink_mode (VTE_TERMINAL(term->vte), sakura.blinking_cursor ? VTE_CURSOR_BLINK_ON : VTE_CURSOR_BLINK_OFF);
+
+	/* Enable bold text by default */
+	vte_terminal_set_allow_bold (VTE_TERMINAL(term->vte), sakura.allow_bold ? TRUE : FALSE);
+
+	/* Change cursor */
+	vte_terminal_set_cursor_shape (VTE_TERMINAL(term->vte), sakura.cursor_type);
+}
+
+
+/* Estimated bytes per row in vte's buffers */
+static gint64
+sakura_term_row_size(struct terminal *term)
+{
+	return vte_terminal_get_column_count(VTE_TERMINAL(term->vte)) * SCROLLBACK_CELL_SIZE + SCROLLBACK_ROW_SIZE;
+}
+
+
+/* Rows in the scrollback, besides the screen */
+static gint
+sakura_term_scrollback_used(struct terminal *term)
+{
+	GtkAdjustment *adj = vte_terminal_get_adjustment(VTE_TERMINAL(term->vte));
+	gint used;
+
+	used = (gint)(gtk_adjustment_get_upper(adj) - gtk_adjustment_get_lower(adj))
+		- vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+	return MAX(used, 0);
+}
+
+
+/* Scrollback of a tab: what the budget gave it, never more than scroll_lines */
+static gint
+sakura_scrollback_lines(struct terminal *term)
+{
+	if (sakura.scrollback_budget <= 0 || term->scroll_limit <= 0)
+		return sakura.scroll_lines;
+
+	return MIN(term->scroll_limit, sakura.scroll_lines);
+}
+
+
+/* 2 for the tab being looked at, 1 for the current tab of an unfocused window,
+ * 0 for the rest */
+static gint
+sakura_scrollback_rank(struct terminal *term)
+{
+	gint page = gtk_notebook_get_current_page(GTK_NOTEBOOK(term->win->notebook));
+	struct terminal *current;
+
+	current = sakura_get_page_term(term->win, page);
+	if (current != term)
+		return 0;
+
+	return term->win->focused ? 2 : 1;
+}
+
+
+static gint
+sakura_scrollback_compare(gconstpointer a, gconstpointer b)
+{
+	struct terminal *x = *(struct terminal **)a, *y = *(struct terminal **)b;
+	gint rx = sakura_scrollback_rank(x), ry = sakura_scrollback_rank(y);
+
+	if (rx != ry)
+		return ry - rx;
+
+	/* Most recently active first */
+	return (y->last_active > x->last_active) - (y->last_active < x->last_active);
+}
+
+
+/* Memory pressure from the kernel PSI, "some avg10" in percent. 0 when the
+ * kernel doesn't have it */
+static gdouble
+sakura_memory_pressure(void)
+{
+	gchar *contents, *avg;
+	gdouble some = 0;
+
+	if (!g_file_get_contents("/proc/pressure/memory", &contents, NULL, NULL))
+		return 0;
+
+	if (g_str_has_prefix(contents, "some") && (avg = strstr(contents, "avg10=")))
+		some = g_ascii_strtod(avg + strlen("avg10="), NULL);
+
+	g_free(contents);
+	return some;
+}
+
+
+/* Share scrollback_budget among the tabs. Every tab keeps SCROLLBACK_MIN_LINES,
+ * what's left goes to the shown tabs first and then to the most recently
+ * active ones, so idle background tabs are the ones trimmed. The budget
+ * shrinks while the system is under memory pressure and grows back slowly.
+ * Also keeps the per tab usage in the label tooltips up to date */
+static gboolean
+sakura_scrollback_rebalance(gpointer data)
+{
+	GHashTableIter iter;
+	GPtrArray *terms;
+	struct terminal *term;
+	gint64 budget = 0, floor_lines, row_size, give;
+	gint lines, used;
+	guint i;
+
+	if (sakura.scrollback_budget <= 0)
+		return G_SOURCE_CONTINUE;
+
+	if (sakura_memory_pressure() > SCROLLBACK_PRESSURE)
+		sakura.scrollback_scale = MAX(sakura.scrollback_scale * 0.75, 0.125);
+	else
+		sakura.scrollback_scale = MIN(sakura.scrollback_scale + 0.05, 1.0);
+	budget = (gint64)(sakura.scrollback_budget * sakura.scrollback_scale * 1024 * 1024);
+
+	terms = g_ptr_array_new();
+	g_hash_table_iter_init(&iter, sakura.terms);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&term)) {
+		if (term->vte)	/* Placeholders have no scrollback */
+			g_ptr_array_add(terms, term);
+	}
+	g_ptr_array_sort(terms, sakura_scrollback_compare);
+
+	floor_lines = MIN(SCROLLBACK_MIN_LINES, sakura.scroll_lines);
+	for (i=0; i<terms->len; i++) {
+		term = g_ptr_array_index(terms, i);
+		budget -= floor_lines * sakura_term_row_size(term);
+	}
+
+	for (i=0; i<terms->len; i++) {
+		gchar *tip, *old;
+
+		term = g_ptr_array_index(terms, i);
+		row_size = sakura_term_row_size(term);
+
+		give = MIN((sakura.scroll_lines - floor_lines) * row_size, MAX(budget, 0));
+		budget -= give;
+		lines = floor_lines + give / row_size;
+		if (lines != term->scroll_limit) {
+			term->scroll_limit = lines;
+			vte_terminal_set_scrollback_lines(VTE_TERMINAL(term->vte), lines);
+		}
+
+		/* Setting the same tooltip again still makes gtk update it */
+		used = sakura_term_scrollback_used(term);
+		tip = g_strdup_printf(_("Scrollback: %d of %d lines, %.1f MB"), used,
+				sakura_scrollback_lines(term), (gdouble)used * row_size / (1024 * 1024));
+		old = gtk_widget_get_tooltip_text(term->label);
+		if (g_strcmp0(tip, old) != 0)
+			gtk_widget_set_tooltip_text(term->label, tip);
+		g_free(old); g_free(tip);
+	}
+
+	g_ptr_array_free(terms, TRUE);
+	return G_SOURCE_CONTINUE;
+}
+
+
+static void
+sakura_contents_changed(GtkWidget *widget, void *data)
+{
+	struct terminal *term = data;
+
+	term->last_active = g_get_monotonic_time();
+	if (sakura.search_indexing)
+		sakura_search_index_schedule(term);
+	if (sakura.triggers)
+		sakura_triggers_schedule(term);
+}
+
+
+/* Link matchers. They are compiled once and shared by all the terminals,
+ * which register them in the same order, so a vte match tag is an index in
+ * sakura.links */
+static const struct {
+	const char *name;
+	const char *regex;
+	const char *command;
+} link_builtins[] = {
+	{ "url", HTTP_REGEXP, NULL },
+	{ "email", "\\b[[:alnum:]._%+-]+@[[:alnum:]-]+(\\.[[:alnum:]-]+)*\\.[[:alpha:]]{2,}\\b", "xdg-open mailto:%s" },
+	{ "path", "(?<=^|[\\s'\"=:(])(~|\\.{1,2})?(/[-[:alnum:]._+~]+)+/?", "xdg-open %s" },
+	{ "sha", "\\b[0-9a-f]{7,40}\\b", NULL },
+	{ "ip", "\\b((25[0-5]|2[0-4][0-9]|1?[0-9]?[0-9])\\.){3}(25[0-5]|2[0-4][0-9]|1?[0-9]?[0-9])(:[0-9]+)?\\b", NULL },
+};
+
+
+static void
+sakura_link_free(gpointer data)
+{
+	struct link *link = data;
+
+	g_free(link->name);
+	g_regex_unref(link->regex);
+	g_free(link->command);
+	g_free(link);
+}
+
+
+static struct link *
+sakura_link_named(GPtrArray *links, const char *name)
+{
+	guint i;
+
+	for (i=0; i<links->len; i++) {
+		if (strcmp(((struct link *)g_ptr_array_index(links, i))->name, name)==0)
+			return g_ptr_array_index(links, i);
+	}
+	return NULL;
+}
+
+
+/* Add a matcher, or replace the regex of the one with that name */
+static void
+sakura_link_add(GPtrArray *links, const char *name, const char *pattern, const char *command)
+{
+	struct link *link;
+	GRegex *regex;
+	GError *gerror=NULL;
+
+	/* OPTIMIZE studies the pattern, or JIT compiles it with PCRE2 */
+	regex = g_regex_new(pattern, G_REGEX_OPTIMIZE | (strcmp(name, "url")==0 ? G_REGEX_CASELESS : 0),
+	                    G_REGEX_MATCH_NOTEMPTY, &gerror);
+	if (!regex) {
+		fprintf(stderr, "Invalid link pattern %s: %s\n", name, gerror->message);
+		g_error_free(gerror);
+		return;
+	}
+
+	link = sakura_link_named(links, name);
+	if (link) {
+		g_regex_unref(link->regex);
+	} else {
+		link = g_new0(struct link, 1);
+		link->name = g_strdup(name);
+		link->command = g_strdup(command);
+		g_ptr_array_add(links, link);
+	}
+	link->regex = regex;
+}
+
+
+/* Build the matchers from link_matchers and link_patterns, and register them
+ * again in every terminal */
+static void
+sakura_links_compile()
+{
+	GPtrArray *links, *old = sakura.links;
+	struct link *link;
+	struct terminal *term;
+	GHashTableIter iter;
+	gchar **names, **lines, **line, *value, *name;
+	GList *l;
+	guint i, j, pass;
+
+	links = g_ptr_array_new_with_free_func(sakura_link_free);
+
+	names = g_strsplit(sakura.link_matchers ? sakura.link_matchers : "", ",", 0);
+	for (i=0; names[i]; i++) {
+		g_strstrip(names[i]);
+		if (names[i][0]=='\0')
+			continue;
+		for (j=0; j<G_N_ELEMENTS(link_builtins); j++) {
+			if (strcmp(link_builtins[j].name, names[i])==0)
+				break;
+		}
+		if (j < G_N_ELEMENTS(link_builtins))
+			sakura_link_add(links, link_builtins[j].name, link_builtins[j].regex, link_builtins[j].command);
+		else
+			fprintf(stderr, "Unknown link matcher \"%s\"\n", names[i]);
+	}
+	g_strfreev(names);
+
+	/* Patterns first, the .open lines may come before them */
+	lines = g_strsplit(sakura.link_patterns ? sakura.link_patterns : "", "\n", 0);
+	for (pass=0; pass<2; pass++) {
+		for (line=lines; *line; line++) {
+			if (!(value = strchr(*line, '=')))
+				continue;
+			name = g_strstrip(g_strndup(*line, value - *line));
+			if (pass==0 && *name && !g_str_has_suffix(name, ".open")) {
+				sakura_link_add(links, name, value+1, NULL);
+			} else if (pass==1 && g_str_has_suffix(name, ".open")) {
+				name[strlen(name) - strlen(".open")] = '\0';
+				if ((link = sakura_link_named(links, name))) {
+					g_free(link->command);
+					link->command = g_strstrip(g_strdup(value+1));
+				} else {
+					fprintf(stderr, "No link pattern for %s.open\n", name);
+				}
+			}
+			g_free(name);
+		}
+	}
+	g_strfreev(lines);
+
+	sakura.links = links;
+	if (sakura.terms) {
+		g_hash_table_iter_init(&iter, sakura.terms);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&term)) {
+			if (term->vte)
+				sakura_links_register(term);
+		}
+	}
+
+	/* vte keeps its own references to the regexes */
+	if (old) {
+		for (l = sakura.windows; l; l = l->next)
+			((struct window *)l->data)->current_link = NULL;
+		g_ptr_array_free(old, TRUE);
+	}
+}
+
+
+static void
+sakura_links_register(struct terminal *term)
+{
+	guint i;
+
+	vte_terminal_match_clear_all(VTE_TERMINAL(term->vte));
+	if (term->links_off)
+		return;
+	for (i=0; i<sakura.links->len; i++)
+		vte_terminal_match_add_gregex(VTE_TERMINAL(term->vte), ((struct link *)g_ptr_array_index(sakura.links, i))->regex, 0);
+}
+
+
+/* vte 0.34 doesn't tell when the alternate screen is in use, but it has no
+ * scrollback: a terminal that had some and now shows only the screen is
+ * running a full screen program, if the shell isn't in the foreground. With
+ * the shell there the history was cleared instead. Links in the alternate
+ * screen are mostly noise, and every pointer motion would look for them */
+static void
+sakura_links_screen_changed(GtkAdjustment *adj, void *data)
+{
+	struct terminal *term = data;
+	bool alternate;
+
+	if (gtk_adjustment_get_upper(adj) - gtk_adjustment_get_lower(adj) > vte_terminal_get_row_count(VTE_TERMINAL(term->vte))) {
+		term->had_history = true;
+		alternate = false;
+	} else {
+		alternate = term->had_history && sakura_proc_running(term);
+		if (!alternate)
+			term->had_history = false;
+	}
+
+	if (alternate != term->links_off) {
+		term->links_off = alternate;
+		sakura_links_register(term);
+	}
+}
+
+
+static bool
+sakura_link_opens(const struct link *link)
+{
+	return link->command || strcmp(link->name, "url")==0;
+}
+
+
+/* Run the command of a matcher, in the directory of the current tab */
+static void
+sakura_link_open(struct window *win, const struct link *link, const char *match)
+{
+	struct terminal *term;
+	GError *gerror=NULL;
+	gchar **parts, *quoted, *cmd, **argv=NULL, *cwd;
+	gint page, argc;
+
+	quoted = g_shell_quote(match);
+	parts = g_strsplit(link->command, "%s", 0);
+	cmd = g_strjoinv(quoted, parts);
+	g_strfreev(parts);
+	g_free(quoted);
+
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
+	cwd = sakura_get_term_cwd(term);
+
+	if (!g_shell_parse_argv(cmd, &argc, &argv, &gerror) ||
+	    !g_spawn_async(cwd, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, &gerror)) {
+		sakura_error(win, "Couldn't exec \"%s\": %s", cmd, gerror->message);
+		g_error_free(gerror);
+	}
+	if (argv)
+		g_strfreev(argv);
+	g_free(cwd);
+	g_free(cmd);
+}
+
+
+/* Scrollback search. Rows are copied to an index as they scroll into the
+ * history, once, in low priority idles. The index is made of blocks of rows
+ * with a bloom filter of their trigrams, so literal searches only scan the
+ * blocks that can have a match. Searches run on worker threads, one per tab,
+ * over references to the blocks: filled blocks never change, and a block
+ * being searched isn't appended to */
+struct search_block {
+	gint ref;
+	glong first_row;
+	guint rows;
+	GString *text;				/* The rows, each ended by '\n' */
+	guint64 bloom[SEARCH_BLOOM_BITS/64];
+};
+
+struct search_match {
+	guint term_id;
+	glong row;
+	gchar *text;
+};
+
+/* A search running on a tab */
+struct search_job {
+	guint term_id;
+	GRegex *regex;
+	gchar *literal;				/* Trigrams checked against the blooms, NULL for regexes */
+	bool caseless;
+	GPtrArray *blocks;
+	GArray *matches;			/* struct search_match, most recent first */
+};
+
+/* State of the search dialog of a window */
+struct search {
+	struct window *win;
+	GtkWidget *dialog, *entry, *all_tabs, *use_regex, *status;
+	GtkListStore *results;
+	GCancellable *cancellable;	/* Of the searches of the last pattern */
+	guint timeout;
+	guint running;				/* Jobs not finished, the dialog may be gone */
+	guint matches;
+	gint64 start;
+};
+
+enum { SEARCH_COLUMN_TAB, SEARCH_COLUMN_TEXT, SEARCH_COLUMN_TERM, SEARCH_COLUMN_ROW, SEARCH_COLUMNS };
+
+
+static struct search_block *
+sakura_search_block_new(glong first_row)
+{
+	struct search_block *block = g_new0(struct search_block, 1);
+
+	block->ref = 1;
+	block->first_row = first_row;
+	block->text = g_string_new(NULL);
+	return block;
+}
+
+
+static struct search_block *
+sakura_search_block_ref(struct search_block *block)
+{
+	g_atomic_int_inc(&block->ref);
+	return block;
+}
+
+
+static void
+sakura_search_block_unref(gpointer data)
+{
+	struct search_block *block = data;
+
+	if (g_atomic_int_dec_and_test(&block->ref)) {
+		g_string_free(block->text, TRUE);
+		g_free(block);
+	}
+}
+
+
+static guint
+sakura_search_trigram(const guchar *p)
+{
+	guint32 t = (guint32)(guchar)g_ascii_tolower(p[0]) << 16 | (guint32)(guchar)g_ascii_tolower(p[1]) << 8 |
+	            (guchar)g_ascii_tolower(p[2]);
+
+	return (t * 2654435761u) >> (32 - 13);	/* log2(SEARCH_BLOOM_BITS) */
+}
+
+
+/* Add a row to a block, and its trigrams to the bloom filter */
+static void
+sakura_search_block_add(struct search_block *block, const char *text, gsize len)
+{
+	const guchar *p = (const guchar *)text;
+	guint bit;
+	gsize i;
+
+	for (i=0; i+2<len; i++) {
+		bit = sakura_search_trigram(p+i);
+		block->bloom[bit/64] |= G_GUINT64_CONSTANT(1) << (bit%64);
+	}
+	g_string_append_len(block->text, text, len);
+	g_string_append_c(block->text, '\n');
+	block->rows++;
+}
+
+
+/* Could the block have the literal? Case folding is ASCII only, so when
+ * ignoring case trigrams with other bytes don't tell anything */
+static bool
+sakura_search_block_may_match(struct search_block *block, const char *literal, bool caseless)
+{
+	const guchar *p = (const guchar *)literal;
+	guint bit;
+	gsize i, len = strlen(literal);
+
+	for (i=0; i+2<len; i++) {
+		if (caseless && (p[i] >= 0x80 || p[i+1] >= 0x80 || p[i+2] >= 0x80))
+			continue;
+		bit = sakura_search_trigram(p+i);
+		if (!(block->bloom[bit/64] & (G_GUINT64_CONSTANT(1) << (bit%64))))
+			return false;
+	}
+	return true;
+}
+
+
+/* Text of a row, without its newline and trailing blanks */
+static void
+sakura_search_add_row(struct search_block *block, struct terminal *term, glong row)
+{
+	glong columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+	char *text;
+	gsize len;
+
+	text = vte_terminal_get_text_range(VTE_TERMINAL(term->vte), row, 0, row, columns-1, NULL, NULL, NULL);
+	len = text ? strlen(text) : 0;
+	while (len > 0 && g_ascii_isspace(text[len-1]))
+		len--;
+	sakura_search_block_add(block, text ? text : "", len);
+	g_free(text);
+}
+
+
+/* Index the rows that went into the history since the last run, a chunk at a time */
+static gboolean
+sakura_search_index_idle(gpointer data)
+{
+	struct terminal *term = data;
+	struct search_block *block;
+	GtkAdjustment *adj;
+	glong lower, history, end;
+	GList *l;
+
+	if (!term->vte) {
+		term->search_idle = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	adj = vte_terminal_get_adjustment(VTE_TERMINAL(term->vte));
+	lower = gtk_adjustment_get_lower(adj);
+	history = gtk_adjustment_get_upper(adj) - vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+
+	if (!term->search_blocks)
+		term->search_blocks = g_ptr_array_new_with_free_func(sakura_search_block_unref);
+
+	/* The terminal was reset */
+	if (term->search_row > history) {
+		g_ptr_array_set_size(term->search_blocks, 0);
+		term->search_row = 0;
+	}
+	term->search_row = MAX(term->search_row, lower);
+
+	/* Drop what fell out of the scrollback */
+	while (term->search_blocks->len > 0) {
+		block = g_ptr_array_index(term->search_blocks, 0);
+		if (block->first_row + (glong)block->rows > lower)
+			break;
+		g_ptr_array_remove_index(term->search_blocks, 0);
+	}
+
+	end = MIN(history, term->search_row + SEARCH_INDEX_CHUNK);
+	block = term->search_blocks->len ? g_ptr_array_index(term->search_blocks, term->search_blocks->len-1) : NULL;
+	for (; term->search_row < end; term->search_row++) {
+		if (!block || block->rows >= SEARCH_BLOCK_ROWS || g_atomic_int_get(&block->ref) > 1 ||
+		    block->first_row + (glong)block->rows != term->search_row) {
+			block = sakura_search_block_new(term->search_row);
+			g_ptr_array_add(term->search_blocks, block);
+		}
+		sakura_search_add_row(block, term, term->search_row);
+	}
+
+	if (term->search_row < history) {
+		term->search_behind = true;
+		return G_SOURCE_CONTINUE;
+	}
+
+	term->search_idle = 0;
+	if (term->search_behind) {
+		term->search_behind = false;
+		/* Results shown didn't have all of it */
+		for (l = sakura.windows; l; l = l->next) {
+			struct window *win = l->data;
+			if (win->search)
+				g_signal_emit_by_name(win->search->entry, "changed");
+		}
+	}
+	return G_SOURCE_REMOVE;
+}
+
+
+static void
+sakura_search_index_schedule(struct terminal *term)
+{
+	if (!term->search_idle && term->vte)
+		term->search_idle = g_idle_add_full(G_PRIORITY_LOW, sakura_search_index_idle, term, NULL);
+}
+
+
+/* Worker thread side: match the regex against every line of the blocks */
+static void
+sakura_search_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+	struct search_job *job = data;
+	struct search_block *block;
+	struct search_match match;
+	GMatchInfo *info;
+	GArray *found;
+	const char *text, *line, *eol;
+	glong row;
+	gint start, end, i, j;
+
+	found = g_array_new(FALSE, FALSE, sizeof(struct search_match));
+	for (i = job->blocks->len-1; i >= 0 && job->matches->len < SEARCH_MAX_RESULTS; i--) {
+		if (g_cancellable_is_cancelled(cancellable))
+			break;
+
+		block = g_ptr_array_index(job->blocks, i);
+		if (job->literal && !sakura_search_block_may_match(block, job->literal, job->caseless))
+			continue;
+
+		text = block->text->str;
+		line = text;
+		row = block->first_row;
+		g_array_set_size(found, 0);
+		while (g_regex_match_full(job->regex, text, block->text->len, line - text, 0, &info, NULL)) {
+			g_match_info_fetch_pos(info, 0, &start, &end);
+			g_match_info_free(info);
+			info = NULL;
+			/* Find the row of the match, and go on from the next one */
+			for (; (eol = strchr(line, '\n')) && eol < text + start; line = eol + 1)
+				row++;
+			if (!eol)
+				break;
+			match.term_id = job->term_id;
+			match.row = row;
+			match.text = g_strndup(line, eol - line);
+			g_array_append_val(found, match);
+			line = eol + 1;
+			row++;
+			if (*line == '\0')
+				break;
+		}
+		g_match_info_free(info);
+
+		for (j = found->len-1; j >= 0 && job->matches->len < SEARCH_MAX_RESULTS; j--)
+			g_array_append_val(job->matches, g_array_index(found, struct search_match, j));
+		for (; j >= 0; j--)
+			g_free(g_array_index(found, struct search_match, j).text);
+	}
+	g_array_free(found, TRUE);
+
+	g_task_return_boolean(task, TRUE);
+}
+
+
+static void
+sakura_search_job_free(gpointer data)
+{
+	struct search_job *job = data;
+	guint i;
+
+	for (i=0; i<job->matches->len; i++)
+		g_free(g_array_index(job->matches, struct search_match, i).text);
+	g_array_free(job->matches, TRUE);
+	g_ptr_array_free(job->blocks, TRUE);
+	g_regex_unref(job->regex);
+	g_free(job->literal);
+	g_free(job);
+}
+
+
+static void
+sakura_search_set_status(struct search *search)
+{
+	gchar *status;
+
+	status = g_strdup_printf(_("%u matches in %.1f ms%s"), search->matches,
+			(g_get_monotonic_time() - search->start) / 1000.0,
+			search->running ? _(", searching...") : "");
+	gtk_label_set_text(GTK_LABEL(search->status), status);
+	g_free(status);
+}
+
+
+static void
+sakura_search_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+	struct search *search = data;
+	struct search_job *job = g_task_get_task_data(G_TASK(result));
+	struct search_match *match;
+	struct terminal *term;
+	GtkTreeIter iter;
+	guint i;
+
+	search->running--;
+
+	/* The dialog was closed, or the pattern changed */
+	if (!search->dialog) {
+		if (!search->running)
+			g_free(search);
+		return;
+	}
+	if (g_cancellable_is_cancelled(g_task_get_cancellable(G_TASK(result))))
+		return;
+
+	term = sakura_term_by_id(job->term_id);
+	for (i=0; term && i<job->matches->len; i++) {
+		match = &g_array_index(job->matches, struct search_match, i);
+		gtk_list_store_append(search->results, &iter);
+		gtk_list_store_set(search->results, &iter,
+				SEARCH_COLUMN_TAB, gtk_label_get_text(GTK_LABEL(term->label)),
+				SEARCH_COLUMN_TEXT, match->text,
+				SEARCH_COLUMN_TERM, match->term_id,
+				SEARCH_COLUMN_ROW, match->row, -1);
+		search->matches++;
+	}
+	sakura_search_set_status(search);
+}
+
+
+/* Snapshot the index and the screen of a tab, and search them on a worker thread */
+static void
+sakura_search_tab(struct search *search, struct terminal *term, GRegex *regex, const char *literal, bool caseless)
+{
+	struct search_job *job;
+	struct search_block *screen;
+	GtkAdjustment *adj;
+	glong row, upper;
+	GTask *task;
+	guint i;
+
+	if (!term->vte)
+		return;
+
+	/* Whatever the idle didn't get to yet is left for the rerun */
+	sakura_search_index_schedule(term);
+
+	job = g_new0(struct search_job, 1);
+	job->term_id = term->id;
+	job->regex = g_regex_ref(regex);
+	job->literal = g_strdup(literal);
+	job->caseless = caseless;
+	job->matches = g_array_new(FALSE, FALSE, sizeof(struct search_match));
+	job->blocks = g_ptr_array_new_with_free_func(sakura_search_block_unref);
+	for (i=0; term->search_blocks && i<term->search_blocks->len; i++)
+		g_ptr_array_add(job->blocks, sakura_search_block_ref(g_ptr_array_index(term->search_blocks, i)));
+
+	/* The screen rows still change, so they're copied */
+	adj = vte_terminal_get_adjustment(VTE_TERMINAL(term->vte));
+	upper = gtk_adjustment_get_upper(adj);
+	row = upper - vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
+	screen = sakura_search_block_new(row);
+	for (; row < upper; row++)
+		sakura_search_add_row(screen, term, row);
+	g_ptr_array_add(job->blocks, screen);
+
+	task = g_task_new(NULL, search->cancellable, sakura_search_done, search);
+	g_task_set_task_data(task, job, sakura_search_job_free);
+	g_task_run_in_thread(task, sakura_search_thread);
+	g_object_unref(task);
+	search->running++;
+}
+
+
+static bool
+sakura_search_has_upper(const char *text)
+{
+	for (; *text; text = g_utf8_next_char(text)) {
+		if (g_unichar_isupper(g_utf8_get_char(text)))
+			return true;
+	}
+	return false;
+}
+
+
+/* Start searching the pattern in the entry. Matching ignores case unless
+ * the pattern has uppercase letters */
+static gboolean
+sakura_search_start(gpointer data)
+{
+	struct search *search = data;
+	struct terminal *term;
+	GHashTableIter iter;
+	GRegex *regex;
+	GError *gerror = NULL;
+	const char *pattern;
+	gchar *escaped = NULL;
+	bool caseless, use_regex;
+	gint page;
+
+	search->timeout = 0;
+	if (search->cancellable) {
+		g_cancellable_cancel(search->cancellable);
+		g_object_unref(search->cancellable);
+		search->cancellable = NULL;
+	}
+	gtk_list_store_clear(search->results);
+	search->matches = 0;
+
+	pattern = gtk_entry_get_text(GTK_ENTRY(search->entry));
+	if (*pattern == '\0') {
+		gtk_label_set_text(GTK_LABEL(search->status), "");
+		return G_SOURCE_REMOVE;
+	}
+
+	use_regex = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(search->use_regex));
+	caseless = !sakura_search_has_upper(pattern);
+	if (!use_regex)
+		escaped = g_regex_escape_string(pattern, -1);
+	regex = g_regex_new(escaped ? escaped : pattern, G_REGEX_OPTIMIZE | G_REGEX_MULTILINE |
+			(caseless ? G_REGEX_CASELESS : 0), 0, &gerror);
+	g_free(escaped);
+	if (!regex) {
+		gtk_label_set_text(GTK_LABEL(search->status), gerror->message);
+		g_error_free(gerror);
+		return G_SOURCE_REMOVE;
+	}
+
+	search->cancellable = g_cancellable_new();
+	search->start = g_get_monotonic_time();
+	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(search->all_tabs))) {
+		g_hash_table_iter_init(&iter, sakura.terms);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&term))
+			sakura_search_tab(search, term, regex, use_regex ? NULL : pattern, caseless);
+	} else {
+		page = gtk_notebook_get_current_page(GTK_NOTEBOOK(search->win->notebook));
+		term = sakura_get_page_term(search->win, page);
+		sakura_search_tab(search, term, regex, use_regex ? NULL : pattern, caseless);
+	}
+	g_regex_unref(regex);
+	sakura_search_set_status(search);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+/* Incremental search: wait for a pause in the typing */
+static void
+sakura_search_changed(GtkWidget *widget, void *data)
+{
+	struct search *search = data;
+
+	if (search->timeout)
+		g_source_remove(search->timeout);
+	search->timeout = g_timeout_add(SEARCH_DELAY, sakura_search_start, search);
+}
+
+
+/* Show the row of a result */
+static void
+sakura_search_activated(GtkTreeView *view, GtkTreePath *path, GtkTreeViewColumn *column, void *data)
+{
+	struct search *search = data;
+	struct terminal *term;
+	GtkTreeIter iter;
+	GtkAdjustment *adj;
+	guint id;
+	glong row;
+	gdouble value;
+
+	if (!gtk_tree_model_get_iter(GTK_TREE_MODEL(search->results), &iter, path))
+		return;
+	gtk_tree_model_get(GTK_TREE_MODEL(search->results), &iter, SEARCH_COLUMN_TERM, &id, SEARCH_COLUMN_ROW, &row, -1);
+
+	term = sakura_term_by_id(id);
+	if (!term || !term->vte)
+		return;
+
+	gtk_notebook_set_current_page(GTK_NOTEBOOK(term->win->notebook),
+			gtk_notebook_page_num(GTK_NOTEBOOK(term->win->notebook), term->hbox));
+	gtk_window_present(GTK_WINDOW(term->win->main_window));
+
+	/* The row in the middle of the screen, if the scrollback still has it */
+	adj = vte_terminal_get_adjustment(VTE_TERMINAL(term->vte));
+	value = row - vte_terminal_get_row_count(VTE_TERMINAL(term->vte)) / 2;
+	value = CLAMP(value, gtk_adjustment_get_lower(adj), gtk_adjustment_get_upper(adj) - gtk_adjustment_get_page_size(adj));
+	gtk_adjustment_set_value(adj, value);
+}
+
+
+static void
+sakura_search_destroyed(GtkWidget *widget, void *data)
+{
+	struct search *search = data;
+
+	if (search->timeout)
+		g_source_remove(search->timeout);
+	if (search->cancellable) {
+		g_cancellable_cancel(search->cancellable);
+		g_object_unref(search->cancellable);
+	}
+	g_object_unref(search->results);
+	search->win->search = NULL;
+	search->dialog = NULL;
+
+	/* The running jobs still point to it */
+	if (!search->running)
+		g_free(search);
+}
+
+
+static void
+sakura_search_close(struct window *win)
+{
+	if (win->search)
+		gtk_widget_destroy(win->search->dialog);
+}
+
+
+/* Search the scrollback of the current tab or of all of them. The dialog isn't
+ * modal, results can be clicked while it's open */
+static void
+sakura_search_dialog(GtkWidget *widget, void *data)
+{
+	struct window *win = (struct window *)data;
+	struct search *search;
+	struct terminal *term;
+	GHashTableIter iter;
+	GtkWidget *box, *options, *scrolled, *view;
+	GtkCellRenderer *renderer;
+
+	if (win->search) {
+		gtk_window_present(GTK_WINDOW(win->search->dialog));
+		return;
+	}
+
+	/* From now on the tabs keep their index up to date */
+	if (!sakura.search_indexing) {
+		sakura.search_indexing = true;
+		g_hash_table_iter_init(&iter, sakura.terms);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&term))
+			sakura_search_index_schedule(term);
+	}
+
+	search = g_new0(struct search, 1);
+	search->win = win;
+	win->search = search;
+
+	search->dialog = gtk_dialog_new_with_buttons(_("Search"), GTK_WINDOW(win->main_window),
+	                                             GTK_DIALOG_DESTROY_WITH_PARENT,
+	                                             _("_Close"), GTK_RESPONSE_CLOSE, NULL);
+	gtk_window_set_default_size(GTK_WINDOW(search->dialog), 640, 400);
+
+	/* Set style */
+	gchar *css = g_strdup_printf (HIG_DIALOG_CSS);
+	gtk_css_provider_load_from_data(sakura.provider, css, -1, NULL);
+	GtkStyleContext *context = gtk_widget_get_style_context (search->dialog);
+	gtk_style_context_add_provider (context, GTK_STYLE_PROVIDER (sakura.provider), GTK_STYLE_PROVIDER_PRIORITY_APPLICATION);
+	g_free(css);
+
+	box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 6);
+	search->entry = gtk_entry_new();
+	options = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 12);
+	search->all_tabs = gtk_check_button_new_with_label(_("All tabs"));
+	search->use_regex = gtk_check_button_new_with_label(_("Regular expression"));
+	search->status = gtk_label_new(NULL);
+	gtk_box_pack_start(GTK_BOX(options), search->all_tabs, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(options), search->use_regex, FALSE, FALSE, 0);
+	gtk_box_pack_end(GTK_BOX(options), search->status, FALSE, FALSE, 0);
+
+	search->results = gtk_list_store_new(SEARCH_COLUMNS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_UINT, G_TYPE_LONG);
+	view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(search->results));
+	renderer = gtk_cell_renderer_text_new();
+	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1, _("Tab"), renderer, "text", SEARCH_COLUMN_TAB, NULL);
+	gtk_tree_view_insert_column_with_attributes(GTK_TREE_VIEW(view), -1, _("Text"), renderer, "text", SEARCH_COLUMN_TEXT, NULL);
+	scrolled = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scrolled), view);
+
+	gtk_box_pack_start(GTK_BOX(box), search->entry, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(box), options, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(box), scrolled, TRUE, TRUE, 0);
+	gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(search->dialog))), box, TRUE, TRUE, 12);
+
+	g_signal_connect(G_OBJECT(search->entry), "changed", G_CALLBACK(sakura_search_changed), search);
+	g_signal_connect(G_OBJECT(search->all_tabs), "toggled", G_CALLBACK(sakura_search_changed), search);
+	g_signal_connect(G_OBJECT(search->use_regex), "toggled", G_CALLBACK(sakura_search_changed), search);
+	g_signal_connect(G_OBJECT(view), "row-activated", G_CALLBACK(sakura_search_activated), search);
+	g_signal_connect(G_OBJECT(search->dialog), "response", G_CALLBACK(gtk_widget_destroy), NULL);
+	g_signal_connect(G_OBJECT(search->dialog), "destroy", G_CALLBACK(sakura_search_destroyed), search);
+
+	gtk_widget_show_all(search->dialog);
+}
+
+
+/* Output triggers. The patterns of the triggers setting are matched against
+ * the rows printed in every tab: the literals with an Aho-Corasick automaton
+ * and the regexes with an alternation of all of them, so the cost doesn't
+ * grow with the number of triggers. Regexes with backreferences, which
+ * would refer to the wrong group there, are matched on their own. Rows are read from vte on the main loop
+ * at most TRIGGER_CHUNK per TRIGGER_INTERVAL and tab, and matched in a worker
+ * thread. A trigger fires once per row */
+enum trigger_action {
+	TRIGGER_MARK = 1<<0,		/* Bold label until the tab is shown */
+	TRIGGER_HIGHLIGHT = 1<<1,	/* Red label until the tab is shown */
+	TRIGGER_NOTIFY = 1<<2		/* Desktop notification and urgency hint */
+};
+
+static const struct {
+	const char *name;
+	guint action;
+} trigger_actions[] = {
+	{ "mark", TRIGGER_MARK },
+	{ "highlight", TRIGGER_HIGHLIGHT },
+	{ "notify", TRIGGER_NOTIFY },
+};
+
+struct trigger {
+	gchar *pattern;
+	GRegex *regex;				/* NULL for literals */
+	guint actions;
+};
+
+/* Compiled triggers, shared with the workers */
+struct triggers {
+	gint ref;
+	GPtrArray *list;			/* struct trigger, bit i of the masks is the ith */
+	guint32 (*delta)[256];		/* Automaton of the literals, state 0 is the root */
+	guint64 *output;			/* Literals ending at each state */
+	guint states;
+	GRegex *any;				/* Alternation of the regexes, NULL without them */
+	guint64 alone;				/* Regexes left out of it, matched on each line */
+};
+
+struct trigger_job {
+	guint term_id;
+	struct triggers *triggers;
+	gchar *text;
+	glong first_row, last_row;
+	guint64 fired;				/* Already fired for first_row */
+	GArray *masks;				/* guint64 per line of text */
+	GArray *rows;				/* glong per line, the row it ends on */
+};
+
+
+static void
+sakura_trigger_free(gpointer data)
+{
+	struct trigger *trigger = data;
+
+	g_free(trigger->pattern);
+	if (trigger->regex)
+		g_regex_unref(trigger->regex);
+	g_free(trigger);
+}
+
+
+static struct triggers *
+sakura_triggers_ref(struct triggers *triggers)
+{
+	g_atomic_int_inc(&triggers->ref);
+	return triggers;
+}
+
+
+static void
+sakura_triggers_unref(struct triggers *triggers)
+{
+	if (!triggers || !g_atomic_int_dec_and_test(&triggers->ref))
+		return;
+
+	g_ptr_array_free(triggers->list, TRUE);
+	g_free(triggers->delta);
+	g_free(triggers->output);
+	if (triggers->any)
+		g_regex_unref(triggers->any);
+	g_free(triggers);
+}
+
+
+/* Goto function of the literals as a trie, then turned into a full
+ * transition table following the failure links breadth first */
+static void
+sakura_triggers_automaton(struct triggers *triggers)
+{
+	struct trigger *trigger;
+	guint *fail, *queue, head = 0, tail = 0;
+	guint i, s, t, c, size = 1;
+	const guchar *p;
+
+	for (i=0; i<triggers->list->len; i++) {
+		trigger = g_ptr_array_index(triggers->list, i);
+		if (!trigger->regex)
+			size += strlen(trigger->pattern);
+	}
+	triggers->delta = g_malloc0(sizeof(*triggers->delta) * size);
+	triggers->output = g_new0(guint64, size);
+	triggers->states = 1;
+
+	for (i=0; i<triggers->list->len; i++) {
+		trigger = g_ptr_array_index(triggers->list, i);
+		if (trigger->regex)
+			continue;
+		for (s=0, p=(const guchar *)trigger->pattern; *p; p++) {
+			if (!triggers->delta[s][*p])
+				triggers->delta[s][*p] = triggers->states++;
+			s = triggers->delta[s][*p];
+		}
+		triggers->output[s] |= G_GUINT64_CONSTANT(1) << i;
+	}
+
+	fail = g_new0(guint, triggers->states);
+	queue = g_new(guint, triggers->states);
+	queue[tail++] = 0;
+	while (head < tail) {
+		s = queue[head++];
+		for (c=0; c<256; c++) {
+			t = triggers->delta[s][c];
+			if (t) {
+				fail[t] = s ? triggers->delta[fail[s]][c] : 0;
+				triggers->output[t] |= triggers->output[fail[t]];
+				queue[tail++] = t;
+			} else if (s) {
+				triggers->delta[s][c] = triggers->delta[fail[s]][c];
+			}
+		}
+	}
+	g_free(fail);
+	g_free(queue);
+}
+
+
+/* Build the triggers from the triggers setting, ACTIONS=TEXT or
+ * ACTIONS=/REGEX/ lines, ACTIONS being a comma separated list */
+static void
+sakura_triggers_compile()
+{
+	struct triggers *triggers;
+	struct trigger *trigger;
+	GString *any = NULL;
+	GError *gerror=NULL;
+	gchar **lines, **line, **names, *value, *pattern;
+	guint actions, i, j;
+	gsize len;
+
+	sakura_triggers_unref(sakura.triggers);
+	sakura.triggers = NULL;
+
+	lines = g_strsplit(sakura.trigger_patterns ? sakura.trigger_patterns : "", "\n", 0);
+	triggers = g_new0(struct triggers, 1);
+	triggers->ref = 1;
+	triggers->list = g_ptr_array_new_with_free_func(sakura_trigger_free);
+
+	for (line=lines; *line; line++) {
+		if (!(value = strchr(*line, '=')) || value[1] == '\0')
+			continue;
+		if (triggers->list->len == TRIGGER_MAX) {
+			fprintf(stderr, "Only %d triggers can be used\n", TRIGGER_MAX);
+			break;
+		}
+
+		actions = 0;
+		names = g_strsplit(*line, ",", 0);
+		for (i=0; names[i]; i++) {
+			/* The last one ends at the = */
+			if ((pattern = strchr(names[i], '=')))
+				*pattern = '\0';
+			g_strstrip(names[i]);
+			for (j=0; j<G_N_ELEMENTS(trigger_actions); j++) {
+				if (strcmp(trigger_actions[j].name, names[i])==0)
+					actions |= trigger_actions[j].action;
+			}
+			if (pattern)
+				break;
+		}
+		g_strfreev(names);
+		if (!actions) {
+			fprintf(stderr, "No trigger action in \"%s\"\n", *line);
+			continue;
+		}
+
+		trigger = g_new0(struct trigger, 1);
+		trigger->actions = actions;
+		value++;
+		len = strlen(value);
+		if (len > 2 && value[0] == '/' && value[len-1] == '/') {
+			trigger->pattern = g_strndup(value+1, len-2);
+			trigger->regex = g_regex_new(trigger->pattern, G_REGEX_OPTIMIZE, 0, &gerror);
+			if (!trigger->regex) {
+				fprintf(stderr, "Invalid trigger /%s/: %s\n", trigger->pattern, gerror->message);
+				g_clear_error(&gerror);
+				sakura_trigger_free(trigger);
+				continue;
+			}
+			if (g_regex_get_max_backref(trigger->regex) > 0) {
+				triggers->alone |= G_GUINT64_CONSTANT(1) << triggers->list->len;
+			} else {
+				if (!any)
+					any = g_string_new(NULL);
+				g_string_append_printf(any, "%s(?:%s)", any->len ? "|" : "", trigger->pattern);
+			}
+		} else {
+			trigger->pattern = g_strdup(value);
+		}
+		g_ptr_array_add(triggers->list, trigger);
+	}
+	g_strfreev(lines);
+
+	if (!triggers->list->len) {
+		sakura_triggers_unref(triggers);
+		return;
+	}
+
+	sakura_triggers_automaton(triggers);
+	/* Valid regexes can still clash, with the same group names */
+	if (any) {
+		triggers->any = g_regex_new(any->str, G_REGEX_OPTIMIZE|G_REGEX_MULTILINE, 0, &gerror);
+		if (!triggers->any) {
+			fprintf(stderr, "Trigger regexes matched one by one, they can't be combined: %s\n", gerror->message);
+			g_clear_error(&gerror);
+			for (i=0; i<triggers->list->len; i++) {
+				trigger = g_ptr_array_index(triggers->list, i);
+				if (trigger->regex)
+					triggers->alone |= G_GUINT64_CONSTANT(1) << i;
+			}
+		}
+		g_string_free(any, TRUE);
+	}
+	sakura.triggers = triggers;
+}
+
+
+/* Worker thread side: the mask of triggers matching each line */
+static void
+sakura_triggers_thread(GTask *task, gpointer source, gpointer data, GCancellable *cancellable)
+{
+	struct trigger_job *job = data;
+	struct triggers *triggers = job->triggers;
+	struct trigger *trigger;
+	GMatchInfo *info;
+	const guchar *p;
+	guint64 mask = 0, *masks;
+	gchar *line, **lines;
+	const gchar *text = job->text, *start, *end, *counted = job->text;
+	gint s, e, n = 0;
+	guint32 state = 0;
+	gboolean matched;
+	guint i;
+
+	for (p=(const guchar *)text; *p; p++) {
+		if (*p == '\n') {
+			g_array_append_val(job->masks, mask);
+			mask = 0;
+			state = 0;
+			continue;
+		}
+		state = triggers->delta[state][*p];
+		mask |= triggers->output[state];
+	}
+	g_array_append_val(job->masks, mask);
+	masks = (guint64 *)job->masks->data;
+
+	/* Lines matching any regex are matched again against each of them */
+	s = 0;
+	while (triggers->any) {
+		matched = g_regex_match_full(triggers->any, text, -1, s, 0, &info, NULL);
+		if (matched)
+			g_match_info_fetch_pos(info, 0, &s, &e);
+		g_match_info_free(info);
+		if (!matched)
+			break;
+		for (start = text + s; start > text && start[-1] != '\n'; start--)
+			;
+		end = strchr(text + s, '\n');
+		if (!end)
+			end = text + strlen(text);
+		for (; counted < start; counted++)
+			n += *counted == '\n';
+
+		line = g_strndup(start, end - start);
+		for (i=0; i<triggers->list->len; i++) {
+			trigger = g_ptr_array_index(triggers->list, i);
+			if (trigger->regex && !(triggers->alone & (G_GUINT64_CONSTANT(1) << i)) &&
+			    g_regex_match(trigger->regex, line, 0, NULL))
+				masks[n] |= G_GUINT64_CONSTANT(1) << i;
+		}
+		g_free(line);
+
+		if (!*end)
+			break;
+		s = end + 1 - text;
+	}
+
+	if (triggers->alone) {
+		lines = g_strsplit(text, "\n", 0);
+		for (n=0; lines[n]; n++) {
+			for (i=0; i<triggers->list->len; i++) {
+				trigger = g_ptr_array_index(triggers->list, i);
+				if ((triggers->alone & (G_GUINT64_CONSTANT(1) << i)) && g_regex_match(trigger->regex, lines[n], 0, NULL))
+					masks[n] |= G_GUINT64_CONSTANT(1) << i;
+			}
+		}
+		g_strfreev(lines);
+	}
+
+	g_task_return_boolean(task, TRUE);
+}
+
+
+static void
+sakura_trigger_job_free(gpointer data)
+{
+	struct trigger_job *job = data;
+
+	sakura_triggers_unref(job->triggers);
+	g_free(job->text);
+	g_array_free(job->masks, TRUE);
+	g_array_free(job->rows, TRUE);
+	g_free(job);
+}
+
+
+/* Bold or red label of a tab with triggers fired while it wasn't shown */
+static void
+sakura_trigger_label(struct terminal *term, guint actions)
+{
+	PangoAttrList *attrs;
+
+	term->trigger_actions = actions;
+	if (!actions) {
+		gtk_label_set_attributes(GTK_LABEL(term->label), NULL);
+		return;
+	}
+
+	attrs = pango_attr_list_new();
+	pango_attr_list_insert(attrs, pango_attr_weight_new(PANGO_WEIGHT_BOLD));
+	if (actions & TRIGGER_HIGHLIGHT)
+		pango_attr_list_insert(attrs, pango_attr_foreground_new(0xcccc, 0, 0));
+	gtk_label_set_attributes(GTK_LABEL(term->label), attrs);
+	pango_attr_list_unref(attrs);
+}
+
+
+static void
+sakura_trigger_fire(struct terminal *term, struct triggers *triggers, guint64 mask)
+{
+	struct trigger *trigger;
+	struct window *win = term->win;
+	gint64 now = g_get_monotonic_time();
+	bool shown = gtk_widget_get_child_visible(term->hbox);
+	gchar *notify;
+	guint i;
+
+	for (i=0; i<triggers->list->len; i++) {
+		if (!(mask & (G_GUINT64_CONSTANT(1) << i)))
+			continue;
+		trigger = g_ptr_array_index(triggers->list, i);
+
+		if (!shown && (trigger->actions & (TRIGGER_MARK|TRIGGER_HIGHLIGHT)))
+			sakura_trigger_label(term, term->trigger_actions | (trigger->actions & (TRIGGER_MARK|TRIGGER_HIGHLIGHT)));
+
+		/* Once in a while, a trigger can match every line of a flood */
+		if ((trigger->actions & TRIGGER_NOTIFY) && !(shown && win->focused) &&
+		    now - term->trigger_notified > TRIGGER_NOTIFY_INTERVAL) {
+			term->trigger_notified = now;
+			gtk_window_set_urgency_hint(GTK_WINDOW(win->main_window), TRUE);
+			if ((notify = g_find_program_in_path("notify-send"))) {
+				gchar *argv[] = { notify, "-a", "sakura", (gchar *)gtk_label_get_text(GTK_LABEL(term->label)),
+				                  trigger->pattern, NULL };
+				g_spawn_async(NULL, argv, NULL, G_SPAWN_STDOUT_TO_DEV_NULL|G_SPAWN_STDERR_TO_DEV_NULL,
+				              NULL, NULL, NULL, NULL);
+				g_free(notify);
+			}
+		}
+	}
+}
+
+
+static void
+sakura_triggers_done(GObject *source, GAsyncResult *result, gpointer data)
+{
+	struct trigger_job *job = g_task_get_task_data(G_TASK(result));
+	struct terminal *term = sakura_term_by_id(job->term_id);
+	guint64 *masks = (guint64 *)job->masks->data, mask = 0, fired = 0;
+	glong *rows = (glong *)job->rows->data;
+	guint i;
+
+	if (!term)
+		return;
+	term->trigger_running = false;
+
+	/* The first row could have been seen before, and the last will */
+	for (i=job->masks->len; i-- > 0 && rows[i] >= job->last_row; )
+		fired |= masks[i] | (i == 0 ? job->fired : 0);
+	masks[0] &= ~job->fired;
+	for (i=0; i<job->masks->len; i++)
+		mask |= masks[i];
+	if (mask && job->triggers == sakura.triggers)
+		sakura_trigger_fire(term, job->triggers, mask);
+
+	term->trigger_fired = fired;
+	term->trigger_row = job->last_row;
+
+	if (term->trigger_more)
+		sakura_triggers_schedule(term);
+}
+
+
+/* Read the rows from the last one seen to the cursor and match them */
+static gboolean
+sakura_triggers_scan(gpointer data)
+{
+	struct terminal *term = data;
+	struct trigger_job *job;
+	GtkAdjustment *adj;
+	GTask *task;
+	GArray *attrs;
+	glong column, row, start, end, columns, line_row;
+	gchar *src, *dst, *line;
+
+	term->trigger_timeout = 0;
+	term->trigger_more = false;
+	if (!sakura.triggers || !term->vte)
+		return G_SOURCE_REMOVE;
+
+	vte_terminal_get_cursor_position(VTE_TERMINAL(term->vte), &column, &row);
+	adj = vte_terminal_get_adjustment(VTE_TERMINAL(term->vte));
+
+	/* Reset, or back from the alternate screen */
+	if (term->trigger_row > row) {
+		term->trigger_row = row;
+		term->trigger_fired = 0;
+	}
+	/* What fell out of the scrollback is lost */
+	start = MAX(term->trigger_row, (glong)gtk_adjustment_get_lower(adj));
+	end = MIN(row, start + TRIGGER_CHUNK);
+	columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
+
+	job = g_new0(struct trigger_job, 1);
+	job->term_id = term->id;
+	job->triggers = sakura_triggers_ref(sakura.triggers);
+	job->first_row = start;
+	job->last_row = end;
+	job->fired = start == term->trigger_row ? term->trigger_fired : 0;
+	job->masks = g_array_new(FALSE, FALSE, sizeof(guint64));
+	job->rows = g_array_new(FALSE, FALSE, sizeof(glong));
+	attrs = g_array_new(FALSE, FALSE, sizeof(VteCharAttributes));
+	job->text = vte_terminal_get_text_range(VTE_TERMINAL(term->vte), start, 0, end, columns-1, NULL, NULL, attrs);
+	if (!job->text)
+		job->text = g_strdup("");
+
+	/* Lines lose their trailing spaces and get the row they end on, vte
+	 * gives the attributes of each byte. Wrapped rows make a single line */
+	for (src=dst=line=job->text; *src; src++) {
+		if (*src == '\n') {
+			while (dst > line && dst[-1] == ' ')
+				dst--;
+			line_row = (guint)(src - job->text) < attrs->len ?
+			           g_array_index(attrs, VteCharAttributes, src - job->text).row : end;
+			g_array_append_val(job->rows, line_row);
+			*dst++ = *src;
+			line = dst;
+		} else {
+			*dst++ = *src;
+		}
+	}
+	while (dst > line && dst[-1] == ' ')
+		dst--;
+	*dst = '\0';
+	g_array_append_val(job->rows, end);
+	g_array_free(attrs, TRUE);
+
+	term->trigger_running = true;
+	term->trigger_more = end < row;
+	task = g_task_new(NULL, NULL, sakura_triggers_done, NULL);
+	g_task_set_task_data(task, job, sakura_trigger_job_free);
+	g_task_run_in_thread(task, sakura_triggers_thread);
+	g_object_unref(task);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static void
+sakura_triggers_schedule(struct terminal *term)
+{
+	if (term->trigger_running)
+		term->trigger_more = true;
+	else if (!term->trigger_timeout && term->vte)
+		term->trigger_timeout = g_timeout_add(TRIGGER_INTERVAL, sakura_triggers_scan, term);
+}
+
+
+/* Memory accounting. vte doesn't tell how much its buffers take, so they're
+ * estimated from their size in rows, like the scrollback budget does */
+struct tab_stats {
+	gint scroll_limit;
+	gint scrollback_lines;
+	gint64 scrollback_bytes;
+	gint64 screen_bytes;
+	gint64 index_bytes;			/* Search index */
+	gint64 background_bytes;	/* Each tab has its own copy of the image */
+	gint64 widget_bytes;
+	gint64 total_bytes;
+};
+
+struct process_stats {
+	gint64 rss;
+	gint64 heap_used;			/* malloc's, GLib allocates from it */
+	gint64 heap_free;
+};
+
+
+static void
+sakura_term_stats(struct terminal *term, struct tab_stats *stats)
+{
+	struct search_block *block;
+	gint width, height;
+	guint i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->widget_bytes = sizeof(struct terminal) + TAB_WIDGETS_SIZE;
+	if (!term->vte) {
+		stats->total_bytes = stats->widget_bytes;
+		return;
+	}
+
+	stats->widget_bytes += VTE_WIDGET_SIZE;
+	stats->scroll_limit = sakura_scrollback_lines(term);
+	stats->scrollback_lines = sakura_term_scrollback_used(term);
+	stats->scrollback_bytes = stats->scrollback_lines * sakura_term_row_size(term);
+	stats->screen_bytes = vte_terminal_get_row_count(VTE_TERMINAL(term->vte)) * sakura_term_row_size(term);
+	for (i=0; term->search_blocks && i<term->search_blocks->len; i++) {
+		block = g_ptr_array_index(term->search_blocks, i);
+		stats->index_bytes += sizeof(*block) + block->text->allocated_len;
+	}
+	if (sakura.background && gdk_pixbuf_get_file_info(sakura.background, &width, &height))
+		stats->background_bytes = (gint64)width * height * 4;
+
+	stats->total_bytes = stats->scrollback_bytes + stats->screen_bytes + stats->index_bytes +
+	                     stats->background_bytes + stats->widget_bytes;
+}
+
+
+static gint64
+sakura_process_rss()
+{
+	gchar *statm;
+	gint64 pages=0;
+
+	if (g_file_get_contents("/proc/self/statm", &statm, NULL, NULL)) {
+		sscanf(statm, "%*d %" G_GINT64_FORMAT, &pages);
+		g_free(statm);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+
+static void
+sakura_process_stats(struct process_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->rss = sakura_process_rss();
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+	stats->heap_used = info.uordblks + info.hblkhd;
+	stats->heap_free = info.fordblks;
+#endif
+}
+
+
+static void
+sakura_json_string(GString *json, const char *text)
+{
+	const guchar *p;
+
+	g_string_append_c(json, '"');
+	for (p = (const guchar *)text; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			g_string_append_printf(json, "\\%c", *p);
+		else if (*p < 0x20)
+			g_string_append_printf(json, "\\u%04x", *p);
+		else
+			g_string_append_c(json, *p);
+	}
+	g_string_append_c(json, '"');
+}
+
+
+/* The whole report, for SIGUSR1 and the stats control command */
+static gchar *
+sakura_stats_json()
+{
+	GString *json = g_string_new(NULL);
+	struct process_stats process;
+	struct tab_stats stats;
+	struct terminal *term;
+	struct window *win;
+	GList *l;
+	gint64 total = 0;
+	gint w, page, n = 0;
+
+	sakura_process_stats(&process);
+	g_string_append_printf(json, "{\n  \"pid\": %d,\n  \"rss_kb\": %" G_GINT64_FORMAT ",\n"
+	                       "  \"heap_used_kb\": %" G_GINT64_FORMAT ",\n  \"heap_free_kb\": %" G_GINT64_FORMAT ",\n"
+	                       "  \"tabs\": [",
+	                       getpid(), process.rss/1024, process.heap_used/1024, process.heap_free/1024);
+
+	for (l = sakura.windows, w = 0; l; l = l->next, w++) {
+		win = l->data;
+		for (page=0; page<gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)); page++) {
+			term = sakura_get_page_term(win, page);
+			sakura_term_stats(term, &stats);
+			total += stats.total_bytes;
+			g_string_append_printf(json, "%s\n    {\"id\": %u, \"window\": %d, \"page\": %d, \"pid\": %d, \"title\": ",
+			                       n++ ? "," : "", term->id, w, page, term->pid);
+			sakura_json_string(json, gtk_label_get_text(GTK_LABEL(term->label)));
+			if (sakura_proc_busy(term) && term->proc.name) {
+				g_string_append(json, ", \"process\": ");
+				sakura_json_string(json, term->proc.name);
+				g_string_append_printf(json, ", \"process_cpu\": %d, \"process_rss_kb\": %" G_GINT64_FORMAT,
+				                       term->proc.cpu, term->proc.rss/1024);
+			}
+			g_string_append_printf(json, ", \"started\": %s, \"scroll_limit\": %d, \"scrollback_lines\": %d"
+			                       ", \"scrollback_bytes\": %" G_GINT64_FORMAT ", \"screen_bytes\": %" G_GINT64_FORMAT
+			                       ", \"search_index_bytes\": %" G_GINT64_FORMAT ", \"background_bytes\": %" G_GINT64_FORMAT
+			                       ", \"widget_bytes\": %" G_GINT64_FORMAT ", \"total_bytes\": %" G_GINT64_FORMAT "}",
+			                       term->vte ? "true" : "false", stats.scroll_limit, stats.scrollback_lines,
+			                       stats.scrollback_bytes, stats.screen_bytes, stats.index_bytes,
+			                       stats.background_bytes, stats.widget_bytes, stats.total_bytes);
+		}
+	}
+	g_string_append_printf(json, "\n  ],\n  \"tabs_total_bytes\": %" G_GINT64_FORMAT "\n}\n", total);
+
+	return g_string_free(json, FALSE);
+}
+
+
+/* SIGUSR1: write the report next to the server socket */
+static gboolean
+sakura_stats_signal(gpointer data)
+{
+	GError *gerror=NULL;
+	gchar *json, *dir, *name, *path;
+
+	dir = g_build_filename(g_get_user_runtime_dir(), "sakura", NULL);
+	g_mkdir_with_parents(dir, 0700);
+	name = g_strdup_printf("stats-%d.json", getpid());
+	path = g_build_filename(dir, name, NULL);
+
+	json = sakura_stats_json();
+	if (g_file_set_contents(path, json, -1, &gerror)) {
+		fprintf(stderr, "Statistics written to %s\n", path);
+	} else {
+		fprintf(stderr, "%s\n", gerror->message);
+		g_error_free(gerror);
+	}
+
+	g_free(json); g_free(path); g_free(name); g_free(dir);
+	return G_SOURCE_CONTINUE;
+}
+
+
+/* The report as a table, for the Statistics dialog */
+static gchar *
+sakura_stats_text()
+{
+	GString *text = g_string_new(NULL);
+	struct process_stats process;
+	struct tab_stats stats;
+	struct terminal *term;
+	struct window *win;
+	GList *l;
+	gint64 total = 0;
+	gint page;
+	gchar *sizes[7];
+	guint i;
+
+	g_string_append_printf(text, "%-20s %9s %10s %10s %10s %10s %10s %10s\n", _("Tab"), _("Lines"),
+	                       _("Scrollback"), _("Screen"), _("Index"), _("Background"), _("Widgets"), _("Total"));
+	for (l = sakura.windows; l; l = l->next) {
+		win = l->data;
+		for (page=0; page<gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)); page++) {
+			term = sakura_get_page_term(win, page);
+			sakura_term_stats(term, &stats);
+			total += stats.total_bytes;
+			sizes[0] = g_format_size(stats.scrollback_bytes);
+			sizes[1] = g_format_size(stats.screen_bytes);
+			sizes[2] = g_format_size(stats.index_bytes);
+			sizes[3] = g_format_size(stats.background_bytes);
+			sizes[4] = g_format_size(stats.widget_bytes);
+			sizes[5] = g_format_size(stats.total_bytes);
+			g_string_append_printf(text, "%-20.20s %9d %10s %10s %10s %10s %10s %10s\n",
+			                       gtk_label_get_text(GTK_LABEL(term->label)), stats.scrollback_lines,
+			                       sizes[0], sizes[1], sizes[2], sizes[3], sizes[4], sizes[5]);
+			for (i=0; i<6; i++)
+				g_free(sizes[i]);
+		}
+	}
+
+	sakura_process_stats(&process);
+	sizes[0] = g_format_size(total);
+	sizes[1] = g_format_size(process.rss);
+	sizes[2] = g_format_size(process.heap_used);
+	sizes[3] = g_format_size(process.heap_free);
+	g_string_append_printf(text, _("\nAll tabs: %s\nResident: %s\nHeap: %s used, %s free\n"),
+	                       sizes[0], sizes[1], sizes[2], sizes[3]);
+	for (i=0; i<4; i++)
+		g_free(sizes[i]);
+
+	return g_string_free(text, FALSE);
+}
+
+
+static void
+sakura_stats_dialog(GtkWidget *widget, void *data)
+{
+	struct window *win = (struct window *)data;
+	GtkWidget *dialog, *view, *scrolled;
+	PangoFontDescription *font;
+	gchar *text;
+
+	dialog = gtk_dialog_new_with_buttons(_("Statistics"), GTK_WINDOW(win->main_window),
+	                                     GTK_DIALOG_DESTROY_WITH_PARENT,
+	                                     _("_Close"), GTK_RESPONSE_CLOSE, NULL);
+	gtk_window_set_default_size(GTK_WINDOW(dialog), 760, 360);
+
+	text = sakura_stats_text();
+	view = gtk_text_view_new();
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(view), FALSE);
+	font = pango_font_description_from_string("Monospace");
+	gtk_widget_override_font(view, font);
+	pango_font_description_free(font);
+	gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(view)), text, -1);
+	g_free(text);
+
+	scrolled = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(scrolled), view);
+	gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(dialog))), scrolled, TRUE, TRUE, 12);
+
+	g_signal_connect(G_OBJECT(dialog), "response", G_CALLBACK(gtk_widget_destroy), NULL);
+	gtk_widget_show_all(dialog);
+}
+
+
+/* Delete the notebook tab passed as a parameter */
+static void
+sakura_del_tab(struct window *win, gint page)
+{
+	struct terminal *term;
+	gint npages;
+
+	term = sakura_get_page_term(win, page);
+	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+
+	/* When there's only one tab use the shell title, if provided. A
+	 * placeholder has none yet */
+	if (npages==2) {
+		const char *title = NULL;
+
+		term = sakura_get_page_term(win, page == 0 ? 1 : 0);
+		if (term->vte)
+			title = vte_terminal_get_window_title(VTE_TERMINAL(term->vte));
+		if (title!=NULL)
+			gtk_window_set_title(GTK_WINDOW(win->main_window), title);
+	}
+
+	term = sakura_get_page_term(win, page);
+
+	/* Do the first tab checks BEFORE deleting the tab, to ensure correct
+	 * sizes are calculated when the tab is deleted */
+	if ( npages == 2) {
+		if (sakura.first_tab) {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), TRUE);
+		} else {
+			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(win->notebook), FALSE);
+		}
+		win->keep_fc=true;
+	}
+
+	gtk_widget_hide(term->hbox);
+	gtk_notebook_remove_page(GTK_NOTEBOOK(win->notebook), page);
+
+	/* Find the next page, if it exists, and grab focus */
+	if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)) > 0) {
+		page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+		term = sakura_get_page_term(win, page);
+		gtk_widget_grab_focus(term->vte);
+	}
+}
+
+
+static void
+sakura_set_bgimage(struct window *win, char *infile)
+{
+	GError *gerror=NULL;
+	GdkPixbuf *pixbuf=NULL;
+	gint page;
+	struct terminal *term;
+
+	if (!infile) SAY("File parameter is NULL");
+
+	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(win->notebook));
+	term = sakura_get_page_term(win, page);
+
+	/* Check file existence and type */
+	if (g_file_test(infile, G_FILE_TEST_IS_REGULAR)) {
+
+		pixbuf = gdk_pixbuf_new_from_file (infile, &gerror);
+		if (!pixbuf) {
+			sakura_error(win, "Error loading image file: %s\n", gerror->message);
+		} else {
+			vte_terminal_set_background_image(VTE_TERMINAL(term->vte), pixbuf);
+			vte_terminal_set_background_saturation(VTE_TERMINAL(term->vte), TRUE);
+			vte_terminal_set_background_transparent(VTE_TERMINAL(term->vte),FALSE);
+
+			if (sakura.background != infile) {
+				g_free(sakura.background);
+				sakura.background = g_strdup(infile);
+			}
+			sakura_config_changed();
+		}
+	}
+}
+
+
+static void
+sakura_error(struct window *win, const char *format, ...)
+{
+	GtkWidget *dialog;
+	va_list args;
+	char* buff;
+
+	va_start(args, format);
+	buff = malloc(sizeof(char)*ERROR_BUFFER_LENGTH);
+	vsnprintf(buff, sizeof(char)*ERROR_BUFFER_LENGTH, format, args);
+	va_end(args);
+
+	dialog = gtk_message_dialog_new(win ? GTK_WINDOW(win->main_window) : NULL, GTK_DIALOG_DESTROY_WITH_PARENT,
+	                                GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "%s", buff);
+	gtk_window_set_title(GTK_WINDOW(dialog), _("Error message"));
+	gtk_dialog_run (GTK_DIALOG (dialog));
+	gtk_widget_destroy (dialog);
+	free(buff);
+}
+
+
+/* Startup tracing. Timestamps are always taken (it's cheap) because the
+ * command line hasn't been parsed yet when the first phases run */
+static gint64
+sakura_trace_now()
+{
+	return trace.done ? 0 : g_get_monotonic_time();
+}
+
+
+static void
+sakura_trace_add(const char *name, gint64 begin)
+{
+	if (trace.done || trace.n_events == TRACE_MAX_EVENTS)
+		return;
+
+	trace.events[trace.n_events].name = name;
+	trace.events[trace.n_events].ts = begin - trace.start;
+	trace.events[trace.n_events].dur = g_get_monotonic_time() - begin;
+	trace.n_events++;
+}
+
+
+/* The first frame has been drawn: startup is over. Write the trace in Chrome
+ * trace event format (chrome://tracing, Perfetto) if it was requested */
+static gboolean
+sakura_trace_first_frame(GtkWidget *widget, void *cr, gpointer data)
+{
+	GError *gerror=NULL;
+	GString *json;
+	int i;
+
+	g_signal_handlers_disconnect_by_func(widget, sakura_trace_first_frame, data);
+	if (trace.done)
+		return FALSE;
+
+	sakura_trace_add("startup", trace.start);
+	trace.done = true;
+
+	if (!option_startup_trace)
+		return FALSE;
+
+	json = g_string_new("{\"traceEvents\":[\n");
+	for (i=0; i<trace.n_events; i++) {
+		g_string_append_printf(json, "  {\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" G_GINT64_FORMAT
+		                       ",\"dur\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%d}%s\n",
+		                       trace.events[i].name, trace.events[i].ts, trace.events[i].dur,
+		                       getpid(), getpid(), i < trace.n_events-1 ? "," : "");
+	}
+	g_string_append(json, "],\"displayTimeUnit\":\"ms\"}\n");
+
+	if (!g_file_set_contents(option_startup_trace, json->str, json->len, &gerror)) {
+		fprintf(stderr, "%s\n", gerror->message);
+		g_error_free(gerror);
+	}
+	g_string_free(json, TRUE);
+
+	return FALSE;
+}
+
+
+/* Socket used by the sakura server. One per configuration file and display,
+ * so instances with different settings or on different displays don't mix */
+static char *
+sakura_server_socket_path()
+{
+	const gchar *display;
+	gchar *name, *path;
+
+	display = gdk_get_display_arg_name();
+	if (!display) display = g_getenv("DISPLAY");
+	if (!display) display = "";
+
+	name = g_strdup_printf("%s-%s", option_config_file ? option_config_file : DEFAULT_CONFIGFILE, display);
+	g_strdelimit(name, "/", '_');
+	path = g_build_filename(g_get_user_runtime_dir(), "sakura", name, NULL);
+	g_free(name);
+
+	return path;
+}
+
+
+/* Rewrites argv to include a -- after the -e argument this is required to make
+ * sure GOption doesn't grab any arguments meant for the command being called */
+static char **
+sakura_rewrite_argv(int argc, char **argv, int *nargc)
+{
+	char **nargv;
+	int i, n;
+	gboolean have_e;
+
+	/* Initialize nargv */
+	nargv = (char**)calloc((argc+2), sizeof(char*));
+	n=0; *nargc=argc;
+	have_e=FALSE;
+
+	for(i=0; i<argc; i++) {
+		if(!have_e && g_strcmp0(argv[i],"-e") == 0)
+		{
+			nargv[n]=g_strdup("-e");
+			n++;
+			nargv[n]=g_strdup("--");
+			(*nargc)++;
+			have_e = TRUE;
+		} else {
+			nargv[n]=g_strdup(argv[i]);
+		}
+		n++;
+	}
+
+	return nargv;
+}
+
+
+/* Restore the command line option globals to their defaults before parsing the
+ * command line of another process */
+static void
+sakura_reset_options()
+{
+	g_free((gchar *)option_font); g_free((gchar *)option_workdir); g_free((gchar *)option_execute);
+	g_free((gchar *)option_title); g_free((gchar *)option_geometry); g_free(option_config_file);
+	g_strfreev(option_xterm_args);
+
+	option_font=NULL; option_workdir=NULL; option_execute=NULL; option_title=NULL;
+	option_geometry=NULL; option_config_file=NULL;
+	option_xterm_args=NULL;
+	option_xterm_execute=FALSE; option_version=FALSE; option_login=FALSE;
+	option_hold=FALSE; option_fullscreen=FALSE; option_maximize=FALSE;
+	option_help=FALSE; option_standalone=FALSE;
+	option_ntabs=1; option_rows=0; option_columns=0;
+}
+
+
+/* A new sakura has been launched. Its command line, working directory and
+ * environment come as a (aayayaay) GVariant preceded by its size. It's read
+ * asynchronously, a stuck client doesn't freeze the windows */
+struct server_request {
+	GSocketConnection *connection;
+	guint32 len;
+	gchar *buf;
+	guchar ack;
+};
+
+
+static void
+sakura_server_request_free(struct server_request *req)
+{
+	g_object_unref(req->connection);
+	g_free(req->buf);
+	g_free(req);
+}
+
+
+static void
+sakura_server_acked(GObject *source, GAsyncResult *result, gpointer data)
+{
+	g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), result, NULL, NULL);
+	sakura_server_request_free((struct server_request *)data);
+}
+
+
+static void
+sakura_server_got_message(GObject *source, GAsyncResult *result, gpointer data)
+{
+	struct server_request *req = data;
+	GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(req->connection));
+	GError *gerror=NULL;
+	GVariant *msg;
+	gsize n;
+	gchar *cwd;
+	gchar **argv, **envv, **nargv;
+	int nargc;
+	struct window *win;
+
+	if (!g_input_stream_read_all_finish(G_INPUT_STREAM(source), result, &n, &gerror) || n!=req->len) {
+		SAY("bad server request: %s", gerror ? gerror->message : "short read");
+		g_clear_error(&gerror);
+		sakura_server_request_free(req);
+		return;
+	}
+
+	msg = g_variant_new_from_data(G_VARIANT_TYPE("(aayayaay)"), req->buf, req->len, FALSE, g_free, req->buf);
+	req->buf = NULL;
+	g_variant_ref_sink(msg);
+	g_variant_get(msg, "(^aay^ay^aay)", &argv, &cwd, &envv);
+	g_variant_unref(msg);
+
+	/* Parse the command line of the client as if it were ours */
+	sakura_reset_options();
+	nargv = sakura_rewrite_argv(g_strv_length(argv), argv, &nargc);
+
+	GOptionContext *context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, entries, GETTEXT_PACKAGE);
+	g_option_context_set_ignore_unknown_options(context, TRUE);
+	g_option_context_set_help_enabled(context, FALSE);
+	req->ack=1;
+	if (!g_option_context_parse(context, &nargc, &nargv, &gerror)) {
+		SAY("cannot parse forwarded command line: %s", gerror->message);
+		g_clear_error(&gerror);
+		req->ack=0;
+	}
+	g_option_context_free(context);
+
+	if (req->ack) {
+		if (option_ntabs <= 0) {
+			option_ntabs=1;
+		}
+
+		win = sakura_window_new(envv, cwd);
+		sakura_add_tabs(win, option_ntabs);
+	}
+
+	g_output_stream_write_all_async(out, &req->ack, 1, G_PRIORITY_DEFAULT, NULL, sakura_server_acked, req);
+
+	g_strfreev(nargv); g_strfreev(argv); g_strfreev(envv); g_free(cwd);
+}
+
+
+static void
+sakura_server_got_length(GObject *source, GAsyncResult *result, gpointer data)
+{
+	struct server_request *req = data;
+	GError *gerror=NULL;
+	gsize n;
+
+	if (!g_input_stream_read_all_finish(G_INPUT_STREAM(source), result, &n, &gerror) ||
+	    n!=sizeof(req->len) || req->len>SERVER_MAX_MESSAGE) {
+		SAY("bad server request: %s", gerror ? gerror->message : "short read");
+		g_clear_error(&gerror);
+		sakura_server_request_free(req);
+		return;
+	}
+
+	req->buf = g_malloc(req->len);
+	g_input_stream_read_all_async(G_INPUT_STREAM(source), req->buf, req->len, G_PRIORITY_DEFAULT, NULL,
+	                              sakura_server_got_message, req);
+}
+
+
+static gboolean
+sakura_server_incoming(GSocketService *service, GSocketConnection *connection, GObject *source, gpointer data)
+{
+	struct server_request *req;
+
+	/* Stuck clients are dropped */
+	g_socket_set_timeout(g_socket_connection_get_socket(connection), 2);
+
+	req = g_new0(struct server_request, 1);
+	req->connection = g_object_ref(connection);
+	g_input_stream_read_all_async(g_io_stream_get_input_stream(G_IO_STREAM(connection)), &req->len, sizeof(req->len),
+	                              G_PRIORITY_DEFAULT, NULL, sakura_server_got_length, req);
+
+	return TRUE;
+}
+
+
+/* Try to open our window in an already running sakura. Returns true if it did */
+static bool
+sakura_server_forward(char **argv)
+{
+	GSocketClient *client;
+	GSocketConnection *connection;
+	GSocketAddress *address;
+	GVariant *msg;
+	gchar *path, *cwd;
+	gchar **envv;
+	guint32 len;
+	guchar ack=0;
+	gsize n;
+	bool done=false;
+
+	path = sakura_server_socket_path();
+	if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+		g_free(path);
+		return false;
+	}
+
+	address = g_unix_socket_address_new(path);
+	client = g_socket_client_new();
+	connection = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), NULL, NULL);
+
+	if (connection) {
+		cwd = g_get_current_dir();
+		envv = g_get_environ();
+		msg = g_variant_ref_sink(g_variant_new("(^aay^ay^aay)", argv, cwd, envv));
+		len = g_variant_get_size(msg);
+
+		GInputStream *in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+		GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+
+		if (g_output_stream_write_all(out, &len, sizeof(len), &n, NULL, NULL) &&
+		    g_output_stream_write_all(out, g_variant_get_data(msg), len, &n, NULL, NULL) &&
+		    g_input_stream_read_all(in, &ack, 1, &n, NULL, NULL) && n==1) {
+			done = (ack==1);
+		}
+
+		g_variant_unref(msg);
+		g_strfreev(envv);
+		g_free(cwd);
+		g_object_unref(connection);
+	}
+
+	g_object_unref(client);
+	g_object_unref(address);
+	g_free(path);
+
+	return done;
+}
+
+
+static void
+sakura_server_start()
+{
+	GSocketAddress *address;
+	GSocketClient *probe;
+	GSocketConnection *connection;
+	GError *gerror=NULL;
+	gchar *dir;
+
+	sakura.socket_path = sakura_server_socket_path();
+
+	dir = g_path_get_dirname(sakura.socket_path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	address = g_unix_socket_address_new(sakura.socket_path);
+
+	/* Another sakura may have started serving since we tried to forward */
+	probe = g_socket_client_new();
+	connection = g_socket_client_connect(probe, G_SOCKET_CONNECTABLE(address), NULL, NULL);
+	g_object_unref(probe);
+	if (connection) {
+		SAY("%s is in use", sakura.socket_path);
+		g_object_unref(connection);
+		g_object_unref(address);
+		g_free(sakura.socket_path);
+		sakura.socket_path=NULL;
+		return;
+	}
+	/* Nobody answered on it, so it's a leftover */
+	g_unlink(sakura.socket_path);
+
+	sakura.server = g_socket_service_new();
+	if (!g_socket_listener_add_address(G_SOCKET_LISTENER(sakura.server), address, G_SOCKET_TYPE_STREAM,
+	                                   G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &gerror)) {
+		SAY("cannot listen on %s: %s", sakura.socket_path, gerror->message);
+		g_error_free(gerror);
+		g_object_unref(address);
+		g_object_unref(sakura.server);
+		sakura.server=NULL;
+		g_free(sakura.socket_path);
+		sakura.socket_path=NULL;
+		return;
+	}
+	g_object_unref(address);
+	g_chmod(sakura.socket_path, 0600);
+
+	g_signal_connect(sakura.server, "incoming", G_CALLBACK(sakura_server_incoming), NULL);
+	g_socket_service_start(sakura.server);
+}
+
+
+static void
+sakura_server_stop()
+{
+	if (!sakura.server)
+		return;
+
+	g_socket_service_stop(sakura.server);
+	g_socket_listener_close(G_SOCKET_LISTENER(sakura.server));
+	g_object_unref(sakura.server);
+	sakura.server=NULL;
+
+	g_unlink(sakura.socket_path);
+	g_free(sakura.socket_path);
+	sakura.socket_path=NULL;
+}
+
+
+/* Spawn helper. A small process forked before gtk is initialized, which
+ * starts the children of all the tabs (forking sakura gets slower as it
+ * grows) and keeps a pool of shells that have already read their rc files.
+ * It gets a request per message on a SOCK_SEQPACKET socket and replies with
+ * the pty master as SCM_RIGHTS. Its children aren't ours, so it also tells
+ * us when they exit */
+enum helper_reply_type {
+	HELPER_SPAWNED,			/* value: 1 if it's a warm shell, -errno on failure */
+	HELPER_EXITED			/* value: wait status */
+};
+
+struct helper_reply {
+	gint32 type;
+	gint32 pid;
+	gint32 value;
+};
+
+static struct {
+	int sock;				/* -1 without a helper, vte forks then */
+	GPid pid;
+	guint watch;
+	char **pool_argv;		/* What the warm shells run. Only tabs that */
+	char **pool_envv;		/* would run the same adopt them */
+	gchar *pool_cwd;
+} helper = { -1 };
+
+static int helper_sigchld[2];
+
+
+/* In the helper: start argv in cwd, on a new pty */
+static pid_t
+sakura_helper_fork(const char *cwd, const char *cgroup, char **argv, bool argv0, char **envv, int *master)
+{
+	struct winsize size = { DEFAULT_ROWS, DEFAULT_COLUMNS, 0, 0 };
+	sigset_t all;
+	char *slave;
+	pid_t pid;
+	int fd;
+
+	*master = posix_openpt(O_RDWR|O_NOCTTY);
+	if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0 || !(slave = ptsname(*master))) {
+		if (*master >= 0) close(*master);
+		return -1;
+	}
+	fcntl(*master, F_SETFD, FD_CLOEXEC);
+	ioctl(*master, TIOCSWINSZ, &size);
+
+	pid = fork();
+	if (pid != 0) {
+		if (pid < 0) close(*master);
+		return pid;
+	}
+
+	/* The child */
+	setsid();
+	fd = open(slave, O_RDWR);
+	if (fd < 0)
+		_exit(127);
+	ioctl(fd, TIOCSCTTY, 0);
+	dup2(fd, STDIN_FILENO); dup2(fd, STDOUT_FILENO); dup2(fd, STDERR_FILENO);
+	if (fd > STDERR_FILENO) close(fd);
+	sakura_cgroup_join(cgroup);
+
+	signal(SIGCHLD, SIG_DFL); signal(SIGPIPE, SIG_DFL); signal(SIGINT, SIG_DFL);
+	sigemptyset(&all);
+	sigprocmask(SIG_SETMASK, &all, NULL);
+
+	if (cwd && chdir(cwd) < 0 && chdir(g_get_home_dir()) < 0) {}
+
+	environ = envv;
+	execvp(argv[0], argv0 ? argv+1 : argv);
+	_exit(127);
+}
+
+
+static bool
+sakura_helper_reply(int sock, gint32 type, pid_t pid, gint32 value, int fd)
+{
+	struct helper_reply reply = { type, pid, value };
+	struct iovec iov = { &reply, sizeof(reply) };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	return sendmsg(sock, &msg, 0) == sizeof(reply);
+}
+
+
+static void
+sakura_helper_sigchld(int sig)
+{
+	int saved = errno;
+	if (write(helper_sigchld[1], "", 1) < 0) {}
+	errno = saved;
+}
+
+
+/* The helper main loop. It never returns */
+static void
+sakura_helper_main(int sock)
+{
+	struct { pid_t pid; int master; } pool[SHELL_POOL_MAX];
+	gint n_pool=0, pool_size=0, i;
+	char **pool_argv=NULL, **pool_envv=NULL, *pool_cwd=NULL;
+	struct pollfd fds[2];
+	GVariant *request;
+	gchar *buf, *cmd, *cwd, *cgroup, **argv, **envv;
+	gboolean argv0;
+	gint32 number;
+	gssize len;
+	pid_t pid;
+	int master, status;
+	char c;
+
+	if (pipe(helper_sigchld) < 0)
+		_exit(1);
+	fcntl(helper_sigchld[0], F_SETFL, O_NONBLOCK);
+	fcntl(helper_sigchld[1], F_SETFL, O_NONBLOCK);
+	fcntl(helper_sigchld[0], F_SETFD, FD_CLOEXEC);
+	fcntl(helper_sigchld[1], F_SETFD, FD_CLOEXEC);
+	signal(SIGCHLD, sakura_helper_sigchld);
+	/* Ctrl+C in the terminal sakura was started from is for sakura */
+	signal(SIGINT, SIG_IGN);
+
+	buf = g_malloc(SERVER_MAX_MESSAGE);
+	fds[0].fd = sock; fds[0].events = POLLIN;
+	fds[1].fd = helper_sigchld[0]; fds[1].events = POLLIN;
+
+	for (;;) {
+		/* Keep the pool full */
+		while (pool_argv && n_pool < pool_size) {
+			pid = sakura_helper_fork(pool_cwd, NULL, pool_argv, true, pool_envv, &master);
+			if (pid < 0)
+				break;
+			pool[n_pool].pid = pid;
+			pool[n_pool].master = master;
+			n_pool++;
+		}
+		while (n_pool > pool_size) {
+			n_pool--;
+			close(pool[n_pool].master);
+			kill(pool[n_pool].pid, SIGHUP);
+		}
+
+		if (poll(fds, 2, -1) < 0)
+			continue;
+
+		if (fds[1].revents) {
+			while (read(helper_sigchld[0], &c, 1) > 0);
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				/* Warm shells that die before being used are not restarted, they
+				   would die again. A new pool config tries again */
+				for (i=0; i<n_pool && pool[i].pid != pid; i++);
+				if (i < n_pool) {
+					close(pool[i].master);
+					pool[i] = pool[--n_pool];
+					pool_size = MIN(pool_size, n_pool);
+				} else {
+					sakura_helper_reply(sock, HELPER_EXITED, pid, status, -1);
+				}
+			}
+		}
+
+		if (!fds[0].revents)
+			continue;
+
+		len = recv(sock, buf, SERVER_MAX_MESSAGE, 0);
+		if (len <= 0) {
+			/* sakura is gone */
+			for (i=0; i<n_pool; i++)
+				kill(pool[i].pid, SIGHUP);
+			_exit(0);
+		}
+
+		request = g_variant_ref_sink(g_variant_new_from_data(G_VARIANT_TYPE("(sib^ay^ay^aay^aay)"), buf, len, FALSE, NULL, NULL));
+		g_variant_get(request, "(sib^ay^ay^aay^aay)", &cmd, &number, &argv0, &cwd, &cgroup, &argv, &envv);
+		g_variant_unref(request);
+
+		if (strcmp(cmd, "pool")==0) {
+			g_strfreev(pool_argv); g_strfreev(pool_envv); g_free(pool_cwd);
+			pool_argv = argv; pool_envv = envv; pool_cwd = cwd;
+			pool_size = CLAMP(number, 0, SHELL_POOL_MAX);
+			/* The running ones may have been started with something else */
+			while (n_pool > 0) {
+				n_pool--;
+				close(pool[n_pool].master);
+				kill(pool[n_pool].pid, SIGHUP);
+			}
+			g_free(cmd); g_free(cgroup);
+			continue;
+		}
+
+		if (strcmp(cmd, "adopt")==0 && n_pool > 0) {
+			n_pool--;
+			sakura_helper_reply(sock, HELPER_SPAWNED, pool[n_pool].pid, 1, pool[n_pool].master);
+			close(pool[n_pool].master);
+		} else if (argv[0]) {
+			pid = sakura_helper_fork(*cwd ? cwd : NULL, cgroup, argv, argv0, envv, &master);
+			if (pid < 0) {
+				sakura_helper_reply(sock, HELPER_SPAWNED, -1, -errno, -1);
+			} else {
+				sakura_helper_reply(sock, HELPER_SPAWNED, pid, 0, master);
+				close(master);
+			}
+		} else {
+			sakura_helper_reply(sock, HELPER_SPAWNED, -1, -EINVAL, -1);
+		}
+
+		g_free(cmd); g_free(cwd); g_free(cgroup); g_strfreev(argv); g_strfreev(envv);
+	}
+}
+
+
+static void
+sakura_helper_stop()
+{
+	if (helper.watch)
+		g_source_remove(helper.watch);
+	helper.watch = 0;
+	if (helper.sock >= 0)
+		close(helper.sock);
+	helper.sock = -1;
+}
+
+
+/* Read a reply, and the pty that comes with it. Waits for it up to timeout
+ * ms, a helper that doesn't answer by then is stopped */
+static bool
+sakura_helper_recv(struct helper_reply *reply, int *fd, int timeout)
+{
+	struct iovec iov = { reply, sizeof(*reply) };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct pollfd pfd = { helper.sock, POLLIN, 0 };
+	gint64 deadline = g_get_monotonic_time() + (gint64)timeout * 1000;
+	gssize len;
+	int ready = 1;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	while (timeout > 0 && (ready = poll(&pfd, 1, MAX((deadline - g_get_monotonic_time()) / 1000, 0))) < 0 &&
+	       errno == EINTR)
+		;
+	if (ready == 0) {
+		SAY("spawn helper is not answering");
+		kill(helper.pid, SIGKILL);
+		sakura_helper_stop();
+		return false;
+	}
+
+	do {
+		len = recvmsg(helper.sock, &msg, MSG_CMSG_CLOEXEC|MSG_DONTWAIT);
+	} while (len < 0 && errno == EINTR);
+
+	if (len == 0 || (len < 0 && errno != EAGAIN)) {
+		SAY("spawn helper is gone");
+		sakura_helper_stop();
+		return false;
+	}
+	if (len < 0)
+		return false;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (len != sizeof(*reply) || (msg.msg_flags & MSG_CTRUNC)) {
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+		return false;
+	}
+	return true;
+}
+
+
+/* The helper's children are watched by the helper */
+static gboolean
+sakura_helper_exited(gpointer data)
+{
+	struct terminal *term = sakura_term_by_pid(GPOINTER_TO_INT(data));
+
+	if (term && term->vte)
+		sakura_child_exited(term->vte, term);
+
+	return G_SOURCE_REMOVE;
+}
+
+
+static gboolean
+sakura_helper_readable(gint fd, GIOCondition condition, gpointer data)
+{
+	struct helper_reply reply;
+	int pty;
+
+	while (helper.sock >= 0 && sakura_helper_recv(&reply, &pty, 0)) {
+		if (pty >= 0)
+			close(pty);
+		if (reply.type == HELPER_EXITED)
+			sakura_helper_exited(GINT_TO_POINTER(reply.pid));
+	}
+
+	if (helper.sock < 0) {
+		helper.watch = 0;
+		return G_SOURCE_REMOVE;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+
+static void
+sakura_helper_reaped(GPid pid, gint status, gpointer data)
+{
+	SAY("spawn helper exited: %d", status);
+	g_spawn_close_pid(pid);
+	if (helper.pid == pid)
+		sakura_helper_stop();
+}
+
+
+static void
+sakura_helper_start()
+{
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0) {
+		SAY("no spawn helper: %s", strerror(errno));
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SAY("no spawn helper: %s", strerror(errno));
+		close(sv[0]); close(sv[1]);
+		return;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		sakura_helper_main(sv[1]);
+	}
+
+	close(sv[1]);
+	helper.pid = pid;
+	g_child_watch_add(pid, sakura_helper_reaped, NULL);
+	helper.sock = sv[0];
+	helper.watch = g_unix_fd_add(helper.sock, G_IO_IN, sakura_helper_readable, NULL);
+}
+
+
+static bool
+sakura_helper_request(const char *cmd, gint32 number, bool argv0, const char *cwd, const char *cgroup,
+                      char **argv, char **envv)
+{
+	const char *none[] = { NULL };
+	GVariant *request;
+	bool sent;
+
+	request = g_variant_ref_sink(g_variant_new("(sib^ay^ay^aay^aay)", cmd, number, argv0, cwd ? cwd : "", cgroup ? cgroup : "",
+	                                           argv ? argv : (char **)none, envv ? envv : (char **)none));
+	sent = send(helper.sock, g_variant_get_data(request), g_variant_get_size(request), 0) ==
+	       (gssize)g_variant_get_size(request);
+	g_variant_unref(request);
+
+	if (!sent) {
+		SAY("spawn helper is gone");
+		sakura_helper_stop();
+	}
+	return sent;
+}
+
+
+/* Warm shells run what the tabs of win would. NULL to only update the size */
+static void
+sakura_helper_pool(struct window *win)
+{
+	if (helper.sock < 0)
+		return;
+
+	if (win) {
+		g_strfreev(helper.pool_argv); g_strfreev(helper.pool_envv); g_free(helper.pool_cwd);
+		helper.pool_argv = g_strdupv(win->argv);
+		helper.pool_envv = g_strdupv(win->envv);
+		helper.pool_cwd = g_strdup(win->cwd);
+	}
+	if (!helper.pool_argv)
+		return;
+
+	sakura_helper_request("pool", sakura.shell_pool, true, helper.pool_cwd, NULL, helper.pool_argv, helper.pool_envv);
+}
+
+
+static bool
+sakura_strv_equal(char **a, char **b)
+{
+	for (; *a && *b; a++, b++) {
+		if (strcmp(*a, *b) != 0)
+			return false;
+	}
+	return !*a && !*b;
+}
+
+
+/* Session logs. vte reads the pty of its child itself, so the output of a
+ * logged tab goes through a relay: the child keeps the pty the helper gave
+ * it, and vte gets a new one in raw mode. A single relay thread copies the
+ * output of all the logged tabs to their vte and their input back, and
+ * hands the output to a writer thread in LOG_BUFFER chunks, or every
+ * LOG_FLUSH. The writer strips the escape sequences for the text logs,
+ * compresses and rotates the files, away from the main loop and the relay */
+struct log_file {
+	int fd;
+	gint64 opened;			/* Monotonic time, for the rotation */
+	gint64 size;			/* Written to it before compression */
+	guint part;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+/* Escape sequence parser state of the text log */
+enum log_strip {
+	LOG_STRIP_TEXT,
+	LOG_STRIP_ESC,
+	LOG_STRIP_CSI,
+	LOG_STRIP_STRING,		/* OSC, DCS, APC, PM and SOS, until BEL or ST */
+	LOG_STRIP_STRING_ESC,
+	LOG_STRIP_CHARSET		/* ESC ( and alike take one more byte */
+};
+
+struct session_log {
+	gint ref;
+	int pty;				/* Child's pty master, kept by the tab */
+	/* Relay thread side */
+	int master;				/* A dup of pty */
+	int outer;				/* Slave side of vte's pty */
+	GByteArray *out, *in;	/* Waiting to be written to outer and master */
+	gsize out_done, in_done;
+	GString *buffer;		/* Output not handed to the writer yet */
+	gint64 flushed;
+	bool master_eof;
+	/* Writer thread side, copied from the settings at the start */
+	gchar *dir;
+	GPid pid;
+	bool raw, text, compress;
+	gint64 rotate_size, rotate_time;
+	struct log_file raw_file, text_file;
+	enum log_strip strip;
+	GString *stripped;
+};
+
+/* A chunk of output for the writer, NULL data closes the log */
+struct log_chunk {
+	struct session_log *log;
+	GString *data;
+};
+
+static struct {
+	GThread *relay;
+	GMutex lock;
+	GPtrArray *logs;		/* Relayed, added by the main thread */
+	int wake[2];
+	bool quit;
+	GThread *writer;
+	GAsyncQueue *queue;		/* struct log_chunk */
+} logs;
+
+
+static struct session_log *
+sakura_log_ref(struct session_log *log)
+{
+	g_atomic_int_inc(&log->ref);
+	return log;
+}
+
+
+static void
+sakura_log_unref(struct session_log *log)
+{
+	if (!g_atomic_int_dec_and_test(&log->ref))
+		return;
+
+	if (log->pty >= 0)
+		close(log->pty);
+	g_byte_array_free(log->out, TRUE);
+	g_byte_array_free(log->in, TRUE);
+	g_string_free(log->buffer, TRUE);
+	g_string_free(log->stripped, TRUE);
+	g_free(log->dir);
+	g_free(log);
+}
+
+
+/* Bytes before the first control character or DEL, 16 at a time with SSE2 */
+static gsize
+sakura_log_plain_run(const guchar *p, gsize len)
+{
+	gsize i = 0;
+#ifdef __SSE2__
+	const __m128i controls = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+	__m128i chunk;
+	int found;
+
+	for (; i+16 <= len; i+=16) {
+		chunk = _mm_loadu_si128((const __m128i *)(p+i));
+		found = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(chunk, controls), chunk),
+		                                       _mm_cmpeq_epi8(chunk, del)));
+		if (found)
+			return i + __builtin_ctz(found);
+	}
+#endif
+	for (; i < len; i++)
+		if (p[i] < 0x20 || p[i] == 0x7f)
+			break;
+	return i;
+}
+
+
+/* Output without escape sequences and control characters but newlines and
+ * tabs. Sequences can be split between chunks, the state is kept */
+static void
+sakura_log_strip(struct session_log *log, const gchar *data, gsize len)
+{
+	const guchar *p = (const guchar *)data;
+	gsize i = 0, run;
+	guchar c;
+
+	g_string_truncate(log->stripped, 0);
+	while (i < len) {
+		if (log->strip == LOG_STRIP_TEXT) {
+			run = sakura_log_plain_run(p+i, len-i);
+			g_string_append_len(log->stripped, data+i, run);
+			if ((i += run) == len)
+				break;
+		}
+
+		c = p[i++];
+		switch (log->strip) {
+		case LOG_STRIP_TEXT:
+			if (c == '\033')
+				log->strip = LOG_STRIP_ESC;
+			else if (c == '\n' || c == '\t')
+				g_string_append_c(log->stripped, c);
+			break;
+		case LOG_STRIP_ESC:
+			if (c == '[')
+				log->strip = LOG_STRIP_CSI;
+			else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X')
+				log->strip = LOG_STRIP_STRING;
+			else if (c == '(' || c == ')' || c == '*' || c == '+' || c == '#' || c == '%')
+				log->strip = LOG_STRIP_CHARSET;
+			else
+				log->strip = LOG_STRIP_TEXT;
+			break;
+		case LOG_STRIP_CSI:
+			if (c == '\033')
+				log->strip = LOG_STRIP_ESC;
+			else if (c >= 0x40 && c <= 0x7e)
+				log->strip = LOG_STRIP_TEXT;
+			break;
+		case LOG_STRIP_STRING:
+			if (c == '\a')
+				log->strip = LOG_STRIP_TEXT;
+			else if (c == '\033')
+				log->strip = LOG_STRIP_STRING_ESC;
+			break;
+		case LOG_STRIP_STRING_ESC:
+			log->strip = c == '\\' ? LOG_STRIP_TEXT : LOG_STRIP_STRING;
+			break;
+		case LOG_STRIP_CHARSET:
+			log->strip = LOG_STRIP_TEXT;
+			break;
+		}
+	}
+}
+
+
+static bool
+sakura_log_write_all(int fd, const gchar *data, gsize len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+
+static void
+sakura_log_close(struct log_file *file)
+{
+#ifdef HAVE_ZSTD
+	gchar out[LOG_ZSTD_OUT];
+	ZSTD_outBuffer output;
+	ZSTD_inBuffer input = { NULL, 0, 0 };
+	size_t left;
+
+	if (file->zstd) {
+		do {
+			output = (ZSTD_outBuffer){ out, sizeof(out), 0 };
+			left = ZSTD_compressStream2(file->zstd, &output, &input, ZSTD_e_end);
+			if (file->fd >= 0)
+				sakura_log_write_all(file->fd, out, output.pos);
+		} while (left > 0 && !ZSTD_isError(left));
+		ZSTD_freeCCtx(file->zstd);
+		file->zstd = NULL;
+	}
+#endif
+	if (file->fd >= 0)
+		close(file->fd);
+	file->fd = -1;
+}
+
+
+/* DIR/YYYYmmdd-HHMMSS-PID[-PART].log or .txt, maybe .zst */
+static void
+sakura_log_open(struct session_log *log, struct log_file *file, const char *extension)
+{
+	GDateTime *now = g_date_time_new_now_local();
+	gchar *stamp, *part, *path;
+
+	stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+	part = file->part ? g_strdup_printf("-%u", file->part) : g_strdup("");
+	path = g_strdup_printf("%s/%s-%d%s.%s%s", log->dir, stamp, log->pid, part, extension,
+	                       log->compress ? ".zst" : "");
+	file->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+	if (file->fd < 0)
+		fprintf(stderr, "Can't open %s: %s\n", path, g_strerror(errno));
+	file->opened = g_get_monotonic_time();
+	file->size = 0;
+	file->part++;
+#ifdef HAVE_ZSTD
+	if (log->compress) {
+		file->zstd = ZSTD_createCCtx();
+		ZSTD_CCtx_setParameter(file->zstd, ZSTD_c_compressionLevel, LOG_ZSTD_LEVEL);
+	}
+#endif
+	g_date_time_unref(now);
+	g_free(stamp); g_free(part); g_free(path);
+}
+
+
+static void
+sakura_log_append(struct session_log *log, struct log_file *file, const char *extension, const gchar *data, gsize len)
+{
+	gint64 now = g_get_monotonic_time();
+#ifdef HAVE_ZSTD
+	gchar out[LOG_ZSTD_OUT];
+	ZSTD_outBuffer output;
+	ZSTD_inBuffer input = { data, len, 0 };
+	size_t left;
+#endif
+
+	if (file->opened && ((log->rotate_size > 0 && file->size >= log->rotate_size) ||
+	                     (log->rotate_time > 0 && now - file->opened >= log->rotate_time)))
+		sakura_log_close(file);
+	if (file->fd < 0)
+		sakura_log_open(log, file, extension);
+	if (file->fd < 0)
+		return;
+	file->size += len;
+
+#ifdef HAVE_ZSTD
+	/* Flushed at every chunk, what's on disk can always be read */
+	if (file->zstd) {
+		do {
+			output = (ZSTD_outBuffer){ out, sizeof(out), 0 };
+			left = ZSTD_compressStream2(file->zstd, &output, &input, ZSTD_e_flush);
+			if (ZSTD_isError(left) || !sakura_log_write_all(file->fd, out, output.pos))
+				break;
+		} while (left > 0 || input.pos < input.size);
+		return;
+	}
+#endif
+	sakura_log_write_all(file->fd, data, len);
+}
+
+
+static gpointer
+sakura_log_writer(gpointer data)
+{
+	struct log_chunk *chunk;
+	struct session_log *log;
+
+	while ((chunk = g_async_queue_pop(logs.queue))->log) {
+		log = chunk->log;
+		if (chunk->data) {
+			if (log->raw)
+				sakura_log_append(log, &log->raw_file, "log", chunk->data->str, chunk->data->len);
+			if (log->text) {
+				sakura_log_strip(log, chunk->data->str, chunk->data->len);
+				if (log->stripped->len)
+					sakura_log_append(log, &log->text_file, "txt", log->stripped->str, log->stripped->len);
+			}
+			g_string_free(chunk->data, TRUE);
+		} else {
+			sakura_log_close(&log->raw_file);
+			sakura_log_close(&log->text_file);
+		}
+		sakura_log_unref(log);
+		g_free(chunk);
+	}
+	g_free(chunk);
+
+	return NULL;
+}
+
+
+/* Relay thread side: hand the output read so far to the writer */
+static void
+sakura_log_flush(struct session_log *log, bool close)
+{
+	struct log_chunk *chunk;
+
+	if (log->buffer->len) {
+		chunk = g_new0(struct log_chunk, 1);
+		chunk->log = sakura_log_ref(log);
+		chunk->data = log->buffer;
+		g_async_queue_push(logs.queue, chunk);
+		log->buffer = g_string_sized_new(LOG_BUFFER);
+	}
+	log->flushed = g_get_monotonic_time();
+
+	if (close) {
+		chunk = g_new0(struct log_chunk, 1);
+		chunk->log = sakura_log_ref(log);
+		g_async_queue_push(logs.queue, chunk);
+	}
+}
+
+
+/* Write what's pending from one side to the other, false when it's gone */
+static bool
+sakura_log_pump(int fd, GByteArray *pending, gsize *done)
+{
+	ssize_t n;
+
+	while (*done < pending->len) {
+		n = write(fd, pending->data + *done, pending->len - *done);
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR;
+		*done += n;
+	}
+	g_byte_array_set_size(pending, 0);
+	*done = 0;
+	return true;
+}
+
+
+/* Read a side, false at its end */
+static bool
+sakura_log_read(int fd, GByteArray *pending, GString *buffer)
+{
+	guint8 data[LOG_READ];
+	ssize_t n;
+
+	n = read(fd, data, sizeof(data));
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR;
+	if (n == 0)
+		return false;
+	g_byte_array_append(pending, data, n);
+	if (buffer)
+		g_string_append_len(buffer, (const gchar *)data, n);
+	return true;
+}
+
+
+static gpointer
+sakura_log_relay(gpointer data)
+{
+	struct session_log *log;
+	struct pollfd *fds = NULL;
+	GPtrArray *relayed = g_ptr_array_new();
+	gchar drain[64];
+	gint64 now, flush;
+	guint i;
+	bool alive, quit;
+
+	while (true) {
+		g_mutex_lock(&logs.lock);
+		quit = logs.quit;
+		g_ptr_array_set_size(relayed, 0);
+		for (i=0; i<logs.logs->len; i++)
+			g_ptr_array_add(relayed, g_ptr_array_index(logs.logs, i));
+		g_mutex_unlock(&logs.lock);
+
+		/* sakura exits, the logs are closed and vte will be gone */
+		if (quit) {
+			for (i=0; i<relayed->len; i++)
+				sakura_log_flush(g_ptr_array_index(relayed, i), true);
+			break;
+		}
+
+		/* Output isn't read while vte hasn't taken the previous one. No
+		 * timeout unless some output is waiting for its LOG_FLUSH */
+		fds = g_renew(struct pollfd, fds, 1 + 2*relayed->len);
+		fds[0] = (struct pollfd){ logs.wake[0], POLLIN, 0 };
+		flush = -1;
+		for (i=0; i<relayed->len; i++) {
+			log = g_ptr_array_index(relayed, i);
+			if (log->buffer->len && (flush < 0 || log->flushed < flush))
+				flush = log->flushed;
+			fds[1+2*i] = (struct pollfd){ log->master_eof ? -1 : log->master,
+				(log->out->len ? 0 : POLLIN) | (log->in->len ? POLLOUT : 0), 0 };
+			fds[2+2*i] = (struct pollfd){ log->outer, (log->in->len ? 0 : POLLIN) | (log->out->len ? POLLOUT : 0), 0 };
+		}
+		if (flush >= 0)
+			flush = CLAMP(LOG_FLUSH - (g_get_monotonic_time() - flush)/1000, 0, LOG_FLUSH);
+		if (poll(fds, 1 + 2*relayed->len, flush) < 0 && errno != EINTR)
+			break;
+		if (fds[0].revents)
+			while (read(logs.wake[0], drain, sizeof(drain)) > 0)
+				;
+
+		now = g_get_monotonic_time();
+		for (i=0; i<relayed->len; i++) {
+			log = g_ptr_array_index(relayed, i);
+			alive = true;
+
+			/* Once the child is gone, what it printed still goes to vte */
+			if (fds[1+2*i].revents & (POLLIN|POLLHUP|POLLERR))
+				log->master_eof = !sakura_log_read(log->master, log->out, log->buffer);
+			if (fds[2+2*i].revents & (POLLIN|POLLHUP|POLLERR))
+				alive = sakura_log_read(log->outer, log->in, NULL);
+			alive = alive && sakura_log_pump(log->outer, log->out, &log->out_done);
+			sakura_log_pump(log->master, log->in, &log->in_done);
+			if (log->master_eof && !log->out->len)
+				alive = false;
+
+			if (log->buffer->len >= LOG_BUFFER || !alive ||
+			    (log->buffer->len && now - log->flushed > LOG_FLUSH*1000))
+				sakura_log_flush(log, !alive);
+
+			/* Closing vte's side ends the tab, closing ours hangs up the child */
+			if (!alive) {
+				close(log->outer);
+				close(log->master);
+				g_mutex_lock(&logs.lock);
+				g_ptr_array_remove(logs.logs, log);
+				g_mutex_unlock(&logs.lock);
+				sakura_log_unref(log);
+			}
+		}
+	}
+
+	g_free(fds);
+	g_ptr_array_free(relayed, TRUE);
+	return NULL;
+}
+
+
+/* Put a relay between the child of a tab and vte, return the master vte
+ * reads from, the one given if the tab isn't logged, or -1 if it can't be */
+static int
+sakura_log_start(struct terminal *term, int master, GPid pid, GError **error)
+{
+	struct session_log *log;
+	struct termios raw;
+	int outer_master, outer;
+	char *slave;
+
+	if (!sakura.log_dir || !sakura.log_dir[0])
+		return master;
+	if (g_strcmp0(sakura.log_format, "raw") != 0 && g_strcmp0(sakura.log_format, "text") != 0 &&
+	    g_strcmp0(sakura.log_format, "both") != 0) {
+		g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+		            _("Invalid log_format \"%s\", it must be raw, text or both"), sakura.log_format);
+		return -1;
+	}
+	if (g_mkdir_with_parents(sakura.log_dir, 0700) < 0) {
+		g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, _("Cannot create %s: %s"),
+		            sakura.log_dir, g_strerror(errno));
+		return -1;
+	}
+
+	outer_master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC);
+	if (outer_master < 0 || grantpt(outer_master) < 0 || unlockpt(outer_master) < 0 ||
+	    !(slave = ptsname(outer_master)) || (outer = open(slave, O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC)) < 0) {
+		g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, _("Cannot create the session log pty: %s"),
+		            g_strerror(errno));
+		if (outer_master >= 0) close(outer_master);
+		return -1;
+	}
+	/* Bytes go through untouched, the child's pty does the line discipline */
+	tcgetattr(outer, &raw);
+	cfmakeraw(&raw);
+	tcsetattr(outer, TCSANOW, &raw);
+
+	if (!logs.relay) {
+		g_mutex_init(&logs.lock);
+		logs.logs = g_ptr_array_new();
+		g_unix_open_pipe(logs.wake, FD_CLOEXEC, NULL);
+		fcntl(logs.wake[0], F_SETFL, O_NONBLOCK);
+		logs.queue = g_async_queue_new();
+		logs.relay = g_thread_new("log-relay", sakura_log_relay, NULL);
+		logs.writer = g_thread_new("log-writer", sakura_log_writer, NULL);
+	}
+
+	log = g_new0(struct session_log, 1);
+	log->ref = 2;			/* The tab's and the relay's */
+	log->pty = master;
+	log->master = dup(master);
+	fcntl(log->master, F_SETFD, FD_CLOEXEC);
+	fcntl(log->master, F_SETFL, O_NONBLOCK);
+	log->outer = outer;
+	log->out = g_byte_array_new();
+	log->in = g_byte_array_new();
+	log->buffer = g_string_sized_new(LOG_BUFFER);
+	log->stripped = g_string_new(NULL);
+	log->flushed = g_get_monotonic_time();
+	log->dir = g_strdup(sakura.log_dir);
+	log->pid = pid;
+	log->raw = g_strcmp0(sakura.log_format, "text") != 0;
+	log->text = g_strcmp0(sakura.log_format, "raw") != 0;
+	log->compress = sakura.log_compress;
+	log->rotate_size = (gint64)sakura.log_rotate_size * 1024 * 1024;
+	log->rotate_time = (gint64)sakura.log_rotate_minutes * 60 * G_USEC_PER_SEC;
+	log->raw_file.fd = log->text_file.fd = -1;
+#ifndef HAVE_ZSTD
+	if (log->compress) {
+		fprintf(stderr, "sakura was built without zstd, session logs are not compressed\n");
+		log->compress = false;
+	}
+#endif
+	term->log = log;
+
+	g_mutex_lock(&logs.lock);
+	g_ptr_array_add(logs.logs, log);
+	g_mutex_unlock(&logs.lock);
+	if (write(logs.wake[1], "", 1) < 0) {}
+
+	return outer_master;
+}
+
+
+/* The relay goes on until vte's side of it is closed */
+static void
+sakura_log_detach(struct terminal *term)
+{
+	if (!term->log)
+		return;
+	close(term->log->pty);
+	term->log->pty = -1;
+	sakura_log_unref(term->log);
+	term->log = NULL;
+}
+
+
+/* vte sized its pty, the child's gets the same size and a SIGWINCH */
+static void
+sakura_log_resize(GtkWidget *widget, GtkAllocation *allocation, struct terminal *term)
+{
+	struct winsize size;
+
+	if (term->log && ioctl(vte_terminal_get_pty(VTE_TERMINAL(term->vte)), TIOCGWINSZ, &size) == 0)
+		ioctl(term->log->pty, TIOCSWINSZ, &size);
+}
+
+
+/* Flush the logs before exiting */
+static void
+sakura_log_done()
+{
+	if (!logs.relay)
+		return;
+
+	g_mutex_lock(&logs.lock);
+	logs.quit = true;
+	g_mutex_unlock(&logs.lock);
+	if (write(logs.wake[1], "", 1) < 0) {}
+	g_thread_join(logs.relay);
+
+	g_async_queue_push(logs.queue, g_new0(struct log_chunk, 1));
+	g_thread_join(logs.writer);
+}
+
+
+/* Master of the pty of the child of a tab, which isn't vte's when logged */
+static int
+sakura_term_pty(struct terminal *term)
+{
+	return term->log ? term->log->pty : vte_terminal_get_pty(VTE_TERMINAL(term->vte));
+}
+
+
+struct spawn_setup {
+	gchar *slave;			/* NULL when vte made the pty */
+	const gchar *cgroup;	/* cgroup.procs of the tab, or NULL */
+};
+
+
+/* In the child of a tab started without the helper: make the slave of our
+ * pty its controlling terminal, and join the tab group */
+static void
+sakura_spawn_setup(gpointer data)
+{
+	struct spawn_setup *setup = data;
+	int fd;
+
+	if (setup->slave) {
+		setsid();
+		fd = open(setup->slave, O_RDWR);
+		if (fd < 0)
+			_exit(127);
+		ioctl(fd, TIOCSCTTY, 0);
+		dup2(fd, STDIN_FILENO); dup2(fd, STDOUT_FILENO); dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO) close(fd);
+	}
+	sakura_cgroup_join(setup->cgroup);
+}
+
+
+/* Start a child on a pty of ours, vte's own can't be relayed */
+static bool
+sakura_spawn_pty(const char *cwd, const char *cgroup, char **argv, char **envv, GSpawnFlags flags,
+                 GPid *pid, int *master, GError **error)
+{
+	struct spawn_setup setup = { NULL, cgroup };
+	bool ok;
+
+	*master = posix_openpt(O_RDWR|O_NOCTTY|O_CLOEXEC);
+	if (*master < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0 || !ptsname(*master)) {
+		g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, "%s", g_strerror(errno));
+		if (*master >= 0) close(*master);
+		return false;
+	}
+
+	setup.slave = g_strdup(ptsname(*master));
+	ok = g_spawn_async(cwd, argv, envv, flags|G_SPAWN_DO_NOT_REAP_CHILD, sakura_spawn_setup, &setup, pid, error);
+	g_free(setup.slave);
+	if (!ok)
+		close(*master);
+	return ok;
+}
+
+
+/* Give vte the pty of the child of a tab, through the session log relay if
+ * it's logged. The child is hung up on failure */
+static bool
+sakura_spawn_attach(struct terminal *term, int fd, GPid pid, GError **error)
+{
+	VtePty *pty;
+	int master;
+
+	master = sakura_log_start(term, fd, pid, error);
+	if (master < 0) {
+		close(fd);
+		kill(pid, SIGHUP);
+		return false;
+	}
+
+	pty = vte_pty_new_foreign(master, error);
+	if (!pty) {
+		close(master);
+		sakura_log_detach(term);
+		kill(pid, SIGHUP);
+		return false;
+	}
+	vte_terminal_set_pty_object(VTE_TERMINAL(term->vte), pty);
+	g_object_unref(pty);
+	term->pid = pid;
+
+	if (term->log) {
+		g_signal_connect_after(G_OBJECT(term->vte), "size-allocate", G_CALLBACK(sakura_log_resize), term);
+		sakura_log_resize(term->vte, NULL, term);
+	}
+	return true;
+}
+
+
+/* Start the child of a tab through the helper, adopting a warm shell if it
+ * would run the same. Without a helper vte forks it, or we do if it's logged.
+ * Tabs that should be logged and can't be get no child and an error dialog */
+static bool
+sakura_spawn(struct terminal *term, const char *cwd, char **argv, char **envv, GSpawnFlags flags, GError **error)
+{
+	struct helper_reply reply;
+	struct spawn_setup setup = { NULL, NULL };
+	bool argv0 = (flags & G_SPAWN_FILE_AND_ARGV_ZERO) != 0;
+	bool same, warm, got, ok = false;
+	GError *lerror=NULL;
+	gchar *cgroup;
+	GPid pid;
+	int fd;
+
+	cgroup = sakura_cgroup_create(term);
+
+	if (helper.sock >= 0) {
+		/* Warm shells are only adopted by tabs opening where they were started */
+		same = argv0 && helper.pool_argv && sakura_strv_equal(argv, helper.pool_argv) &&
+		       sakura_strv_equal(envv, helper.pool_envv);
+		warm = same && cwd && g_strcmp0(cwd, helper.pool_cwd) == 0;
+
+		if (sakura_helper_request(warm ? "adopt" : "spawn", 0, argv0, cwd, cgroup, argv, envv)) {
+			/* Children exiting meanwhile are handled after this */
+			while ((got = sakura_helper_recv(&reply, &fd, HELPER_TIMEOUT)) && reply.type == HELPER_EXITED) {
+				if (fd >= 0)
+					close(fd);
+				g_idle_add(sakura_helper_exited, GINT_TO_POINTER(reply.pid));
+			}
+
+			if (got && reply.type == HELPER_SPAWNED && fd >= 0) {
+				if (!sakura_spawn_attach(term, fd, reply.pid, &lerror))
+					goto failed;
+				if (reply.value == 1)
+					sakura_cgroup_attach(term);
+
+				/* The next tabs are likely to open there too, the pool moves */
+				if (same && !warm && cwd) {
+					g_free(helper.pool_cwd);
+					helper.pool_cwd = g_strdup(cwd);
+					sakura_helper_pool(NULL);
+				}
+				ok = true;
+				goto out;
+			}
+			if (got) {
+				g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED, "%s", g_strerror(-reply.value));
+				goto out;
+			}
+		}
+	}
+
+	if (sakura.log_dir && sakura.log_dir[0]) {
+		if (!sakura_spawn_pty(cwd, cgroup, argv, envv, flags, &pid, &fd, error))
+			goto out;
+		if (!sakura_spawn_attach(term, fd, pid, &lerror))
+			goto failed;
+		vte_terminal_watch_child(VTE_TERMINAL(term->vte), pid);
+		ok = true;
+		goto out;
+	}
+
+	setup.cgroup = cgroup;
+	ok = vte_terminal_fork_command_full(VTE_TERMINAL(term->vte), VTE_PTY_NO_HELPER, cwd, argv, envv, flags,
+	                                    cgroup ? sakura_spawn_setup : NULL, &setup, &term->pid, error);
+	goto out;
+
+failed:
+	sakura_error(term->win, "%s", lerror->message);
+	g_propagate_error(error, lerror);
+out:
+	g_free(cgroup);
+	return ok;
+}
+
+
+/* Remote control. Clients connect to the control socket and send commands,
+ * one per line with tab separated fields, and get a reply per command in the
+ * same order. Commands can be sent without waiting for the replies:
+ *
+ *   open [cwd=DIR] [command=CMD] [env=NAME=VALUE]... [title=TITLE] [tab=ID]
+ *                          ok ID. Opens a tab in the window of tab ID, or in
+ *                          the first window
+ *   send ID TEXT           Types TEXT in the tab
+ *   focus ID               Shows the tab and raises its window
+ *   close ID               Closes the tab, without asking
+ *   list                   ok N, and N lines: ID PID CWD TITLE
+ *   read ID                ok TEXT, the visible text of the tab
+ *
+ * ID can be "last", the last tab opened in this connection. Errors are
+ * replied as "error MESSAGE". Values are unescaped as C strings (\t, \n, \\),
+ * and replies escaped the same way */
+struct control_client {
+	GSocketConnection *connection;
+	GDataInputStream *in;
+	GString *replies;			/* Not written yet */
+	GBytes *writing;			/* Being written */
+	bool closed;				/* No more commands coming */
+	guint last;					/* Last tab opened */
+};
+
+static void sakura_control_read(struct control_client *);
+
+
+static char *
+sakura_control_path()
+{
+	gchar *path, *control;
+
+	path = sakura_server_socket_path();
+	control = g_strconcat(path, ".control", NULL);
+	g_free(path);
+
+	return control;
+}
+
+
+static void
+sakura_control_escape(GString *reply, const char *s)
+{
+	for (; s && *s; s++) {
+		switch (*s) {
+			case '\\': g_string_append(reply, "\\\\"); break;
+			case '\t': g_string_append(reply, "\\t"); break;
+			case '\n': g_string_append(reply, "\\n"); break;
+			case '\r': g_string_append(reply, "\\r"); break;
+			default: g_string_append_c(reply, *s);
+		}
+	}
+}
+
+
+static struct terminal *
+sakura_control_term(struct control_client *client, const char *id)
+{
+	if (!id)
+		return NULL;
+	if (strcmp(id, "last")==0)
+		return sakura_term_by_id(client->last);
+	return sakura_term_by_id(strtoul(id, NULL, 10));
+}
+
+
+static void
+sakura_control_open(struct control_client *client, gchar **args, GString *reply)
+{
+	struct window *win;
+	struct terminal *term, *next_to=NULL;
+	gchar *cwd=NULL, *title=NULL, *value, **argv=NULL, **envv;
+	GError *gerror=NULL;
+	int argc;
+
+	envv = g_get_environ();
+	for (; *args; args++) {
+		value = strchr(*args, '=');
+		if (!value) {
+			g_string_append_printf(reply, "error\tbad argument %s", *args);
+			goto out;
+		}
+		*value++ = '\0';
+		if (strcmp(*args, "cwd")==0) {
+			g_free(cwd); cwd = g_strdup(value);
+		} else if (strcmp(*args, "title")==0) {
+			g_free(title); title = g_strdup(value);
+		} else if (strcmp(*args, "tab")==0) {
+			next_to = sakura_control_term(client, value);
+			if (!next_to) {
+				g_string_append_printf(reply, "error\tno tab %s", value);
+				goto out;
+			}
+		} else if (strcmp(*args, "env")==0 && strchr(value, '=')) {
+			gchar *name = g_strndup(value, strchr(value, '=') - value);
+			envv = g_environ_setenv(envv, name, strchr(value, '=')+1, TRUE);
+			g_free(name);
+		} else if (strcmp(*args, "command")==0) {
+			g_strfreev(argv); argv=NULL;
+			if (!g_shell_parse_argv(value, &argc, &argv, &gerror)) {
+				g_string_append_printf(reply, "error\t%s", gerror->message);
+				g_error_free(gerror);
+				goto out;
+			}
+		} else {
+			g_string_append_printf(reply, "error\tbad argument %s", *args);
+			goto out;
+		}
+	}
+
+	win = next_to ? next_to->win : (struct window *)sakura.windows->data;
+	term = sakura_add_tab_full(win, cwd, argv, envv, false, &gerror);
+	if (gerror) {
+		g_string_append(reply, "error\t");
+		sakura_control_escape(reply, gerror->message);
+		g_error_free(gerror);
+		sakura_del_tab(win, gtk_notebook_page_num(GTK_NOTEBOOK(win->notebook), term->hbox));
+		goto out;
+	}
+	if (title) {
+		sakura_set_tab_label_text(term, title);
+		term->label_set_byuser=true;
+	}
+	client->last = term->id;
+	g_string_append_printf(reply, "ok\t%u", term->id);
+
+out:
+	g_free(cwd); g_free(title);
+	g_strfreev(argv); g_strfreev(envv);
+}
+
+
+static void
+sakura_control_list(GString *reply)
+{
+	struct window *win;
+	struct terminal *term;
+	GString *tabs = g_string_new(NULL);
+	const char *title;
+	gchar *cwd;
+	GList *l;
+	int i, n_pages, n=0;
+
+	for (l = sakura.windows; l; l = l->next) {
+		win = (struct window *)l->data;
+		n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook));
+		for (i=0; i<n_pages; i++) {
+			term = sakura_get_page_term(win, i);
+			cwd = sakura_get_term_cwd(term);
+			title = term->vte ? vte_terminal_get_window_title(VTE_TERMINAL(term->vte)) : NULL;
+			g_string_append_printf(tabs, "\n%u\t%d\t", term->id, term->pid);
+			sakura_control_escape(tabs, cwd);
+			g_string_append_c(tabs, '\t');
+			sakura_control_escape(tabs, title ? title : gtk_label_get_text(GTK_LABEL(term->label)));
+			g_free(cwd);
+			n++;
+		}
+	}
+	g_string_append_printf(reply, "ok\t%d%s", n, tabs->str);
+	g_string_free(tabs, TRUE);
+}
+
+
+/* The rows shown, which are at the end of the scrollback unless it's scrolled */
+static void
+sakura_control_read_text(struct terminal *term, GString *reply)
+{
+	VteTerminal *vte = VTE_TERMINAL(term->vte);
+	glong top, rows, columns;
+	char *text;
+
+	top = (glong)gtk_adjustment_get_value(vte_terminal_get_adjustment(vte));
+	rows = vte_terminal_get_row_count(vte);
+	columns = vte_terminal_get_column_count(vte);
+	text = vte_terminal_get_text_range(vte, top, 0, top+rows-1, columns-1, NULL, NULL, NULL);
+
+	g_string_append(reply, "ok\t");
+	sakura_control_escape(reply, text);
+	g_free(text);
+}
+
+
+/* The last tab of a window was closed. Not from the callback of the client,
+ * which could be freed with the last window */
+static gboolean
+sakura_control_destroy(gpointer data)
+{
+	struct window *win = data;
+
+	if (g_list_find(sakura.windows, win) && gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook))==0)
+		sakura_destroy(win);
+	return G_SOURCE_REMOVE;
+}
+
+
+static void
+sakura_control_command(struct control_client *client, char *line, GString *reply)
+{
+	struct terminal *term;
+	struct window *win;
+	gchar **args;
+	guint i;
+
+	args = g_strsplit(line, "\t", 0);
+	for (i=0; args[i]; i++) {
+		gchar *value = g_strcompress(args[i]);
+		g_free(args[i]);
+		args[i] = value;
+	}
+
+	if (!args[0] || !*args[0]) {
+		g_string_append(reply, "error\tempty command");
+	} else if (strcmp(args[0], "open")==0) {
+		sakura_control_open(client, args+1, reply);
+	} else if (strcmp(args[0], "list")==0) {
+		sakura_control_list(reply);
+	} else if (strcmp(args[0], "stats")==0) {
+		gchar *json = sakura_stats_json();
+		g_string_append(reply, "ok\t");
+		sakura_control_escape(reply, json);
+		g_free(json);
+	} else if (strcmp(args[0], "send") && strcmp(args[0], "focus") && strcmp(args[0], "close") && strcmp(args[0], "read")) {
+		g_string_append_printf(reply, "error\tunknown command %s", args[0]);
+	} else if (!(term = sakura_control_term(client, args[1]))) {
+		g_string_append_printf(reply, "error\tno tab %s", args[1] ? args[1] : "given");
+	} else if (strcmp(args[0], "send")==0) {
+		sakura_tab_materialize(term);
+		if (args[2]) {
+			vte_terminal_feed_child(VTE_TERMINAL(term->vte), args[2], strlen(args[2]));
+			g_string_append(reply, "ok");
+		} else {
+			g_string_append(reply, "error\tno text");
+		}
+	} else if (strcmp(args[0], "focus")==0) {
+		win = term->win;
+		gtk_notebook_set_current_page(GTK_NOTEBOOK(win->notebook),
+		                              gtk_notebook_page_num(GTK_NOTEBOOK(win->notebook), term->hbox));
+		gtk_window_present(GTK_WINDOW(win->main_window));
+		gtk_widget_grab_focus(term->vte);
+		g_string_append(reply, "ok");
+	} else if (strcmp(args[0], "close")==0) {
+		win = term->win;
+		sakura_del_tab(win, gtk_notebook_page_num(GTK_NOTEBOOK(win->notebook), term->hbox));
+		g_string_append(reply, "ok");
+		if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook))==0)
+			g_idle_add(sakura_control_destroy, win);
+	} else {
+		sakura_tab_materialize(term);
+		sakura_control_read_text(term, reply);
+	}
+	g_string_append_c(reply, '\n');
+
+	g_strfreev(args);
+}
+
+
+static void
+sakura_control_free(struct control_client *client)
+{
+	g_object_unref(client->in);
+	g_object_unref(client->connection);
+	g_string_free(client->replies, TRUE);
+	g_free(client);
+}
+
 
-	sakura.menu=gtk_menu_new();
-	//sakura.labels_menu=gtk_menu_new();
+static void sakura_control_flush(struct control_client *);
 
-	/* Add items to popup menu */
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), gtk_separator_menu_item_new());
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), sakura.item_open_link);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), sakura.item_copy_link);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), sakura.open_link_separator);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), item_new_tab);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), item_set_name);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), item_close_tab);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), gtk_separator_menu_item_new());
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), item_set_title);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), gtk_separator_menu_item_new());
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), item_copy);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), item_paste);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), sakura.item_clear_background);
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), gtk_separator_menu_item_new());
-	gtk_menu_shell_append(GTK_MENU_SHELL(sakura.menu), item_options);
+static void
+sakura_control_written(GObject *stream, GAsyncResult *result, gpointer data)
+{
+	struct control_client *client = (struct control_client *)data;
+	GError *gerror=NULL;
+	GBytes *rest=NULL;
+	gssize n;
+	gsize size = g_bytes_get_size(client->writing);
+
+	n = g_output_stream_write_bytes_finish(G_OUTPUT_STREAM(stream), result, &gerror);
+	if (n < 0) {
+		SAY("control client gone: %s", gerror->message);
+		g_error_free(gerror);
+		g_string_truncate(client->replies, 0);
+	} else if ((gsize)n < size) {
+		rest = g_bytes_new_from_bytes(client->writing, n, size-n);
+	}
+	g_bytes_unref(client->writing);
+	client->writing = NULL;
+
+	if (rest) {
+		client->writing = rest;
+		g_output_stream_write_bytes_async(G_OUTPUT_STREAM(stream), rest, G_PRIORITY_DEFAULT,
+		                                  NULL, sakura_control_written, client);
+		return;
+	}
+	sakura_control_flush(client);
+}
 
-	options_menu=gtk_menu_new();
-	other_options_menu=gtk_menu_new();
-	cursor_menu=gtk_menu_new();
-	palette_menu=gtk_menu_new();
 
-	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_fullscreen);
-	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_colors);
-	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_font);
-	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_select_background);
-	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), gtk_separator_menu_item_new());
-	gtk_menu_shell_append(GTK_MENU_SHELL(options_menu), item_other_options);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_show_first_tab);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_tabs_on_bottom);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_show_close_button);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), gtk_separator_menu_item_new());
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_toggle_scrollbar);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_toggle_resize_grip);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_less_questions);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_urgent_bell);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_audible_bell);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_visible_bell);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_disable_numbered_tabswitch);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_use_fading);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_blinking_cursor);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_allow_bold);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_cursor);
-	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_block);
-	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_underline);
-	gtk_menu_shell_append(GTK_MENU_SHELL(cursor_menu), item_cursor_ibeam);
-	gtk_menu_shell_append(GTK_MENU_SHELL(other_options_menu), item_palette);
-	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_tango);
-	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_linux);
-	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_xterm);
-	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_solarized_dark);
-	gtk_menu_shell_append(GTK_MENU_SHELL(palette_menu), item_palette_solarized_light);
+/* Replies are written in the background, so a client sending a long batch
+ * before reading anything doesn't block sakura */
+static void
+sakura_control_flush(struct control_client *client)
+{
+	GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(client->connection));
 
-	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_options), options_menu);
-	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_other_options), other_options_menu);
-	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_cursor), cursor_menu);
-	gtk_menu_item_set_submenu(GTK_MENU_ITEM(item_palette), palette_menu);
+	if (client->writing)
+		return;
 
-	/* ... and finally assign callbacks to menuitems */
-	g_signal_connect(G_OBJECT(item_new_tab), "activate", G_CALLBACK(sakura_new_tab), NULL);
-	g_signal_connect(G_OBJECT(item_set_name), "activate", G_CALLBACK(sakura_set_name_dialog), NULL);
-	g_signal_connect(G_OBJECT(item_close_tab), "activate", G_CALLBACK(sakura_close_tab), NULL);
-	g_signal_connect(G_OBJECT(item_select_font), "activate", G_CALLBACK(sakura_font_dialog), NULL);
-	g_signal_connect(G_OBJECT(item_select_background), "activate", G_CALLBACK(sakura_select_background_dialog), NULL);
-	g_signal_connect(G_OBJECT(item_copy), "activate", G_CALLBACK(sakura_copy), NULL);
-	g_signal_connect(G_OBJECT(item_paste), "activate", G_CALLBACK(sakura_paste), NULL);
-	g_signal_connect(G_OBJECT(item_select_colors), "activate", G_CALLBACK(sakura_color_dialog), NULL);
-
-	g_signal_connect(G_OBJECT(item_show_first_tab), "activate", G_CALLBACK(sakura_show_first_tab), NULL);
-	g_signal_connect(G_OBJECT(item_tabs_on_bottom), "activate", G_CALLBACK(sakura_tabs_on_bottom), NULL);
-	g_signal_connect(G_OBJECT(item_less_questions), "activate", G_CALLBACK(sakura_less_questions), NULL);
-	g_signal_connect(G_OBJECT(item_show_close_button), "activate", G_CALLBACK(sakura_show_close_button), NULL);
-	g_signal_connect(G_OBJECT(item_toggle_scrollbar), "activate", G_CALLBACK(sakura_show_scrollbar), NULL);
-	g_signal_connect(G_OBJECT(item_toggle_resize_grip), "activate", G_CALLBACK(sakura_show_resize_grip), NULL);
-	g_signal_connect(G_OBJECT(item_urgent_bell), "activate", G_CALLBACK(sakura_urgent_bell), NULL);
-	g_signal_connect(G_OBJECT(item_audible_bell), "activate", G_CALLBACK(sakura_audible_bell), NULL);
-	g_signal_connect(G_OBJECT(item_visible_bell), "activate", G_CALLBACK(sakura_visible_bell), NULL);
-	g_signal_connect(G_OBJECT(item_blinking_cursor), "activate", G_CALLBACK(sakura_blinking_cursor), NULL);
-	g_signal_connect(G_OBJECT(item_allow_bold), "activate", G_CALLBACK(sakura_allow_bold), NULL);
-	g_signal_connect(G_OBJECT(item_disable_numbered_tabswitch),
-			"activate", G_CALLBACK(sakura_disable_numbered_tabswitch), NULL);
-	g_signal_connect(G_OBJECT(item_use_fading), "activate", G_CALLBACK(sakura_use_fading), NULL);
-	g_signal_connect(G_OBJECT(item_set_title), "activate", G_CALLBACK(sakura_set_title_dialog), NULL);
-	g_signal_connect(G_OBJECT(item_cursor_block), "activate", G_CALLBACK(sakura_set_cursor), "block");
-	g_signal_connect(G_OBJECT(item_cursor_underline), "activate", G_CALLBACK(sakura_set_cursor), "underline");
-	g_signal_connect(G_OBJECT(item_cursor_ibeam), "activate", G_CALLBACK(sakura_set_cursor), "ibeam");
-	g_signal_connect(G_OBJECT(item_palette_tango), "activate", G_CALLBACK(sakura_set_palette), "tango");
-	g_signal_connect(G_OBJECT(item_palette_linux), "activate", G_CALLBACK(sakura_set_palette), "linux");
-	g_signal_connect(G_OBJECT(item_palette_xterm), "activate", G_CALLBACK(sakura_set_palette), "xterm");
-	g_signal_connect(G_OBJECT(item_palette_solarized_dark), "activate", G_CALLBACK(sakura_set_palette), "solarized_dark");
-	g_signal_connect(G_OBJECT(item_palette_solarized_light), "activate", G_CALLBACK(sakura_set_palette), "solarized_light");
+	if (client->replies->len == 0) {
+		if (client->closed)
+			sakura_control_free(client);
+		return;
+	}
 
-	g_signal_connect(G_OBJECT(sakura.item_open_link), "activate", G_CALLBACK(sakura_open_url), NULL);
-	g_signal_connect(G_OBJECT(sakura.item_copy_link), "activate", G_CALLBACK(sakura_copy_url), NULL);
-	g_signal_connect(G_OBJECT(sakura.item_clear_background), "activate", G_CALLBACK(sakura_clear), NULL);
-	g_signal_connect(G_OBJECT(item_fullscreen), "activate", G_CALLBACK(sakura_fullscreen), NULL);
+	client->writing = g_string_free_to_bytes(client->replies);
+	client->replies = g_string_new(NULL);
+	g_output_stream_write_bytes_async(out, client->writing, G_PRIORITY_DEFAULT,
+	                                  NULL, sakura_control_written, client);
+}
 
 
-	gtk_widget_show_all(sakura.menu);
+/* Lines are only read once they're whole in the buffer, which is
+ * CONTROL_MAX_LINE long, so a client can't make sakura buffer more */
+static void
+sakura_control_filled(GObject *stream, GAsyncResult *result, gpointer data)
+{
+	struct control_client *client = (struct control_client *)data;
+	GError *gerror=NULL;
+	gssize n;
 
-	/* We don't want to see this if there's no background image */
-	if (!sakura.background) {
-		gtk_widget_hide(sakura.item_clear_background);
+	n = g_buffered_input_stream_fill_finish(G_BUFFERED_INPUT_STREAM(stream), result, &gerror);
+	if (n <= 0) {
+		if (gerror) {
+			SAY("control client gone: %s", gerror->message);
+			g_error_free(gerror);
+		}
+		client->closed = true;
 	}
+	sakura_control_read(client);
 }
 
 
 static void
-sakura_destroy()
+sakura_control_read(struct control_client *client)
 {
-	SAY("Destroying sakura");
-
-	/* Delete all existing tabs */
-	while (gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook)) >= 1) {
-		sakura_del_tab(-1);
+	GBufferedInputStream *in = G_BUFFERED_INPUT_STREAM(client->in);
+	const char *buffer;
+	gsize available, len;
+	char *line;
+
+	for (;;) {
+		buffer = g_buffered_input_stream_peek_buffer(in, &available);
+		if (!available || (!memchr(buffer, '\n', available) && !client->closed))
+			break;
+		/* Whole or the last one, this doesn't block */
+		line = g_data_input_stream_read_line(client->in, &len, NULL, NULL);
+		if (!line)
+			break;
+		sakura_control_command(client, line, client->replies);
+		g_free(line);
 	}
 
-	g_key_file_free(sakura.cfg);
-
-	pango_font_description_free(sakura.font);
+	if (!client->closed && available >= CONTROL_MAX_LINE) {
+		SAY("control line too long");
+		client->closed = true;
+	}
+	if (!client->closed)
+		g_buffered_input_stream_fill_async(in, -1, G_PRIORITY_DEFAULT, NULL, sakura_control_filled, client);
+	/* Frees a closed client once its replies are written */
+	sakura_control_flush(client);
+}
 
-	if (sakura.background)
-		free(sakura.background);
 
-	free(sakura.configfile);
+static gboolean
+sakura_control_incoming(GSocketService *service, GSocketConnection *connection, GObject *source, gpointer data)
+{
+	struct control_client *client;
 
-	gtk_main_quit();
+	client = g_new0(struct control_client, 1);
+	client->connection = g_object_ref(connection);
+	client->in = g_data_input_stream_new(g_io_stream_get_input_stream(G_IO_STREAM(connection)));
+	g_buffered_input_stream_set_buffer_size(G_BUFFERED_INPUT_STREAM(client->in), CONTROL_MAX_LINE);
+	client->replies = g_string_new(NULL);
+	sakura_control_read(client);
 
+	return TRUE;
 }
 
 
 static void
-sakura_set_size(void)
+sakura_control_start()
 {
-	struct terminal *term;
-	gint pad_x, pad_y;
-	gint char_width, char_height;
-	guint npages;
-	gint min_width, natural_width;
-	gint page;
-
+	GSocketAddress *address;
+	GSocketClient *probe;
+	GSocketConnection *connection;
+	GError *gerror=NULL;
+	gchar *dir;
+
+	sakura.control_path = sakura_control_path();
+
+	dir = g_path_get_dirname(sakura.control_path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	address = g_unix_socket_address_new(sakura.control_path);
+
+	/* Another sakura, started standalone or without server mode, already has it */
+	probe = g_socket_client_new();
+	connection = g_socket_client_connect(probe, G_SOCKET_CONNECTABLE(address), NULL, NULL);
+	g_object_unref(probe);
+	if (connection) {
+		SAY("%s is in use", sakura.control_path);
+		g_object_unref(connection);
+		g_object_unref(address);
+		g_free(sakura.control_path);
+		sakura.control_path=NULL;
+		return;
+	}
+	g_unlink(sakura.control_path);
+
+	sakura.control = g_socket_service_new();
+	if (!g_socket_listener_add_address(G_SOCKET_LISTENER(sakura.control), address, G_SOCKET_TYPE_STREAM,
+	                                   G_SOCKET_PROTOCOL_DEFAULT, NULL, NULL, &gerror)) {
+		SAY("cannot listen on %s: %s", sakura.control_path, gerror->message);
+		g_error_free(gerror);
+		g_object_unref(address);
+		g_object_unref(sakura.control);
+		sakura.control=NULL;
+		g_free(sakura.control_path);
+		sakura.control_path=NULL;
+		return;
+	}
+	g_object_unref(address);
+	g_chmod(sakura.control_path, 0600);
 
-	term = sakura_get_page_term(sakura, 0);
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+	g_signal_connect(sakura.control, "incoming", G_CALLBACK(sakura_control_incoming), NULL);
+	g_socket_service_start(sakura.control);
+}
 
-	/* Mayhaps an user resize happened. Check if row and columns have changed */
-	if (sakura.resized) {
-		sakura.columns=vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
-		sakura.rows=vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
-		SAY("New columns %ld and rows %ld", sakura.columns, sakura.rows);
-		sakura.resized=FALSE;
-	}
 
-	gtk_widget_style_get(term->vte, "inner-border", &term->border, NULL);
-	pad_x = term->border->left + term->border->right;
-	pad_y = term->border->top + term->border->bottom;
-	SAY("padding x %d y %d", pad_x, pad_y);
-	char_width = vte_terminal_get_char_width(VTE_TERMINAL(term->vte));
-	char_height = vte_terminal_get_char_height(VTE_TERMINAL(term->vte));
+static void
+sakura_control_stop()
+{
+	if (!sakura.control)
+		return;
 
-	sakura.width = pad_x + (char_width * sakura.columns);
-	sakura.height = pad_y + (char_height * sakura.rows);
+	g_socket_service_stop(sakura.control);
+	g_socket_listener_close(G_SOCKET_LISTENER(sakura.control));
+	g_object_unref(sakura.control);
+	sakura.control=NULL;
 
-	if (npages>=2 || sakura.first_tab) {
-		//gint min_height, natural_height;
-		//gtk_widget_get_preferred_height(sakura.notebook, &min_height, &natural_height);
-		//SAY("NOTEBOOK min height %d natural height %d", min_height, natural_height);
-		/* Deprecated. TODO: Remove
-		guint16 hb, vb;
-		hb=gtk_notebook_get_tab_hborder(GTK_NOTEBOOK(sakura.notebook));
-		vb=gtk_notebook_get_tab_vborder(GTK_NOTEBOOK(sakura.notebook));
-		SAY("notebook borders h %d v %d", hb, vb);*/
+	g_unlink(sakura.control_path);
+	g_free(sakura.control_path);
+	sakura.control_path=NULL;
+}
 
-		/* TODO: Yeah i know, this is utterly shit. Remove this ugly hack and set geometry hints*/
-		if (!sakura.show_scrollbar)
-			//sakura.height += min_height - 10;
-			sakura.height += 10;
-		else
-			//sakura.height += min_height - 47;
-			sakura.height += 47;
 
-		sakura.width += 8;
-		sakura.width += /* (hb*2)+*/ (pad_x*2);
+/* sakura --control: send all of stdin in one go, then print the replies.
+ * With a command (sakura --stats) only that one is sent, and the text of its
+ * reply printed as is */
+static int
+sakura_control_client(const char *command)
+{
+	GSocketClient *client;
+	GSocketConnection *connection;
+	GSocketAddress *address;
+	GError *gerror=NULL;
+	GOutputStream *out;
+	GInputStream *in;
+	GString *reply=NULL;
+	gchar *path, buf[4096], *text;
+	gssize n;
+	gsize written;
+	int status=EXIT_SUCCESS;
+
+	path = sakura_control_path();
+	address = g_unix_socket_address_new(path);
+	client = g_socket_client_new();
+	connection = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(address), NULL, &gerror);
+	g_object_unref(client);
+	g_object_unref(address);
+
+	if (!connection) {
+		fprintf(stderr, "%s: %s\n", path, gerror->message);
+		g_error_free(gerror);
+		g_free(path);
+		return EXIT_FAILURE;
+	}
+	g_free(path);
+
+	out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+	if (command) {
+		reply = g_string_new(NULL);
+		g_output_stream_write_all(out, command, strlen(command), &written, NULL, &gerror);
+		g_output_stream_write_all(out, "\n", 1, &written, NULL, gerror ? NULL : &gerror);
+	} else {
+		while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+			if (!g_output_stream_write_all(out, buf, n, &written, NULL, &gerror))
+				break;
+		}
 	}
+	/* No more commands: sakura answers the ones it has and hangs up */
+	g_socket_shutdown(g_socket_connection_get_socket(connection), FALSE, TRUE, NULL);
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
-
-	gtk_widget_get_preferred_width(term->scrollbar, &min_width, &natural_width);
-	SAY("SCROLLBAR min width %d natural width %d", min_width, natural_width);
-	if(sakura.show_scrollbar) {
-		sakura.width += min_width;
+	in = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+	while (!gerror && (n = g_input_stream_read(in, buf, sizeof(buf), NULL, &gerror)) > 0) {
+		if (reply)
+			g_string_append_len(reply, buf, n);
+		else
+			fwrite(buf, 1, n, stdout);
 	}
 
-	/* GTK does not ignore resize for maximized windows on some systems,
-	so we do need check if it's maximized or not */
-	GdkWindow *gdk_window = gtk_widget_get_window(GTK_WIDGET(sakura.main_window));
-	if(gdk_window != NULL) {
-		if(gdk_window_get_state(gdk_window) & GDK_WINDOW_STATE_MAXIMIZED) {
-			SAY("window is maximized, will not resize");
-			return;
+	if (gerror) {
+		fprintf(stderr, "%s\n", gerror->message);
+		g_error_free(gerror);
+		status=EXIT_FAILURE;
+	} else if (reply) {
+		g_strchomp(reply->str);
+		if (g_str_has_prefix(reply->str, "ok\t")) {
+			text = g_strcompress(reply->str + strlen("ok\t"));
+			fputs(text, stdout);
+			g_free(text);
+		} else {
+			fprintf(stderr, "%s\n", reply->str);
+			status=EXIT_FAILURE;
 		}
 	}
+	if (reply)
+		g_string_free(reply, TRUE);
+	g_object_unref(connection);
 
-	gtk_window_resize(GTK_WINDOW(sakura.main_window), sakura.width, sakura.height);
-	SAY("RESIZED TO %d %d", sakura.width, sakura.height);
+	return status;
 }
 
 
+#ifdef SAKURA_BENCH
+static const char *bench_stage_names[BENCH_STAGES] = {
+	"key_press", "pty_write", "echo", "draw", "frame"
+};
+
+static const struct {
+	gint tabs;
+	bool fading;		/* Unfocused fading and a translucent background */
+	bool flood;			/* A background tab printing as fast as it can */
+} bench_scenarios[] = {
+	{ 1, false, false }, { 1, true, false }, { 1, false, true }, { 1, true, true },
+	{ 20, false, false }, { 20, true, false }, { 20, false, true }, { 20, true, true },
+	{ 200, false, false }, { 200, true, false }, { 200, false, true }, { 200, true, true },
+};
+#define NUM_BENCH_SCENARIOS (sizeof(bench_scenarios)/sizeof(bench_scenarios[0]))
+
+static gboolean sakura_bench_inject(gpointer);
+static void     sakura_bench_scenario();
+
+
 static void
-sakura_set_font()
+sakura_bench_mark(enum bench_stage stage)
 {
-	gint n_pages;
-	struct terminal *term;
-	int i;
+	if (!bench.pending || bench.times[stage][bench.sample] != -1)
+		return;
 
-	n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+	/* Stages only count in order: a redraw before the echo isn't our key's */
+	if (stage > 0 && bench.times[stage-1][bench.sample] == -1)
+		return;
 
-	/* Set the font for all tabs */
-	for (i = (n_pages - 1); i >= 0; i--) {
-		term = sakura_get_page_term(sakura, i);
-		vte_terminal_set_font(VTE_TERMINAL(term->vte), sakura.font);
+	bench.times[stage][bench.sample] = g_get_monotonic_time() - bench.start;
+
+	if (stage == BENCH_FRAME) {
+		bench.pending = false;
+		g_source_remove(bench.timeout);
+		bench.sample++;
+		g_idle_add(sakura_bench_inject, NULL);
 	}
 }
 
 
 static void
-sakura_move_tab(gint direction)
+sakura_bench_commit(VteTerminal *vte, gchar *text, guint size, gpointer data)
 {
-	gint page, n_pages;
-	GtkWidget *child;
+	sakura_bench_mark(BENCH_PTY_WRITE);
+}
 
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	n_pages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	child=gtk_notebook_get_nth_page(GTK_NOTEBOOK(sakura.notebook), page);
 
-	if (direction==FORWARD) {
-		if (page!=n_pages-1)
-			gtk_notebook_reorder_child(GTK_NOTEBOOK(sakura.notebook), child, page+1);
-	} else {
-		if (page!=0)
-			gtk_notebook_reorder_child(GTK_NOTEBOOK(sakura.notebook), child, page-1);
-	}
+static void
+sakura_bench_contents_changed(VteTerminal *vte, gpointer data)
+{
+	sakura_bench_mark(BENCH_ECHO);
 }
 
 
-/* Find the notebook page for the vte terminal passed as a parameter */
-static gint sakura_find_tab(VteTerminal *vte_term)
+static gboolean
+sakura_bench_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
 {
-	gint matched_page, page, n_pages;
-	struct terminal *term;
+	sakura_bench_mark(BENCH_DRAW);
+	return FALSE;
+}
 
-	n_pages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
 
-	matched_page = -1;
-	page = 0;
+static void
+sakura_bench_after_paint(GdkFrameClock *clock, gpointer data)
+{
+	bench.frames++;
+	sakura_bench_mark(BENCH_FRAME);
+}
 
-	do {
-		term = sakura_get_page_term(sakura, page);
-		if ((VteTerminal *)term->vte == vte_term) {
-			matched_page=page;
-		}
-		page++;
-	} while (page < n_pages);
 
-	return (matched_page);
+static gboolean
+sakura_bench_key_timeout(gpointer data)
+{
+	/* Lost key. The stages it didn't reach stay at -1 */
+	bench.pending = false;
+	bench.timeout = 0;
+	bench.sample++;
+	g_idle_add(sakura_bench_inject, NULL);
+	return G_SOURCE_REMOVE;
 }
 
 
 static void
-sakura_set_tab_label_text(const gchar *title, gint page)
+sakura_bench_send_key(GdkEventType type, guint keyval)
 {
-	struct terminal *term;
-	gchar *chopped_title;
+	GdkEvent *event;
+	GdkKeymapKey *keys;
+	gint n_keys;
+
+	event = gdk_event_new(type);
+	event->key.window = g_object_ref(gtk_widget_get_window(bench.win->main_window));
+	event->key.send_event = TRUE;
+	event->key.time = GDK_CURRENT_TIME;
+	event->key.state = 0;
+	event->key.keyval = keyval;
+	event->key.string = g_strdup(gdk_keyval_name(keyval));
+	event->key.length = strlen(event->key.string);
+	if (gdk_keymap_get_entries_for_keyval(gdk_keymap_get_default(), keyval, &keys, &n_keys)) {
+		event->key.hardware_keycode = keys[0].keycode;
+		event->key.group = keys[0].group;
+		g_free(keys);
+	}
+	gdk_event_set_device(event, bench.keyboard);
+
+	gtk_main_do_event(event);
+	gdk_event_free(event);
+}
 
-	term = sakura_get_page_term(sakura, page);
 
-	if ( (title!=NULL) && (g_strcmp0(title, "") !=0) ) {
-		/* Chop to max size. TODO: Should it be configurable by the user? */
-		chopped_title = g_strndup(title, TAB_MAX_SIZE);
-		/* Honor the minimum tab label size */
-		while (strlen(chopped_title)< TAB_MIN_SIZE) {
-			char *old_ptr = chopped_title;
-			chopped_title = g_strconcat(chopped_title, " ", NULL);
-			free(old_ptr);
+static gint
+sakura_bench_compare(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* Add the percentiles of the scenario to the report */
+static void
+sakura_bench_report()
+{
+	gint64 *sorted;
+	gint n, i, stage;
+	const double percentiles[] = { 0.5, 0.99, 0.999 };
+	const char *names[] = { "p50", "p99", "p99.9" };
+	guint p;
+
+	g_string_append_printf(bench.json, "%s\n    {\"tabs\": %d, \"fading\": %s, \"flood\": %s",
+	                       bench.scenario ? "," : "", bench_scenarios[bench.scenario].tabs,
+	                       bench_scenarios[bench.scenario].fading ? "true" : "false",
+	                       bench_scenarios[bench.scenario].flood ? "true" : "false");
+
+	sorted = g_new(gint64, bench.samples);
+	for (stage=0; stage<BENCH_STAGES; stage++) {
+		for (i=0, n=0; i<bench.samples; i++) {
+			if (bench.times[stage][i] != -1)
+				sorted[n++] = bench.times[stage][i];
 		}
-		gtk_label_set_text(GTK_LABEL(term->label), chopped_title);
-		free(chopped_title);
-	} else { /* Use the default values */
-		gtk_label_set_text(GTK_LABEL(term->label), term->label_text);
+		qsort(sorted, n, sizeof(gint64), sakura_bench_compare);
+
+		g_string_append_printf(bench.json, ",\n     \"%s\": {\"missed\": %d", bench_stage_names[stage], bench.samples-n);
+		for (p=0; p<G_N_ELEMENTS(percentiles) && n>0; p++) {
+			i = (gint)ceil(percentiles[p]*n)-1;
+			g_string_append_printf(bench.json, ", \"%s\": %" G_GINT64_FORMAT, names[p], sorted[MAX(i, 0)]);
+		}
+		g_string_append(bench.json, "}");
 	}
+	g_string_append(bench.json, "}");
+	g_free(sorted);
 }
 
 
+/* Write the report to file ("-" is stdout), and clean up */
 static void
-sakura_add_tab()
+sakura_bench_finish(const char *file)
 {
-	struct terminal *term;
-	GtkWidget *tab_hbox;
-	GtkWidget *close_button;
-	int index;
-	int npages;
-	gchar *cwd = NULL;
-	gchar *label_text = _("Terminal %d");
+	GError *gerror=NULL;
+	GSList *l;
 
+	g_string_append(bench.json, "\n  ]\n}\n");
+	if (strcmp(file, "-")==0) {
+		fputs(bench.json->str, stdout);
+	} else if (!g_file_set_contents(file, bench.json->str, bench.json->len, &gerror)) {
+		fprintf(stderr, "%s\n", gerror->message);
+		g_error_free(gerror);
+	}
+	g_string_free(bench.json, TRUE);
 
-	term = g_new0( struct terminal, 1 );
-	term->hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
-	term->vte=vte_terminal_new();
+	sakura_destroy(bench.win);
 
-	/* Create label for tabs */
-	term->label_set_byuser=false;
+	for (l = bench.files; l; l = l->next)
+		g_unlink((gchar *)l->data);
+	g_slist_free_full(bench.files, g_free);
+	g_rmdir(bench.dir);
+	g_free(bench.dir);
+}
 
-	term->colorset=sakura.last_colorset-1;
 
-	/* appling tab title pattern from config (https://answers.launchpad.net/sakura/+question/267951) */
-	if(sakura.tab_default_title != NULL) {
-		label_text = sakura.tab_default_title;
-		term->label_set_byuser = true;
+/* Type the next key of the scenario, or go on with the next one */
+static gboolean
+sakura_bench_inject(gpointer data)
+{
+	gint stage;
+
+	if (bench.sample == bench.samples) {
+		sakura_bench_report();
+		if (bench_scenarios[bench.scenario].flood)
+			sakura_del_tab(bench.win, bench.flood_page);
+		if (++bench.scenario == NUM_BENCH_SCENARIOS) {
+			for (stage=0; stage<BENCH_STAGES; stage++)
+				g_free(bench.times[stage]);
+			sakura_bench_finish(option_bench_latency);
+		} else {
+			sakura_bench_scenario();
+		}
+		return G_SOURCE_REMOVE;
 	}
 
-	term->label_text=g_strdup_printf(label_text, sakura.label_count++);
-	term->label=gtk_label_new(term->label_text);
-
-	tab_hbox=gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 2);
-	gtk_box_pack_start(GTK_BOX(tab_hbox), term->label, FALSE, FALSE, 0);
+	for (stage=0; stage<BENCH_STAGES; stage++)
+		bench.times[stage][bench.sample] = -1;
 
-	/* If the tab close button is enabled, create and add it to the tab */
-	if (sakura.show_closebutton) {
-		close_button=gtk_button_new();
-		/* adding scroll-event to button, to propagate it to notebook (fix for scroll event until pointer above the button) */
-		gtk_widget_add_events(close_button, GDK_SCROLL_MASK);
+	bench.pending = true;
+	bench.timeout = g_timeout_add(BENCH_KEY_TIMEOUT, sakura_bench_key_timeout, NULL);
+	bench.start = g_get_monotonic_time();
+	sakura_bench_send_key(GDK_KEY_PRESS, GDK_KEY_x);
+	sakura_bench_send_key(GDK_KEY_RELEASE, GDK_KEY_x);
 
-		gtk_widget_set_name(close_button, "closebutton");
-		gtk_button_set_relief(GTK_BUTTON(close_button), GTK_RELIEF_NONE);
+	return G_SOURCE_REMOVE;
+}
 
-		GtkWidget *image=gtk_image_new_from_icon_name("window-close", GTK_ICON_SIZE_MENU);
-		gtk_container_add (GTK_CONTAINER (close_button), image);
-		gtk_box_pack_start(GTK_BOX(tab_hbox), close_button, FALSE, FALSE, 0);
-	}
 
-	if (sakura.tabs_on_bottom) {
-		gtk_notebook_set_tab_pos(GTK_NOTEBOOK(sakura.notebook), GTK_POS_BOTTOM);
-	}
+static gboolean
+sakura_bench_settled(gpointer data)
+{
+	gtk_notebook_set_current_page(GTK_NOTEBOOK(bench.win->notebook), 0);
+	gtk_widget_grab_focus(bench.term->vte);
+	bench.sample = 0;
+	sakura_bench_inject(NULL);
+	return G_SOURCE_REMOVE;
+}
 
-	gtk_widget_show_all(tab_hbox);
 
-	/* Init vte */
-	vte_terminal_set_scrollback_lines(VTE_TERMINAL(term->vte), SCROLL_LINES);
-	vte_terminal_match_add_gregex(VTE_TERMINAL(term->vte), sakura.http_regexp, 0);
-	vte_terminal_set_mouse_autohide(VTE_TERMINAL(term->vte), TRUE);
+/* Set up the tabs and settings of the current scenario */
+static void
+sakura_bench_scenario()
+{
+	struct window *win = bench.win;
+	gint i;
 
-	term->scrollbar=gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, vte_terminal_get_adjustment(VTE_TERMINAL(term->vte)));
+	/* Scenarios go from less to more tabs, so they only have to be added */
+	sakura_bench_set_child(bench.echo_child);
+	while (gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook)) < bench_scenarios[bench.scenario].tabs)
+		sakura_add_tab(win);
 
-	gtk_box_pack_start(GTK_BOX(term->hbox), term->vte, TRUE, TRUE, 0);
-	gtk_box_pack_start(GTK_BOX(term->hbox), term->scrollbar, FALSE, FALSE, 0);
+	if (bench_scenarios[bench.scenario].flood) {
+		sakura_bench_set_child(bench.flood_child);
+		sakura_add_tab(win);
+		bench.flood_page = gtk_notebook_get_n_pages(GTK_NOTEBOOK(win->notebook))-1;
+	}
 
-	/* Select the directory to use for the new tab */
-	index = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	if(index >= 0) {
-		struct terminal *prev_term;
-		prev_term = sakura_get_page_term( sakura, index );
-		cwd = sakura_get_term_cwd( prev_term );
+	/* Fading only applies to unfocused windows, pretend we are one */
+	sakura.use_fading = bench_scenarios[bench.scenario].fading;
+	win->first_focus = true;
+	win->focused = !bench_scenarios[bench.scenario].fading;
+	for (i=0; i<NUM_COLORSETS; i++)
+		sakura.backcolors[i].alpha = bench_scenarios[bench.scenario].fading ? 0.8 : 1.0;
+	sakura_set_colors();
 
-		term->colorset = prev_term->colorset;
-	}
-	if (!cwd)
-		cwd = g_get_current_dir();
+	g_timeout_add(BENCH_SETTLE, sakura_bench_settled, NULL);
+}
 
-	/* Keep values when adding tabs */
-	sakura.keep_fc=true;
 
-	if ((index=gtk_notebook_append_page(GTK_NOTEBOOK(sakura.notebook), term->hbox, tab_hbox))==-1) {
-		sakura_error("Cannot create a new tab");
-		exit(1);
+/* Create the temporary directory for the scripts and data of the benchmarks */
+static void
+sakura_bench_init(struct window *win)
+{
+	bench.win = win;
+	bench.dir = g_dir_make_tmp("sakura-bench-XXXXXX", NULL);
+	if (!bench.dir) {
+		fprintf(stderr, "Cannot create a temporary directory\n");
+		exit(EXIT_FAILURE);
 	}
+}
 
-	gtk_notebook_set_tab_reorderable(GTK_NOTEBOOK(sakura.notebook), term->hbox, TRUE);
-	// TODO: Set group id to support detached tabs
-	// gtk_notebook_set_tab_detachable(GTK_NOTEBOOK(sakura.notebook), term->hbox, TRUE);
-
-	sakura_set_page_term(sakura, index, term );
 
-	/* vte signals */
-	g_signal_connect(G_OBJECT(term->vte), "beep", G_CALLBACK(sakura_beep), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "increase-font-size", G_CALLBACK(sakura_increase_font), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "decrease-font-size", G_CALLBACK(sakura_decrease_font), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "child-exited", G_CALLBACK(sakura_child_exited), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "eof", G_CALLBACK(sakura_eof), NULL);
-	g_signal_connect(G_OBJECT(term->vte), "window-title-changed", G_CALLBACK(sakura_title_changed), NULL);
-	g_signal_connect_swapped(G_OBJECT(term->vte), "button-press-event", G_CALLBACK(sakura_button_press), sakura.menu);
+static const gchar *
+sakura_bench_script(const char *name, const char *script)
+{
+	gchar *path;
 
-	/* Notebook signals */
-	g_signal_connect(G_OBJECT(sakura.notebook), "page-removed", G_CALLBACK(sakura_page_removed), NULL);
-	if (sakura.show_closebutton) {
-		g_signal_connect(G_OBJECT(close_button), "clicked", G_CALLBACK(sakura_closebutton_clicked), term->hbox);
+	path = g_build_filename(bench.dir, name, NULL);
+	if (!g_file_set_contents(path, script, -1, NULL) || g_chmod(path, 0700) != 0) {
+		fprintf(stderr, "Cannot create %s\n", path);
+		exit(EXIT_FAILURE);
 	}
+	bench.files = g_slist_prepend(bench.files, path);
+	return path;
+}
 
-	/* TODO: Use this with vte_spawn_sync. With fork_command__full is overwritten */
-	char *command_env[2]={"TERM=xterm-256color",0};
-	/* First tab */
-	npages=gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
-	if (npages == 1) {
-		if (sakura.first_tab) {
-			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(sakura.notebook), TRUE);
-		} else {
-			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(sakura.notebook), FALSE);
-		}
 
-		gtk_notebook_set_show_border(GTK_NOTEBOOK(sakura.notebook), FALSE);
-		sakura_set_font();
-		/* Set size before showing the widgets but after setting the font */
-		sakura_set_size();
+/* Run program in the next tab added */
+static void
+sakura_bench_set_child(const char *program)
+{
+	g_free(bench.win->argv[0]); g_free(bench.win->argv[1]);
+	bench.win->argv[0] = g_strdup(program);
+	bench.win->argv[1] = g_strdup(program);
+}
 
-		gtk_widget_show_all(sakura.notebook);
-		if (!sakura.show_scrollbar) {
-			gtk_widget_hide(term->scrollbar);
-		}
 
-		if (option_geometry) {
-			if (!gtk_window_parse_geometry(GTK_WINDOW(sakura.main_window), option_geometry)) {
-				fprintf(stderr, "Invalid geometry.\n");
-				gtk_widget_show(sakura.main_window);
-			} else {
-				gtk_widget_show(sakura.main_window);
-				sakura.columns = vte_terminal_get_column_count(VTE_TERMINAL(term->vte));
-				sakura.rows = vte_terminal_get_row_count(VTE_TERMINAL(term->vte));
-			}
-		} else {
-            gtk_widget_show(sakura.main_window);
-		}
+/* Type keys in a tab whose child echoes them back, and time each one from
+ * injection to the frame showing it */
+static void
+sakura_bench_latency_start(struct window *win)
+{
+	GdkDeviceManager *manager;
+	gint stage;
+
+	sakura_bench_init(win);
+	bench.samples = MAX(option_bench_samples, 1);
+	for (stage=0; stage<BENCH_STAGES; stage++)
+		bench.times[stage] = g_new(gint64, bench.samples);
+
+	/* The smallest child that echoes: no line discipline, no shell */
+	bench.echo_child = sakura_bench_script("echo", "#!/bin/sh\nstty raw -echo\nexec cat\n");
+	bench.flood_child = sakura_bench_script("flood", "#!/bin/sh\nexec yes 'background tab flooding output'\n");
+
+	sakura_bench_set_child(bench.echo_child);
+	sakura_add_tab(win);
+	bench.term = sakura_get_page_term(win, 0);
+
+	g_signal_connect(G_OBJECT(bench.term->vte), "commit", G_CALLBACK(sakura_bench_commit), NULL);
+	g_signal_connect(G_OBJECT(bench.term->vte), "contents-changed", G_CALLBACK(sakura_bench_contents_changed), NULL);
+	g_signal_connect_after(G_OBJECT(bench.term->vte), "draw", G_CALLBACK(sakura_bench_draw), NULL);
+	g_signal_connect(G_OBJECT(gtk_widget_get_frame_clock(win->main_window)), "after-paint",
+	                 G_CALLBACK(sakura_bench_after_paint), NULL);
+
+	manager = gdk_display_get_device_manager(gdk_display_get_default());
+	bench.keyboard = gdk_device_get_associated_device(gdk_device_manager_get_client_pointer(manager));
+
+	bench.json = g_string_new(NULL);
+	g_string_append_printf(bench.json, "{\n  \"benchmark\": \"keystroke-latency\",\n  \"unit\": \"us\",\n"
+	                       "  \"samples\": %d,\n  \"rgba\": %s,\n  \"scenarios\": [",
+	                       bench.samples, sakura.has_rgba ? "true" : "false");
+
+	bench.scenario = 0;
+	sakura_bench_scenario();
+}
 
-		/* Set WINDOWID env variable */
-		GdkWindow *gwin = gtk_widget_get_window (sakura.main_window);
-		if (gwin != NULL) {
-			guint winid = gdk_x11_window_get_xid (gwin);
-			gchar *winidstr = g_strdup_printf ("0x%x", winid);
-			g_setenv ("WINDOWID", winidstr, FALSE);
-			g_free (winidstr);
-		}
+/* Link matching cost. vte looks for the matchers around the pointer at
+ * every motion over the terminal, so this is the cost of a hover */
+static const struct {
+	const char *name;
+	const char *matchers;		/* Built-ins, in link_matchers syntax */
+	gint copies;				/* Times each one is registered */
+} bench_link_sets[] = {
+	{ "none", "", 1 },			/* What the alternate screen gets */
+	{ "url", "url", 1 },
+	{ "url_twice", "url", 2 },	/* The same regex registered twice */
+	{ "all", "url,email,path,sha,ip", 1 },
+};
 
-		int command_argc=0; char **command_argv;
-		if (option_execute||option_xterm_execute) {
-			GError *gerror = NULL;
-			gchar *path;
 
-			if(option_execute) {
-				/* -x option */
-				if (!g_shell_parse_argv(option_execute, &command_argc, &command_argv, &gerror)) {
-					switch (gerror->code) {
-						case G_SHELL_ERROR_EMPTY_STRING:
-							sakura_error("Empty exec string");
-							exit(1);
-							break;
-						case G_SHELL_ERROR_BAD_QUOTING:
-							sakura_error("Cannot parse command line arguments: mangled quoting");
-							exit(1);
-							break;
-						case G_SHELL_ERROR_FAILED:
-							sakura_error("Error in exec option command line arguments");
-							exit(1);
-					}
-					g_error_free(gerror);
-				}
-			} else {
-				/* -e option - last in the command line, takes all extra arguments */
-				if (option_xterm_args) {
-					gchar *command_joined;
-					command_joined = g_strjoinv(" ", option_xterm_args);
-					if (!g_shell_parse_argv(command_joined, &command_argc, &command_argv, &gerror)) {
-						switch (gerror->code) {
-							case G_SHELL_ERROR_EMPTY_STRING:
-								sakura_error("Empty exec string");
-								exit(1);
-								break;
-							case G_SHELL_ERROR_BAD_QUOTING:
-								sakura_error("Cannot parse command line arguments: mangled quoting");
-								exit(1);
-							case G_SHELL_ERROR_FAILED:
-								sakura_error("Error in exec option command line arguments");
-								exit(1);
-						}
-					}
-					g_error_free(gerror);
-					g_free(command_joined);
-				}
+/* A screen of words, links, paths, hashes and addresses */
+static gchar *
+sakura_bench_links_screen()
+{
+	GString *screen = g_string_new(NULL);
+	GRand *rand = g_rand_new_with_seed(0);
+	gsize line;
+	gint row;
+
+	for (row=0; row<BENCH_LINK_ROWS; row++) {
+		line = screen->len;
+		while (screen->len - line < BENCH_LINK_COLUMNS - 48) {
+			switch (g_rand_int_range(rand, 0, 12)) {
+				case 0: g_string_append_printf(screen, "https://example.com/issues/%u?tab=%u ", g_rand_int(rand) % 100000, g_rand_int(rand) % 10); break;
+				case 1: g_string_append_printf(screen, "/usr/lib/x86_64-linux-gnu/libfoo.so.%u ", g_rand_int(rand) % 10); break;
+				case 2: g_string_append_printf(screen, "%08x%04x ", g_rand_int(rand), g_rand_int(rand) % 0x10000); break;
+				case 3: g_string_append_printf(screen, "10.%u.%u.%u:%u ", g_rand_int(rand) % 256, g_rand_int(rand) % 256, g_rand_int(rand) % 256, g_rand_int(rand) % 65536); break;
+				case 4: g_string_append_printf(screen, "user%u@example.org ", g_rand_int(rand) % 1000); break;
+				default: g_string_append_printf(screen, "%.*s ", g_rand_int_range(rand, 2, 10), "terminalsakuravtematching"+g_rand_int_range(rand, 0, 15)); break;
 			}
+		}
+		if (row < BENCH_LINK_ROWS-1)
+			g_string_append(screen, "\r\n");
+	}
+	g_rand_free(rand);
 
-			/* Check if the command is valid */
-			if (command_argc > 0) {
-				path=g_find_program_in_path(command_argv[0]);
-				if (path) {
-					if (!vte_terminal_fork_command_full(VTE_TERMINAL(term->vte), VTE_PTY_NO_HELPER, NULL,
-				 	    command_argv, command_env, G_SPAWN_SEARCH_PATH, NULL, NULL, &term->pid, &gerror)) {
-						SAY("error: %s", gerror->message);
-					}
-				} else {
-					sakura_error("%s command not found", command_argv[0]);
-					command_argc=0;
-					//exit(1);
-				}
-				free(path);
-				g_strfreev(command_argv); g_strfreev(option_xterm_args);
-			}
-		} // else { /* No execute option */
+	return g_string_free(screen, FALSE);
+}
 
-		/* Only fork if there is no execute option or if it has failed */
-		if ( (!option_execute && !option_xterm_args) || (command_argc==0)) {
-			if (option_hold==TRUE) {
-				sakura_error("Hold option given without any command");
-				option_hold=FALSE;
+
+static gboolean
+sakura_bench_links_run(gpointer data)
+{
+	VteTerminal *vte = VTE_TERMINAL(bench.term->vte);
+	GRand *rand = g_rand_new_with_seed(0);
+	GPtrArray *links;
+	gchar **names, *match;
+	gint64 *times, start, total;
+	gint set, copy, i, n, tag, matched;
+	guint j, k;
+
+	times = g_new(gint64, bench.samples);
+	for (set=0; set<(gint)G_N_ELEMENTS(bench_link_sets); set++) {
+		links = g_ptr_array_new_with_free_func(sakura_link_free);
+		names = g_strsplit(bench_link_sets[set].matchers, ",", 0);
+		for (j=0; names[j]; j++) {
+			for (k=0; k<G_N_ELEMENTS(link_builtins); k++) {
+				if (strcmp(link_builtins[k].name, names[j])==0)
+					sakura_link_add(links, link_builtins[k].name, link_builtins[k].regex, NULL);
 			}
-			vte_terminal_fork_command_full(VTE_TERMINAL(term->vte), VTE_PTY_NO_HELPER, cwd, sakura.argv, command_env,
-						       G_SPAWN_SEARCH_PATH|G_SPAWN_FILE_AND_ARGV_ZERO, NULL, NULL, &term->pid, NULL);
 		}
-	/* Not the first tab */
-	} else {
-		sakura_set_font();
-		gtk_widget_show_all(term->hbox);
-		if (!sakura.show_scrollbar) {
-			gtk_widget_hide(term->scrollbar);
+		g_strfreev(names);
+
+		vte_terminal_match_clear_all(vte);
+		for (copy=0; copy<bench_link_sets[set].copies; copy++) {
+			for (j=0; j<links->len; j++)
+				vte_terminal_match_add_gregex(vte, ((struct link *)g_ptr_array_index(links, j))->regex, 0);
 		}
 
-		if (npages==2) {
-			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(sakura.notebook), TRUE);
-			sakura_set_size();
+		/* Same cells for every set */
+		g_rand_set_seed(rand, 0);
+		matched = 0;
+		total = 0;
+		for (i=0; i<bench.samples; i++) {
+			glong column = g_rand_int_range(rand, 0, vte_terminal_get_column_count(vte));
+			glong row = g_rand_int_range(rand, 0, vte_terminal_get_row_count(vte));
+
+			start = g_get_monotonic_time();
+			match = vte_terminal_match_check(vte, column, row, &tag);
+			times[i] = g_get_monotonic_time() - start;
+			total += times[i];
+			if (match)
+				matched++;
+			g_free(match);
 		}
-		/* Call set_current page after showing the widget: gtk ignores this
-		 * function in the window is not visible *sigh*. Gtk documentation
-		 * says this is for "historical" reasons. Me arse */
-		gtk_notebook_set_current_page(GTK_NOTEBOOK(sakura.notebook), index);
-		vte_terminal_fork_command_full(VTE_TERMINAL(term->vte), VTE_PTY_NO_HELPER, cwd, sakura.argv, command_env,
-					       G_SPAWN_SEARCH_PATH|G_SPAWN_FILE_AND_ARGV_ZERO, NULL, NULL, &term->pid, NULL);
+		qsort(times, bench.samples, sizeof(gint64), sakura_bench_compare);
+		n = bench.samples;
+
+		g_string_append_printf(bench.json, "%s\n    {\"name\": \"%s\", \"regexes\": %u, \"matched\": %d"
+		                       ", \"mean\": %.2f, \"p50\": %" G_GINT64_FORMAT ", \"p99\": %" G_GINT64_FORMAT "}",
+		                       set ? "," : "", bench_link_sets[set].name, links->len * bench_link_sets[set].copies,
+		                       matched, (double)total/n, times[n/2], times[MAX((gint)ceil(0.99*n)-1, 0)]);
+		g_ptr_array_free(links, TRUE);
 	}
+	g_free(times);
+	g_rand_free(rand);
 
-	free(cwd);
+	sakura_bench_finish(option_bench_links);
+	return G_SOURCE_REMOVE;
+}
 
-	/* Configuration for the newly created terminal */
-	GdkRGBA white={255, 255, 255, 1};
-	vte_terminal_set_color_background_rgba(VTE_TERMINAL (term->vte), &white);
 
-	/* Init vte terminal */
-	vte_terminal_set_scrollback_lines(VTE_TERMINAL(term->vte), sakura.scroll_lines);
-	vte_terminal_match_add_gregex(VTE_TERMINAL(term->vte), sakura.http_regexp, 0);
-	vte_terminal_set_mouse_autohide(VTE_TERMINAL(term->vte), TRUE);
+/* A 400x120 terminal, with a small font so it fits in the screen */
+static void
+sakura_bench_links_start(struct window *win)
+{
+	PangoFontDescription *font;
+	gchar *screen;
 
-	vte_terminal_set_backspace_binding(VTE_TERMINAL(term->vte), VTE_ERASE_ASCII_DELETE);
-	vte_terminal_set_colors_rgba(VTE_TERMINAL(term->vte),
-							  &sakura.forecolors[term->colorset],
-							  &sakura.backcolors[term->colorset],
-							  sakura.palette, PALETTE_SIZE);
-	vte_terminal_set_color_cursor_rgba(VTE_TERMINAL(term->vte), &sakura.curscolors[term->colorset]);
-	if (sakura.has_rgba) {
-		vte_terminal_set_opacity(VTE_TERMINAL (term->vte), (int)((sakura.backcolors[term->colorset].alpha)*65535));
-	}
+	sakura_bench_init(win);
+	bench.samples = MAX(option_bench_samples, 1);
 
-	if (sakura.background) {
-		sakura_set_bgimage(sakura.background);
-	}
+	win->hold = true;
+	bench.echo_child = sakura_bench_script("echo", "#!/bin/sh\nstty raw -echo\nexec cat\n");
+	sakura_bench_set_child(bench.echo_child);
+	sakura_add_tab(win);
+	bench.term = sakura_get_page_term(win, 0);
 
-	if (sakura.word_chars) {
-		vte_terminal_set_word_chars( VTE_TERMINAL (term->vte), sakura.word_chars );
-	}
+	font = pango_font_description_copy(sakura.font);
+	pango_font_description_set_size(font, 4*PANGO_SCALE);
+	vte_terminal_set_font(VTE_TERMINAL(bench.term->vte), font);
+	pango_font_description_free(font);
+	vte_terminal_set_size(VTE_TERMINAL(bench.term->vte), BENCH_LINK_COLUMNS, BENCH_LINK_ROWS);
+	gtk_window_resize(GTK_WINDOW(win->main_window), 1, 1);
 
-	/* Get rid of these nasty bells */
-	vte_terminal_set_audible_bell (VTE_TERMINAL(term->vte), sakura.audible_bell ? TRUE : FALSE);
-	vte_terminal_set_visible_bell (VTE_TERMINAL(term->vte), sakura.visible_bell ? TRUE : FALSE);
+	screen = sakura_bench_links_screen();
+	vte_terminal_feed(VTE_TERMINAL(bench.term->vte), screen, -1);
+	g_free(screen);
 
-	/* Disable stupid blinking cursor */
-	vte_terminal_set_cursor_blink_mode (VTE_TERMINAL(term->vte), sakura.blinking_cursor ? VTE_CURSOR_BLINK_ON : VTE_CURSOR_BLINK_OFF);
+	bench.json = g_string_new(NULL);
+	g_string_append_printf(bench.json, "{\n  \"benchmark\": \"link-match\",\n  \"unit\": \"us\",\n"
+	                       "  \"samples\": %d,\n  \"sets\": [", bench.samples);
 
-	/* Enable bold text by default */
-	vte_terminal_set_allow_bold (VTE_TERMINAL(term->vte), sakura.allow_bold ? TRUE : FALSE);
+	g_timeout_add(BENCH_SETTLE, sakura_bench_links_run, NULL);
+}
 
-	/* Change cursor */
-	vte_terminal_set_cursor_shape (VTE_TERMINAL(term->vte), sakura.cursor_type);
+/* Output throughput workloads. Their data is generated beforehand, so the
+ * child is just cat and never the bottleneck */
+static void sakura_bench_gen_ascii(FILE *, GRand *, gint64);
+static void sakura_bench_gen_sgr(FILE *, GRand *, gint64);
+static void sakura_bench_gen_unicode(FILE *, GRand *, gint64);
+static void sakura_bench_gen_tui(FILE *, GRand *, gint64);
+static void sakura_bench_gen_lines(FILE *, GRand *, gint64);
+
+static const struct {
+	const char *name;
+	void (*generate)(FILE *, GRand *, gint64);
+	gint scroll_lines;
+	gint64 size;			/* Bytes, 0 for --bench-size */
+	gint tabs;				/* Each reading the data at the same time */
+} bench_workloads[] = {
+	{ "ascii", sakura_bench_gen_ascii, 4096, 0, 1 },
+	{ "sgr", sakura_bench_gen_sgr, 4096, 0, 1 },
+	{ "unicode", sakura_bench_gen_unicode, 4096, 0, 1 },
+	{ "tui", sakura_bench_gen_tui, 4096, 0, 1 },
+	/* 1.5M short lines, enough to fill even the big scrollback */
+	{ "scrollback_4096", sakura_bench_gen_lines, 4096, 1500000*9, 1 },
+	{ "scrollback_1m", sakura_bench_gen_lines, 1000000, 1500000*9, 1 },
+	/* Busy logs in many tabs, the same amount of data in all */
+	{ "tabs_50", sakura_bench_gen_sgr, 4096, 0, BENCH_TABS },
+};
+#define NUM_BENCH_WORKLOADS (sizeof(bench_workloads)/sizeof(bench_workloads[0]))
+
+/* For --bench-triggers, logs of builds and services have a few of them */
+static const char *bench_triggers[] = {
+	"ERROR", "FATAL", "BUILD FAILED", "Segmentation fault", "Traceback", "panic:", "Killed",
+	"command not found", "Permission denied", "No space left", "Connection refused", "timed out",
+	"undefined reference", "warning:", "error:", "FAILED", "Assertion", "core dumped", "OOM", "denied",
+	"/[Pp]assword( for [^:]+)?: *$/", "/\\bexit (status|code) [1-9][0-9]*/", "/^make(\\[[0-9]+\\])?: \\*\\*\\*/",
+	"/\\b[45][0-9][0-9] (GET|POST|PUT|DELETE)\\b/", "/request [0-9a-f]{8} failed/", "/^\\s+at .*\\(.*:[0-9]+\\)$/",
+	"/took [0-9]{4,}ms/", "/(?i)\\bdeadlock\\b/", "/[0-9]+ tests? failed/", "/^Done\\.$/",
+};
 
-	/* FIXME: Possible race here. Find some way to force to process all configure
-	 * events before setting keep_fc again to false */
-	sakura.keep_fc=false;
-}
+static void sakura_bench_workload();
 
 
-/* Delete the notebook tab passed as a parameter */
 static void
-sakura_del_tab(gint page)
+sakura_bench_gen_ascii(FILE *out, GRand *rand, gint64 size)
 {
-	struct terminal *term;
-	gint npages;
+	gint64 written;
+	int i;
 
-	term = sakura_get_page_term(sakura, page);
-	npages = gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook));
+	for (written=0; written<size; written+=80) {
+		for (i=0; i<79; i++)
+			fputc(g_rand_int_range(rand, ' ', '~'+1), out);
+		fputc('\n', out);
+	}
+}
 
-	/* When there's only one tab use the shell title, if provided */
-	if (npages==2) {
-		const char *title;
 
-		term = sakura_get_page_term(sakura, 0);
-		title = vte_terminal_get_window_title(VTE_TERMINAL(term->vte));
-		if (title!=NULL)
-			gtk_window_set_title(GTK_WINDOW(sakura.main_window), title);
+/* Colored logs, as from a build or a service */
+static void
+sakura_bench_gen_sgr(FILE *out, GRand *rand, gint64 size)
+{
+	const char *levels[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+	gint64 written=0;
+	int level, i, n;
+
+	while (written < size) {
+		level = g_rand_int_range(rand, 0, 4);
+		n = fprintf(out, "\033[2m%02d:%02d:%02d.%03d\033[0m \033[1;3%dm%-5s\033[0m \033[38;5;%dm%s\033[39m ",
+		            g_rand_int_range(rand, 0, 24), g_rand_int_range(rand, 0, 60), g_rand_int_range(rand, 0, 60),
+		            g_rand_int_range(rand, 0, 1000), level+3, levels[level], g_rand_int_range(rand, 16, 232), "worker");
+		for (i=0; i<g_rand_int_range(rand, 4, 10); i++)
+			n += fprintf(out, "%s\033[4m%x\033[24m ", i%2 ? "request" : "id=", g_rand_int(rand));
+		fputc('\n', out);
+		written += n+1;
 	}
+}
 
-	term = sakura_get_page_term(sakura, page);
 
-	/* Do the first tab checks BEFORE deleting the tab, to ensure correct
-	 * sizes are calculated when the tab is deleted */
-	if ( npages == 2) {
-		if (sakura.first_tab) {
-			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(sakura.notebook), TRUE);
-		} else {
-			gtk_notebook_set_show_tabs(GTK_NOTEBOOK(sakura.notebook), FALSE);
+/* Double width CJK, with some accented latin mixed in */
+static void
+sakura_bench_gen_unicode(FILE *out, GRand *rand, gint64 size)
+{
+	gchar utf8[6];
+	gint64 written=0;
+	int i, n;
+
+	while (written < size) {
+		for (i=0; i<38; i++) {
+			if (i%8 == 7)
+				n = g_unichar_to_utf8(0xe0 + g_rand_int_range(rand, 0, 32), utf8);
+			else
+				n = g_unichar_to_utf8(0x4e00 + g_rand_int_range(rand, 0, 0x5000), utf8);
+			fwrite(utf8, 1, n, out);
+			written += n;
 		}
-		sakura.keep_fc=true;
+		fputc('\n', out);
+		written++;
 	}
+}
 
-	gtk_widget_hide(term->hbox);
-	gtk_notebook_remove_page(GTK_NOTEBOOK(sakura.notebook), page);
 
-	/* Find the next page, if it exists, and grab focus */
-	if (gtk_notebook_get_n_pages(GTK_NOTEBOOK(sakura.notebook)) > 0) {
-		page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-		term = sakura_get_page_term(sakura, page);
-		gtk_widget_grab_focus(term->vte);
+/* Full screen redraws with cursor addressing, as from top or a TUI */
+static void
+sakura_bench_gen_tui(FILE *out, GRand *rand, gint64 size)
+{
+	gint64 written=0;
+	int row;
+
+	while (written < size) {
+		written += fprintf(out, "\033[H\033[7m%-80s\033[0m", " PID USER      PR  NI    VIRT    RES  %CPU COMMAND");
+		for (row=2; row<=24; row++) {
+			written += fprintf(out, "\033[%d;1H%5d %-8s %3d %3d %7d %6d \033[%dm%5.1f\033[0m %-20s\033[K", row,
+			                   g_rand_int_range(rand, 1, 99999), "sakura", 20, 0,
+			                   g_rand_int_range(rand, 0, 9999999), g_rand_int_range(rand, 0, 999999),
+			                   g_rand_boolean(rand) ? 1 : 0, g_rand_double_range(rand, 0, 100), "process");
+		}
 	}
 }
 
 
 static void
-sakura_set_bgimage(char *infile)
+sakura_bench_gen_lines(FILE *out, GRand *rand, gint64 size)
 {
-	GError *gerror=NULL;
-	GdkPixbuf *pixbuf=NULL;
-	gint page;
-	struct terminal *term;
+	gint64 line;
 
-	if (!infile) SAY("File parameter is NULL");
-
-	page = gtk_notebook_get_current_page(GTK_NOTEBOOK(sakura.notebook));
-	term = sakura_get_page_term(sakura, page);
+	for (line=0; line*9<size; line++)
+		fprintf(out, "%08" G_GINT64_FORMAT "\n", line);
+}
 
-	/* Check file existence and type */
-	if (g_file_test(infile, G_FILE_TEST_IS_REGULAR)) {
 
-		pixbuf = gdk_pixbuf_new_from_file (infile, &gerror);
-		if (!pixbuf) {
-			sakura_error("Error loading image file: %s\n", gerror->message);
-		} else {
-			vte_terminal_set_background_image(VTE_TERMINAL(term->vte), pixbuf);
-			vte_terminal_set_background_saturation(VTE_TERMINAL(term->vte), TRUE);
-			vte_terminal_set_background_transparent(VTE_TERMINAL(term->vte),FALSE);
+/* Runs every BENCH_TICK ms while a workload is running. Late ticks mean the
+ * main loop was blocked */
+static gboolean
+sakura_bench_tick(gpointer data)
+{
+	gint64 now = g_get_monotonic_time(), gap;
 
-			sakura_set_config_string("background", infile);
-		}
+	gap = now - bench.last_tick - BENCH_TICK*1000;
+	if (gap > BENCH_STALL*1000) {
+		bench.stalls++;
+		bench.max_stall = MAX(bench.max_stall, gap);
 	}
+	bench.last_tick = now;
+	bench.peak_rss = MAX(bench.peak_rss, sakura_process_rss());
+
+	return G_SOURCE_CONTINUE;
 }
 
 
 static void
-sakura_set_config_key(const gchar *key, guint value)
+sakura_bench_workload_eof(VteTerminal *vte, gpointer data)
 {
-	char *valname;
+	gint64 elapsed = g_get_monotonic_time() - bench.start;
+	gint page;
 
-	valname=gdk_keyval_name(value);
-	g_key_file_set_string(sakura.cfg, cfg_group, key, valname);
-	sakura.config_modified=TRUE;
-	//FIXME: free() valname?
-}
+	page = gtk_notebook_page_num(GTK_NOTEBOOK(bench.win->notebook), sakura_term_by_vte(vte)->hbox);
+	sakura_del_tab(bench.win, page);
+	if (--bench.running > 0)
+		return;
 
+	g_source_remove(bench.ticker);
+	sakura_bench_tick(NULL);
 
-static guint
-sakura_get_config_key(const gchar *key)
-{
-	gchar *value;
-	guint retval=GDK_KEY_VoidSymbol;
+	g_string_append_printf(bench.json, "%s\n    {\"name\": \"%s\", \"tabs\": %d, \"scroll_lines\": %d, \"bytes\": %" G_GINT64_FORMAT
+	                       ", \"seconds\": %.3f, \"mb_per_s\": %.2f, \"frames\": %u, \"stalls\": %u"
+	                       ", \"max_stall_ms\": %.1f, \"peak_rss_kb\": %" G_GINT64_FORMAT "}",
+	                       bench.workload ? "," : "", bench_workloads[bench.workload].name,
+	                       bench_workloads[bench.workload].tabs, bench_workloads[bench.workload].scroll_lines, bench.bytes, elapsed/1e6,
+	                       bench.bytes/(1024.0*1024.0)/(elapsed/1e6), bench.frames, bench.stalls,
+	                       bench.max_stall/1000.0, bench.peak_rss/1024);
 
-	value=g_key_file_get_string(sakura.cfg, cfg_group, key, NULL);
-	if (value!=NULL){
-		retval=gdk_keyval_from_name(value);
-		g_free(value);
+	if (++bench.workload == NUM_BENCH_WORKLOADS) {
+		sakura_bench_finish(option_bench_throughput);
+	} else {
+		sakura_bench_workload();
 	}
+}
 
-	/* For backwards compatibility with integer values */
-	/* If gdk_keyval_from_name fail, it seems to be integer value*/
-	if ((retval==GDK_KEY_VoidSymbol)||(retval==0)) {
-		retval=g_key_file_get_integer(sakura.cfg, cfg_group, key, NULL);
-	}
 
-	/* always use uppercase value as keyval. (https://bugs.launchpad.net/sakura/+bug/1399487), and possibly (https://bugs.launchpad.net/sakura/+bug/1521723)*/
-	return gdk_keyval_to_upper(retval);
+static gboolean
+sakura_bench_workload_run(gpointer data)
+{
+	struct terminal *term;
+	gchar *script, *name;
+	struct stat st;
+	gint i;
+
+	name = g_strdup_printf("%s.sh", bench_workloads[bench.workload].name);
+	script = g_strdup_printf("#!/bin/sh\nexec cat '%s/%s.dat'\n", bench.dir, bench_workloads[bench.workload].name);
+	sakura_bench_set_child(sakura_bench_script(name, script));
+	g_free(name); g_free(script);
+
+	name = g_strdup_printf("%s/%s.dat", bench.dir, bench_workloads[bench.workload].name);
+	bench.bytes = g_stat(name, &st) == 0 ? st.st_size * bench_workloads[bench.workload].tabs : 0;
+	g_free(name);
+
+	sakura.scroll_lines = bench_workloads[bench.workload].scroll_lines;
+	bench.frames = 0;
+	bench.stalls = 0;
+	bench.max_stall = 0;
+	bench.peak_rss = 0;
+	bench.last_tick = g_get_monotonic_time();
+	bench.ticker = g_timeout_add(BENCH_TICK, sakura_bench_tick, NULL);
+
+	/* From the spawn to the last byte read by vte in every tab */
+	bench.start = g_get_monotonic_time();
+	for (i=0; i<bench_workloads[bench.workload].tabs; i++) {
+		sakura_add_tab(bench.win);
+		term = sakura_get_page_term(bench.win, gtk_notebook_get_n_pages(GTK_NOTEBOOK(bench.win->notebook))-1);
+		g_signal_connect(G_OBJECT(term->vte), "eof", G_CALLBACK(sakura_bench_workload_eof), NULL);
+	}
+	bench.running = bench_workloads[bench.workload].tabs;
+
+	return G_SOURCE_REMOVE;
 }
 
 
 static void
-sakura_error(const char *format, ...)
+sakura_bench_workload()
 {
-	GtkWidget *dialog;
-	va_list args;
-	char* buff;
+	g_timeout_add(BENCH_SETTLE, sakura_bench_workload_run, NULL);
+}
 
-	va_start(args, format);
-	buff = malloc(sizeof(char)*ERROR_BUFFER_LENGTH);
-	vsnprintf(buff, sizeof(char)*ERROR_BUFFER_LENGTH, format, args);
-	va_end(args);
 
-	dialog = gtk_message_dialog_new(GTK_WINDOW(sakura.main_window), GTK_DIALOG_DESTROY_WITH_PARENT,
-	                                GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE, "%s", buff);
-	gtk_window_set_title(GTK_WINDOW(dialog), _("Error message"));
-	gtk_dialog_run (GTK_DIALOG (dialog));
-	gtk_widget_destroy (dialog);
-	free(buff);
+/* Stream each workload through a new tab and measure how fast it's shown */
+static void
+sakura_bench_throughput_start(struct window *win)
+{
+	GRand *rand;
+	FILE *out;
+	gchar *path, *font;
+	guint i;
+
+	sakura_bench_init(win);
+
+	for (i=0; i<NUM_BENCH_WORKLOADS; i++) {
+		path = g_strdup_printf("%s/%s.dat", bench.dir, bench_workloads[i].name);
+		out = fopen(path, "w");
+		if (!out) {
+			fprintf(stderr, "Cannot create %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		/* Same seed, same data: runs can be compared */
+		rand = g_rand_new_with_seed(i);
+		bench_workloads[i].generate(out, rand, (bench_workloads[i].size ? bench_workloads[i].size :
+		                            (gint64)MAX(option_bench_size, 1)*1024*1024) / bench_workloads[i].tabs);
+		g_rand_free(rand);
+		fclose(out);
+		bench.files = g_slist_prepend(bench.files, path);
+	}
+
+	/* Tabs are closed by the benchmark, not when their child exits */
+	win->hold = true;
+	bench.echo_child = sakura_bench_script("echo", "#!/bin/sh\nstty raw -echo\nexec cat\n");
+	sakura_bench_set_child(bench.echo_child);
+	sakura_add_tab(win);
+
+	g_signal_connect(G_OBJECT(gtk_widget_get_frame_clock(win->main_window)), "after-paint",
+	                 G_CALLBACK(sakura_bench_after_paint), NULL);
+
+	/* Only marks, notifications would spawn processes */
+	if (option_bench_triggers) {
+		GString *triggers = g_string_new(NULL);
+		for (i=0; i<G_N_ELEMENTS(bench_triggers); i++)
+			g_string_append_printf(triggers, "mark=%s\n", bench_triggers[i]);
+		g_free(sakura.trigger_patterns);
+		sakura.trigger_patterns = g_string_free(triggers, FALSE);
+		sakura_triggers_compile();
+	}
+
+	if (option_bench_log) {
+		g_free(sakura.log_dir);
+		sakura.log_dir = g_strdup(option_bench_log);
+		g_free(sakura.log_format);
+		sakura.log_format = g_strdup("both");
+	}
+
+	font = pango_font_description_to_string(sakura.font);
+	bench.json = g_string_new(NULL);
+	g_string_append_printf(bench.json, "{\n  \"benchmark\": \"throughput\",\n  \"font\": \"%s\",\n"
+	                       "  \"columns\": %ld,\n  \"rows\": %ld,\n  \"triggers\": %u,\n  \"log\": %s,\n  \"workloads\": [",
+	                       font, win->columns, win->rows, sakura.triggers ? sakura.triggers->list->len : 0,
+	                       option_bench_log ? (sakura.log_compress ? "\"both, zstd\"" : "\"both\"") : "null");
+	g_free(font);
+
+	bench.workload = 0;
+	sakura_bench_workload();
 }
+#endif
 
 
 /* This function is used to fix bug #1393939 */
@@ -3338,9 +10066,14 @@ int
 main(int argc, char **argv)
 {
 	gchar *localedir;
-	int i; int n;
 	char **nargv; int nargc;
-	gboolean have_e;
+	struct window *win;
+	gchar *cwd;
+	gchar **envv;
+
+	gint64 t;
+
+	trace.start = g_get_monotonic_time();
 
 	/* Localization */
 	setlocale(LC_ALL, "");
@@ -3349,35 +10082,18 @@ main(int argc, char **argv)
 	bindtextdomain(GETTEXT_PACKAGE, localedir);
 	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
 	g_free(localedir);
+	sakura_trace_add("locale", trace.start);
 
-	/* Rewrites argv to include a -- after the -e argument this is required to make
-	 * sure GOption doesn't grab any arguments meant for the command being called */
-
-	/* Initialize nargv */
-	nargv = (char**)calloc((argc+1), sizeof(char*));
-	n=0; nargc=argc;
-	have_e=FALSE;
-
-	for(i=0; i<argc; i++) {
-		if(!have_e && g_strcmp0(argv[i],"-e") == 0)
-		{
-			nargv[n]="-e";
-			n++;
-			nargv[n]="--";
-			nargc++;
-			have_e = TRUE;
-		} else {
-			nargv[n]=g_strdup(argv[i]);
-		}
-		n++;
-	}
+	t = sakura_trace_now();
+	nargv = sakura_rewrite_argv(argc, argv, &nargc);
 
 	/* Options parsing */
 	GError *error=NULL;
 	GOptionContext *context; GOptionGroup *option_group;
 
 	context = g_option_context_new (_("- vte-based terminal emulator"));
-	option_group = gtk_get_option_group(TRUE);
+	/* Don't open the display yet, we could be just a client of a running sakura */
+	option_group = gtk_get_option_group(FALSE);
 	g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
 	g_option_group_set_translation_domain(option_group, GETTEXT_PACKAGE);
 	g_option_context_add_group (context, option_group);
@@ -3404,6 +10120,7 @@ main(int argc, char **argv)
 	}
 
 	g_option_context_free(context);
+	sakura_trace_add("options", t);
 
 	if (option_workdir && chdir(option_workdir)) {
 		fprintf(stderr, _("Cannot change working directory\n"));
@@ -3419,13 +10136,55 @@ main(int argc, char **argv)
 		option_ntabs=1;
 	}
 
+	if (option_control || option_stats) {
+		g_strfreev(nargv);
+		return sakura_control_client(option_stats ? "stats" : NULL);
+	}
+
+	if (!option_standalone && sakura_server_forward(argv)) {
+		g_strfreev(nargv);
+		return 0;
+	}
+
+	/* While we're still small */
+	sakura_helper_start();
+
 	/* Init stuff */
+	t = sakura_trace_now();
 	gtk_init(&nargc, &nargv); g_strfreev(nargv);
+	sakura_trace_add("gtk_init", t);
 	sakura_init();
 
+	cwd = g_get_current_dir();
+	envv = g_get_environ();
+	win = sakura_window_new(envv, cwd);
+	g_strfreev(envv); g_free(cwd);
+
+#ifdef SAKURA_BENCH
+	if (option_bench_latency || option_bench_throughput || option_bench_links) {
+		if (option_bench_latency)
+			sakura_bench_latency_start(win);
+		else if (option_bench_throughput)
+			sakura_bench_throughput_start(win);
+		else
+			sakura_bench_links_start(win);
+		gtk_main();
+		return 0;
+	}
+#endif
+
 	/* Add initial tabs (1 by default) */
-	for (i=0; i<option_ntabs; i++)
-		sakura_add_tab();
+	sakura_add_tabs(win, option_ntabs);
+
+	/* Warm shells for new tabs in this window, now that it has its WINDOWID */
+	sakura_helper_pool(win);
+
+	if (sakura.server_mode && !option_standalone) {
+		sakura_server_start();
+	}
+	if (!option_standalone) {
+		sakura_control_start();
+	}
 
 	sakura_sanitize_working_directory();
 